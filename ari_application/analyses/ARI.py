@@ -1,5 +1,7 @@
 # Standard library imports
 import time
+import hashlib
+import threading
 
 # Third-party imports
 import numpy as np
@@ -8,8 +10,8 @@ import nibabel as nib
 from scipy.stats import norm
 
 # PyQt5 imports
-from PyQt5.QtCore import Qt, QTimer
-from PyQt5.QtWidgets import QProgressDialog
+from PyQt5.QtCore import Qt, QTimer, QEventLoop
+from PyQt5.QtWidgets import QApplication, QProgressDialog
 
 # Project-specific imports (organized by module type)
 from ari_application.models.image_processing import ImageProcessing
@@ -34,7 +36,195 @@ class pyARI:
     def fileInfo(self):
         return self.brain_nav.fileInfo
 
+    # Bump when the inputs that go into an index change, so that old index files are ignored
+    INDEX_KEY_VERSION = 1
+
+    # From this many in-mask voxels on (high-resolution volumes) the session keeps its TDP bounds
+    # in compact form (see ARISession.compact), which gives the same results in less memory
+    COMPACT_VOXELS = 1 << 20
+
+    def indexKey(self, p, indexp, volDim, alpha, conn):
+        """
+        Hash of everything the ARI index depends on: the in-mask p-values, the mask (through
+        the in-mask voxel coordinates), the volume dimensions, alpha and conn.
+        """
+        h = hashlib.sha256()
+        h.update(f"ARI index v{self.INDEX_KEY_VERSION}|{list(volDim)}|{float(alpha)!r}|{int(conn)}|".encode())
+        h.update(np.ascontiguousarray(p, dtype=np.float64).tobytes())
+        h.update(np.ascontiguousarray(indexp, dtype=np.int64).tobytes())
+        return h.hexdigest()
+
+    def indexPath(self, file_nr):
+        """
+        Path of the ARI index written next to the NIfTI file, or None if the map has no file.
+        """
+        full_path = self.fileInfo[file_nr].get('full_path')
+        return None if full_path is None else full_path + '.ariidx'
+
+    def loadIndex(self, index_path, index_key):
+        """
+        Restore the results of a previous run on the same inputs, or return None.
+        """
+        if index_path is None:
+            return None
+        try:
+            return ARI_C.np_loadIndex(index_path, index_key)
+        except (OSError, RuntimeError) as e:
+            print(f"Ignoring ARI index {index_path}: {e}")
+            return None
+
+    def saveIndex(self, index_path, index_key, session, ordp, rankp, hom):
+        """
+        Write the ARI index for later runs; a map in a read-only location simply goes without.
+        """
+        if index_path is None:
+            return
+        try:
+            ARI_C.np_saveIndex(session, index_path, index_key,
+                               np.ascontiguousarray(ordp, dtype=np.intc), np.ascontiguousarray(rankp, dtype=np.intc),
+                               hom.jump_alpha, hom.simes_factor)
+        except (OSError, RuntimeError) as e:
+            print(f"Could not write ARI index {index_path}: {e}")
+
+    def startProfile(self):
+        """
+        Switch on the stage counters of both native modules and clear their totals.
+        """
+        for module in (hommel, ARI_C):
+            module.np_profileEnable(True)
+            module.np_profileReset()
+
+    def stopProfile(self):
+        """
+        Switch off the stage counters again and return their totals per stage (see np_profileStats),
+        summed over both native modules, in the order in which the stages usually run.
+        """
+        stats = {}
+        for module in (hommel, ARI_C):
+            for stage, totals in module.np_profileStats().items():
+                merged = stats.setdefault(stage, {})
+                for name, value in totals.items():
+                    merged[name] = max(merged.get(name, 0), value) if name == 'peak_rss_kb' else merged.get(name, 0) + value
+            module.np_profileEnable(False)
+        return stats
+
+    def printProfile(self, stats):
+        """
+        Log the stage totals of a run, slowest stage first.
+        """
+        print(f"{'stage':<28} {'calls':>7} {'seconds':>9} {'peak MB':>8}  counters")
+        for stage, totals in sorted(stats.items(), key=lambda item: -item[1]['seconds']):
+            counters = ', '.join(f"{name} {value}" for name, value in totals.items()
+                                 if name not in ('calls', 'seconds', 'peak_rss_kb'))
+            peak = f"{totals['peak_rss_kb'] / 1024:8.1f}" if totals['peak_rss_kb'] else f"{'':>8}"
+            print(f"{stage:<28} {totals['calls']:>7} {totals['seconds']:9.4f} {peak}  {counters}")
+
+    def runNative(self, progress, label, first, steps, call, stages=None):
+        """
+        Run one native stage in a worker thread while the event loop keeps running, so that the
+        viewers stay responsive and the Cancel button of the progress dialog takes effect. The
+        native calls release the GIL; call(hook) passes the ARI_C.NativeProgress hook on to the
+        calls that take one, and the dialog moves from first to first + steps along with it.
+        A call that goes through several reporting stages can map them to parts of that range
+        with stages, {stage: (label, first, steps)}.
+        Returns the result of call, or raises ARI_C.Cancelled if the dialog was cancelled.
+        """
+        hook = ARI_C.NativeProgress()
+        outcome = {}
+
+        def worker():
+            try:
+                outcome['result'] = call(hook)
+            except BaseException as e:
+                outcome['error'] = e
+
+        progress.setLabelText(label)
+        progress.setValue(first)
+        thread = threading.Thread(target=worker, name=f"ARI {label}", daemon=True)
+        thread.start()
+        value = first
+        while thread.is_alive():
+            QApplication.processEvents(QEventLoop.AllEvents, 50)
+            if progress.wasCanceled():
+                hook.cancel()
+            elif stages is not None and hook.stage in stages:
+                stage_label, stage_first, stage_steps = stages[hook.stage]
+                progress.setLabelText(stage_label)
+                value = max(value, stage_first + int(stage_steps * hook.fraction))
+                progress.setValue(value)
+            elif stages is None:
+                value = max(value, first + int(steps * hook.fraction))
+                progress.setValue(value)
+            thread.join(0.02)
+
+        if 'error' in outcome:
+            raise outcome['error']
+        if progress.wasCanceled():
+            raise ARI_C.Cancelled("cancelled")
+        progress.setValue(first + steps)
+        return outcome.get('result')
+
     def runARI(self):
+        try:
+            return self.runStages()
+        except ARI_C.Cancelled:
+            print("ARI analysis cancelled.")
+            self.stopProfile()
+            return None
+
+    def analyseMaps(self, file_nrs, chunk=8, nthreads=0, progress=None, keep_sessions=False):
+        """
+        Batch analysis of several loaded maps with the current settings (alpha, conn), without the
+        viewers. Maps that share a mask are analysed together in one native call (np_analyseMaps),
+        chunk maps at a time to bound memory, which builds the adjacency list and simes factors of
+        the mask once and runs Hommel, cluster identification, forestTDP and query preparation of
+        the maps concurrently on nthreads threads (0: all). The results are written to the ARI
+        index of each map, so that a later runARI on the map starts at the gradient map.
+        Returns {file_nr: {'h', 'wbtdp', 'concentration'[, 'session']}}.
+        """
+        alpha = self.brain_nav.input['alpha']
+        conn  = self.brain_nav.input['conn']
+
+        # In-mask p-values and coordinates per map, grouped by mask
+        groups = {}
+        current = self.brain_nav.file_nr
+        try:
+            for file_nr in file_nrs:
+                self.brain_nav.file_nr = file_nr
+                p, pval, m, indexp = Utilities(self.brain_nav).getPVals()
+                shape  = self.fileInfo[file_nr]['data'].shape
+                volDim = [shape[i] for i in [2, 1, 0]]
+                mask   = (tuple(volDim), np.ascontiguousarray(indexp, dtype=np.int64).tobytes())
+                groups.setdefault(mask, []).append((file_nr, np.ascontiguousarray(p, dtype=np.float64), indexp, shape))
+        finally:
+            self.brain_nav.file_nr = current
+
+        results = {}
+        for (volDim, _), maps in groups.items():
+            indexp = maps[0][2]
+            maskI = np.zeros(volDim, dtype=np.intc)
+            maskI[tuple(indexp)] = np.arange(1, len(indexp[0]) + 1)
+            maskI_flat = np.ascontiguousarray(maskI.ravel('C'), dtype=np.intc)
+            indexp_c   = np.ascontiguousarray(np.ravel_multi_index(indexp, maskI.shape, order='C'), dtype=np.intc)
+            volDim_c   = np.ascontiguousarray(list(maps[0][3]), dtype=np.intc)
+
+            for start in range(0, len(maps), chunk):
+                batch = maps[start:start + chunk]
+                P = np.ascontiguousarray(np.stack([p for _, p, _, _ in batch]), dtype=np.float64)
+                simes_factor, analysed = ARI_C.np_analyseMaps(P, maskI_flat, indexp_c, volDim_c, conn, alpha,
+                                                              nthreads=nthreads, max_maps=chunk, progress=progress)
+                for (file_nr, p, _, _), res in zip(batch, analysed):
+                    hom = pyHommel(p=p, jump_alpha=res['jump_alpha'], sorter=res['ORD'] - 1, adjusted=None,
+                                   simes_factor=simes_factor, simes=True)
+                    self.saveIndex(self.indexPath(file_nr), self.indexKey(p, indexp, volDim, alpha, conn),
+                                   res['session'], res['ORD'], res['RANK'], hom)
+                    results[file_nr] = {'h': res['h'], 'wbtdp': res['wbtdp'], 'concentration': res['concentration']}
+                    if keep_sessions:
+                        res['session'].compact = len(p) >= self.COMPACT_VOXELS
+                        results[file_nr]['session'] = res['session']
+        return results
+
+    def runStages(self):
         gammas = np.arange(0, 1.01, 0.01)
 
         # Use a fixed total of 100 steps for better control
@@ -91,72 +281,34 @@ class pyARI:
         # Use alpha from settings 
         alpha = self.brain_nav.input['alpha']
 
-        print('entering hommel')
-        # Hommel step
-        progress.setLabelText("Computing whole-brain TDP...")
-        hom = pyHommel.hommel_wbTDP(p, simes=True)
-        mintdp = hom.tdp(alpha = alpha)
-        progress.setValue(HOMMEL_STEPS)
-
-        # Update progress
-        progress.setValue(5)
-
-        if mintdp == 0:
-            print("No significant brain activations can be detected.")
-            return None
-        
-        print('entering findHalpha')
-        # Alpha threshold step
-        progress.setLabelText("Calculating alpha thresholds...")
-        halpha          = hommel.py_findHalpha(hom.jump_alpha, alpha = alpha, m=m)
-        # simeshalpha = hom.simes_factor[halpha + 1]
-        simeshalpha     = hom.simes_factor[halpha]
-        conc_thres      = hom.concentration(alpha)
-        progress.setValue(HOMMEL_STEPS + HALPHA_STEPS)
-
-        # Remove hom (not needed in Python unused variables are
-        # automatically removed by the garbage collector)
-        # del hom
-
-        # Sort p-values in ascending order and get the sorted indices  
-        # ordp = np.argsort(p)
-        # ordp = ordp.astype(int)  # Ensure ordp is of integer type
-        flattened_p = p.flatten(order='C')
-        ordp_flat   = np.argsort(p, kind='stable')
-        ordp        = ordp_flat.astype(int)
-
-        # Find the sorting ranks for unsorted p-values
-        rankp       = np.zeros(m, dtype=int)
-        # rankp[ordp] = np.arange(1, m + 1)
-        rankp[ordp] = np.arange(m)
-        
-        rankp       = rankp.astype(int)  # Ensure rankp is of integer type
+        # In pval utility function we have transposed the data, this is needed for cpp, here we take the data shape
+        # which is still untransposed and transpose its dimensions the same way so that the mask is in alignment
+        volDim = self.fileInfo[file_nr]['data'].shape
+        volDim = [volDim[i] for i in [2, 1, 0]]
 
-        # Correct for one based ordering
-        ordp += 1
-        rankp +=1
+        # A map that was analysed before with the same inputs has an index next to it, holding
+        # the sorting orders, Hommel results, forest, TDP bounds and admissible STCs. With it,
+        # everything up to the gradient map is skipped.
+        index_path = self.indexPath(file_nr)
+        index_key  = self.indexKey(p, indexp, volDim, alpha, conn)
+        cached     = self.loadIndex(index_path, index_key)
 
         # Create a 3D whole-brain mask of unsorted orders (starts from 1)
         # volDim = self.fileInfo[file_nr]['header'].get_data_shape()
         # volDim =  self.fileInfo[file_nr]['original_data_dimensions']
         # volDim = self.fileInfo[file_nr]['data'].shape
 
-        # In pval utility function we have transposed the data, this is needed for cpp, here we take the data shape
-        # which is still untransposed and transpose its dimensions the same way so that the mask is in alignment
-        volDim = self.fileInfo[file_nr]['data'].shape
-        volDim = [volDim[i] for i in [2, 1, 0]]
-   
-
         # Initialize 3D mask with zeros
-        maskI = np.zeros(volDim, dtype=int)  # Assuming volDim is equivalent to fileInfo$header$dim[2:4]
+        maskI = np.zeros(volDim, dtype=np.intc)  # Assuming volDim is equivalent to fileInfo$header$dim[2:4]
 
         # Create a 1-based index for assigning values to mask
         maskI[tuple(indexp)] = np.arange(1, len(indexp[0]) + 1)  # Assigns 1 to m (like 1:m in R)
 
-        # Flatten maskI into a list in C-order
-        maskI_flat = maskI.flatten('C').tolist()
+        # Flatten maskI in C-order (int32, so the C++ code can read it in place)
+        maskI_flat = np.ascontiguousarray(maskI.ravel('C'), dtype=np.intc)
         
         indexp_linear   = np.ravel_multi_index(indexp, maskI.shape, order='C')
+        indexp_c        = np.ascontiguousarray(indexp_linear, dtype=np.intc)
 
         # Convert volDim to list
         # volDim_list = list(volDim)
@@ -165,108 +317,88 @@ class pyARI:
         # While the mask is constructed using the 'new' dimensions, findAdjList still requires the original data dimensions
         # for it to work properly --> WHY?
         volDim_list = list(self.fileInfo[file_nr]['data'].shape)
+        volDim_c    = np.ascontiguousarray(volDim_list, dtype=np.intc)
         # volDim_list = [volDim_list[i] for i in [2, 1, 0]]  
 
-        # Call the Cython functions
-
-        # Adjacency list step
-        print('entering py_findAdjList')
-        progress.setLabelText("Building voxel adjacency list...")
-        adj     = ARI_C.py_findAdjList(maskI_flat, indexp_linear.tolist(), volDim_list, m, conn)        
-        # adj     = get_adjList.findAdjList(maskI_flat, indexp_linear.tolist(), volDim_list, m, conn)
-        # adj     = ARI_C.py_findAdjList(maskI_flat, indexp_linear.tolist(), [59, 77, 65], m, conn)
-        progress.setValue(HOMMEL_STEPS + HALPHA_STEPS + ADJLIST_STEPS)
-
-        # Cluster identification step
-        print('entering py_findClusters')
-        progress.setLabelText("Identifying brain clusters...")
-        reslist = ARI_C.py_findClusters(m, adj, ordp.tolist(), rankp.tolist())
-        progress.setValue(HOMMEL_STEPS + HALPHA_STEPS + ADJLIST_STEPS + CLUSTERS_STEPS)
-
-        # TDP calculation step
-        print('entering py_forestTDP')
-        progress.setLabelText("Computing cluster TDP values...")
-        tdps    = ARI_C.py_forestTDP(m, halpha, alpha, simeshalpha, p.tolist(), reslist["SIZE"], reslist["ROOT"], reslist["CHILD"])
-        progress.setValue(HOMMEL_STEPS + HALPHA_STEPS + ADJLIST_STEPS + CLUSTERS_STEPS + TDP_STEPS)
-
-        # Query preparation step
-        print('entering py_queryPreparation')
-        progress.setLabelText("Preparing for TDP queries...")
-        stcs    = ARI_C.py_queryPreparation(m, reslist["ROOT"], tdps, reslist["CHILD"])
-        progress.setValue(HOMMEL_STEPS + HALPHA_STEPS + ADJLIST_STEPS + CLUSTERS_STEPS + TDP_STEPS + QUERY_PREP_STEPS)
-
-
-        # initialize a vector for marking found clusters
-        marks = np.zeros(m, dtype=int)
-        marks = marks.tolist()
-
         # initialize cluster image: >0 for voxels within clusters & gradient map
         # Get the dimensions of the transposed functional data 
         # dim = self.fileInfo[file_nr]['header'].get_data_shape()
         dim = volDim
         # dim = [65, 77, 49]
 
-        # Initialize the cluster image and gradient map with zeros
-        clusimg = np.zeros(dim)
-        gradmap = np.zeros(dim)
+        # Initialize the gradient map with zeros
+        gradmap = np.zeros(dim, dtype=np.float32)
 
         # Define TDP thresholds ranging from 0 to 1 with 0.01 increments
         # gammas = np.arange(0, 1.01, 0.01)
 
-        # Start timer for the batch query
-        query_time = 0
-        tic = time.time()
-
-        # Call the batch function with all gamma values at once. Results are the same but C implementation outperforms
-        # Python version. Making connection with C routine takes long but the itterations are much faster in C. 
-        print('entering py_answerQueryBatch')
-        progress.setLabelText("Running TDP queries for gradient map...")
-        batch_clusterlists = ARI_C.py_answerQueryBatch(gammas.tolist(), stcs, reslist['SIZE'], marks, tdps, reslist['CHILD'])
-        # batch_clusterlists = get_clusters.answer_query_batch(gammas.tolist(), stcs, reslist['SIZE'], marks, tdps, reslist['CHILD'])
+        # Time and count the native stages of this run (reported at the end)
+        self.startProfile()
+
+        # Without an index, the whole analysis up to the local minima is one native call
+        # (np_runPipeline) that runs independent stages concurrently: Hommel alongside the
+        # adjacency list, the local minima alongside the TDP bounds and the gradient map alongside
+        # the query preparation. The returned session keeps the forest, TDP bounds and admissible
+        # STCs on the C++ side, so the steps below (and all later queries from the UI) do not copy
+        # the forest back and forth. It runs in a worker thread (see runNative) and can be cancelled.
+        native_end = HOMMEL_STEPS + HALPHA_STEPS + ADJLIST_STEPS + CLUSTERS_STEPS + TDP_STEPS + QUERY_PREP_STEPS + GAMMA_STEPS
+        if cached is None:
+            p_c = np.ascontiguousarray(p, dtype=np.float64)
+            stages = {
+                'findAdjList':   ("Identifying brain clusters...", HOMMEL_STEPS + HALPHA_STEPS, ADJLIST_STEPS),
+                'reduceEdges':   ("Identifying brain clusters...", HOMMEL_STEPS + HALPHA_STEPS + ADJLIST_STEPS, CLUSTERS_STEPS // 2),
+                'sweepClusters': ("Identifying brain clusters...", HOMMEL_STEPS + HALPHA_STEPS + ADJLIST_STEPS + CLUSTERS_STEPS // 2, CLUSTERS_STEPS // 2),
+                'forestTDP':     ("Computing cluster TDP values...", HOMMEL_STEPS + HALPHA_STEPS + ADJLIST_STEPS + CLUSTERS_STEPS, TDP_STEPS),
+                'gradientMap':   ("Building gradient map...", native_end - GAMMA_STEPS, GAMMA_STEPS)
+            }
+            pipeline = self.runNative(progress, "Computing whole-brain TDP...", 0, native_end,
+                                      lambda hook: ARI_C.np_runPipeline(p_c, maskI_flat, indexp_c, volDim_c, conn, alpha, gammas.tolist(), gradmap,
+                                                                        np.ascontiguousarray(dim, dtype=np.intc), compact=m >= self.COMPACT_VOXELS,
+                                                                        nthreads=0, progress=hook),
+                                      stages=stages)
+            hom = pyHommel(p=p, jump_alpha=pipeline['jump_alpha'], sorter=pipeline['ORD'] - 1, adjusted=pipeline['adjusted'],
+                           simes_factor=pipeline['simes_factor'], simes=True)
+            mintdp = pipeline['wbtdp']
+        else:
+            hom = pyHommel(p=p, jump_alpha=cached['jump_alpha'], sorter=cached['ORD'] - 1, adjusted=None,
+                           simes_factor=cached['simes_factor'], simes=True)
+            mintdp = hom.tdp(alpha = alpha)
+            progress.setValue(HOMMEL_STEPS)
 
-        # Update for starting gamma loop
-        current_progress = HOMMEL_STEPS + HALPHA_STEPS + ADJLIST_STEPS + CLUSTERS_STEPS + TDP_STEPS + QUERY_PREP_STEPS
-        progress.setValue(current_progress)
+        if mintdp == 0:
+            print("No significant brain activations can be detected.")
+            self.stopProfile()
+            return None
         
-        # For gamma iterations, use a subset of update points to avoid excessive redraws
-        num_gammas = len(gammas)
-        update_points = 10  # Number of visual updates during gamma iteration
-        update_interval = max(1, num_gammas // update_points)
-
-        # End timer for the batch query
-        toc = time.time()
-        query_time += toc - tic
-        print(f"Query time: {query_time:.4f} seconds")
-
-        # Loop through each result in the batch
-        for i, clusterlist in enumerate(batch_clusterlists):
-            if progress.wasCanceled():
-                break
-            
-            g = gammas[i]  # Corresponding gamma value
-            
-            # Only update the progress dialog occasionally to avoid UI slowdowns
-            if i % update_interval == 0 or i == num_gammas - 1:
-                # Calculate progress within the GAMMA_STEPS allocation
-                gamma_progress = int((i / num_gammas) * GAMMA_STEPS)
-                progress.setValue(current_progress + gamma_progress)
-                progress.setLabelText(f"Building gradient map: {int(g*100)}% TDP")
+        # Alpha threshold step
+        progress.setLabelText("Calculating alpha thresholds...")
+        halpha          = hommel.np_findHalpha(hom.jump_alpha, alpha = alpha, m=m)
+        # simeshalpha = hom.simes_factor[halpha + 1]
+        simeshalpha     = hom.simes_factor[halpha]
+        conc_thres      = hom.concentration(alpha)
+        progress.setValue(max(progress.value(), HOMMEL_STEPS + HALPHA_STEPS))
 
-            
-            if len(clusterlist) != 0:
-                # Adjust the zero-based index correction
-                # Flatten the cluster list and use it to index into 'indexp'
-                out_ids = indexp_linear[np.concatenate(clusterlist)]
-                
-                # Set the corresponding indices in 'clusimg' to 1 for the current clusters
-                clusimg.flat[out_ids] = 1
-                
-                # Update the gradient map with the maximum value between the current map and the new clusters
-                gradmap = np.maximum(gradmap, (clusimg > 0) * g)
-                
-                # Reset the cluster image to zeros for the next iteration
-                clusimg.flat[out_ids] = 0
+        # Remove hom (not needed in Python unused variables are
+        # automatically removed by the garbage collector)
+        # del hom
 
+        # The sorting orders and ranks of the p-values (1-based), as the forest was built with
+        if cached is None:
+            ordp        = pipeline['ORD'].astype(int)
+            rankp       = pipeline['RANK'].astype(int)
+            session     = pipeline['session']
+            self.saveIndex(index_path, index_key, session, ordp, rankp, hom)
+        else:
+            ordp        = cached['ORD'].astype(int)
+            rankp       = cached['RANK'].astype(int)
+            session     = cached['session']  # Views the mapped index, so it is left in full mode
+
+            # Write, for every voxel, the largest gamma at which it lies inside a maximal STC. This
+            # is the same map as answering the query for every gamma and taking the voxel-wise
+            # maximum, but it is computed in one walk over the forest on the C++ side.
+            self.runNative(progress, "Building gradient map...", native_end - GAMMA_STEPS, GAMMA_STEPS,
+                           lambda hook: ARI_C.np_gradientMap(session, gammas.tolist(), gradmap, progress=hook))
+        progress.setValue(native_end)
 
           # After gamma loop
         current_progress = HOMMEL_STEPS + HALPHA_STEPS + ADJLIST_STEPS + CLUSTERS_STEPS + TDP_STEPS + QUERY_PREP_STEPS + GAMMA_STEPS
@@ -283,17 +415,28 @@ class pyARI:
         # we transpose it back to the original. 
         gradmap_img = nib.Nifti1Image(gradmap, affine=self.fileInfo[file_nr]['affine'] )
 
+        # Python-side copies of the forest for the routines in getClusters/Metrics, as NumPy arrays
+        # (the children and the marks stay in the session)
+        forest = ARI_C.np_forestArrays(session)
+        reslist = {
+            'SIZE': forest['SIZE'],
+            'ROOT': forest['ROOT']
+        }
+        tdps = forest['TDP']
+        stcs = forest['ADMSTC']
+
         # Using the property funciton defined below we can drop the brain_nav chaining
         self.fileInfo[file_nr].update({
             'pval': pval,
             'p': p,
             'ordp': ordp,
             'm': m,
-            'marks': marks,
             'mintdp': mintdp,
             'indexp': indexp,
             'indexp_linear': indexp_linear,
             'reslist': reslist,
+            'ari_session': session,
+            'tdp_clusters': {},
             'tdps': tdps,
             'stcs': stcs,
             'conc_thres': conc_thres,
@@ -338,14 +481,17 @@ class pyARI:
         progress.setValue(current_progress + 5)
 
 
-        # Precompute the IDs of local minima (leaves of the tree) based on the CHILD structure.
-        LM_ids = ARI_C.py_findLMS(self.fileInfo[file_nr]['reslist']['CHILD'])
-
-        # Map local minima IDs (LM_ids) to their corresponding voxel indices using the linear indexing system.
-        LM_voxel_indices = [self.fileInfo[file_nr]['indexp_linear'][lm] for lm in LM_ids]
-
-        # Convert voxel indices to their corresponding XYZ coordinates in the brain image.
-        LM_xyz = ARI_C.py_ids2xyz(LM_voxel_indices, list(dim))
+        # Precompute the IDs of local minima (leaves of the tree) based on the CHILD structure,
+        # together with their XYZ coordinates in the brain image (the session maps the node ids
+        # to voxel indices through indexp_linear), in one native call. np_runPipeline has found
+        # them already.
+        # LM_ids = session.findLMS()
+        # LM_xyz = session.ids2xyz(LM_ids, list(dim))
+        if cached is None:
+            LM_ids, LM_xyz = pipeline['LMS'], pipeline['LMS_xyz']
+        else:
+            LM_ids, LM_xyz = ARI_C.np_findLMSXYZ(session, np.ascontiguousarray(dim, dtype=np.intc))
+        LM_ids = LM_ids.tolist()
         # LM_xyz = get_adjList.py_ids2xyz(LM_voxel_indices, list(dim))
         # LM_xyz = ARI_C.py_ids2xyz(LM_voxel_indices, list(self.fileInfo[file_nr]['original_data_dimensions']))
 
@@ -356,7 +502,7 @@ class pyARI:
 
         # Create a mapping from local minima IDs (LM_ids) to their XYZ coordinates.
         self.fileInfo[file_nr]['voxel_to_LM'] = {
-            lm_id: tuple(coord) for lm_id, coord in zip(LM_ids, LM_xyz)
+            lm_id: tuple(coord) for lm_id, coord in zip(LM_ids, LM_xyz.tolist())
         }
 
         # Create a count mapping for each LM_id, used to generate unique cluster IDs.
@@ -585,8 +731,20 @@ class pyARI:
 
         current_progress += TEMPLATE_STEPS
 
+        # Stage totals of the native code in this run; kept with the map so they can be inspected later
+        profile = self.stopProfile()
+        self.fileInfo[file_nr]['ari_profile'] = profile
+        self.printProfile(profile)
+        footprint = ARI_C.np_memoryFootprint(session)
+        mapped = f", {footprint['mapped'] / 2**20:.1f} MB mapped from the index" if session.mapped else ""
+        print(f"ARI session: {footprint['total'] / 2**20:.1f} MB ({'compact' if session.compact else 'full'} TDP bounds{mapped})")
+
         # Final update
-        progress.setLabelText("Finalizing and updating views...")
+        if profile:
+            slowest = max(profile, key=lambda stage: profile[stage]['seconds'])
+            progress.setLabelText(f"Finalizing and updating views... (slowest stage: {slowest}, {profile[slowest]['seconds']:.2f} s)")
+        else:
+            progress.setLabelText("Finalizing and updating views...")
         progress.setValue(current_progress)
 
 
@@ -13,12 +13,13 @@ class pyHommel:
         self.simes = simes
 
     @classmethod
-    def hommel_wbTDP(cls, p, simes=True):
+    def hommel_wbTDP(cls, p, simes=True, nthreads=0):
         """
         Compute the whole-brain TDP, i.e. min(TDP).
         
         :param p: Array-like, p-values.
         :param simes: Boolean, whether to use the Simes method.
+        :param nthreads: Threads for sorting the p-values (0: all cores).
         :return: Instance of PyHommel.
         """
         # Check for missing values in p
@@ -32,32 +33,24 @@ class pyHommel:
         # Get the names if p is a pandas Series
         names = p.index if isinstance(p, pd.Series) else None
 
-        # Sort the p-values and get the permutation indices
-        # flattened_p = p.flatten(order='C')
-        # ordp_flat   = np.argsort(flattened_p)
-        # ordp        = ordp_flat.astype(int)
-
-        perm = list(np.argsort(p, kind='stable'))
-        sorted_p = p[perm]
-
-        # List sorted_p for input below
-        sorted_p = sorted_p.tolist()
+        # Sort the p-values and get the permutation indices (native stable sort, 1-based order)
+        order, _, sorted_p = hommel.np_orderPValues(np.ascontiguousarray(p, dtype=np.float64), nthreads)
+        perm = order - 1
 
         # Length of p-values
         m = len(p)
 
         # Compute Simes factor
-        simes_factor        = hommel.py_findsimesfactor(simes, m)
+        simes_factor        = hommel.np_findsimesfactor(simes, m)
 
         # Find the jumps of h(alpha)
-        jump_alpha          = hommel.py_findalpha(sorted_p, m, simes_factor, simes)
+        jump_alpha          = hommel.np_findalpha(sorted_p, m, simes_factor, simes)
 
         # Calculate adjusted p-values for all elementary hypotheses
-        adjusted            = hommel.py_adjustedElementary(sorted_p, jump_alpha, m, simes_factor)
+        adjusted            = hommel.np_adjustedElementary(sorted_p, jump_alpha, m, simes_factor)
 
         # Reorder adjusted p-values to match original order
-        adjusted = np.array(adjusted)
-        adjusted[perm] = adjusted
+        adjusted[perm] = adjusted.copy()
 
         # If names are present, convert adjusted to a pandas Series
         if names is not None:
@@ -129,34 +122,98 @@ class pyHommel:
             return 0
 
         # Find the index h for the given alpha
-        h = hommel.py_findHalpha(self.jump_alpha, alpha, m)
+        h = hommel.np_findHalpha(self.jump_alpha, alpha, m)
         # Get the Simes factor for the determined h
         simes_factor = self.simes_factor[h]
         # Sort the p-values using the stored sorter
         all_sorted_p = self.p[self.sorter]
 
-        # Create an array of indices sorted by p-values
-        ix_sorted_p = np.zeros(m, dtype=int)
-        # ix_sorted_p[self.sorter] = np.arange(1, m + 1)
-        ix_sorted_p[self.sorter] = np.arange(m)
-        ix_sorted_p = ix_sorted_p[ix]
+        # The (1-based) ranks of the selected p-values, which is what findDiscoveries takes
+        ix_sorted_p = self.ranks()[ix]
 
-        # Convert to list for compatibility with the C++ function
-        ix_sorted_p = ix_sorted_p.tolist()
-        all_sorted_p = all_sorted_p.tolist()
+        # Contiguous int32/float64 arrays, read in place by the C++ function
+        ix_sorted_p = np.ascontiguousarray(ix_sorted_p, dtype=np.intc)
+        all_sorted_p = np.ascontiguousarray(all_sorted_p, dtype=np.float64)
 
         # Find the number of discoveries using the C++ function
-        discoveries = hommel.py_findDiscoveries(ix_sorted_p, all_sorted_p, simes_factor, h, alpha, k, m)
+        discoveries = hommel.np_findDiscoveries(ix_sorted_p, all_sorted_p, simes_factor, h, alpha, k, m)
 
         if not incremental:
             # If not incremental, return the number of discoveries for the last index
-            # return discoveries[k]
-            return discoveries[k-1]
+            return discoveries[k]
         else:
             # If incremental, return the number of discoveries for each step
             return discoveries[1:]
 
 
+    def ranks(self):
+        """
+        The 1-based rank of every p-value in the sorted p-values (the index form of the native
+        discovery functions), as contiguous int32.
+        """
+        ranks = np.empty(len(self.p), dtype=np.intc)
+        ranks[self.sorter] = np.arange(1, len(self.p) + 1, dtype=np.intc)
+        return ranks
+
+    def discoveries_sets(self, sets, alpha=0.05, nthreads=0):
+        """
+        Calculate the number of discoveries and the TDP of many selections in one native call,
+        e.g. all clusters of a map or all regions of an atlas.
+
+        Parameters:
+        sets (list of array-like): Integer indices of the p-values of each selection.
+        alpha (float): Significance level for determining discoveries.
+        nthreads (int): Number of threads to spread the selections over (0: all cores).
+
+        Returns:
+        tuple: (discoveries, tdp), arrays with one entry per selection (TDP 0 for empty ones).
+        """
+        sizes = np.array([len(ix) for ix in sets], dtype=np.intc)
+        ptr = np.zeros(len(sets) + 1, dtype=np.intc)
+        np.cumsum(sizes, out=ptr[1:])
+        ranks = self.ranks()
+        idx = np.concatenate([ranks[np.asarray(ix, dtype=np.intp)] for ix in sets]) if len(sets) else np.zeros(0, dtype=np.intc)
+        return self._discoveries_csr(ptr, idx, sizes, alpha, nthreads)
+
+    def discoveries_regions(self, labels, alpha=0.05, nthreads=0):
+        """
+        Calculate the number of discoveries and the TDP of every region of a label map, e.g. an
+        atlas resampled to the voxels of p. Label 0 is background and is left out.
+
+        Parameters:
+        labels (array-like): Integer region label of each p-value (same order and length as p).
+        alpha (float): Significance level for determining discoveries.
+        nthreads (int): Number of threads to spread the regions over (0: all cores).
+
+        Returns:
+        tuple: (regions, sizes, discoveries, tdp), arrays with one entry per region label.
+        """
+        labels = np.asarray(labels).ravel()
+        if len(labels) != len(self.p):
+            raise ValueError("'labels' must hold one label per p-value")
+
+        # Group the voxels by label (stable, so each region keeps the order of p)
+        inside = np.flatnonzero(labels != 0)
+        order = inside[np.argsort(labels[inside], kind='stable')]
+        regions, sizes = np.unique(labels[order], return_counts=True)
+        sizes = sizes.astype(np.intc)
+        ptr = np.zeros(len(regions) + 1, dtype=np.intc)
+        np.cumsum(sizes, out=ptr[1:])
+        idx = self.ranks()[order]
+        discoveries, tdp = self._discoveries_csr(ptr, idx, sizes, alpha, nthreads)
+        return regions, sizes, discoveries, tdp
+
+    def _discoveries_csr(self, ptr, idx, sizes, alpha, nthreads):
+        m = len(self.p)
+        h = hommel.np_findHalpha(self.jump_alpha, alpha, m)
+        all_sorted_p = np.ascontiguousarray(self.p[self.sorter], dtype=np.float64)
+        if np.any(np.isnan(all_sorted_p)):
+            raise ValueError("Missing values in p-values")
+        discoveries = hommel.np_findDiscoveriesBatch(np.ascontiguousarray(ptr, dtype=np.intc), np.ascontiguousarray(idx, dtype=np.intc),
+                                                     all_sorted_p, self.simes_factor[h], h, alpha, m, nthreads)
+        tdp = np.divide(discoveries, sizes, out=np.zeros(len(sizes)), where=sizes > 0)
+        return discoveries, tdp
+
     def concentration(self, alpha):
         """
         Calculate the concentration of p-values for a given alpha.
@@ -169,7 +226,7 @@ class pyHommel:
         """
         m = len(self.p)  # Total number of p-values
         # Find the index h for the given alpha
-        h = hommel.py_findHalpha(self.jump_alpha, alpha, m)
+        h = hommel.np_findHalpha(self.jump_alpha, alpha, m)
 
         # Get the Simes factor for the determined h
         # simes_factor = self.simes_factor[h + 1]
@@ -178,7 +235,7 @@ class pyHommel:
         # Sort the p-values using the stored sorter
         sorted_p = self.p[self.sorter]
         # Find the concentration using the C++ function
-        z = hommel.py_findConcentration(sorted_p.tolist(), simes_factor, h, alpha, m)
+        z = hommel.np_findConcentration(np.ascontiguousarray(sorted_p, dtype=np.float64), simes_factor, h, alpha, m)
 
         # Return the p-value at the determined concentration index
         return sorted_p[z]
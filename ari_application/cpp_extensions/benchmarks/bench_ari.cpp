@@ -0,0 +1,431 @@
+// bench_ari.cpp
+//
+// Standalone benchmark of the native ARI stages (Hommel, sorting, adjacency list, forest, TDP
+// bounds, queries) on synthetic volumes, outside the Qt application. For every stage it reports
+// the median wall time over the repetitions, the number and volume of heap allocations and the
+// peak of live heap memory during the stage, and the peak resident set size of the process.
+// The inputs are generated from a fixed seed, so runs on the same machine are comparable.
+//
+// Build (from this directory):
+//   g++ -O2 -std=c++11 -pthread -I../cpp_sources -o bench_ari bench_ari.cpp
+//       ../cpp_sources/ARICluster.cpp ../cpp_sources/ARISession.cpp ../cpp_sources/hommel.cpp
+//       ../cpp_sources/hommel_simd.cpp
+//
+// Run:
+//   ./bench_ari [--grid 2mm|1mm|0.7mm] [--field smooth|sparse] [--conn 6|18|26]
+//               [--reps N] [--threads N] [--seed N] [--csv]
+//
+// The grids are the MNI bounding boxes at 2mm (91 x 109 x 91), 1mm (182 x 218 x 182) and the
+// 0.7mm of 7T acquisitions (260 x 311 x 260), with an ellipsoidal brain mask of about 228k,
+// 1.8M and 5.3M voxels. The smooth field is smoothed noise plus broad activation blobs (large,
+// deep forests); the sparse field is white noise plus a few small blobs (many small clusters).
+// See bench_getClusters.py for the pure-Python baseline of the query stages.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+#include "ARICluster.h"
+#include "ARISession.h"
+#include "hommel.h"
+
+// ---------------------------------------------------------------------------------------------
+// Heap accounting: every allocation carries a header with its size, so that the live heap and
+// its peak can be tracked per stage
+
+namespace
+{
+std::atomic<long> ALLOCS(0);       // Allocations since the last reset
+std::atomic<long> ALLOCBYTES(0);   // Bytes allocated since the last reset
+std::atomic<long> LIVEBYTES(0);    // Bytes currently allocated
+std::atomic<long> PEAKBYTES(0);    // Peak of LIVEBYTES since the last reset
+
+const size_t HEADER = 16;          // Keeps the default new alignment
+
+void* countedAlloc(size_t n)
+{
+    char* raw = static_cast<char*>(std::malloc(n + HEADER));
+    if (raw == NULL) return NULL;
+    *reinterpret_cast<size_t*>(raw) = n;
+
+    ALLOCS++;
+    ALLOCBYTES += n;
+    long live = (LIVEBYTES += n);
+    long peak = PEAKBYTES.load();
+    while (live > peak && !PEAKBYTES.compare_exchange_weak(peak, live)) {}
+    return raw + HEADER;
+}
+
+void countedFree(void* ptr)
+{
+    if (ptr == NULL) return;
+    char* raw = static_cast<char*>(ptr) - HEADER;
+    LIVEBYTES -= *reinterpret_cast<size_t*>(raw);
+    std::free(raw);
+}
+}
+
+void* operator new(size_t n)
+{
+    void* ptr = countedAlloc(n);
+    if (ptr == NULL) throw std::bad_alloc();
+    return ptr;
+}
+void* operator new[](size_t n) { return operator new(n); }
+void* operator new(size_t n, const std::nothrow_t&) noexcept { return countedAlloc(n); }
+void* operator new[](size_t n, const std::nothrow_t&) noexcept { return countedAlloc(n); }
+void operator delete(void* ptr) noexcept { countedFree(ptr); }
+void operator delete[](void* ptr) noexcept { countedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { countedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { countedFree(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { countedFree(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { countedFree(ptr); }
+
+// Peak resident set size of the process in MB
+static double peakRSS()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);  // bytes
+#else
+    return usage.ru_maxrss / 1024.0;  // kilobytes
+#endif
+}
+
+// ---------------------------------------------------------------------------------------------
+// Synthetic inputs
+
+struct Workload
+{
+    int DIMS[3];
+    int m;
+    std::vector<int> MASK;      // 1-based node id of each in-mask voxel, 0 outside (as maskI in runARI)
+    std::vector<int> INDEXP;    // Voxel indices of the in-mask voxels
+    std::vector<double> P;      // One-sided p-values of the in-mask voxels
+};
+
+// Three passes of a box filter of radius r along every axis (close to a Gaussian)
+static void smoothVolume(std::vector<double>& VOL, const int* DIMS, int r)
+{
+    long stride[3] = {1, DIMS[0], static_cast<long>(DIMS[0]) * DIMS[1]};
+    std::vector<double> LINE, SUM;
+    for (int pass = 0; pass < 3; pass++)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            int n = DIMS[axis];
+            int a = (axis + 1) % 3, b = (axis + 2) % 3;
+            LINE.resize(n);
+            SUM.resize(n + 1);
+            for (int i = 0; i < DIMS[a]; i++)
+            {
+                for (int j = 0; j < DIMS[b]; j++)
+                {
+                    long base = i * stride[a] + j * stride[b];
+                    SUM[0] = 0;
+                    for (int k = 0; k < n; k++) SUM[k + 1] = SUM[k] + VOL[base + k * stride[axis]];
+                    for (int k = 0; k < n; k++)
+                    {
+                        int lo = std::max(0, k - r), hi = std::min(n - 1, k + r);
+                        LINE[k] = (SUM[hi + 1] - SUM[lo]) / (hi - lo + 1);
+                    }
+                    for (int k = 0; k < n; k++) VOL[base + k * stride[axis]] = LINE[k];
+                }
+            }
+        }
+    }
+}
+
+static Workload makeWorkload(const std::string& grid, const std::string& field, unsigned seed)
+{
+    Workload W;
+    double voxmm;
+    if (grid == "2mm") { W.DIMS[0] = 91; W.DIMS[1] = 109; W.DIMS[2] = 91; voxmm = 2.0; }
+    else if (grid == "1mm") { W.DIMS[0] = 182; W.DIMS[1] = 218; W.DIMS[2] = 182; voxmm = 1.0; }
+    else if (grid == "0.7mm") { W.DIMS[0] = 260; W.DIMS[1] = 311; W.DIMS[2] = 260; voxmm = 0.7; }
+    else throw std::invalid_argument("unknown grid " + grid);
+    if (field != "smooth" && field != "sparse") throw std::invalid_argument("unknown field " + field);
+
+    const int* DIMS = W.DIMS;
+    long nvox = static_cast<long>(DIMS[0]) * DIMS[1] * DIMS[2];
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> normal(0.0, 1.0);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    // Noise, smoothed to about 8mm FWHM for the smooth field
+    std::vector<double> Z(nvox);
+    for (long i = 0; i < nvox; i++) Z[i] = normal(rng);
+    if (field == "smooth")
+    {
+        int r = std::max(1, static_cast<int>(std::lround(2.0 / voxmm)));
+        smoothVolume(Z, DIMS, r);
+        double ss = 0;
+        for (long i = 0; i < nvox; i++) ss += Z[i] * Z[i];
+        double sd = std::sqrt(ss / nvox);
+        for (long i = 0; i < nvox; i++) Z[i] /= sd;
+    }
+
+    // Ellipsoidal brain mask with semi-axes of 39.2% of the bounding box
+    double c[3], s[3];
+    for (int d = 0; d < 3; d++)
+    {
+        c[d] = (DIMS[d] - 1) / 2.0;
+        s[d] = 0.392 * DIMS[d];
+    }
+    W.MASK.assign(nvox, 0);
+    for (long i = 0; i < nvox; i++)
+    {
+        double x = (i % DIMS[0] - c[0]) / s[0];
+        double y = ((i / DIMS[0]) % DIMS[1] - c[1]) / s[1];
+        double z = (i / (static_cast<long>(DIMS[0]) * DIMS[1]) - c[2]) / s[2];
+        if (x * x + y * y + z * z <= 1.0)
+        {
+            W.INDEXP.push_back(static_cast<int>(i));
+            W.MASK[i] = static_cast<int>(W.INDEXP.size());
+        }
+    }
+    W.m = static_cast<int>(W.INDEXP.size());
+
+    // Activation blobs inside the mask: broad for the smooth field, small and strong for the sparse one
+    int nblobs = (field == "smooth") ? 12 : 40;
+    double sigma = ((field == "smooth") ? 8.0 : 3.0) / voxmm;
+    double amp = (field == "smooth") ? 4.0 : 5.0;
+    for (int b = 0; b < nblobs; b++)
+    {
+        int centre = W.INDEXP[static_cast<int>(uniform(rng) * W.m) % W.m];
+        int bx = centre % DIMS[0], by = (centre / DIMS[0]) % DIMS[1], bz = centre / (DIMS[0] * DIMS[1]);
+        int r = static_cast<int>(std::ceil(3 * sigma));
+        for (int z = std::max(0, bz - r); z <= std::min(DIMS[2] - 1, bz + r); z++)
+            for (int y = std::max(0, by - r); y <= std::min(DIMS[1] - 1, by + r); y++)
+                for (int x = std::max(0, bx - r); x <= std::min(DIMS[0] - 1, bx + r); x++)
+                {
+                    double d2 = (x - bx) * (x - bx) + (y - by) * (y - by) + (z - bz) * (z - bz);
+                    Z[x + DIMS[0] * (y + static_cast<long>(DIMS[1]) * z)] += amp * std::exp(-d2 / (2 * sigma * sigma));
+                }
+    }
+
+    W.P.resize(W.m);
+    for (int i = 0; i < W.m; i++) W.P[i] = 0.5 * std::erfc(Z[W.INDEXP[i]] / std::sqrt(2.0));
+    return W;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Stage timing
+
+struct StageResult
+{
+    std::string name;
+    double ms;          // Median wall time
+    long allocs;        // Heap allocations (last repetition)
+    double allocmb;     // MB allocated (last repetition)
+    double peakmb;      // Peak of live heap above the level at the start of the stage (last repetition)
+    double rssmb;       // Peak resident set size of the process after the stage
+};
+
+// Run setup() and then stage() reps times, timing only stage()
+static StageResult runStage(const std::string& name, int reps, const std::function<void()>& setup, const std::function<void()>& stage)
+{
+    std::vector<double> MS;
+    StageResult R;
+    R.name = name;
+    for (int r = 0; r < reps; r++)
+    {
+        setup();
+        long live = LIVEBYTES.load();
+        ALLOCS = 0;
+        ALLOCBYTES = 0;
+        PEAKBYTES = live;
+
+        auto t0 = std::chrono::steady_clock::now();
+        stage();
+        auto t1 = std::chrono::steady_clock::now();
+
+        MS.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+        R.allocs = ALLOCS.load();
+        R.allocmb = ALLOCBYTES.load() / (1024.0 * 1024.0);
+        R.peakmb = (PEAKBYTES.load() - live) / (1024.0 * 1024.0);
+    }
+    std::sort(MS.begin(), MS.end());
+    R.ms = MS[MS.size() / 2];
+    R.rssmb = peakRSS();
+    return R;
+}
+
+static void usage(const char* prog)
+{
+    std::fprintf(stderr, "usage: %s [--grid 2mm|1mm|0.7mm] [--field smooth|sparse] [--conn 6|18|26] "
+                         "[--reps N] [--threads N] [--seed N] [--csv]\n", prog);
+    std::exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    std::string grid = "2mm", field = "smooth";
+    int conn = 26, reps = 3, nthreads = 0;
+    unsigned seed = 1;
+    bool csv = false;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--csv") { csv = true; continue; }
+        if (i + 1 >= argc) usage(argv[0]);
+        std::string val = argv[++i];
+        if (arg == "--grid") grid = val;
+        else if (arg == "--field") field = val;
+        else if (arg == "--conn") conn = std::atoi(val.c_str());
+        else if (arg == "--reps") reps = std::max(1, std::atoi(val.c_str()));
+        else if (arg == "--threads") nthreads = std::atoi(val.c_str());
+        else if (arg == "--seed") seed = static_cast<unsigned>(std::atoi(val.c_str()));
+        else usage(argv[0]);
+    }
+    if (conn != 6 && conn != 18 && conn != 26) usage(argv[0]);
+
+    Workload W = makeWorkload(grid, field, seed);
+    int m = W.m;
+    const double alpha = 0.05;
+
+    // Inputs of the later stages, produced by the earlier ones
+    std::vector<double> SORTEDP, SIMESFACTOR, JUMPALPHA, ADJUSTED;
+    std::vector<int> ORD(m), RANK(m);
+    int h = 0, conc = 0;
+    CSR ADJ;
+    ARISession session;
+    std::vector<double> GAMMAS;
+    for (int g = 0; g <= 100; g++) GAMMAS.push_back(g / 100.0);
+    std::vector< std::vector<int> > ANS;
+    std::vector<int> REPS, OFFSETS;
+
+    std::vector<StageResult> RESULTS;
+    auto nothing = []() {};
+
+    RESULTS.push_back(runStage("sort p", reps, nothing, [&]() {
+        std::vector<int> I(m);
+        for (int i = 0; i < m; i++) I[i] = i;
+        std::stable_sort(I.begin(), I.end(), [&W](int a, int b) { return W.P[a] < W.P[b]; });
+        SORTEDP.resize(m);
+        for (int i = 0; i < m; i++)
+        {
+            ORD[i] = I[i] + 1;
+            RANK[I[i]] = i + 1;
+            SORTEDP[i] = W.P[I[i]];
+        }
+    }));
+
+    RESULTS.push_back(runStage("hommel (findalpha, adjustedElementary)", reps, nothing, [&]() {
+        SIMESFACTOR = findsimesfactor(true, m);
+        JUMPALPHA = findalpha(SORTEDP.data(), m, SIMESFACTOR.data(), true);
+        ADJUSTED = adjustedElementary(SORTEDP.data(), JUMPALPHA.data(), m, SIMESFACTOR.data());
+    }));
+
+    RESULTS.push_back(runStage("findHalpha + findConcentration", reps, nothing, [&]() {
+        h = findHalpha(JUMPALPHA.data(), alpha, m);
+        conc = findConcentration(SORTEDP.data(), SIMESFACTOR[h], h, alpha, m);
+    }));
+
+    RESULTS.push_back(runStage("findAdjList", reps, nothing, [&]() {
+        ADJ = findAdjListCSR(W.MASK.data(), W.INDEXP.data(), W.DIMS, m, conn, nthreads);
+    }));
+
+    RESULTS.push_back(runStage("findClusters (adjacency list)", reps, nothing, [&]() {
+        session.findClusters(m, ADJ, ORD.data(), RANK.data(), nthreads);
+    }));
+
+    RESULTS.push_back(runStage("findClusters (mask volume)", reps, nothing, [&]() {
+        session.findClusters(m, W.MASK.data(), W.INDEXP.data(), W.DIMS, conn, ORD.data(), RANK.data(), nthreads);
+    }));
+    session.setIndexp(W.INDEXP.data());
+
+    RESULTS.push_back(runStage("forestTDP", reps, nothing, [&]() {
+        session.forestTDP(h, alpha, SIMESFACTOR[h], W.P.data(), nthreads);
+    }));
+
+    RESULTS.push_back(runStage("queryPreparation", reps, nothing, [&]() {
+        session.queryPreparation();
+    }));
+
+    RESULTS.push_back(runStage("answerQueryBatch (101 gammas)", reps, nothing, [&]() {
+        std::vector< std::vector< std::vector<int> > > BATCH = session.answerQueryBatch(GAMMAS);
+    }));
+
+    RESULTS.push_back(runStage("answerQueryBatchReps (101 gammas)", reps, nothing, [&]() {
+        session.answerQueryBatchReps(GAMMAS, REPS, OFFSETS);
+    }));
+
+    // 200 changes of a cluster of the answer at gamma = 0.5, drawn from a fixed seed
+    ANS = session.answerQuery(0.5);
+    std::vector<int> CQV;
+    std::vector<double> CQCHG;
+    std::mt19937 rng(seed + 1);
+    for (int i = 0; i < 200 && !ANS.empty(); i++)
+    {
+        const std::vector<int>& cl = ANS[rng() % ANS.size()];
+        CQV.push_back(cl[rng() % cl.size()]);
+        int chg = 1 + static_cast<int>(rng() % 10);  // 0.01 .. 0.10, either way
+        CQCHG.push_back((rng() % 2 ? chg : -chg) / 100.0);
+    }
+    RESULTS.push_back(runStage("changeQuery (200 changes)", reps, nothing, [&]() {
+        for (size_t i = 0; i < CQV.size(); i++)
+        {
+            try
+            {
+                std::vector< std::vector<int> > CHG = session.changeQuery(CQV[i], CQCHG[i], ANS);
+            }
+            catch (const std::invalid_argument&)
+            {
+                // The cluster cannot change any further in this direction, as in the UI
+            }
+        }
+    }));
+
+    // TDP of the largest cluster at gamma = 0.5 through the Hommel discoveries
+    std::vector<int> IDX;
+    for (size_t i = 0; i < ANS.size(); i++)
+    {
+        if (ANS[i].size() > IDX.size())
+        {
+            IDX.resize(ANS[i].size());
+            for (size_t j = 0; j < ANS[i].size(); j++) IDX[j] = RANK[ANS[i][j]];
+        }
+    }
+    RESULTS.push_back(runStage("findDiscoveries (largest cluster)", reps, nothing, [&]() {
+        if (!IDX.empty())
+        {
+            std::vector<int> DISC = findDiscoveries(IDX.data(), SORTEDP.data(), SIMESFACTOR[h], h, alpha, static_cast<int>(IDX.size()), m);
+        }
+    }));
+
+    // Report
+    if (csv)
+    {
+        std::printf("grid,field,conn,threads,m,stage,ms,allocs,alloc_mb,peak_heap_mb,peak_rss_mb\n");
+        for (size_t i = 0; i < RESULTS.size(); i++)
+        {
+            const StageResult& R = RESULTS[i];
+            std::printf("%s,%s,%d,%d,%d,\"%s\",%.3f,%ld,%.2f,%.2f,%.1f\n", grid.c_str(), field.c_str(), conn, nthreads, m,
+                        R.name.c_str(), R.ms, R.allocs, R.allocmb, R.peakmb, R.rssmb);
+        }
+        return 0;
+    }
+
+    std::printf("grid %s, field %s, conn %d, threads %d, seed %u: m = %d voxels, h = %d, concentration = %d, "
+                "%zu clusters at gamma 0.5\n\n", grid.c_str(), field.c_str(), conn, nthreads, seed, m, h, conc, ANS.size());
+    std::printf("%-40s %12s %12s %12s %12s %12s\n", "stage", "ms", "allocs", "alloc MB", "peak heap MB", "peak RSS MB");
+    for (size_t i = 0; i < RESULTS.size(); i++)
+    {
+        const StageResult& R = RESULTS[i];
+        std::printf("%-40s %12.2f %12ld %12.2f %12.2f %12.1f\n", R.name.c_str(), R.ms, R.allocs, R.allocmb, R.peakmb, R.rssmb);
+    }
+    return 0;
+}
@@ -0,0 +1,175 @@
+# bench_getClusters.py
+#
+# Pure-Python baseline for bench_ari.cpp: times the Python implementations in getAdjList.py and
+# getClusters.py against the native functions they mirror, on the same kind of synthetic volume
+# (the same grids, mask and fields, drawn with NumPy's generator instead of the C++ one).
+# Time is the median wall time over the repetitions, memory the peak traced by tracemalloc
+# (Python allocations only, so the native columns show the size of the returned objects).
+#
+# Run (with the extensions compiled, from the directory that holds ari_application):
+#   python -m ari_application.cpp_extensions.benchmarks.bench_getClusters --grid 2mm --field smooth --conn 26
+#
+# The pure-Python adjacency list takes minutes on the 1mm and 0.7mm grids; --skip-adjlist
+# leaves it out.
+
+import argparse
+import time
+import tracemalloc
+
+import numpy as np
+from scipy.stats import norm
+
+import ari_application.cpp_extensions.cython_modules.ARICluster as ARI_C
+import ari_application.cpp_extensions.cython_modules.hommel as hommel
+from ari_application.analyses.getAdjList import get_adjList
+from ari_application.analyses.getClusters import get_clusters
+
+GRIDS = {
+    '2mm':   ((91, 109, 91), 2.0),
+    '1mm':   ((182, 218, 182), 1.0),
+    '0.7mm': ((260, 311, 260), 0.7),
+}
+
+
+def box_filter(vol, r, axis):
+    """Mean over a window of radius r along axis, shrinking the window at the borders."""
+    n = vol.shape[axis]
+    csum = np.cumsum(vol, axis=axis)
+    csum = np.concatenate([np.zeros_like(np.take(csum, [0], axis=axis)), csum], axis=axis)
+    k = np.arange(n)
+    lo = np.maximum(0, k - r)
+    hi = np.minimum(n - 1, k + r)
+    shape = [1, 1, 1]
+    shape[axis] = n
+    width = (hi - lo + 1).reshape(shape)
+    return (np.take(csum, hi + 1, axis=axis) - np.take(csum, lo, axis=axis)) / width
+
+
+def make_workload(grid, field, seed):
+    """
+    Synthetic volume as in bench_ari.cpp. Returns (MASK, INDEXP, DIMS, p): the 1-based node id
+    of every voxel (0 outside the mask), the voxel indices of the in-mask voxels, the dimensions
+    (first axis fastest, as in the C++ code) and the one-sided p-values of the in-mask voxels.
+    """
+    dims, voxmm = GRIDS[grid]
+    rng = np.random.default_rng(seed)
+
+    # Volume in C order with the first dimension fastest, i.e. indexed [z, y, x]
+    z = rng.standard_normal(dims[::-1])
+    if field == 'smooth':
+        r = max(1, int(round(2.0 / voxmm)))
+        for _ in range(3):
+            for axis in (2, 1, 0):
+                z = box_filter(z, r, axis)
+        z /= np.sqrt(np.mean(z * z))
+
+    # Ellipsoidal brain mask with semi-axes of 39.2% of the bounding box
+    zz, yy, xx = np.meshgrid(*[np.arange(d) for d in dims[::-1]], indexing='ij')
+    coords = (xx, yy, zz)
+    inside = sum(((coords[d] - (dims[d] - 1) / 2.0) / (0.392 * dims[d])) ** 2 for d in range(3)) <= 1.0
+    indexp = np.flatnonzero(inside.ravel()).astype(np.intc)
+    m = len(indexp)
+
+    # Activation blobs inside the mask
+    nblobs, sigma, amp = (12, 8.0 / voxmm, 4.0) if field == 'smooth' else (40, 3.0 / voxmm, 5.0)
+    for centre in indexp[rng.integers(0, m, nblobs)]:
+        cz, cy, cx = np.unravel_index(centre, z.shape)
+        d2 = (xx - cx) ** 2 + (yy - cy) ** 2 + (zz - cz) ** 2
+        z += amp * np.exp(-d2 / (2 * sigma * sigma))
+
+    mask = np.zeros(z.size, dtype=np.intc)
+    mask[indexp] = np.arange(1, m + 1)
+    p = np.ascontiguousarray(norm.sf(z.ravel()[indexp]), dtype=np.float64)
+    return mask, indexp, np.array(dims, dtype=np.intc), p
+
+
+def measure(fn, reps):
+    """Median wall time (ms) of fn over reps calls, the peak traced memory (MB) of the last one and its result."""
+    times = []
+    for _ in range(reps):
+        tracemalloc.start()
+        t0 = time.perf_counter()
+        result = fn()
+        times.append((time.perf_counter() - t0) * 1000)
+        _, peak = tracemalloc.get_traced_memory()
+        tracemalloc.stop()
+    return float(np.median(times)), peak / 2 ** 20, result
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Pure-Python baseline of the native ARI query stages')
+    parser.add_argument('--grid', choices=sorted(GRIDS), default='2mm')
+    parser.add_argument('--field', choices=['smooth', 'sparse'], default='smooth')
+    parser.add_argument('--conn', type=int, choices=[6, 18, 26], default=26)
+    parser.add_argument('--reps', type=int, default=3)
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--skip-adjlist', action='store_true')
+    args = parser.parse_args()
+
+    alpha = 0.05
+    mask, indexp, dims, p = make_workload(args.grid, args.field, args.seed)
+    m = len(p)
+
+    # Native pipeline up to the admissible STCs, as in runARI
+    ordp = np.argsort(p, kind='stable')
+    rankp = np.empty(m, dtype=np.intc)
+    rankp[ordp] = np.arange(1, m + 1)
+    ordp = np.ascontiguousarray(ordp + 1, dtype=np.intc)
+    sorted_p = np.ascontiguousarray(p[ordp - 1])
+    simes_factor = hommel.np_findsimesfactor(True, m)
+    jump_alpha = hommel.np_findalpha(sorted_p, m, simes_factor, True)
+    h = hommel.np_findHalpha(jump_alpha, alpha, m)
+
+    session = ARI_C.np_findClustersGrid(m, mask, indexp, dims, args.conn, ordp, rankp, nthreads=0)
+    ARI_C.np_forestTDP(session, h, alpha, simes_factor[h], p, nthreads=0)
+    ARI_C.np_queryPreparation(session)
+
+    # List copies for the Python implementations
+    size, roots, child, tdp = session.SIZE, session.ROOT, session.CHILD, session.TDP
+    admstc = session.ADMSTC
+    mark = [0] * m
+    gammas = [g / 100 for g in range(101)]
+    ans = session.answerQuery(0.5)
+
+    rng = np.random.default_rng(args.seed + 1)
+    changes = []
+    for _ in range(200 if ans else 0):
+        cluster = ans[rng.integers(len(ans))]
+        changes.append((int(cluster[rng.integers(len(cluster))]), int(rng.integers(1, 11)) * (1 if rng.integers(2) else -1) / 100))
+
+    def change_all(fn):
+        for v, chg in changes:
+            try:
+                fn(v, chg)
+            except Exception:
+                pass  # The cluster cannot change any further in this direction
+
+    stages = []
+    if not args.skip_adjlist:
+        mask_list, indexp_list, dims_list = mask.tolist(), indexp.tolist(), dims.tolist()
+        stages.append(('findAdjList',
+                       lambda: get_adjList.findAdjList(mask_list, indexp_list, dims_list, m, args.conn),
+                       lambda: ARI_C.np_findAdjList(mask, indexp, dims, m, args.conn, nthreads=0)))
+    stages += [
+        ('queryPreparation',
+         lambda: get_clusters.query_preparation(m, roots, tdp, child),
+         lambda: ARI_C.np_queryPreparation(session)),
+        ('answerQueryBatch (101 gammas)',
+         lambda: get_clusters.answer_query_batch(gammas, admstc, size, mark, tdp, child),
+         lambda: session.answerQueryBatch(gammas)),
+        ('changeQuery (200 changes)',
+         lambda: change_all(lambda v, chg: get_clusters.change_query(v, chg, admstc, size, mark, tdp, child, ans)),
+         lambda: change_all(lambda v, chg: session.changeQuery(v, chg, ans))),
+    ]
+
+    print(f"grid {args.grid}, field {args.field}, conn {args.conn}, seed {args.seed}: m = {m} voxels, "
+          f"{len(ans)} clusters at gamma 0.5\n")
+    print(f"{'stage':<32} {'python ms':>12} {'python MB':>10} {'native ms':>12} {'native MB':>10} {'speed-up':>9}")
+    for name, py_fn, native_fn in stages:
+        py_ms, py_mb, _ = measure(py_fn, args.reps)
+        nat_ms, nat_mb, _ = measure(native_fn, args.reps)
+        print(f"{name:<32} {py_ms:12.2f} {py_mb:10.2f} {nat_ms:12.2f} {nat_mb:10.2f} {py_ms / max(nat_ms, 1e-6):8.1f}x")
+
+
+if __name__ == '__main__':
+    main()
@@ -7,18 +7,31 @@
  * - **UnionBySize**: Merges sets using union by size for disjoint-set data structures.
  * - **findClusters**: Computes all supra-threshold clusters (STCs).
  * - **descendants**: Finds all descendants of a given node in a tree.
+ * - **postOrder**: Numbers the forest in post-order, making every subtree a contiguous range.
  * - **heavyPathTDP**: Computes the TDP bounds of the heavy path starting from a node.
- * - **forestTDP**: Iterates over the forest to compute TDP values for all nodes.
+ * - **forestTDP**: Iterates over the forest to compute TDP values for all nodes
+ *   (optionally spreading the heavy paths over a work-stealing thread pool).
  * - **queryPreparation**: Prepares the admissible STCs based on TDP values.
  * - **findLeft**: Finds the leftmost index in the sorted list where TDP is above a threshold.
  * - **answerQuery**: Finds maximal STCs that meet the TDP condition for a given threshold.
  * - **answerQueryBatch**: Processes multiple gamma values to find clusters in batch mode.
+ * - **answerQueryBatchReps**: Batch queries that return cluster representatives only.
+ * - **answerQueryDelta**: Clusters that appear or disappear when the TDP threshold moves.
+ * - **thresholdClusters**: Supra-threshold clusters at a p-value threshold, read off the forest.
+ * - **clusterSummary**: Size, TDP, peak & atlas label of clusters.
+ * - **gradientMap**: Writes the largest gamma at which each voxel lies in a cluster.
  * - **counting_sort**: Performs counting sort on cluster sizes in descending order.
  * - **findAdjList**: Finds the adjacency list for in-mask voxels based on connectivity.
  * - **index2xyz**: Converts a linear voxel index to 3D (x, y, z) coordinates.
- * - **ids2xyz**: Converts a list of voxel indices to a list of 3D coordinates.
+ * - **ids2xyz**: Converts a list of voxel indices to a list (or an n x 3 array) of 3D coordinates.
  * - **xyz_check**: Checks whether a voxel is within bounds and in the mask.
  * - **findNeighbours**: Finds the valid neighboring voxels for a given voxel.
+ *
+ * The adjacency list and the children list are stored in CSR form (see ARICluster.h);
+ * the overloads taking std::vector<std::vector<int> > convert and forward to those.
+ * The entry points time themselves and count their work through ProfileScope (see Profile.h);
+ * the long loops report their progress to, and can be cancelled through, the ProgressReporter
+ * installed on the calling thread (see Progress.h).
  */
 
 
@@ -27,16 +40,53 @@
 #include <list>
 #include <algorithm>
 #include <iterator>
+#include <functional>
 #include <cmath>
 #include "hommel.h"
 #include <fstream>
 #include <iomanip>
+#include <stdexcept>
+#include <limits>
 
-// #include "../cpp_sources/ARICluster.h"
+#include "ARICluster.h"
+#include "ThreadPool.h"
+#include "Profile.h"
+#include "Progress.h"
+#include "hommel_simd.h"
 
 // Function prototypes for functions used but not defined within this file
 int Find(int i, std::vector<int>& PARENT);
 
+//------------------------- (0) CSR STORAGE -------------------------//
+
+CSR::CSR(const std::vector< std::vector<int> >& ROWS) : OFS(ROWS.size() + 1, 0)
+{
+    for (size_t i = 0; i < ROWS.size(); i++)
+    {
+        OFS[i + 1] = OFS[i] + ROWS[i].size();
+    }
+    IDX.reserve(OFS.back());
+    for (size_t i = 0; i < ROWS.size(); i++)
+    {
+        IDX.insert(IDX.end(), ROWS[i].begin(), ROWS[i].end());
+    }
+}
+
+std::vector< std::vector<int> > CSR::toRows() const
+{
+    return CSRRef(*this).toRows();
+}
+
+std::vector< std::vector<int> > CSRRef::toRows() const
+{
+    std::vector< std::vector<int> > ROWS(rows());
+    for (int i = 0; i < rows(); i++)
+    {
+        ROWS[i].assign(begin(i), end(i));
+    }
+    return ROWS;
+}
+
 //------------------------- (1) FIND ALL STCS (USING SORTING RANKS) -------------------------//
 
 // Union function of a disjoint-set data structure based on the "union by size" technique.
@@ -70,15 +120,80 @@ void UnionBySize(int i, int j, std::vector<int>& PARENT, std::vector<int>& FORES
 // Compute all supra-threshold clusters (STCs)
 std::vector< std::vector<int> > findClusters(int m, std::vector< std::vector<int> >& ADJ, std::vector<int>& ORD, std::vector<int>& RANK)
 {
-    // Initialize output: a list of children for all nodes
-    std::vector< std::vector<int> > CHILD(m);
+    return findClusters(m, ADJ, ORD.data(), RANK.data());
+}
+
+std::vector< std::vector<int> > findClusters(int m, std::vector< std::vector<int> >& ADJ, const int* ORD, const int* RANK)
+{
+    std::vector<int> SIZE, ROOT;
+    CSR CHILD;
+    findClusters(m, CSR(ADJ), ORD, RANK, SIZE, ROOT, CHILD);
+
+    // Construct the result vector
+    std::vector< std::vector<int> > result;
+    result.reserve(m + 2);
+    result.push_back(SIZE);
+    result.push_back(ROOT);
+    for (int i = 0; i < m; i++)
+    {
+        result.push_back(std::vector<int>(CHILD.begin(i), CHILD.end(i)));
+    }
+
+    return result;
+}
+
+// Neighbour lookup of the sweep below, read from an adjacency list (ids are 1-based)
+struct CSRNeighbours
+{
+    const CSRRef& ADJ;
+    CSRNeighbours(const CSRRef& adj) : ADJ(adj) {}
+    const int* operator() (int v, int& nids) { nids = ADJ.degree(v); return ADJ.begin(v); }
+};
+
+// Whether the lower-ranked nodes among IDS lie in more than one tree
+static bool joinsTrees(const int* IDS, int nids, int rank, const int* RANK, std::vector<int>& PARENT)
+{
+    int rep = -1;
+    for (int j = 0; j < nids; j++)
+    {
+        if (RANK[IDS[j] - 1] < rank)
+        {
+            int jrep = Find(IDS[j] - 1, PARENT);
+            if (rep >= 0 && jrep != rep) return true;
+            rep = jrep;
+        }
+    }
+    return false;
+}
+
+// The sweep behind findClusters. NBRS(v, nids) returns the (1-based) neighbours of node v
+// and their number in nids; the pointer must stay valid until the next call.
+// If RED is given, its rows are used instead of NBRS wherever that gives the same result: RED
+// must connect the same components as NBRS at every point of the sweep (see reduceEdges), so
+// a node whose RED row reaches at most one tree has at most that one tree as child. NBRS is
+// only asked for the nodes that join several trees, to find the children in the original order.
+template <class Neighbours>
+static void sweepClusters(int m, Neighbours& NBRS, const CSR* RED, const int* ORD, const int* RANK, std::vector<int>& SIZE, std::vector<int>& ROOT, CSR& CHILD)
+{
+    ProfileScope prof("sweepClusters");
+    long long finds = 0, unions = 0;
+    ProgressReporter* R = progressCurrent();
+    if (R) R->begin("sweepClusters", m);
+    ProgressTicker tick(R);
+
     // Initialize output: a vector of sizes of subtrees
-    std::vector<int> SIZE(m, 1);
+    SIZE.assign(m, 1);
     // Initialize output: a list of forest roots
-    std::list<int> ROOT;
+    ROOT.clear();
     
     // Initialize a child list for a single node
-    std::list<int> CHD;
+    std::vector<int> CHD;
+
+    // Children are found in the order of the sweep, so collect them in that order first
+    // and lay out the rows of CHILD by node id afterwards
+    std::vector<int> NCHD(m, 0);  // Number of children of each node
+    std::vector<int> SWEEP;       // All child lists, in sweep order
+    SWEEP.reserve(m);
     
     // Prepare disjoint set data structure
     std::vector<int> PARENT, FORESTROOT;
@@ -96,37 +211,52 @@ std::vector< std::vector<int> > findClusters(int m, std::vector< std::vector<int
         int v = ORD[i] - 1;  // Convert to 1-based indexing
         
         // Find neighbours for node with the ith smallest p-value
-        std::vector<int>& IDS = ADJ[v];
+        int nids;
+        const int* IDS;
+        if (RED)
+        {
+            IDS = RED->begin(v);
+            nids = RED->degree(v);
+            if (joinsTrees(IDS, nids, i + 1, RANK, PARENT)) IDS = NBRS(v, nids);
+        }
+        else
+        {
+            IDS = NBRS(v, nids);
+        }
         
         // Loop through all its neighbours
-        for (size_t j = 0; j < IDS.size(); j++)
+        for (int j = 0; j < nids; j++)
         {
             if (RANK[IDS[j] - 1] < i + 1)  // Convert to 1-based indexing
             {
                 int jrep = Find(IDS[j] - 1, PARENT);  // Representative of the tree (1-based)
                 int w = FORESTROOT[jrep];  // Forest root of the tree
+                finds++;
                 
                 if (v != w)
                 {
                     // Merge S_v and S_w = S_{jrep}
                     UnionBySize(v, jrep, PARENT, FORESTROOT, SIZE);
+                    unions++;
                     
-                    // Put a heavy child in front (using std::list)
+                    // Put a heavy child in front
                     if (CHD.empty() || SIZE[CHD.front()] >= SIZE[w])
                     {
                         CHD.push_back(w);
                     }
                     else
                     {
-                        CHD.push_front(w);
+                        CHD.insert(CHD.begin(), w);
                     }
                 }
             }
         }
         
         // Update child list
-        CHILD[v] = std::vector<int>(CHD.begin(), CHD.end());
+        NCHD[v] = CHD.size();
+        SWEEP.insert(SWEEP.end(), CHD.begin(), CHD.end());
         CHD.clear();
+        tick();
     }
     
     // Find forest roots
@@ -138,18 +268,161 @@ std::vector< std::vector<int> > findClusters(int m, std::vector< std::vector<int
         }
     }
 
-    // Construct the result vector
-    std::vector< std::vector<int> > result;
-    result.push_back(SIZE);
-    result.push_back(std::vector<int>(ROOT.begin(), ROOT.end()));
-    result.insert(result.end(), CHILD.begin(), CHILD.end());
+    // Lay out the child lists by node id
+    CHILD.OFS.assign(m + 1, 0);
+    for (int v = 0; v < m; v++)
+    {
+        CHILD.OFS[v + 1] = CHILD.OFS[v] + NCHD[v];
+    }
+    CHILD.IDX.resize(CHILD.OFS[m]);
+    std::vector<int>::const_iterator it = SWEEP.begin();
+    for (int i = 0; i < m; i++)
+    {
+        int v = ORD[i] - 1;
+        std::copy(it, it + NCHD[v], CHILD.IDX.begin() + CHILD.OFS[v]);
+        it += NCHD[v];
+    }
 
-    return result;
+    prof.count("voxels", m);
+    prof.count("finds", finds);
+    prof.count("unions", unions);
+    prof.count("bytes", sizeof(int) * (5 * static_cast<long long>(m) + SWEEP.size() + CHILD.IDX.size()));
+}
+
+// Reduce the graph given by NBRS to fewer edges that connect the same components at every
+// point of the sweep. The nodes are split into nthreads contiguous ranges of ids (slabs, when
+// INDEXP is in ascending order), and each thread runs the sweep on the edges inside its slab
+// with a plain union-find: an edge is only kept if it joins two different trees, i.e. the kept
+// edges form a minimum spanning forest of the slab (edge (u,v) weighing max(RANK[u], RANK[v])).
+// All edges between slabs are kept. Row v of RED lists the kept neighbours of v with a lower
+// rank, in the order of NBRS.
+template <class Neighbours>
+static void reduceEdges(int m, const Neighbours& NBRS, const int* ORD, const int* RANK, ThreadPool& pool, CSR& RED)
+{
+    ProfileScope prof("reduceEdges");
+    int nslabs = std::min(m, pool.size());
+    std::vector<int> PARENT(m), SIZE(m, 1);
+    std::vector<int> START(m);   // Position of the row of v in the edge buffer of its slab
+    std::vector< std::vector<int> > EDGES(nslabs);
+    RED.OFS.assign(m + 1, 0);
+    int* OFS = RED.OFS.data();
+    ProgressReporter* R = progressCurrent();
+    if (R) R->begin("reduceEdges", m);
+
+    for (int c = 0; c < nslabs; c++)
+    {
+        int first = static_cast<long long>(m) * c / nslabs;
+        int last = static_cast<long long>(m) * (c + 1) / nslabs;
+        pool.submit([&, c, first, last]() {
+            Neighbours nbrs(NBRS);
+            ProgressTicker tick(R);
+            std::vector<int>& E = EDGES[c];
+            for (int v = first; v < last; v++) PARENT[v] = v;
+
+            for (int i = 0; i < m; i++)
+            {
+                int v = ORD[i] - 1;
+                if (v < first || v >= last) continue;
+
+                int nids;
+                const int* IDS = nbrs(v, nids);
+                START[v] = E.size();
+                for (int j = 0; j < nids; j++)
+                {
+                    int u = IDS[j] - 1;
+                    if (RANK[u] >= i + 1) continue;
+                    if (u >= first && u < last)
+                    {
+                        int urep = Find(u, PARENT);
+                        int vrep = Find(v, PARENT);
+                        if (urep == vrep) continue;
+                        if (SIZE[urep] < SIZE[vrep]) std::swap(urep, vrep);
+                        PARENT[vrep] = urep;
+                        SIZE[urep] += SIZE[vrep];
+                    }
+                    E.push_back(IDS[j]);
+                }
+                OFS[v + 1] = E.size() - START[v];
+                tick();
+            }
+        });
+    }
+    pool.wait();
+
+    for (int v = 0; v < m; v++)
+    {
+        OFS[v + 1] += OFS[v];
+    }
+    RED.IDX.resize(OFS[m]);
+    for (int c = 0; c < nslabs; c++)
+    {
+        int first = static_cast<long long>(m) * c / nslabs;
+        int last = static_cast<long long>(m) * (c + 1) / nslabs;
+        pool.submit([&, c, first, last]() {
+            for (int v = first; v < last; v++)
+            {
+                std::copy(EDGES[c].begin() + START[v], EDGES[c].begin() + START[v] + (OFS[v + 1] - OFS[v]), RED.IDX.begin() + OFS[v]);
+            }
+            std::vector<int>().swap(EDGES[c]);
+        });
+    }
+    pool.wait();
+
+    prof.count("voxels", m);
+    prof.count("edges", RED.IDX.size());
+    prof.count("bytes", sizeof(int) * (4 * static_cast<long long>(m) + 2 * RED.IDX.size()));
+}
+
+// The sweep on nthreads threads: reduceEdges runs in parallel and the sweep itself then only
+// looks at about one edge per node. Gives the same forest as the serial sweep.
+template <class Neighbours>
+static void sweepClusters(int m, Neighbours& NBRS, const int* ORD, const int* RANK, std::vector<int>& SIZE, std::vector<int>& ROOT, CSR& CHILD, int nthreads)
+{
+    if (nthreads == 1)
+    {
+        sweepClusters(m, NBRS, static_cast<const CSR*>(NULL), ORD, RANK, SIZE, ROOT, CHILD);
+        return;
+    }
+
+    CSR RED;
+    {
+        ThreadPool pool(nthreads);
+        if (pool.size() == 1)
+        {
+            sweepClusters(m, NBRS, static_cast<const CSR*>(NULL), ORD, RANK, SIZE, ROOT, CHILD);
+            return;
+        }
+        reduceEdges(m, NBRS, ORD, RANK, pool, RED);
+    }
+    sweepClusters(m, NBRS, &RED, ORD, RANK, SIZE, ROOT, CHILD);
+}
+
+void findClusters(int m, const CSRRef& ADJ, const int* ORD, const int* RANK, std::vector<int>& SIZE, std::vector<int>& ROOT, CSR& CHILD)
+{
+    findClusters(m, ADJ, ORD, RANK, SIZE, ROOT, CHILD, 1);
+}
+
+void findClusters(int m, const CSRRef& ADJ, const int* ORD, const int* RANK, std::vector<int>& SIZE, std::vector<int>& ROOT, CSR& CHILD, int nthreads)
+{
+    ProfileScope prof("findClusters", true);
+    prof.count("voxels", m);
+    prof.count("edges", ADJ.IDX.size());
+
+    CSRNeighbours NBRS(ADJ);
+    sweepClusters(m, NBRS, ORD, RANK, SIZE, ROOT, CHILD, nthreads);
 }
 
 
 //------------------------- (2) COMPUTE TDPS FOR ALL STCS -------------------------//
 
+// Orders heavy-path heads (head, parent) by descending subtree size of the head
+struct compareHeadSize
+{
+    ArrayRef<int> size;
+    compareHeadSize(ArrayRef<int> sz) : size(sz) {}
+    bool operator() (const std::pair<int, int>& a, const std::pair<int, int>& b) const { return size[a.first] > size[b.first]; }
+};
+
 // Iterative post-order traversal to find descendants of v (including v).
 // Note: When we pop a vertex from the stack, we push that vertex again as a value and
 // then all its children in reverse order on the stack. If we pop a value, it means that
@@ -157,8 +430,14 @@ std::vector< std::vector<int> > findClusters(int m, std::vector< std::vector<int
 // the current value to the descendants too.
 std::vector<int> descendants(int v, std::vector<int>& SIZE, std::vector< std::vector<int> >& CHILD)
 {
-    // Initialize the descendant list based on the size of the subtree at node v
-    std::vector<int> DESC(SIZE[v], 0);
+    return descendants(v, SIZE, CSR(CHILD));
+}
+
+// descendants into DESC, which keeps its capacity (for the repeated calls of forestTDP)
+static void descendants(int v, ArrayRef<int> SIZE, const CSRRef& CHILD, std::vector<int>& DESC)
+{
+    // Size the descendant list to the subtree at node v
+    DESC.resize(SIZE[v]);
     
     int len = 0;  // Track the number of found descendants
     int top = SIZE[v] - 1;  // Track the top of the stack
@@ -181,22 +460,83 @@ std::vector<int> descendants(int v, std::vector<int>& SIZE, std::vector< std::ve
             DESC[top] = ~v;  // Mark the current node as a value
             
             // Process all children in reverse order
-            std::vector<int>& CHD = CHILD[v];
-            for (int j = CHD.size() - 1; j >= 0; j--)
+            const int* CHD = CHILD.begin(v);
+            for (int j = CHILD.degree(v) - 1; j >= 0; j--)
             {
                 top--;
                 DESC[top] = CHD[j]; 
             }
         }
     }
-    
+}
+
+std::vector<int> descendants(int v, ArrayRef<int> SIZE, const CSRRef& CHILD)
+{
+    std::vector<int> DESC;
+    descendants(v, SIZE, CHILD, DESC);
     return DESC;
 }
 
+// Post-order (Euler-tour) numbering of the forest, with children visited in CHILD order as in
+// descendants(). ORDER lists all nodes in that order and POS[v] is the position of v in ORDER,
+// so the subtree of v is the range ORDER[POS[v]-SIZE[v]+1], ..., ORDER[POS[v]], in exactly
+// the order descendants(v) would return it.
+void postOrder(ArrayRef<int> SIZE, const CSRRef& CHILD, std::vector<int>& ORDER, std::vector<int>& POS)
+{
+    ProfileScope prof("postOrder");
+    int m = CHILD.rows();
+    prof.count("voxels", m);
+    ORDER.assign(m, 0);
+    POS.assign(m, 0);
+
+    std::vector<char> ISCHILD(m, 0);
+    for (size_t j = 0; j < CHILD.IDX.size(); j++)
+    {
+        ISCHILD[CHILD.IDX[j]] = 1;
+    }
+
+    // POS[v] first holds the start of the subtree range of v; the children of v are laid out
+    // one after another from the start of v, and v itself comes last
+    std::vector<int> STACK;
+    STACK.reserve(m);
+    int next = 0;
+    for (int r = 0; r < m; r++)
+    {
+        if (ISCHILD[r]) continue;
+
+        POS[r] = next;
+        next += SIZE[r];
+        STACK.push_back(r);
+        while (!STACK.empty())
+        {
+            int v = STACK.back();
+            STACK.pop_back();
+
+            int start = POS[v];
+            POS[v] = start + SIZE[v] - 1;
+            ORDER[POS[v]] = v;
+
+            for (const int* c = CHILD.begin(v); c != CHILD.end(v); ++c)
+            {
+                POS[*c] = start;
+                start += SIZE[*c];
+                STACK.push_back(*c);
+            }
+        }
+    }
+}
+
+// Copy the subtree of v out of the post-order numbering (same result as descendants(v))
+std::vector<int> subtree(int v, ArrayRef<int> SIZE, ArrayRef<int> ORDER, ArrayRef<int> POS)
+{
+    const int* first = ORDER.data() + POS[v] - SIZE[v] + 1;
+    return std::vector<int>(first, first + SIZE[v]);
+}
+
 
 
 // Calculates the size of the concentration set at a fixed alpha
-int findConcentration_one_based(const std::vector<double>& p, double simesfactor, int h, double alpha, int m) {
+int findConcentration_one_based(ArrayRef<double> p, double simesfactor, int h, double alpha, int m) {
     int z = m - h;
     if (z > 0) {
         while ((z < m) & (simesfactor * p[z-1] > (z - m + h + 1) * alpha)) {
@@ -207,7 +547,7 @@ int findConcentration_one_based(const std::vector<double>& p, double simesfactor
 }
 
 // Implementation of findDiscoveries
-std::vector<int> findDiscoveries_one_based(const std::vector<int>& idx, const std::vector<double>& allp, double simesfactor, int h, double alpha, int k, int m) {
+std::vector<int> findDiscoveries_one_based(ArrayRef<int> idx, ArrayRef<double> allp, double simesfactor, int h, double alpha, int k, int m) {
     // Calculate categories for the p-values
     std::vector<int> cats;
     for (int i = 0; i < k; i++) {
@@ -260,17 +600,18 @@ std::vector<int> findDiscoveries_one_based(const std::vector<int>& idx, const st
 // Compute the TDP bounds of the heavy path starting at v (1-based indexing)
 void heavyPathTDP(int v, int par, int m, int h, double alpha, double simesh, std::vector<double>& P, std::vector<int>& SIZE, std::vector< std::vector<int> >& CHILD, std::vector<double>& TDP)
 {
-    // Use descendants with one-based indexing
-    std::vector<int> HP = descendants(v, SIZE, CHILD);  
-    for (size_t i = 0; i < HP.size(); i++)
-    {
-        HP[i]++;  // Adjust descendants to 1-based indexing
-    }
-
-    std::vector<int> NUM = findDiscoveries(HP, P, simesh, h, alpha, HP.size(), m);
-    // std::vector<int> NUM = findDiscoveries_one_based(HP, P, simesh, h, alpha, HP.size(), m);
+    heavyPathTDP(v, par, m, h, alpha, simesh, P.data(), SIZE, CHILD, TDP);
+}
 
+void heavyPathTDP(int v, int par, int m, int h, double alpha, double simesh, const double* P, std::vector<int>& SIZE, std::vector< std::vector<int> >& CHILD, std::vector<double>& TDP)
+{
+    heavyPathTDP(v, par, m, h, alpha, simesh, P, SIZE, CSR(CHILD), TDP);
+}
 
+// Walk down the heavy path from v (with parent par), setting the TDP bounds of its nodes from the
+// discovery counts NUM of the descendants of v
+static void heavyPathWalk(int v, int par, const int* NUM, const double* P, ArrayRef<int> SIZE, const CSRRef& CHILD, double* TDP)
+{
     while (true)  // Walk down the heavy path
     {
         // Check if v represents an STC
@@ -290,95 +631,456 @@ void heavyPathTDP(int v, int par, int m, int h, double alpha, double simesh, std
         
         // Update v & its parent
         par = v;
-        std::vector<int>& CHD = CHILD[v];  // Adjust CHILD for 1-based indexing
-        v = CHD[0];  // Move to the first child and adjust for 1-based indexing
+        v = *CHILD.begin(v);  // Move to the first (heavy) child
     }
 }
 
+void heavyPathTDP(int v, int par, int m, int h, double alpha, double simesh, const double* P, ArrayRef<int> SIZE, const CSRRef& CHILD, std::vector<double>& TDP)
+{
+    // Use descendants with one-based indexing
+    std::vector<int> HP = descendants(v, SIZE, CHILD);  
+    for (size_t i = 0; i < HP.size(); i++)
+    {
+        HP[i]++;  // Adjust descendants to 1-based indexing
+    }
+
+    std::vector<int> NUM = findDiscoveries(HP.data(), P, simesh, h, alpha, HP.size(), m);
+    heavyPathWalk(v, par, NUM.data(), P, SIZE, CHILD, TDP.data());
+}
+
+// The parts of findDiscoveries that only depend on the p-values and alpha, for all heavy paths
+// of forestTDP: CAT[v] = getCategory(P[v], simesh, alpha, m) and the concentration z
+struct PathCategories
+{
+    std::vector<int> CAT;
+    int z;
+
+    PathCategories(int m, int h, double alpha, double simesh, const double* P) : CAT(m)
+    {
+        simdCategories(P, m, simesh, alpha, m, CAT.data());
+        z = findConcentration(P, simesh, h, alpha, m);
+    }
+};
+
+// Buffers of the heavy paths of one forestTDP task, reused from one path to the next
+struct PathScratch
+{
+    std::vector<int> HP;
+    DiscoveryScratch D;
+};
+
+// heavyPathTDP with the categories of all nodes computed beforehand: the categories of the
+// descendants are looked up rather than recomputed, so each node's category is computed once
+// instead of once for every heavy path above it. TDP holds all m bounds.
+static void heavyPathTDP(int v, int par, int m, int h, const PathCategories& C, const double* P, ArrayRef<int> SIZE, const CSRRef& CHILD,
+                         double* TDP, PathScratch& S)
+{
+    descendants(v, SIZE, CHILD, S.HP);
+    int k = S.HP.size();
+    S.D.cats.resize(k);
+    for (int i = 0; i < k; i++)
+    {
+        S.D.cats[i] = C.CAT[S.HP[i]];
+    }
+
+    const int* NUM = findDiscoveriesOfCategories(S.D.cats.data(), C.z, h, k, m, S.D);
+    heavyPathWalk(v, par, NUM, P, SIZE, CHILD, TDP);
+}
 
 std::vector<double> forestTDP(int m, int h, double alpha, double simesh, std::vector<double>& P, std::vector<int>& SIZE, std::vector<int>& ROOT, std::vector< std::vector<int> >& CHILD)
+{
+    return forestTDP(m, h, alpha, simesh, P.data(), SIZE, ROOT, CHILD);
+}
+
+std::vector<double> forestTDP(int m, int h, double alpha, double simesh, const double* P, std::vector<int>& SIZE, std::vector<int>& ROOT, std::vector< std::vector<int> >& CHILD)
+{
+    return forestTDP(m, h, alpha, simesh, P, SIZE, ROOT, CSR(CHILD));
+}
+
+// Number of nodes on all heavy paths of the forest (the work of forestTDP, reported as its progress)
+static long long heavyPathNodes(int m, ArrayRef<int> SIZE, ArrayRef<int> ROOT, const CSRRef& CHILD)
+{
+    long long n = 0;
+    for (size_t i = 0; i < ROOT.size(); i++) n += SIZE[ROOT[i]];
+    for (int i = 0; i < m; i++)
+    {
+        const int* CHD = CHILD.begin(i);
+        for (int j = 1; j < CHILD.degree(i); j++) n += SIZE[CHD[j]];
+    }
+    return n;
+}
+
+std::vector<double> forestTDP(int m, int h, double alpha, double simesh, const double* P, ArrayRef<int> SIZE, ArrayRef<int> ROOT, const CSRRef& CHILD)
 {
     // std::cout << "Entering forestTDP function" << std::endl;  // Log entry to function
+    ProfileScope prof("forestTDP", true);
+    long long paths = 0, desc = 0;
     std::vector<double> TDP(m);
+    ProgressReporter* R = progressCurrent();
+    if (R) R->begin("forestTDP", heavyPathNodes(m, SIZE, ROOT, CHILD));
+    ProgressTicker tick(R);
+    PathCategories C(m, h, alpha, simesh, P);
+    PathScratch S;
 
     // Loop through all roots
     for (size_t i = 0; i < ROOT.size(); i++)
     {
         // No subtraction for ROOT[i] as it matches the original
-        heavyPathTDP(ROOT[i], -1, m, h, alpha, simesh, P, SIZE, CHILD, TDP);  
+        heavyPathTDP(ROOT[i], -1, m, h, C, P, SIZE, CHILD, TDP.data(), S);  
+        paths++;
+        desc += SIZE[ROOT[i]];
+        tick(SIZE[ROOT[i]]);
     }
     
     // Loop through all nodes
     for (int i = 0; i < m; i++)
     {
-        std::vector<int>& CHD = CHILD[i];
+        const int* CHD = CHILD.begin(i);
         
         // Loop through all children starting from the second child (1-based index logic)
-        for (size_t j = 1; j < CHD.size(); j++)
+        for (int j = 1; j < CHILD.degree(i); j++)
         {
-            heavyPathTDP(CHD[j], i, m, h, alpha, simesh, P, SIZE, CHILD, TDP);
+            heavyPathTDP(CHD[j], i, m, h, C, P, SIZE, CHILD, TDP.data(), S);
+            paths++;
+            desc += SIZE[CHD[j]];
+            tick(SIZE[CHD[j]]);
         }
     }
 
+    prof.count("voxels", m);
+    prof.count("heavy_paths", paths);
+    prof.count("descendants", desc);
     // std::cout << "Exiting forestTDP function" << std::endl;  // Log exit from function
     return TDP;
 }
 
+// Parallel forestTDP. Each heavy path only reads P, SIZE & CHILD and only writes the TDP entries
+// of its own nodes, so the heavy paths are independent tasks and the result is identical to the
+// serial version. The paths are scheduled in descending order of size, so that the largest ones
+// (starting at the forest roots) do not end up running alone at the end. Small paths are grouped
+// into tasks of at least PATH_GRAIN nodes to keep the scheduling overhead down.
+// Heads of all heavy paths with their parents: the roots and all non-first children, in
+// descending order of size
+static std::vector< std::pair<int, int> > heavyPathHeads(int m, ArrayRef<int> SIZE, ArrayRef<int> ROOT, const CSRRef& CHILD)
+{
+    std::vector< std::pair<int, int> > HEADS;
+    HEADS.reserve(m);
+    for (size_t i = 0; i < ROOT.size(); i++)
+    {
+        HEADS.push_back(std::make_pair(ROOT[i], -1));
+    }
+    for (int i = 0; i < m; i++)
+    {
+        const int* CHD = CHILD.begin(i);
+        for (int j = 1; j < CHILD.degree(i); j++)
+        {
+            HEADS.push_back(std::make_pair(CHD[j], i));
+        }
+    }
+    std::stable_sort(HEADS.begin(), HEADS.end(), compareHeadSize(SIZE));
+    return HEADS;
+}
+
+// Number of nodes on all heavy paths below HEADS, i.e. of descendants gathered by heavyPathTDP
+static long long pathNodes(const std::vector< std::pair<int, int> >& HEADS, ArrayRef<int> SIZE)
+{
+    long long n = 0;
+    for (size_t k = 0; k < HEADS.size(); k++) n += SIZE[HEADS[k].first];
+    return n;
+}
+
+std::vector<double> forestTDP(int m, int h, double alpha, double simesh, const double* P, ArrayRef<int> SIZE, ArrayRef<int> ROOT, const CSRRef& CHILD, int nthreads)
+{
+    if (nthreads == 1) return forestTDP(m, h, alpha, simesh, P, SIZE, ROOT, CHILD);
+
+    ProfileScope prof("forestTDP", true);
+    const int PATH_GRAIN = 4096;
+    std::vector<double> TDP(m);
+    std::vector< std::pair<int, int> > HEADS = heavyPathHeads(m, SIZE, ROOT, CHILD);
+    ProgressReporter* R = progressCurrent();
+    long long desc = (prof.enabled() || R) ? pathNodes(HEADS, SIZE) : 0;
+    if (R) R->begin("forestTDP", desc);
+    prof.count("descendants", desc);
+    prof.count("voxels", m);
+    prof.count("heavy_paths", HEADS.size());
+
+    PathCategories C(m, h, alpha, simesh, P);
+    ThreadPool pool(nthreads);
+    size_t first = 0;
+    while (first < HEADS.size())
+    {
+        // Collect consecutive paths until the task holds PATH_GRAIN nodes
+        size_t last = first;
+        int nodes = 0;
+        while (last < HEADS.size() && (last == first || nodes < PATH_GRAIN))
+        {
+            nodes += SIZE[HEADS[last].first];
+            last++;
+        }
+
+        pool.submit([=, &HEADS, &C, &SIZE, &CHILD, &TDP]() {
+            ProgressTicker tick(R);
+            PathScratch S;
+            for (size_t k = first; k < last; k++)
+            {
+                heavyPathTDP(HEADS[k].first, HEADS[k].second, m, h, C, P, SIZE, CHILD, TDP.data(), S);
+                tick(SIZE[HEADS[k].first]);
+            }
+        });
+        first = last;
+    }
+    pool.wait();
+
+    return TDP;
+}
+
+// heavyPathTDP for several alphas at once: the descendants of the head are gathered once and
+// shared by all alphas, whose categories C[k] are looked up as in heavyPathTDP. The bounds for
+// alpha k go to TDP[k*m + v].
+static void heavyPathTDP(int v, int par, int m, ArrayRef<int> H, const std::vector<PathCategories>& C,
+                         const double* P, ArrayRef<int> SIZE, const CSRRef& CHILD, double* TDP, PathScratch& S)
+{
+    descendants(v, SIZE, CHILD, S.HP);
+    int n = S.HP.size();
+    S.D.cats.resize(n);
+
+    for (size_t k = 0; k < C.size(); k++)
+    {
+        const int* CAT = C[k].CAT.data();
+        for (int i = 0; i < n; i++)
+        {
+            S.D.cats[i] = CAT[S.HP[i]];
+        }
+
+        const int* NUM = findDiscoveriesOfCategories(S.D.cats.data(), C[k].z, H[k], n, m, S.D);
+        heavyPathWalk(v, par, NUM, P, SIZE, CHILD, TDP + k * static_cast<size_t>(m));
+    }
+}
+
+// forestTDP for several alphas in one pass over the heavy paths (H[k] = h(ALPHA[k]) and
+// SIMESH[k] = simesfactor[H[k]]). Returns the m x ALPHA.size() matrix of TDP bounds in
+// column-major order, i.e. column k, TDP[k*m], ..., TDP[k*m + m-1], equals
+// forestTDP(m, H[k], ALPHA[k], SIMESH[k], P, SIZE, ROOT, CHILD). The heavy paths are spread over
+// nthreads threads as in forestTDP (nthreads <= 0: all hardware threads).
+std::vector<double> forestTDP(int m, ArrayRef<int> H, ArrayRef<double> ALPHA, ArrayRef<double> SIMESH, const double* P,
+                              ArrayRef<int> SIZE, ArrayRef<int> ROOT, const CSRRef& CHILD, int nthreads)
+{
+    if (H.size() != ALPHA.size() || SIMESH.size() != ALPHA.size()) throw std::invalid_argument("'H', 'ALPHA' and 'SIMESH' must have the same length");
+
+    ProfileScope prof("forestTDP (several alphas)", true);
+    const int PATH_GRAIN = 4096;
+    std::vector<double> TDP(static_cast<size_t>(m) * ALPHA.size());
+    if (ALPHA.empty()) return TDP;
+    std::vector< std::pair<int, int> > HEADS = heavyPathHeads(m, SIZE, ROOT, CHILD);
+    ProgressReporter* R = progressCurrent();
+    long long desc = (prof.enabled() || R) ? pathNodes(HEADS, SIZE) : 0;
+    if (R) R->begin("forestTDP", desc);
+    prof.count("descendants", desc);
+    prof.count("voxels", m);
+    prof.count("heavy_paths", HEADS.size());
+    prof.count("alphas", ALPHA.size());
+
+    std::vector<PathCategories> C;
+    C.reserve(ALPHA.size());
+    for (size_t k = 0; k < ALPHA.size(); k++)
+    {
+        C.push_back(PathCategories(m, H[k], ALPHA[k], SIMESH[k], P));
+    }
+
+    if (nthreads == 1)
+    {
+        ProgressTicker tick(R);
+        PathScratch S;
+        for (size_t k = 0; k < HEADS.size(); k++)
+        {
+            heavyPathTDP(HEADS[k].first, HEADS[k].second, m, H, C, P, SIZE, CHILD, TDP.data(), S);
+            tick(SIZE[HEADS[k].first]);
+        }
+        return TDP;
+    }
+
+    ThreadPool pool(nthreads);
+    size_t first = 0;
+    while (first < HEADS.size())
+    {
+        size_t last = first;
+        int nodes = 0;
+        while (last < HEADS.size() && (last == first || nodes < PATH_GRAIN))
+        {
+            nodes += SIZE[HEADS[last].first];
+            last++;
+        }
+
+        pool.submit([=, &HEADS, &H, &C, &SIZE, &CHILD, &TDP]() {
+            ProgressTicker tick(R);
+            PathScratch S;
+            for (size_t k = first; k < last; k++)
+            {
+                heavyPathTDP(HEADS[k].first, HEADS[k].second, m, H, C, P, SIZE, CHILD, TDP.data(), S);
+                tick(SIZE[HEADS[k].first]);
+            }
+        });
+        first = last;
+    }
+    pool.wait();
+
+    return TDP;
+}
+
 //------------------------- (3) PREPARE ADMISSIBLE STCS -------------------------//
 
 // Construct a comparator for the below sorting step
+template <class TDPS>
 struct compareBy
 {
-    std::vector<double>& value;
-    compareBy(std::vector<double>& val) : value(val) {}
+    const TDPS& value;
+    compareBy(const TDPS& val) : value(val) {}
     bool operator() (int i, int j) { return value[i] < value[j]; }
 };
 
 // Set up ADMSTC: a list of representatives of admissible STCs
 std::vector<int> queryPreparation(int m, std::vector<int>& ROOT, std::vector<double>& TDP, std::vector< std::vector<int> >& CHILD)
 {
+    return queryPreparation(m, ROOT, TDP, CSR(CHILD));
+}
+
+// The maximum TDP on the path to a node is that of the last admissible node on it, so the walks
+// below carry that node (-1 if none) instead of the TDP itself
+template <class TDPS>
+static inline double pathTDP(const TDPS& TDP, int a)
+{
+    return (a < 0) ? -1.0 : TDP[a];  // Invalid STCs have TDP -1, so no STC without admissible ancestor is below this
+}
+
+template <class TDPS>
+static std::vector<int> queryPreparationImpl(int m, ArrayRef<int> ROOT, const TDPS& TDP, const CSRRef& CHILD)
+{
+    ProfileScope prof("queryPreparation", true);
     std::vector<int> ADMSTC;  // A vector of representatives of admissible STCs
     ADMSTC.reserve(m);
-    std::vector<double> STACK;
-    STACK.reserve(m * 2);
+    std::vector< std::pair<int, int> > STACK;  // Nodes still to visit, with the last admissible node above them
     
     // Loop through all roots
     for (size_t i = 0; i < ROOT.size(); i++)
     {
-        STACK.push_back(ROOT[i]);  // Walk down the forest from ROOT[i]
-        STACK.push_back(-1);       // Maximum seen TDP on the path to ROOT[i]: non-existent
+        STACK.push_back(std::make_pair(ROOT[i], -1));  // Walk down the forest from ROOT[i]
         while (STACK.size() > 0)
         {
-            double q = STACK.back();  // Maximum seen TDP on the path to v
-            STACK.pop_back();
-            int v = static_cast<int>(STACK.back());
+            int v = STACK.back().first;
+            int a = STACK.back().second;
             STACK.pop_back();
             
             // Check if v has higher TDP than its ancestors
-            if (TDP[v] > q) ADMSTC.push_back(v);  // Note: q>=-1 & invalid STCs have TDP=-1
+            if (TDP[v] > pathTDP(TDP, a))  // Note: q>=-1 & invalid STCs have TDP=-1
+            {
+                ADMSTC.push_back(v);
+                a = v;
+            }
             
-            std::vector<int>& CHD = CHILD[v];
-            for (size_t j = 0; j < CHD.size(); j++)
+            const int* CHD = CHILD.begin(v);
+            for (int j = 0; j < CHILD.degree(v); j++)
             {
-                STACK.push_back(CHD[j]);
-                STACK.push_back(std::max(TDP[v], q));
+                STACK.push_back(std::make_pair(CHD[j], a));
             }
         }
     }
     
     // Sort ADMSTC in ascending order of TDP using the comparator
-    std::sort(ADMSTC.begin(), ADMSTC.end(), compareBy(TDP));
+    std::sort(ADMSTC.begin(), ADMSTC.end(), compareBy<TDPS>(TDP));
 
+    prof.count("voxels", m);
+    prof.count("admissible", ADMSTC.size());
     return ADMSTC;
 }
 
+std::vector<int> queryPreparation(int m, ArrayRef<int> ROOT, ArrayRef<double> TDP, const CSRRef& CHILD)
+{
+    return queryPreparationImpl(m, ROOT, TDP, CHILD);
+}
+
+std::vector<int> queryPreparation(int m, ArrayRef<int> ROOT, const CountTDP& TDP, const CSRRef& CHILD)
+{
+    return queryPreparationImpl(m, ROOT, TDP, CHILD);
+}
+
+// Find the nearest admissible proper ancestor of every node (-1 if there is none).
+// Along a root path the admissible STCs have strictly increasing TDP, so for a query gamma the
+// maximal admissible STCs are those with TDP >= gamma whose admissible parent has TDP < gamma.
+template <class TDPS>
+static std::vector<int> findAdmissibleParentsImpl(int m, ArrayRef<int> ROOT, const TDPS& TDP, const CSRRef& CHILD)
+{
+    ProfileScope prof("findAdmissibleParents");
+    prof.count("voxels", m);
+    std::vector<int> ADMPAR(m, -1);
+    std::vector<int> NODES;     // Stack of nodes still to visit
+
+    for (size_t i = 0; i < ROOT.size(); i++)
+    {
+        NODES.push_back(ROOT[i]);
+        while (!NODES.empty())
+        {
+            int v = NODES.back();
+            NODES.pop_back();
+
+            // Admissible nodes pass themselves down, others pass on their own admissible parent
+            int a = (TDP[v] > pathTDP(TDP, ADMPAR[v])) ? v : ADMPAR[v];
+            for (const int* c = CHILD.begin(v); c != CHILD.end(v); ++c)
+            {
+                ADMPAR[*c] = a;
+                NODES.push_back(*c);
+            }
+        }
+    }
+
+    return ADMPAR;
+}
+
+std::vector<int> findAdmissibleParents(int m, ArrayRef<int> ROOT, ArrayRef<double> TDP, const CSRRef& CHILD)
+{
+    return findAdmissibleParentsImpl(m, ROOT, TDP, CHILD);
+}
+
+std::vector<int> findAdmissibleParents(int m, ArrayRef<int> ROOT, const CountTDP& TDP, const CSRRef& CHILD)
+{
+    return findAdmissibleParentsImpl(m, ROOT, TDP, CHILD);
+}
+
+// Discoveries of every node for bounds computed by forestTDP: TDP[v] * SIZE[v] rounds to the
+// number of discoveries, and CountTDP reproduces TDP[v] from it exactly
+void countTDP(ArrayRef<double> TDP, ArrayRef<int> SIZE, std::vector<int>& NUM)
+{
+    if (TDP.size() != SIZE.size()) throw std::invalid_argument("'TDP' must have one bound per node");
+
+    NUM.resize(TDP.size());
+    for (size_t v = 0; v < TDP.size(); v++)
+    {
+        NUM[v] = (TDP[v] < 0) ? -1 : static_cast<int>(std::floor(TDP[v] * SIZE[v] + 0.5));
+    }
+    CountTDP COUNTS(NUM.data(), SIZE.data());
+    for (size_t v = 0; v < TDP.size(); v++)
+    {
+        if (COUNTS[v] != TDP[v]) throw std::invalid_argument("'TDP' does not hold discoveries / size");
+    }
+}
+
+void expandTDP(ArrayRef<int> NUM, ArrayRef<int> SIZE, std::vector<double>& TDP)
+{
+    CountTDP COUNTS(NUM.data(), SIZE.data());
+    TDP.resize(NUM.size());
+    for (size_t v = 0; v < NUM.size(); v++)
+    {
+        TDP[v] = COUNTS[v];
+    }
+}
+
 //-------------------------- (4) FORM CLUSTERS USING gamma --------------------------//
 
 // Find leftmost index i in ADMSTC such that TDP[ADMSTC[i]] >= g
 // Return size(ADMSTC) if no such index exists;
 // Run linear search & binary search in parallel;
 // gamma >= 0 is needed because inadmissible STCs have been assigned TDP -1.
-int findLeft(double gamma, std::vector<int>& ADMSTC, std::vector<double>& TDP)
+template <class TDPS>
+static int findLeftImpl(double gamma, ArrayRef<int> ADMSTC, const TDPS& TDP)
 {
     int right = ADMSTC.size();
     int low = 0;
@@ -406,104 +1108,730 @@ int findLeft(double gamma, std::vector<int>& ADMSTC, std::vector<double>& TDP)
     return low;  // If no linear search match, return low index
 }
 
+int findLeft(double gamma, ArrayRef<int> ADMSTC, ArrayRef<double> TDP)
+{
+    return findLeftImpl(gamma, ADMSTC, TDP);
+}
+
+int findLeft(double gamma, ArrayRef<int> ADMSTC, const CountTDP& TDP)
+{
+    return findLeftImpl(gamma, ADMSTC, TDP);
+}
+
 // Answer the query, i.e., find maximal STCs under the TDP condition.
 // gamma >= 0 is needed because inadmissible STCs have been assigned TDP -1.
 std::vector< std::vector<int> > answerQuery(double gamma, std::vector<int>& ADMSTC, std::vector<int>& SIZE, std::vector<int>& MARK, std::vector<double>& TDP, std::vector<std::vector<int> >& CHILD)
 {
+    return answerQuery(gamma, ADMSTC, SIZE, MARK, TDP, CSR(CHILD));
+}
+
+std::vector< std::vector<int> > answerQuery(double gamma, ArrayRef<int> ADMSTC, ArrayRef<int> SIZE, std::vector<int>& MARK, ArrayRef<double> TDP, const CSRRef& CHILD)
+{
+    ProfileScope prof("answerQuery");
     if (gamma < 0) gamma = 0;  // Constrain TDP threshold gamma to be non-negative
 
     // Initialize output: a list of sorting rank vectors for all clusters
     std::list<std::vector<int> > ANS;
 
-    int left = findLeft(gamma, ADMSTC, TDP);
+    int left = findLeft(gamma, ADMSTC, TDP);
+
+    for (int i = left; i < static_cast<int>(ADMSTC.size()); i++)  // Loop through ADMSTC
+    {
+        if (MARK[ADMSTC[i]] == 0)
+        {
+            // Append a cluster to ANS
+            std::vector<int> DESC = descendants(ADMSTC[i], SIZE, CHILD);
+            ANS.push_back(DESC);
+            prof.count("clusters", 1);
+            prof.count("descendants", DESC.size());
+
+            // Mark the corresponding voxels
+            for (int j = 0; j < static_cast<int>(DESC.size()); j++)
+            {
+                MARK[DESC[j]] = 1;
+            }
+        }
+    }
+
+    // Clear marks back to 0
+    for (std::list<std::vector<int> >::iterator it = ANS.begin(); it != ANS.end(); ++it)
+    {
+        for (size_t j = 0; j < it->size(); j++)
+        {
+            MARK[it->at(j)] = 0;
+        }
+    }
+
+    // Convert list to a vector of vectors for the result
+    std::vector< std::vector<int> > result(ANS.begin(), ANS.end());
+    return result;
+}
+
+    // Processes a batch of gamma values to identify maximal STCs under the TDP condition.
+    // The gamma_batch vector contains all gamma values to be processed in one function call, 
+    // as opposed to calling answerQuery in a loop for each gamma individually (as done in R).
+    // This approach significantly improves performance, reducing processing times compared to
+    // the single-call method. However, this batch processing might introduce 
+    // overhead that could lead to crashes, particularly with large datasets.
+    std::vector< std::vector< std::vector<int> > > answerQueryBatch(std::vector<double>& gamma_batch, std::vector<int>& ADMSTC, std::vector<int>& SIZE, std::vector<int>& MARK, std::vector<double>& TDP, std::vector< std::vector<int> >& CHILD)
+    {
+        return answerQueryBatch(gamma_batch, ADMSTC, SIZE, MARK, TDP, CSR(CHILD));
+    }
+
+    std::vector< std::vector< std::vector<int> > > answerQueryBatch(ArrayRef<double> gamma_batch, ArrayRef<int> ADMSTC, ArrayRef<int> SIZE, std::vector<int>& MARK, ArrayRef<double> TDP, const CSRRef& CHILD)
+    {
+        ProfileScope prof("answerQueryBatch");
+        prof.count("queries", gamma_batch.size());
+        std::vector< std::vector< std::vector<int> > > batch_results;
+        ProgressReporter* R = progressCurrent();
+        if (R) R->begin("answerQueryBatch", gamma_batch.size());
+
+        for (size_t i = 0; i < gamma_batch.size(); ++i) {
+            double gamma = gamma_batch[i];
+            if (gamma < 0) gamma = 0; // Constrain TDP threshold gamma to be non-negative
+
+            // Initialize output for this gamma: a list of sorting rank vectors for all clusters
+            std::list< std::vector<int> > ANS;
+
+            int left = findLeft(gamma, ADMSTC, TDP);
+
+            for (size_t i = left; i < ADMSTC.size(); i++)
+            {
+                if (MARK[ADMSTC[i]] == 0)
+                {
+                    // Append a cluster to ANS
+                    std::vector<int> DESC = descendants(ADMSTC[i], SIZE, CHILD);
+                    ANS.push_back(DESC);
+                    prof.count("clusters", 1);
+                    prof.count("descendants", DESC.size());
+                    // Mark the corresponding voxels
+                    for (size_t j = 0; j < DESC.size(); j++)
+                    {
+                        MARK[DESC[j]] = 1;
+                    }
+                }
+            }
+
+            // Clear marks back to 0
+            for (std::list<std::vector<int> >::iterator it = ANS.begin(); it != ANS.end(); ++it)
+            {
+                for (size_t j = 0; j < it->size(); j++)
+                {
+                    MARK[it->at(j)] = 0;
+                }
+            }
+
+            // Convert the list of vectors to a vector of vectors for this gamma
+            std::vector< std::vector<int> > result(ANS.begin(), ANS.end());
+
+            // Store the result for this gamma
+            batch_results.push_back(result);
+            if (R) R->advance(1);
+        }
+
+        return batch_results;
+    }
+
+
+// Keep, of the representatives REPS[first], ..., REPS.back() of one query, only the top_k largest
+// (all if top_k < 0), in the order they came in; among clusters of the size at the cut the earlier
+// ones are kept
+static void keepLargest(std::vector<int>& REPS, size_t first, const int* SIZE, int top_k)
+{
+    size_t n = REPS.size() - first;
+    if (top_k < 0 || n <= static_cast<size_t>(top_k)) return;
+    if (top_k == 0)
+    {
+        REPS.resize(first);
+        return;
+    }
+
+    // Size of the top_k-th largest cluster, and how many of that size still fit
+    std::vector<int> SIZES(n);
+    for (size_t j = 0; j < n; j++) SIZES[j] = SIZE[REPS[first + j]];
+    std::nth_element(SIZES.begin(), SIZES.begin() + (top_k - 1), SIZES.end(), std::greater<int>());
+    int cut = SIZES[top_k - 1];
+    int ties = top_k;
+    for (size_t j = 0; j < n; j++)
+    {
+        if (SIZES[j] > cut) ties--;
+    }
+
+    size_t out = first;
+    for (size_t j = first; j < REPS.size(); j++)
+    {
+        int size = SIZE[REPS[j]];
+        if (size > cut || (size == cut && ties-- > 0)) REPS[out++] = REPS[j];
+    }
+    REPS.resize(out);
+}
+
+// Compact batch query: instead of the voxels of every cluster, return the cluster representatives
+// of all queries in one flat array. The representatives for gamma_batch[i] are
+// REPS[OFFSETS[i]], ..., REPS[OFFSETS[i+1]-1], in the same order as the clusters returned by
+// answerQuery; the voxels of a cluster are descendants(rep). ADMPAR comes from findAdmissibleParents.
+// With SIZE given, clusters of fewer than min_size voxels are left out and of the others only the
+// top_k largest are kept per query (all if top_k < 0), still in answerQuery order.
+template <class TDPS>
+static void answerQueryBatchRepsImpl(ArrayRef<double> gamma_batch, ArrayRef<int> ADMSTC, ArrayRef<int> ADMPAR, const TDPS& TDP,
+                                     const int* SIZE, int min_size, int top_k, std::vector<int>& REPS, std::vector<int>& OFFSETS)
+{
+    ProfileScope prof("answerQueryBatchReps");
+    REPS.clear();
+    OFFSETS.assign(1, 0);
+    OFFSETS.reserve(gamma_batch.size() + 1);
+    ProgressReporter* R = progressCurrent();
+    if (R) R->begin("answerQueryBatchReps", gamma_batch.size());
+
+    long long pruned = 0;
+    for (size_t i = 0; i < gamma_batch.size(); i++)
+    {
+        double gamma = gamma_batch[i];
+        if (gamma < 0) gamma = 0;  // Constrain TDP threshold gamma to be non-negative
+
+        int left = findLeft(gamma, ADMSTC, TDP);
+        size_t first = REPS.size();
+        for (size_t j = left; j < ADMSTC.size(); j++)
+        {
+            int a = ADMPAR[ADMSTC[j]];
+            if (a >= 0 && TDP[a] >= gamma) continue;
+            if (SIZE != NULL && SIZE[ADMSTC[j]] < min_size)
+            {
+                pruned++;
+                continue;
+            }
+            REPS.push_back(ADMSTC[j]);
+        }
+        if (SIZE != NULL)
+        {
+            size_t found = REPS.size();
+            keepLargest(REPS, first, SIZE, top_k);
+            pruned += found - REPS.size();
+        }
+        OFFSETS.push_back(REPS.size());
+        if (R) R->advance(1);
+    }
+
+    prof.count("queries", gamma_batch.size());
+    prof.count("clusters", REPS.size());
+    if (SIZE != NULL) prof.count("pruned", pruned);
+}
+
+void answerQueryBatchReps(ArrayRef<double> gamma_batch, ArrayRef<int> ADMSTC, ArrayRef<int> ADMPAR, ArrayRef<double> TDP, std::vector<int>& REPS, std::vector<int>& OFFSETS)
+{
+    answerQueryBatchRepsImpl(gamma_batch, ADMSTC, ADMPAR, TDP, NULL, 0, -1, REPS, OFFSETS);
+}
+
+void answerQueryBatchReps(ArrayRef<double> gamma_batch, ArrayRef<int> ADMSTC, ArrayRef<int> ADMPAR, const CountTDP& TDP, std::vector<int>& REPS, std::vector<int>& OFFSETS)
+{
+    answerQueryBatchRepsImpl(gamma_batch, ADMSTC, ADMPAR, TDP, NULL, 0, -1, REPS, OFFSETS);
+}
+
+void answerQueryBatchReps(ArrayRef<double> gamma_batch, ArrayRef<int> ADMSTC, ArrayRef<int> ADMPAR, ArrayRef<double> TDP,
+                          ArrayRef<int> SIZE, int min_size, int top_k, std::vector<int>& REPS, std::vector<int>& OFFSETS)
+{
+    answerQueryBatchRepsImpl(gamma_batch, ADMSTC, ADMPAR, TDP, SIZE.data(), min_size, top_k, REPS, OFFSETS);
+}
+
+void answerQueryBatchReps(ArrayRef<double> gamma_batch, ArrayRef<int> ADMSTC, ArrayRef<int> ADMPAR, const CountTDP& TDP,
+                          ArrayRef<int> SIZE, int min_size, int top_k, std::vector<int>& REPS, std::vector<int>& OFFSETS)
+{
+    answerQueryBatchRepsImpl(gamma_batch, ADMSTC, ADMPAR, TDP, SIZE.data(), min_size, top_k, REPS, OFFSETS);
+}
+
+// Admissible children of every node: the admissible nodes whose admissible parent it is, in ADMSTC order
+CSR admissibleChildren(int m, ArrayRef<int> ADMSTC, ArrayRef<int> ADMPAR)
+{
+    ProfileScope prof("admissibleChildren");
+    prof.count("admissible", ADMSTC.size());
+    CSR ADMCHILD;
+    ADMCHILD.OFS.assign(m + 1, 0);
+    for (size_t i = 0; i < ADMSTC.size(); i++)
+    {
+        if (ADMPAR[ADMSTC[i]] >= 0) ADMCHILD.OFS[ADMPAR[ADMSTC[i]] + 1]++;
+    }
+    for (int v = 0; v < m; v++) ADMCHILD.OFS[v + 1] += ADMCHILD.OFS[v];
+
+    std::vector<int> NEXT(ADMCHILD.OFS.begin(), ADMCHILD.OFS.end() - 1);
+    ADMCHILD.IDX.resize(ADMCHILD.OFS[m]);
+    for (size_t i = 0; i < ADMSTC.size(); i++)
+    {
+        if (ADMPAR[ADMSTC[i]] >= 0) ADMCHILD.IDX[NEXT[ADMPAR[ADMSTC[i]]]++] = ADMSTC[i];
+    }
+
+    return ADMCHILD;
+}
+
+// Jump pointers over the admissible parents. Along the chain of admissible ancestors of a node
+// the TDP strictly decreases towards the root, so a node's own TDP is also the running maximum
+// of the TDP above it, and "TDP >= gamma" holds on an unbroken stretch of the chain starting
+// below. ADMJUMP[a] is an admissible ancestor of a chosen as in a skew-binary random access list
+// (Myers, 1983): with d the depth of a in the admissible chain, the jumps from a cover 1, 3, 7,
+// ... levels, so that any ancestor is reached in O(log d) steps along ADMPAR and ADMJUMP. Roots
+// of the chain jump to themselves and inadmissible nodes have -1. ADMSTC lists the parents
+// before their children (ascending TDP), which is the only order the construction needs.
+std::vector<int> admissibleJumps(int m, ArrayRef<int> ADMSTC, ArrayRef<int> ADMPAR)
+{
+    ProfileScope prof("admissibleJumps");
+    prof.count("admissible", ADMSTC.size());
+    std::vector<int> ADMJUMP(m, -1);
+    std::vector<int> DEPTH(m, 0);   // Depth in the admissible chain (admissible nodes only)
+    for (size_t i = 0; i < ADMSTC.size(); i++)
+    {
+        int a = ADMSTC[i];
+        int p = ADMPAR[a];
+        if (p < 0)
+        {
+            ADMJUMP[a] = a;
+            continue;
+        }
+        int j = ADMJUMP[p];
+        DEPTH[a] = DEPTH[p] + 1;
+        ADMJUMP[a] = (DEPTH[p] - DEPTH[j] == DEPTH[j] - DEPTH[ADMJUMP[j]]) ? ADMJUMP[j] : p;
+    }
+    return ADMJUMP;
+}
+
+// Cluster at gamma that contains node v: the highest admissible ancestor-or-self of v with
+// TDP >= gamma, provided its nearest admissible ancestor-or-self has TDP >= gamma. As ADMJUMP
+// never skips over a node with TDP < gamma when it lands on one with TDP >= gamma, the walk
+// takes the jump whenever it stays in the cluster and the parent step otherwise.
+// gamma >= 0 is needed because inadmissible STCs have been assigned TDP -1.
+template <class TDPS>
+static int containingClusterImpl(int v, double gamma, ArrayRef<int> ADMIDX, ArrayRef<int> ADMPAR,
+                                 ArrayRef<int> ADMJUMP, const TDPS& TDP)
+{
+    if (gamma < 0) gamma = 0;  // Constrain TDP threshold gamma to be non-negative
+
+    int a = (ADMIDX[v] >= 0) ? v : ADMPAR[v];
+    if (a < 0 || TDP[a] < gamma) return -1;
+    for (;;)
+    {
+        int p = ADMPAR[a];
+        if (p < 0 || TDP[p] < gamma) return a;
+        int j = ADMJUMP[a];
+        a = (TDP[j] >= gamma) ? j : p;
+    }
+}
+
+int containingCluster(int v, double gamma, ArrayRef<int> ADMIDX, ArrayRef<int> ADMPAR,
+                      ArrayRef<int> ADMJUMP, ArrayRef<double> TDP)
+{
+    return containingClusterImpl(v, gamma, ADMIDX, ADMPAR, ADMJUMP, TDP);
+}
+
+int containingCluster(int v, double gamma, ArrayRef<int> ADMIDX, ArrayRef<int> ADMPAR,
+                      ArrayRef<int> ADMJUMP, const CountTDP& TDP)
+{
+    return containingClusterImpl(v, gamma, ADMIDX, ADMPAR, ADMJUMP, TDP);
+}
+
+// Difference between the answers at gamma0 and gamma1: the representatives of the clusters at gamma1
+// that are no clusters at gamma0 (ADDED) and of those at gamma0 that are gone at gamma1 (REMOVED),
+// both in ADMSTC order. With lo < hi the two gammas, the clusters at lo that are none at hi are the
+// admissible STCs with TDP in [lo, hi) whose admissible parent has TDP < lo, and the clusters at hi
+// that are none at lo are the first admissible nodes with TDP >= hi below those. So only that part
+// of ADMSTC and the admissible children below it are visited; a merge shows up as one added and
+// several removed clusters. ADMIDX comes from admissibleIndex and ADMCHILD from admissibleChildren.
+template <class TDPS>
+static void answerQueryDeltaImpl(double gamma0, double gamma1, ArrayRef<int> ADMSTC, ArrayRef<int> ADMIDX, ArrayRef<int> ADMPAR,
+                                 const CSRRef& ADMCHILD, const TDPS& TDP, std::vector<int>& ADDED, std::vector<int>& REMOVED)
+{
+    ProfileScope prof("answerQueryDelta");
+    ADDED.clear();
+    REMOVED.clear();
+
+    // Constrain TDP thresholds to be non-negative
+    if (gamma0 < 0) gamma0 = 0;
+    if (gamma1 < 0) gamma1 = 0;
+    if (gamma0 == gamma1) return;
+
+    double lo = std::min(gamma0, gamma1);
+    double hi = std::max(gamma0, gamma1);
+    std::vector<int>& LOREPS = (gamma1 < gamma0) ? ADDED : REMOVED;   // Clusters at lo only
+    std::vector<int>& HIREPS = (gamma1 < gamma0) ? REMOVED : ADDED;   // Clusters at hi only
+
+    int left = findLeft(lo, ADMSTC, TDP);
+    int right = findLeft(hi, ADMSTC, TDP);
+    std::vector<int> STACK;
+    for (int i = left; i < right; i++)
+    {
+        int a = ADMPAR[ADMSTC[i]];
+        if (a >= 0 && TDP[a] >= lo) continue;
+        LOREPS.push_back(ADMSTC[i]);
+
+        // Along the admissible children TDP increases; stop at the first ones reaching hi
+        STACK.push_back(ADMSTC[i]);
+        while (!STACK.empty())
+        {
+            int v = STACK.back();
+            STACK.pop_back();
+            for (const int* c = ADMCHILD.begin(v); c != ADMCHILD.end(v); ++c)
+            {
+                if (TDP[*c] >= hi) HIREPS.push_back(*c);
+                else STACK.push_back(*c);
+            }
+        }
+    }
+
+    std::sort(HIREPS.begin(), HIREPS.end(), [&ADMIDX](int u, int v) { return ADMIDX[u] < ADMIDX[v]; });
+
+    prof.count("admissible", right - left);
+    prof.count("added", ADDED.size());
+    prof.count("removed", REMOVED.size());
+}
+
+void answerQueryDelta(double gamma0, double gamma1, ArrayRef<int> ADMSTC, ArrayRef<int> ADMIDX, ArrayRef<int> ADMPAR,
+                      const CSRRef& ADMCHILD, ArrayRef<double> TDP, std::vector<int>& ADDED, std::vector<int>& REMOVED)
+{
+    answerQueryDeltaImpl(gamma0, gamma1, ADMSTC, ADMIDX, ADMPAR, ADMCHILD, TDP, ADDED, REMOVED);
+}
+
+void answerQueryDelta(double gamma0, double gamma1, ArrayRef<int> ADMSTC, ArrayRef<int> ADMIDX, ArrayRef<int> ADMPAR,
+                      const CSRRef& ADMCHILD, const CountTDP& TDP, std::vector<int>& ADDED, std::vector<int>& REMOVED)
+{
+    answerQueryDeltaImpl(gamma0, gamma1, ADMSTC, ADMIDX, ADMPAR, ADMCHILD, TDP, ADDED, REMOVED);
+}
+
+// Label the voxels of the clusters with representatives REPS[0], ..., REPS[nreps-1]:
+// LABEL[v] = k+1 for the voxels of cluster k. Other entries of LABEL are left as they are.
+void labelClusters(const int* REPS, int nreps, ArrayRef<int> SIZE, ArrayRef<int> ORDER, ArrayRef<int> POS, int* LABEL)
+{
+    ProfileScope prof("labelClusters");
+    for (int k = 0; k < nreps; k++)
+    {
+        const int* DESC = ORDER.data() + POS[REPS[k]] - SIZE[REPS[k]] + 1;
+        for (int j = 0; j < SIZE[REPS[k]]; j++)
+        {
+            LABEL[DESC[j]] = k + 1;
+        }
+        prof.count("voxels", SIZE[REPS[k]]);
+    }
+    prof.count("clusters", nreps);
+}
+
+// Same, written to LABEL[INDEXP[v]] in a volume of nvox voxels (voxels outside the clusters are untouched)
+void labelClusters(const int* REPS, int nreps, ArrayRef<int> SIZE, ArrayRef<int> ORDER, ArrayRef<int> POS,
+                   const int* INDEXP, int* LABEL, int nvox)
+{
+    ProfileScope prof("labelClusters");
+    for (int k = 0; k < nreps; k++)
+    {
+        const int* DESC = ORDER.data() + POS[REPS[k]] - SIZE[REPS[k]] + 1;
+        for (int j = 0; j < SIZE[REPS[k]]; j++)
+        {
+            int vox = INDEXP[DESC[j]];
+            if (vox < 0 || vox >= nvox) throw std::out_of_range("voxel index outside the label volume");
+            LABEL[vox] = k + 1;
+        }
+        prof.count("voxels", SIZE[REPS[k]]);
+    }
+    prof.count("clusters", nreps);
+}
+
+// Supra-threshold clusters: the connected components of the first k nodes in the sorting order ORD
+// (1-based), i.e. of the voxels below a p-value threshold. The forest is built by adding the nodes in
+// that order, so each component is the subtree of its last node, and that is the one node among the
+// first k whose parent is not among them. The children of the first k nodes are among them too, so
+// the representatives are found by marking those children, in O(k) time. REPS is sorted by
+// decreasing cluster size (ties in the order of ORD).
+template <class Marks>
+static void thresholdClustersImpl(int k, const int* ORD, ArrayRef<int> SIZE, const CSRRef& CHILD, Marks& MARK, std::vector<int>& REPS)
+{
+    ProfileScope prof("thresholdClusters");
+    prof.count("voxels", k);
+    REPS.clear();
+
+    for (int i = 0; i < k; i++)
+    {
+        int v = ORD[i] - 1;
+        for (const int* c = CHILD.begin(v); c != CHILD.end(v); ++c) MARK[*c] = 1;
+    }
+    for (int i = 0; i < k; i++)
+    {
+        if (MARK[ORD[i] - 1] == 0) REPS.push_back(ORD[i] - 1);
+    }
+    for (int i = 0; i < k; i++)
+    {
+        int v = ORD[i] - 1;
+        for (const int* c = CHILD.begin(v); c != CHILD.end(v); ++c) MARK[*c] = 0;
+    }
+
+    std::stable_sort(REPS.begin(), REPS.end(), [&SIZE](int u, int v) { return SIZE[u] > SIZE[v]; });
+    prof.count("clusters", REPS.size());
+}
+
+void thresholdClusters(int k, const int* ORD, ArrayRef<int> SIZE, const CSRRef& CHILD, std::vector<int>& MARK, std::vector<int>& REPS)
+{
+    thresholdClustersImpl(k, ORD, SIZE, CHILD, MARK, REPS);
+}
+
+// Same, with the marks kept in a bitset
+void thresholdClusters(int k, const int* ORD, ArrayRef<int> SIZE, const CSRRef& CHILD, std::vector<bool>& MARK, std::vector<int>& REPS)
+{
+    thresholdClustersImpl(k, ORD, SIZE, CHILD, MARK, REPS);
+}
+
+// Running summary of a range of cluster voxels (see clusterSummary)
+struct ClusterPart
+{
+    int size;
+    double peak;
+    int peakid;
+};
+
+// Summarise the voxels DESC[0], ..., DESC[n-1]: the peak is the largest statistic, ties going to the smaller node id
+static void summariseVoxels(const int* DESC, int n, const int* INDEXP, const double* STAT, ClusterPart& PART)
+{
+    PART.size = n;
+    PART.peak = -std::numeric_limits<double>::infinity();
+    PART.peakid = -1;
+
+    for (int j = 0; j < n; j++)
+    {
+        int v = DESC[j];
+        double s = STAT[INDEXP[v]];
+        if (s > PART.peak || (s == PART.peak && v < PART.peakid))
+        {
+            PART.peak = s;
+            PART.peakid = v;
+        }
+    }
+}
+
+// Summary table of the clusters represented by REPS[0], ..., REPS[nreps-1] in one pass over their
+// voxels (see ClusterTable). STAT (and ATLAS, if not NULL) are volumes with DIMS[0]*DIMS[1]*DIMS[2]
+// voxels, addressed through INDEXP. The voxels of every cluster are a contiguous range of ORDER, so the
+// ranges are cut into pieces of about the same length that are summarised in parallel and then merged.
+template <class TDPS>
+static void clusterSummaryImpl(const int* REPS, int nreps, ArrayRef<int> SIZE, ArrayRef<int> ORDER, ArrayRef<int> POS,
+                               const TDPS& TDP, const int* INDEXP, const int* DIMS, const double* STAT, const int* ATLAS,
+                               ClusterTable& TBL, int nthreads)
+{
+    ProfileScope prof("clusterSummary");
+    const int PIECE_GRAIN = 65536;
 
-    for (int i = left; i < static_cast<int>(ADMSTC.size()); i++)  // Loop through ADMSTC
+    // Pieces of the clusters: cluster, first voxel & number of voxels
+    std::vector<int> PCLUS, PFIRST, PLEN;
+    for (int k = 0; k < nreps; k++)
     {
-        if (MARK[ADMSTC[i]] == 0)
+        int first = POS[REPS[k]] - SIZE[REPS[k]] + 1;
+        for (int off = 0; off < SIZE[REPS[k]]; off += PIECE_GRAIN)
         {
-            // Append a cluster to ANS
-            std::vector<int> DESC = descendants(ADMSTC[i], SIZE, CHILD);
-            ANS.push_back(DESC);
+            PCLUS.push_back(k);
+            PFIRST.push_back(first + off);
+            PLEN.push_back(std::min(PIECE_GRAIN, SIZE[REPS[k]] - off));
+        }
+    }
 
-            // Mark the corresponding voxels
-            for (int j = 0; j < static_cast<int>(DESC.size()); j++)
+    std::vector<ClusterPart> PARTS(PCLUS.size());
+    if (nthreads == 1)
+    {
+        for (size_t i = 0; i < PARTS.size(); i++)
+        {
+            summariseVoxels(ORDER.data() + PFIRST[i], PLEN[i], INDEXP, STAT, PARTS[i]);
+        }
+    }
+    else
+    {
+        ThreadPool pool(nthreads);
+        size_t first = 0;
+        while (first < PARTS.size())
+        {
+            // Collect consecutive pieces until the task holds PIECE_GRAIN voxels
+            size_t last = first;
+            int voxels = 0;
+            while (last < PARTS.size() && (last == first || voxels < PIECE_GRAIN))
             {
-                MARK[DESC[j]] = 1;
+                voxels += PLEN[last];
+                last++;
             }
+
+            pool.submit([=, &ORDER, &PFIRST, &PLEN, &PARTS]() {
+                for (size_t i = first; i < last; i++)
+                {
+                    summariseVoxels(ORDER.data() + PFIRST[i], PLEN[i], INDEXP, STAT, PARTS[i]);
+                }
+            });
+            first = last;
         }
+        pool.wait();
     }
 
-    // Clear marks back to 0
-    for (std::list<std::vector<int> >::iterator it = ANS.begin(); it != ANS.end(); ++it)
+    TBL.SIZE.assign(nreps, 0);
+    TBL.TDP.assign(nreps, 0);
+    TBL.PEAK.assign(nreps, 0);
+    TBL.PEAKID.assign(nreps, -1);
+    TBL.PEAKXYZ.assign(3 * nreps, 0);
+    TBL.LABEL.assign(nreps, 0);
+
+    // Merge the pieces of every cluster (they are stored cluster by cluster)
+    size_t i = 0;
+    for (int k = 0; k < nreps; k++)
     {
-        for (size_t j = 0; j < it->size(); j++)
+        ClusterPart ALL = PARTS[i++];
+        while (i < PARTS.size() && PCLUS[i] == k)
         {
-            MARK[it->at(j)] = 0;
+            const ClusterPart& PART = PARTS[i++];
+            ALL.size += PART.size;
+            if (PART.peak > ALL.peak || (PART.peak == ALL.peak && PART.peakid < ALL.peakid))
+            {
+                ALL.peak = PART.peak;
+                ALL.peakid = PART.peakid;
+            }
+        }
+        if (ALL.peakid < 0)  // No comparable statistic in the cluster (all NaN)
+        {
+            ALL.peakid = REPS[k];
+            ALL.peak = STAT[INDEXP[REPS[k]]];
         }
+
+        int vox = INDEXP[ALL.peakid];
+        TBL.SIZE[k] = ALL.size;
+        TBL.TDP[k] = TDP[REPS[k]];
+        TBL.PEAK[k] = ALL.peak;
+        TBL.PEAKID[k] = ALL.peakid;
+        TBL.PEAKXYZ[3 * k] = vox % DIMS[0];
+        TBL.PEAKXYZ[3 * k + 1] = (vox / DIMS[0]) % DIMS[1];
+        TBL.PEAKXYZ[3 * k + 2] = vox / (DIMS[0] * DIMS[1]);
+        if (ATLAS != NULL) TBL.LABEL[k] = ATLAS[vox];
+        prof.count("voxels", ALL.size);
     }
+    prof.count("clusters", nreps);
+}
 
-    // Convert list to a vector of vectors for the result
-    std::vector< std::vector<int> > result(ANS.begin(), ANS.end());
-    return result;
+void clusterSummary(const int* REPS, int nreps, ArrayRef<int> SIZE, ArrayRef<int> ORDER, ArrayRef<int> POS,
+                    ArrayRef<double> TDP, const int* INDEXP, const int* DIMS, const double* STAT, const int* ATLAS,
+                    ClusterTable& TBL, int nthreads)
+{
+    clusterSummaryImpl(REPS, nreps, SIZE, ORDER, POS, TDP, INDEXP, DIMS, STAT, ATLAS, TBL, nthreads);
 }
 
-    // Processes a batch of gamma values to identify maximal STCs under the TDP condition.
-    // The gamma_batch vector contains all gamma values to be processed in one function call, 
-    // as opposed to calling answerQuery in a loop for each gamma individually (as done in R).
-    // This approach significantly improves performance, reducing processing times compared to
-    // the single-call method. However, this batch processing might introduce 
-    // overhead that could lead to crashes, particularly with large datasets.
-    std::vector< std::vector< std::vector<int> > > answerQueryBatch(std::vector<double>& gamma_batch, std::vector<int>& ADMSTC, std::vector<int>& SIZE, std::vector<int>& MARK, std::vector<double>& TDP, std::vector< std::vector<int> >& CHILD)
+void clusterSummary(const int* REPS, int nreps, ArrayRef<int> SIZE, ArrayRef<int> ORDER, ArrayRef<int> POS,
+                    const CountTDP& TDP, const int* INDEXP, const int* DIMS, const double* STAT, const int* ATLAS,
+                    ClusterTable& TBL, int nthreads)
+{
+    clusterSummaryImpl(REPS, nreps, SIZE, ORDER, POS, TDP, INDEXP, DIMS, STAT, ATLAS, TBL, nthreads);
+}
+
+// Gradient map: for every in-mask voxel v, the largest gamma in gamma_batch at which v lies
+// inside one of the clusters returned by answerQuery (0 if there is no such gamma), written to
+// GRADMAP[INDEXP[v]]. A voxel lies in a cluster at gamma iff some STC containing it has
+// TDP >= gamma, i.e. iff the maximum TDP on its path to the root is >= gamma. So instead of
+// answering every query, one top-down walk of the forest carries that running maximum and
+// looks up the largest qualifying gamma for each voxel. Voxels outside the mask are not touched.
+// With SIZE given only clusters of at least min_size voxels count. The cluster of v at gamma is
+// its highest ancestor with TDP >= gamma, so it has min_size voxels or more iff some ancestor
+// with that many voxels has TDP >= gamma: the running maximum then only takes in such ancestors,
+// which (as SIZE only shrinks going down) form the top part of every root path.
+template <class TDPS>
+static void gradientMapImpl(ArrayRef<double> gamma_batch, ArrayRef<int> ROOT, const TDPS& TDP, const CSRRef& CHILD,
+                            const int* SIZE, int min_size, const int* INDEXP, float* GRADMAP, int nvox)
+{
+    ProfileScope prof("gradientMap", true);
+    prof.count("voxels", CHILD.rows());
+    prof.count("queries", gamma_batch.size());
+
+    // Sorted non-negative gammas (answerQuery clamps gamma to be non-negative)
+    std::vector<double> GAMMA(gamma_batch.begin(), gamma_batch.end());
+    for (size_t i = 0; i < GAMMA.size(); i++)
     {
-        std::vector< std::vector< std::vector<int> > > batch_results;
+        if (GAMMA[i] < 0) GAMMA[i] = 0;
+    }
+    std::sort(GAMMA.begin(), GAMMA.end());
 
-        for (size_t i = 0; i < gamma_batch.size(); ++i) {
-            double gamma = gamma_batch[i];
-            if (gamma < 0) gamma = 0; // Constrain TDP threshold gamma to be non-negative
+    std::vector< std::pair<int, int> > NODES;  // Nodes still to visit, with the node of maximum TDP above them (see pathTDP)
+    ProgressReporter* R = progressCurrent();
+    if (R) R->begin("gradientMap", CHILD.rows());
+    ProgressTicker tick(R);
 
-            // Initialize output for this gamma: a list of sorting rank vectors for all clusters
-            std::list< std::vector<int> > ANS;
+    for (size_t i = 0; i < ROOT.size(); i++)
+    {
+        NODES.push_back(std::make_pair(ROOT[i], -1));
+        while (!NODES.empty())
+        {
+            int v = NODES.back().first;
+            int a = NODES.back().second;
+            NODES.pop_back();
+            if (TDP[v] > pathTDP(TDP, a) && (SIZE == NULL || SIZE[v] >= min_size)) a = v;
+            double q = pathTDP(TDP, a);  // Maximum TDP on the path to v, v included
 
-            int left = findLeft(gamma, ADMSTC, TDP);
+            if (INDEXP[v] < 0 || INDEXP[v] >= nvox) throw std::out_of_range("voxel index outside the gradient map");
 
-            for (size_t i = left; i < ADMSTC.size(); i++)
-            {
-                if (MARK[ADMSTC[i]] == 0)
-                {
-                    // Append a cluster to ANS
-                    std::vector<int> DESC = descendants(ADMSTC[i], SIZE, CHILD);
-                    ANS.push_back(DESC);
-                    // Mark the corresponding voxels
-                    for (size_t j = 0; j < DESC.size(); j++)
-                    {
-                        MARK[DESC[j]] = 1;
-                    }
-                }
-            }
+            // Largest gamma <= q, if any
+            std::vector<double>::iterator it = std::upper_bound(GAMMA.begin(), GAMMA.end(), q);
+            GRADMAP[INDEXP[v]] = (it == GAMMA.begin()) ? 0.0f : static_cast<float>(*(it - 1));
 
-            // Clear marks back to 0
-            for (std::list<std::vector<int> >::iterator it = ANS.begin(); it != ANS.end(); ++it)
+            for (const int* c = CHILD.begin(v); c != CHILD.end(v); ++c)
             {
-                for (size_t j = 0; j < it->size(); j++)
-                {
-                    MARK[it->at(j)] = 0;
-                }
+                NODES.push_back(std::make_pair(*c, a));
             }
+            tick();
+        }
+    }
+}
 
-            // Convert the list of vectors to a vector of vectors for this gamma
-            std::vector< std::vector<int> > result(ANS.begin(), ANS.end());
+void gradientMap(ArrayRef<double> gamma_batch, ArrayRef<int> ROOT, ArrayRef<double> TDP, const CSRRef& CHILD, const int* INDEXP, float* GRADMAP, int nvox)
+{
+    gradientMapImpl(gamma_batch, ROOT, TDP, CHILD, NULL, 0, INDEXP, GRADMAP, nvox);
+}
 
-            // Store the result for this gamma
-            batch_results.push_back(result);
-        }
+void gradientMap(ArrayRef<double> gamma_batch, ArrayRef<int> ROOT, const CountTDP& TDP, const CSRRef& CHILD, const int* INDEXP, float* GRADMAP, int nvox)
+{
+    gradientMapImpl(gamma_batch, ROOT, TDP, CHILD, NULL, 0, INDEXP, GRADMAP, nvox);
+}
 
-        return batch_results;
-    }
+void gradientMap(ArrayRef<double> gamma_batch, ArrayRef<int> ROOT, ArrayRef<double> TDP, const CSRRef& CHILD,
+                 ArrayRef<int> SIZE, int min_size, const int* INDEXP, float* GRADMAP, int nvox)
+{
+    gradientMapImpl(gamma_batch, ROOT, TDP, CHILD, SIZE.data(), min_size, INDEXP, GRADMAP, nvox);
+}
+
+void gradientMap(ArrayRef<double> gamma_batch, ArrayRef<int> ROOT, const CountTDP& TDP, const CSRRef& CHILD,
+                 ArrayRef<int> SIZE, int min_size, const int* INDEXP, float* GRADMAP, int nvox)
+{
+    gradientMapImpl(gamma_batch, ROOT, TDP, CHILD, SIZE.data(), min_size, INDEXP, GRADMAP, nvox);
+}
 
+// Gradient map of answered queries: GRADMAP[INDEXP[v]] is the largest non-negative gamma_batch[i]
+// for which v lies in one of the clusters REPS[OFFSETS[i]], ..., REPS[OFFSETS[i+1]-1] (as returned
+// by answerQueryBatchReps, possibly pruned), 0 if none. Every in-mask voxel is written.
+void gradientMap(ArrayRef<double> gamma_batch, ArrayRef<int> REPS, ArrayRef<int> OFFSETS,
+                 ArrayRef<int> SIZE, ArrayRef<int> ORDER, ArrayRef<int> POS,
+                 const int* INDEXP, float* GRADMAP, int nvox)
+{
+    ProfileScope prof("gradientMapReps");
+    prof.count("queries", gamma_batch.size());
+    prof.count("clusters", REPS.size());
+    if (OFFSETS.size() != gamma_batch.size() + 1) throw std::invalid_argument("'OFFSETS' must have one entry per gamma, plus one");
+
+    int m = ORDER.size();
+    for (int v = 0; v < m; v++)
+    {
+        if (INDEXP[v] < 0 || INDEXP[v] >= nvox) throw std::out_of_range("voxel index outside the gradient map");
+        GRADMAP[INDEXP[v]] = 0.0f;
+    }
+    for (size_t i = 0; i < gamma_batch.size(); i++)
+    {
+        float gamma = static_cast<float>(gamma_batch[i] < 0 ? 0 : gamma_batch[i]);
+        for (int k = OFFSETS[i]; k < OFFSETS[i + 1]; k++)
+        {
+            const int* DESC = ORDER.data() + POS[REPS[k]] - SIZE[REPS[k]] + 1;
+            for (int j = 0; j < SIZE[REPS[k]]; j++)
+            {
+                float& g = GRADMAP[INDEXP[DESC[j]]];
+                if (gamma > g) g = gamma;
+            }
+            prof.count("voxels", SIZE[REPS[k]]);
+        }
+    }
+}
 
 // Counting sort in descending order of cluster sizes.
 std::vector<int> counting_sort(int n, int maxid, std::vector<int>& CLSTRSIZE)
 {
+    ProfileScope prof("counting_sort");
+    prof.count("clusters", n);
     // Initialise output sorted indices for descending cluster sizes
     std::vector<int> SORTED(n, 0);
     std::vector<int> COUNT(maxid + 1, 0);
@@ -555,6 +1883,11 @@ std::vector<int> counting_sort(int n, int maxid, std::vector<int>& CLSTRSIZE)
 
 // Convert linear index to [x y z] coordinates
 std::vector<int> index2xyz(int index, std::vector<int>& DIMS)
+{
+    return index2xyz(index, DIMS.data());
+}
+
+std::vector<int> index2xyz(int index, const int* DIMS)
 {
     std::vector<int> XYZ;
     XYZ.reserve(3);
@@ -572,17 +1905,31 @@ std::vector<std::vector<int> > ids2xyz(std::vector<int>& IDS, std::vector<int>&
     std::vector<std::vector<int> > XYZS(IDS.size(), std::vector<int>(3));
     for (size_t i = 0; i < IDS.size(); i++)
     {
-        std::vector<int> XYZ = index2xyz(IDS[i], DIMS);
-        XYZS[i][0] = XYZ[0];
-        XYZS[i][1] = XYZ[1];
-        XYZS[i][2] = XYZ[2];
+        ids2xyz(&IDS[i], 1, DIMS.data(), XYZS[i].data());
     }
 
     return XYZS;
 }
 
+// Same, written row by row into the n x 3 array XYZ
+void ids2xyz(const int* IDS, int n, const int* DIMS, int* XYZ)
+{
+    for (int i = 0; i < n; i++)
+    {
+        int index = IDS[i];
+        XYZ[3 * i] = index % DIMS[0];  // x
+        XYZ[3 * i + 1] = (index / DIMS[0]) % DIMS[1];  // y
+        XYZ[3 * i + 2] = index / (DIMS[0] * DIMS[1]);  // z
+    }
+}
+
 // Check if a voxel is in the mask
 bool xyz_check(int x, int y, int z, int index, std::vector<int>& DIMS, std::vector<int>& MASK)
+{
+    return xyz_check(x, y, z, index, DIMS.data(), MASK.data());
+}
+
+bool xyz_check(int x, int y, int z, int index, const int* DIMS, const int* MASK)
 {
     return (x >= 0 && x < DIMS[0] &&  // C order: x corresponds to the first dimension
             y >= 0 && y < DIMS[1] &&  // y corresponds to the second dimension
@@ -590,42 +1937,48 @@ bool xyz_check(int x, int y, int z, int index, std::vector<int>& DIMS, std::vect
             MASK[index] != 0);
 }
 
+// xyz coordinate adjustment vectors
+// Coordinate adjustment vectors for finding neighbors in a 3D grid.
+// These vectors represent the relative offsets to move from a given voxel 
+// to its neighboring voxels. Each triplet (DX[i], DY[i], DZ[i]) specifies 
+// a direction to a neighboring voxel.
+//
+// The 26 possible directions correspond to the neighbors in 26-connectivity:
+// - 6-connectivity: includes only the voxels that share a face with the central voxel (6 neighbors).
+// - 18-connectivity: includes the voxels that share an edge or a face with the central voxel (18 neighbors).
+// - 26-connectivity: includes the voxels that share a vertex, an edge, or a face with the central voxel (26 neighbors).
+//
+// Example offsets:
+// - (1, 0, 0)   : move one step in the x-direction (right neighbor)
+// - (-1, 0, 0)  : move one step in the negative x-direction (left neighbor)
+// - (0, 1, 0)   : move one step in the y-direction (front neighbor)
+// - (0, -1, 0)  : move one step in the negative y-direction (back neighbor)
+// - (0, 0, 1)   : move one step in the z-direction (top neighbor)
+// - (0, 0, -1)  : move one step in the negative z-direction (bottom neighbor)
+// - (1, 1, 0)   : move one step in both the x and y directions (diagonal neighbor in the xy-plane)
+// - (-1, 1, 0)  : move one step in the negative x direction and one step in the y direction (another diagonal neighbor in the xy-plane)
+// - (1, 0, 1)   : move one step in the x direction and one step in the z direction (diagonal neighbor in the xz-plane)
+// - (0, 1, 1)   : move one step in the y direction and one step in the z direction (diagonal neighbor in the yz-plane)
+// - (1, 1, 1)   : move one step in all three directions (diagonal neighbor in the 3D space)
+//
+// These vectors are used in the findNeighbours function to iterate through
+// all potential neighbors of a voxel by simply adding these offsets to the voxel's coordinates.
+// findAdjListCSR turns them into linear index offsets (see stencilOffsets).
+static const int DX[26] = {1,-1,0, 0,0, 0,  1,-1, 1,-1,1,-1, 1,-1,0, 0, 0, 0,  1,-1, 1,-1, 1,-1, 1,-1};
+static const int DY[26] = {0, 0,1,-1,0, 0,  1, 1,-1,-1,0, 0, 0, 0,1,-1, 1,-1,  1, 1,-1,-1, 1, 1,-1,-1};
+static const int DZ[26] = {0, 0,0, 0,1,-1,  0, 0, 0, 0,1, 1,-1,-1,1, 1,-1,-1,  1, 1, 1, 1,-1,-1,-1,-1};
+
 // Find valid neighbours of a voxel
 std::vector<int> findNeighbours(std::vector<int>& MASK, std::vector<int>& DIMS, int index, int conn)
+{
+    return findNeighbours(MASK.data(), DIMS.data(), index, conn);
+}
+
+std::vector<int> findNeighbours(const int* MASK, const int* DIMS, int index, int conn)
 {
     // compute [x y z] coordinates based on voxel index
     std::vector<int> XYZ = index2xyz(index, DIMS);
     
-    // xyz coordinate adjustment vectors
-    // Coordinate adjustment vectors for finding neighbors in a 3D grid.
-        // These vectors represent the relative offsets to move from a given voxel 
-        // to its neighboring voxels. Each triplet (DX[i], DY[i], DZ[i]) specifies 
-        // a direction to a neighboring voxel.
-        //
-        // The 26 possible directions correspond to the neighbors in 26-connectivity:
-        // - 6-connectivity: includes only the voxels that share a face with the central voxel (6 neighbors).
-        // - 18-connectivity: includes the voxels that share an edge or a face with the central voxel (18 neighbors).
-        // - 26-connectivity: includes the voxels that share a vertex, an edge, or a face with the central voxel (26 neighbors).
-        //
-        // Example offsets:
-        // - (1, 0, 0)   : move one step in the x-direction (right neighbor)
-        // - (-1, 0, 0)  : move one step in the negative x-direction (left neighbor)
-        // - (0, 1, 0)   : move one step in the y-direction (front neighbor)
-        // - (0, -1, 0)  : move one step in the negative y-direction (back neighbor)
-        // - (0, 0, 1)   : move one step in the z-direction (top neighbor)
-        // - (0, 0, -1)  : move one step in the negative z-direction (bottom neighbor)
-        // - (1, 1, 0)   : move one step in both the x and y directions (diagonal neighbor in the xy-plane)
-        // - (-1, 1, 0)  : move one step in the negative x direction and one step in the y direction (another diagonal neighbor in the xy-plane)
-        // - (1, 0, 1)   : move one step in the x direction and one step in the z direction (diagonal neighbor in the xz-plane)
-        // - (0, 1, 1)   : move one step in the y direction and one step in the z direction (diagonal neighbor in the yz-plane)
-        // - (1, 1, 1)   : move one step in all three directions (diagonal neighbor in the 3D space)
-        //
-        // These vectors are used in the findNeighbours function to iterate through
-        // all potential neighbors of a voxel by simply adding these offsets to the voxel's coordinates.
-    int DX[26] = {1,-1,0, 0,0, 0,  1,-1, 1,-1,1,-1, 1,-1,0, 0, 0, 0,  1,-1, 1,-1, 1,-1, 1,-1};
-    int DY[26] = {0, 0,1,-1,0, 0,  1, 1,-1,-1,0, 0, 0, 0,1,-1, 1,-1,  1, 1,-1,-1, 1, 1,-1,-1};
-    int DZ[26] = {0, 0,0, 0,1,-1,  0, 0, 0, 0,1, 1,-1,-1,1, 1,-1,-1,  1, 1, 1, 1,-1,-1,-1,-1};
-    
     // find all valid neighbours of a voxel
     std::vector<int> IDS(conn);
     int len = 0;
@@ -659,9 +2012,20 @@ std::vector<std::vector<int> > findAdjList(std::vector<int>& MASK,    // 3D mask
                                            int m,                     // Number of in-mask voxels
                                            int conn)                  // Connectivity criterion (e.g., 6, 18, or 26)
 {
+    return findAdjList(MASK.data(), INDEXP.data(), DIMS.data(), m, conn);
+}
+
+std::vector<std::vector<int> > findAdjList(const int* MASK, const int* INDEXP, const int* DIMS, int m, int conn)
+{
+    ProfileScope prof("findAdjList", true);
+    prof.count("voxels", m);
+
     // Initialize the adjacency list with 'm' empty vectors
     // Each entry in ADJ will be a list of neighbors for a corresponding voxel
     std::vector<std::vector<int> > ADJ(m);
+    ProgressReporter* R = progressCurrent();
+    if (R) R->begin("findAdjList", m);
+    ProgressTicker tick(R);
 
     // Loop through all in-mask voxels
     for (int i = 0; i < m; i++)
@@ -672,18 +2036,199 @@ std::vector<std::vector<int> > findAdjList(std::vector<int>& MASK,    // 3D mask
         
         // Store the list of neighbors in the adjacency list at position 'i'
         ADJ[i] = IDS;
+        tick();
     }
 
     // Return the computed adjacency list
     return ADJ;
 }
 
+CSR findAdjListCSR(std::vector<int>& MASK, std::vector<int>& INDEXP, std::vector<int>& DIMS, int m, int conn)
+{
+    return findAdjListCSR(MASK.data(), INDEXP.data(), DIMS.data(), m, conn, 1);
+}
+
+CSR findAdjListCSR(const int* MASK, const int* INDEXP, const int* DIMS, int m, int conn)
+{
+    return findAdjListCSR(MASK, INDEXP, DIMS, m, conn, 1);
+}
+
+// Linear index offsets of the first conn stencil directions (DX, DY, DZ)
+static void stencilOffsets(const int* DIMS, int conn, int* OFF)
+{
+    for (int i = 0; i < conn; i++)
+    {
+        OFF[i] = xyz2index(DX[i], DY[i], DZ[i], DIMS);
+    }
+}
+
+// Write the in-mask neighbours of a voxel to IDS (in stencil order, as findNeighbours) and return
+// their number; IDS may be NULL to only count them. Voxels that are not on the border of the
+// volume have all their stencil neighbours inside it, so for those no bounds checks are needed.
+static inline int stencilNeighbours(const int* MASK, const int* DIMS, const int* OFF, int conn, int index, int* IDS)
+{
+    int x = index % DIMS[0];
+    int y = (index / DIMS[0]) % DIMS[1];
+    int z = index / (DIMS[0] * DIMS[1]);
+    int len = 0;
+
+    if (x > 0 && x < DIMS[0] - 1 && y > 0 && y < DIMS[1] - 1 && z > 0 && z < DIMS[2] - 1)
+    {
+        for (int i = 0; i < conn; i++)
+        {
+            int id = MASK[index + OFF[i]];
+            if (id != 0)
+            {
+                if (IDS) IDS[len] = id;
+                len++;
+            }
+        }
+    }
+    else
+    {
+        for (int i = 0; i < conn; i++)
+        {
+            if (xyz_check(x + DX[i], y + DY[i], z + DZ[i], index + OFF[i], DIMS, MASK))
+            {
+                if (IDS) IDS[len] = MASK[index + OFF[i]];
+                len++;
+            }
+        }
+    }
+    return len;
+}
+
+// Same as findAdjList, but written straight into CSR arrays. The neighbours are found through
+// precomputed linear stride offsets; a first pass counts them to size the arrays exactly and a
+// second pass fills them in. Both passes split the in-mask voxels into contiguous ranges (z-slabs
+// when INDEXP is in ascending order) that run on nthreads threads (nthreads <= 0: all hardware
+// threads). The result does not depend on nthreads.
+CSR findAdjListCSR(const int* MASK, const int* INDEXP, const int* DIMS, int m, int conn, int nthreads)
+{
+    if (conn < 0 || conn > 26) throw std::invalid_argument("'conn' must be at most 26");
+
+    ProfileScope prof("findAdjList", true);
+    prof.count("voxels", m);
+
+    int OFF[26];
+    stencilOffsets(DIMS, conn, OFF);
+
+    CSR ADJ;
+    ADJ.OFS.assign(m + 1, 0);
+    ProgressReporter* R = progressCurrent();
+    if (R) R->begin("findAdjList", 2 * static_cast<long long>(m));  // Two passes over the voxels
+
+    if (nthreads == 1)
+    {
+        ProgressTicker tick(R);
+        for (int i = 0; i < m; i++)
+        {
+            ADJ.OFS[i + 1] = ADJ.OFS[i] + stencilNeighbours(MASK, DIMS, OFF, conn, INDEXP[i], NULL);
+            tick();
+        }
+        ADJ.IDX.resize(ADJ.OFS[m]);
+        for (int i = 0; i < m; i++)
+        {
+            stencilNeighbours(MASK, DIMS, OFF, conn, INDEXP[i], ADJ.IDX.data() + ADJ.OFS[i]);
+            tick();
+        }
+        prof.count("edges", ADJ.IDX.size());
+        prof.count("bytes", sizeof(int) * (ADJ.OFS.size() + ADJ.IDX.size()));
+        return ADJ;
+    }
+
+    ThreadPool pool(nthreads);
+    int nchunks = std::min(m, 4 * pool.size());
+    int* OFS = ADJ.OFS.data();
+
+    // Pass 1: number of neighbours of voxel i in OFS[i+1]
+    for (int c = 0; c < nchunks; c++)
+    {
+        int first = static_cast<long long>(m) * c / nchunks;
+        int last = static_cast<long long>(m) * (c + 1) / nchunks;
+        pool.submit([=, &OFF]() {
+            ProgressTicker tick(R);
+            for (int i = first; i < last; i++)
+            {
+                OFS[i + 1] = stencilNeighbours(MASK, DIMS, OFF, conn, INDEXP[i], NULL);
+                tick();
+            }
+        });
+    }
+    pool.wait();
+
+    for (int i = 0; i < m; i++)
+    {
+        OFS[i + 1] += OFS[i];
+    }
+    ADJ.IDX.resize(OFS[m]);
+    int* IDX = ADJ.IDX.data();
+
+    // Pass 2: the neighbours themselves
+    for (int c = 0; c < nchunks; c++)
+    {
+        int first = static_cast<long long>(m) * c / nchunks;
+        int last = static_cast<long long>(m) * (c + 1) / nchunks;
+        pool.submit([=, &OFF]() {
+            ProgressTicker tick(R);
+            for (int i = first; i < last; i++)
+            {
+                stencilNeighbours(MASK, DIMS, OFF, conn, INDEXP[i], IDX + OFS[i]);
+                tick();
+            }
+        });
+    }
+    pool.wait();
+
+    prof.count("edges", ADJ.IDX.size());
+    prof.count("bytes", sizeof(int) * (ADJ.OFS.size() + ADJ.IDX.size()));
+    return ADJ;
+}
+
+// Neighbour lookup of the sweep in findClusters, read from the mask volume on the fly
+struct GridNeighbours
+{
+    const int* MASK;
+    const int* INDEXP;
+    const int* DIMS;
+    int conn;
+    int OFF[26];
+    int IDS[26];
+
+    GridNeighbours(const int* mask, const int* indexp, const int* dims, int c) : MASK(mask), INDEXP(indexp), DIMS(dims), conn(c)
+    {
+        stencilOffsets(DIMS, conn, OFF);
+    }
+    const int* operator() (int v, int& nids) { nids = stencilNeighbours(MASK, DIMS, OFF, conn, INDEXP[v], IDS); return IDS; }
+};
+
+// Same forest as findClusters(m, findAdjListCSR(MASK, INDEXP, DIMS, m, conn), ...), but the
+// neighbours of each node are looked up in the mask volume when the sweep reaches it, so the
+// adjacency list is never stored.
+void findClusters(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const int* ORD, const int* RANK,
+                  std::vector<int>& SIZE, std::vector<int>& ROOT, CSR& CHILD)
+{
+    findClusters(m, MASK, INDEXP, DIMS, conn, ORD, RANK, SIZE, ROOT, CHILD, 1);
+}
+
+void findClusters(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const int* ORD, const int* RANK,
+                  std::vector<int>& SIZE, std::vector<int>& ROOT, CSR& CHILD, int nthreads)
+{
+    if (conn < 0 || conn > 26) throw std::invalid_argument("'conn' must be at most 26");
+
+    ProfileScope prof("findClusters", true);
+    prof.count("voxels", m);
+
+    GridNeighbours NBRS(MASK, INDEXP, DIMS, conn);
+    sweepClusters(m, NBRS, ORD, RANK, SIZE, ROOT, CHILD, nthreads);
+}
+
 
 //-------------------------- NEWLY ADDED: (5) CHANGE CLUSTER SIZE --------------------------//
 
 // Find the index of the cluster that contains voxel v in cluster list ANS
 // Return -1 if no such cluster exists
-int findRep(int v, const std::vector<int>& SIZE, const std::vector<std::vector<int> >& ANS) {
+int findRep(int v, ArrayRef<int> SIZE, const std::vector<std::vector<int> >& ANS) {
     for (size_t i = 0; i < ANS.size(); ++i) {
         const std::vector<int>& CLUS = ANS[i];
         int irep = CLUS[CLUS.size() - 1];  // Representative of the cluster
@@ -717,7 +2262,7 @@ int findRep(int v, const std::vector<int>& SIZE, const std::vector<std::vector<i
 
 // Find the index of a cluster in a cluster list (with no duplicate elements)
 // Return -1 if no such index exists
-int findIndex(int irep, const std::vector<int>& ADMSTC, const std::vector<double>& TDP) {
+int findIndex(int irep, ArrayRef<int> ADMSTC, ArrayRef<double> TDP) {
     int left = 0;
     int right = static_cast<int>(ADMSTC.size()) - 1;  // Explicit cast for size()
     int low = left;
@@ -753,17 +2298,17 @@ int findIndex(int irep, const std::vector<int>& ADMSTC, const std::vector<double
 // std::vector<std::vector<int> > changeQuery(
 //     int ix,                                     // 1-based index of cluster in ANS
 //     double tdpchg,                              // Expected change in TDP
-//     const std::vector<int>& ADMSTC,             // Admissible vertices
+//     ArrayRef<int> ADMSTC,             // Admissible vertices
 //     std::vector<int>& SIZE,                     // Subtree sizes
 //     std::vector<int>& MARK,                     // Mark nodes
-//     const std::vector<double>& TDP,             // All TDP bounds
+//     ArrayRef<double> TDP,             // All TDP bounds
 //     std::vector< std::vector<int> >& CHILD,     // Children list
 //     const std::vector<std::vector<int> >& ANS   // Clusters
 // ) {
 //     std::vector<std::vector<int> > CHG;  // Initialize the output list of clusters
 
 //     // Get the cluster to process
-//     const std::vector<int>& CLUS = ANS[ix - 1];
+//     ArrayRef<int> CLUS = ANS[ix - 1];
 
 //     // Mark all nodes in the cluster
 //     for (size_t i = 0; i < CLUS.size(); ++i) {
@@ -815,26 +2360,106 @@ int findIndex(int irep, const std::vector<int>& ADMSTC, const std::vector<double
 std::vector<std::vector<int> > changeQuery(
     int v,                              // 0-based node index
     double tdpchg,                      // Used to specify an expected change in TDP. A positive value indicates increasing the TDP bound or reducing the current cluster size.
-    const std::vector<int>& ADMSTC,     // Admissible vertices (sorted by TDP)
+    ArrayRef<int> ADMSTC,     // Admissible vertices (sorted by TDP)
     std::vector<int>& SIZE,             // Subtree sizes for all nodes
-    std::vector<int>& MARK,             // Node markers, used to mark the nodes
-    const std::vector<double>& TDP,     // All TDP bounds
+    std::vector<int>& /* MARK */,       // Node markers, no longer used (kept for the py_changeQuery signature)
+    ArrayRef<double> TDP,     // All TDP bounds
     std::vector<std::vector<int> >& CHILD, // Children list for all vertices
     const std::vector<std::vector<int> >& ANS) // Cluster list, normally, the output of calling the function answerQuery()
 {
+    return changeQuery(v, tdpchg, ADMSTC, SIZE, TDP, CSR(CHILD), ANS);
+}
+
+std::vector<std::vector<int> > changeQuery(int v, double tdpchg, ArrayRef<int> ADMSTC, ArrayRef<int> SIZE,
+                                           ArrayRef<double> TDP, const CSRRef& CHILD,
+                                           const std::vector<std::vector<int> >& ANS)
+{
+    std::vector<int> ORDER, POS;
+    postOrder(SIZE, CHILD, ORDER, POS);
+    return changeQuery(v, tdpchg, ADMSTC, SIZE, TDP, ORDER, POS, ANS);
+}
+
+// Position of every node in ADMSTC (-1 for inadmissible nodes)
+std::vector<int> admissibleIndex(int m, ArrayRef<int> ADMSTC)
+{
+    std::vector<int> ADMIDX(m, -1);
+    for (size_t i = 0; i < ADMSTC.size(); i++) ADMIDX[ADMSTC[i]] = i;
+    return ADMIDX;
+}
+
+// Nearest admissible proper ancestor of every node, read from the post-order numbering: in reverse
+// post-order every node comes before its descendants, so a stack of the admissible nodes whose
+// subtree is still open holds the admissible ancestors of the current node
+static std::vector<int> admissibleParents(ArrayRef<int> ADMIDX, ArrayRef<int> SIZE,
+                                          ArrayRef<int> ORDER, ArrayRef<int> POS)
+{
+    int m = ORDER.size();
+    std::vector<int> ADMPAR(m, -1);
+    std::vector<int> STACK;
+
+    for (int p = m - 1; p >= 0; p--)
+    {
+        int v = ORDER[p];
+        while (!STACK.empty() && POS[STACK.back()] - SIZE[STACK.back()] >= p) STACK.pop_back();
+        if (!STACK.empty()) ADMPAR[v] = STACK.back();
+        if (ADMIDX[v] >= 0) STACK.push_back(v);
+    }
+
+    return ADMPAR;
+}
+
+// Find the index of the cluster that contains node v in ANS, whose clusters are whole subtrees with
+// their representative last (as returned by answerQuery); -1 if no such cluster exists.
+// Only the representatives are looked at: v lies in the subtree of a iff POS[v] falls in its range.
+static int findCluster(int v, ArrayRef<int> SIZE, ArrayRef<int> POS, const std::vector<std::vector<int> >& ANS)
+{
+    for (size_t i = 0; i < ANS.size(); i++)
+    {
+        if (ANS[i].empty()) continue;
+        int irep = ANS[i].back();
+        if (POS[irep] - SIZE[irep] < POS[v] && POS[v] <= POS[irep]) return i;
+    }
+    return -1;
+}
+
+// Same as above, with the subtrees read from the post-order numbering (see postOrder)
+std::vector<std::vector<int> > changeQuery(int v, double tdpchg, ArrayRef<int> ADMSTC, ArrayRef<int> SIZE,
+                                           ArrayRef<double> TDP,
+                                           ArrayRef<int> ORDER, ArrayRef<int> POS,
+                                           const std::vector<std::vector<int> >& ANS)
+{
+    std::vector<int> ADMIDX = admissibleIndex(SIZE.size(), ADMSTC);
+    std::vector<int> ADMPAR = admissibleParents(ADMIDX, SIZE, ORDER, POS);
+    return changeQuery(v, tdpchg, ADMSTC, ADMIDX, ADMPAR, SIZE, TDP, ORDER, POS, ANS);
+}
+
+// Same as above, for a prepared forest. Along a root path the admissible STCs have strictly
+// increasing TDP, so the cluster to grow into is the first admissible ancestor of the chosen one
+// that is far enough below its TDP, and the clusters to shrink into are the admissible nodes of its
+// subtree that are far enough above it while their admissible parent is not. Other clusters of ANS
+// are tested for containment through their representative only, and no node is marked.
+template <class TDPS>
+static std::vector<std::vector<int> > changeQueryImpl(int v, double tdpchg, ArrayRef<int> ADMSTC, ArrayRef<int> ADMIDX,
+                                                      ArrayRef<int> ADMPAR, ArrayRef<int> SIZE, const TDPS& TDP,
+                                                      ArrayRef<int> ORDER, ArrayRef<int> POS,
+                                                      const std::vector<std::vector<int> >& ANS)
+{
+    ProfileScope prof("changeQuery");
+    prof.count("clusters_in", ANS.size());
+
     // Initialise output: a list of clusters
-    std::list<std::vector<int> > CHG;
+    std::vector<std::vector<int> > CHG;
 
     // Check for v
     if (v < 0) throw std::invalid_argument("'v' should be non-negative");
 
     // Find the cluster that contains v
-    int iclus = findRep(v, SIZE, ANS);
+    int iclus = (v < static_cast<int>(POS.size())) ? findCluster(v, SIZE, POS, ANS) : -1;
     if (iclus < 0) throw std::invalid_argument("No cluster can be specified with 'v'");
-    const std::vector<int>& CLUS = ANS[iclus];
+    int irep = ANS[iclus].back();
 
     // Find the index of the cluster representative in ADMSTC
-    int idxv = findIndex(CLUS[CLUS.size() - 1], ADMSTC, TDP);
+    int idxv = ADMIDX[irep];
     if (idxv < 0) throw std::invalid_argument("The chosen cluster cannot be found in 'ADMSTC'");
 
     // Check the TDP change value
@@ -843,7 +2468,7 @@ std::vector<std::vector<int> > changeQuery(
     // Check for max(TDP), min(TDP) & curr(TDP)
     double maxtdp = TDP[ADMSTC[ADMSTC.size() - 1]];
     double mintdp = TDP[ADMSTC[0]];
-    double curtdp = TDP[CLUS[CLUS.size() - 1]];
+    double curtdp = TDP[irep];
 
     if ((tdpchg < 0 && mintdp == curtdp) || (tdpchg > 0 && maxtdp == curtdp)) {
         throw std::invalid_argument("No further changes can be attained");
@@ -857,97 +2482,69 @@ std::vector<std::vector<int> > changeQuery(
         throw std::invalid_argument("A further TDP augmentation cannot be achieved");
     }
 
-    // Mark all nodes within the cluster
-    for (int j = 0; j < CLUS.size(); j++) {
-        MARK[CLUS[j]] = 1;
-    }
-
     if (tdpchg < 0) {  // Increase size (OR decrease TDP) of the cluster
-        for (int i = idxv - 1; i >= 0; i--) {
-            if (TDP[ADMSTC[i]] >= 0 && TDP[ADMSTC[i]] - TDP[ADMSTC[idxv]] <= tdpchg && SIZE[ADMSTC[i]] > SIZE[ADMSTC[idxv]]) {
-                std::vector<int> DESC = descendants(ADMSTC[i], SIZE, CHILD);
-
-                int left = 0;
-                int right = DESC.size() - 1;
-                while (left <= right) {
-                    if (MARK[DESC[left]] > 0 || MARK[DESC[right]] > 0) {
-                        CHG.push_back(DESC);
-
-                        // Append remaining clusters to CHG
-                        int dfsz = DESC.size() - CLUS.size();
-                        for (int j = 0; j < ANS.size(); j++) {  // <<<<< UNTOUCHED LOOP
-                            if (j != iclus) {
-                                const std::vector<int>& CL = ANS[j];
-
-                                if (dfsz >= CL.size()) {
-                                    for (int k = 0; k < CL.size(); k++) {
-                                        MARK[CL[k]] = 2;
-                                    }
-
-                                    // Check if DESC contains CL
-                                    int l = 0;
-                                    int r = DESC.size() - 1;
-                                    while (r - l >= CL.size() - 1) {
-                                        if (MARK[DESC[l]] == 2 || MARK[DESC[r]] == 2) {
-                                            dfsz = dfsz - CL.size();
-                                            break;
-                                        }
-                                        l++;
-                                        r--;
-                                    }
-
-                                    // Append CL to CHG if DESC does not contain CL
-                                    if (l > DESC.size() - 1 || r < 0 || (MARK[DESC[l]] != 2 && MARK[DESC[r]] != 2)) {
-                                        CHG.push_back(CL);
-                                    }
-
-                                    for (int k = 0; k < CL.size(); k++) {
-                                        MARK[CL[k]] = 0;
-                                    }
-                                } else {
-                                    CHG.push_back(CL);
-                                }
-                            }
-                        }
-
-                        // Clear marks back to 0
-                        for (int j = 0; j < CLUS.size(); j++) {
-                            MARK[CLUS[j]] = 0;
-                        }
-
-                        return std::vector<std::vector<int> >(CHG.begin(), CHG.end());
-                    }
-                    left++;
-                    right--;
+        for (int a = ADMPAR[irep]; a >= 0; a = ADMPAR[a]) {
+            if (TDP[a] >= 0 && TDP[a] - curtdp <= tdpchg) {
+                int lo = POS[a] - SIZE[a];
+                CHG.push_back(std::vector<int>(ORDER.begin() + lo + 1, ORDER.begin() + POS[a] + 1));
+
+                // Append the remaining clusters that are not part of the enlarged one
+                for (size_t j = 0; j < ANS.size(); j++) {
+                    if (static_cast<int>(j) == iclus) continue;
+                    int jrep = ANS[j].empty() ? -1 : ANS[j].back();
+                    if (jrep < 0 || POS[jrep] <= lo || POS[jrep] > POS[a]) CHG.push_back(ANS[j]);
                 }
+                break;
             }
         }
     } else {  // Decrease size (OR increase TDP) of the cluster
-        for (int i = idxv + 1; i < ADMSTC.size(); i++) {
-            if (TDP[ADMSTC[i]] >= 0 && TDP[ADMSTC[i]] - TDP[ADMSTC[idxv]] >= tdpchg && MARK[ADMSTC[i]] == 1) {
-                std::vector<int> DESC = descendants(ADMSTC[i], SIZE, CHILD);
-                CHG.push_back(DESC);
-
-                for (int j = 0; j < DESC.size(); j++) {
-                    MARK[DESC[j]] = 2;
-                }
+        // Walk the proper descendants of irep in reverse post-order (ancestors first). Below a qualifying
+        // node every admissible descendant has an admissible parent that qualifies too, so its whole
+        // subtree is skipped at once
+        std::vector<int> DOWN;
+        int lo = POS[irep] - SIZE[irep];
+        for (int p = POS[irep] - 1; p > lo; p--) {
+            int a = ORDER[p];
+            if (ADMIDX[a] < 0) continue;
+            if (TDP[a] >= 0 && TDP[a] - curtdp >= tdpchg && !(TDP[ADMPAR[a]] - curtdp >= tdpchg)) {
+                DOWN.push_back(a);
+                p = POS[a] - SIZE[a] + 1;
             }
         }
 
+        // Report the smaller clusters in ADMSTC order
+        std::sort(DOWN.begin(), DOWN.end(), [&ADMIDX](int a, int b) { return ADMIDX[a] < ADMIDX[b]; });
+        for (size_t i = 0; i < DOWN.size(); i++) {
+            const int* DESC = ORDER.data() + POS[DOWN[i]] - SIZE[DOWN[i]] + 1;
+            CHG.push_back(std::vector<int>(DESC, DESC + SIZE[DOWN[i]]));
+        }
+
         // Append remaining clusters to CHG
-        for (int j = 0; j < ANS.size(); j++) {  // <<<<< UNTOUCHED LOOP
-            if (j != iclus) {
+        for (size_t j = 0; j < ANS.size(); j++) {
+            if (static_cast<int>(j) != iclus) {
                 CHG.push_back(ANS[j]);
             }
         }
     }
 
-    // Clear marks back to 0
-    for (int j = 0; j < CLUS.size(); j++) {
-        MARK[CLUS[j]] = 0;
-    }
+    prof.count("clusters_out", CHG.size());
+    return CHG;
+}
+
+std::vector<std::vector<int> > changeQuery(int v, double tdpchg, ArrayRef<int> ADMSTC, ArrayRef<int> ADMIDX,
+                                           ArrayRef<int> ADMPAR, ArrayRef<int> SIZE, ArrayRef<double> TDP,
+                                           ArrayRef<int> ORDER, ArrayRef<int> POS,
+                                           const std::vector<std::vector<int> >& ANS)
+{
+    return changeQueryImpl(v, tdpchg, ADMSTC, ADMIDX, ADMPAR, SIZE, TDP, ORDER, POS, ANS);
+}
 
-    return std::vector<std::vector<int> >(CHG.begin(), CHG.end());
+std::vector<std::vector<int> > changeQuery(int v, double tdpchg, ArrayRef<int> ADMSTC, ArrayRef<int> ADMIDX,
+                                           ArrayRef<int> ADMPAR, ArrayRef<int> SIZE, const CountTDP& TDP,
+                                           ArrayRef<int> ORDER, ArrayRef<int> POS,
+                                           const std::vector<std::vector<int> >& ANS)
+{
+    return changeQueryImpl(v, tdpchg, ADMSTC, ADMIDX, ADMPAR, SIZE, TDP, ORDER, POS, ANS);
 }
 
 // Find all local minima (leaves of the constructed forest)
@@ -961,3 +2558,30 @@ std::vector<int> findLMS(const std::vector<std::vector<int> >& CHILD) {
     return LMS;
 }
 
+std::vector<int> findLMS(const CSRRef& CHILD) {
+    ProfileScope prof("findLMS");
+    prof.count("voxels", CHILD.rows());
+    std::vector<int> LMS;
+    for (int i = 0; i < CHILD.rows(); i++) {
+        if (CHILD.degree(i) == 0) {
+            LMS.push_back(i);
+        }
+    }
+    return LMS;
+}
+
+// Local minima in ascending order of p, i.e. in the sorting order ORD (1-based) the forest was
+// built with, or in order of node id if ORD is NULL; at most topk of them (all if topk < 0)
+void findLMS(const CSRRef& CHILD, const int* ORD, int topk, std::vector<int>& LMS) {
+    ProfileScope prof("findLMS");
+    LMS.clear();
+    int m = CHILD.rows();
+    for (int i = 0; i < m && topk != static_cast<int>(LMS.size()); i++) {
+        int v = (ORD != NULL) ? ORD[i] - 1 : i;
+        if (CHILD.degree(v) == 0) {
+            LMS.push_back(v);
+        }
+        prof.count("voxels", 1);
+    }
+}
+
@@ -3,18 +3,138 @@
 
 #include <vector>
 #include <stack>
+#include <cstddef>
+
+// Read-only view of a contiguous array: a std::vector, or memory owned elsewhere such as a section
+// of a mapped index file (see ARISession::loadIndex). The functions below take their input arrays
+// as views, so they run on either without a copy; a std::vector converts implicitly.
+template <class T>
+class ArrayRef
+{
+public:
+    ArrayRef() : PTR(NULL), N(0) {}
+    ArrayRef(const std::vector<T>& V) : PTR(V.data()), N(V.size()) {}
+    ArrayRef(const T* PTR, size_t N) : PTR(PTR), N(N) {}
+
+    const T& operator[](size_t i) const { return PTR[i]; }
+    size_t size() const { return N; }
+    bool empty() const { return N == 0; }
+    const T* data() const { return PTR; }
+    const T* begin() const { return PTR; }
+    const T* end() const { return PTR + N; }
+    const T& front() const { return PTR[0]; }
+    const T& back() const { return PTR[N - 1]; }
+
+private:
+    const T* PTR;
+    size_t N;
+};
+
+// Compressed sparse row (CSR) storage of a list of integer rows, used for the adjacency
+// list (ADJ) and the children list (CHILD) of the forest: row i consists of
+// IDX[OFS[i]], ..., IDX[OFS[i+1]-1]. All rows share one allocation, so the traversals
+// below walk contiguous memory instead of chasing one heap block per node.
+struct CSR
+{
+    std::vector<int> OFS;  // Row offsets (number of rows + 1 entries, OFS[0] = 0)
+    std::vector<int> IDX;  // Concatenated rows
+
+    CSR() : OFS(1, 0) {}
+    explicit CSR(const std::vector< std::vector<int> >& ROWS);
+
+    int rows() const { return static_cast<int>(OFS.size()) - 1; }
+    int degree(int i) const { return OFS[i + 1] - OFS[i]; }
+    const int* begin(int i) const { return IDX.data() + OFS[i]; }
+    const int* end(int i) const { return IDX.data() + OFS[i + 1]; }
+
+    // Convert back to one vector per row
+    std::vector< std::vector<int> > toRows() const;
+};
+
+// Read-only view of a CSR (see ArrayRef), taken by the functions below; a CSR converts implicitly
+struct CSRRef
+{
+    ArrayRef<int> OFS;
+    ArrayRef<int> IDX;
+
+    CSRRef(const CSR& C) : OFS(C.OFS), IDX(C.IDX) {}
+    CSRRef(ArrayRef<int> OFS, ArrayRef<int> IDX) : OFS(OFS), IDX(IDX) {}
+
+    int rows() const { return static_cast<int>(OFS.size()) - 1; }
+    int degree(int i) const { return OFS[i + 1] - OFS[i]; }
+    const int* begin(int i) const { return IDX.data() + OFS[i]; }
+    const int* end(int i) const { return IDX.data() + OFS[i + 1]; }
+
+    std::vector< std::vector<int> > toRows() const;
+};
+
+// TDP bounds kept as numbers of discoveries (the compact mode of ARISession): the bound of node v
+// is NUM[v] / SIZE[v], the same double that forestTDP computes, or -1 for an invalid STC
+// (NUM[v] < 0). The query functions below take either this or the m doubles of forestTDP.
+struct CountTDP
+{
+    const int* NUM;
+    const int* SIZE;
+
+    CountTDP(const int* NUM, const int* SIZE) : NUM(NUM), SIZE(SIZE) {}
+
+    double operator[](int v) const
+    {
+        return NUM[v] < 0 ? -1.0 : static_cast<double>(NUM[v]) / static_cast<double>(SIZE[v]);
+    }
+};
+
+// Discoveries of every node for the TDP bounds of forestTDP (see CountTDP); throws
+// std::invalid_argument if TDP does not hold such bounds
+void countTDP(ArrayRef<double> TDP, ArrayRef<int> SIZE, std::vector<int>& NUM);
+// ... and back
+void expandTDP(ArrayRef<int> NUM, ArrayRef<int> SIZE, std::vector<double>& TDP);
 
 std::vector<int> descendants(int v, std::vector<int>& SIZE, std::vector< std::vector<int> >& CHILD);
+std::vector<int> descendants(int v, ArrayRef<int> SIZE, const CSRRef& CHILD);
+
+// Post-order numbering of the forest: the subtree of v is ORDER[POS[v]-SIZE[v]+1], ..., ORDER[POS[v]]
+void postOrder(ArrayRef<int> SIZE, const CSRRef& CHILD, std::vector<int>& ORDER, std::vector<int>& POS);
+std::vector<int> subtree(int v, ArrayRef<int> SIZE, ArrayRef<int> ORDER, ArrayRef<int> POS);
 
 void heavyPathTDP(int v, int par, int m, int h, double alpha, double simesh, std::vector<double>& P, std::vector<int>& SIZE, std::vector< std::vector<int> >& CHILD, std::vector<double>& TDP);
+void heavyPathTDP(int v, int par, int m, int h, double alpha, double simesh, const double* P, std::vector<int>& SIZE, std::vector< std::vector<int> >& CHILD, std::vector<double>& TDP);
+void heavyPathTDP(int v, int par, int m, int h, double alpha, double simesh, const double* P, ArrayRef<int> SIZE, const CSRRef& CHILD, std::vector<double>& TDP);
 std::vector<double> forestTDP(int m, int h, double alpha, double simesh, std::vector<double>& P, std::vector<int>& SIZE, std::vector<int>& ROOT, std::vector< std::vector<int> >& CHILD);
+std::vector<double> forestTDP(int m, int h, double alpha, double simesh, const double* P, std::vector<int>& SIZE, std::vector<int>& ROOT, std::vector< std::vector<int> >& CHILD);
+std::vector<double> forestTDP(int m, int h, double alpha, double simesh, const double* P, ArrayRef<int> SIZE, ArrayRef<int> ROOT, const CSRRef& CHILD);
+// Same, with the heavy paths spread over nthreads threads (nthreads <= 0: all hardware threads)
+std::vector<double> forestTDP(int m, int h, double alpha, double simesh, const double* P, ArrayRef<int> SIZE, ArrayRef<int> ROOT, const CSRRef& CHILD, int nthreads);
+// Several alphas in one pass: column k of the returned m x ALPHA.size() matrix (column-major) holds the bounds for ALPHA[k]
+std::vector<double> forestTDP(int m, ArrayRef<int> H, ArrayRef<double> ALPHA, ArrayRef<double> SIMESH, const double* P,
+                              ArrayRef<int> SIZE, ArrayRef<int> ROOT, const CSRRef& CHILD, int nthreads);
 std::vector<std::vector<int> > findClusters(int m, std::vector< std::vector<int> >& ADJ, std::vector<int>& ORD, std::vector<int>& RANK);
+std::vector<std::vector<int> > findClusters(int m, std::vector< std::vector<int> >& ADJ, const int* ORD, const int* RANK);
+// CSR variant: fills SIZE, ROOT & CHILD instead of packing them into one list
+void findClusters(int m, const CSRRef& ADJ, const int* ORD, const int* RANK, std::vector<int>& SIZE, std::vector<int>& ROOT, CSR& CHILD);
+// Grid variant: the neighbours are read from the mask volume (as in findAdjList) during the sweep
+void findClusters(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const int* ORD, const int* RANK,
+                  std::vector<int>& SIZE, std::vector<int>& ROOT, CSR& CHILD);
+// Same, with the sweep spread over nthreads threads (nthreads <= 0: all hardware threads); the forest does not depend on it
+void findClusters(int m, const CSRRef& ADJ, const int* ORD, const int* RANK, std::vector<int>& SIZE, std::vector<int>& ROOT, CSR& CHILD, int nthreads);
+void findClusters(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const int* ORD, const int* RANK,
+                  std::vector<int>& SIZE, std::vector<int>& ROOT, CSR& CHILD, int nthreads);
 std::vector<int> queryPreparation(int m, std::vector<int>& ROOT, std::vector<double>& TDP, std::vector< std::vector<int> >& CHILD);
-int findLeft(double gamma, std::vector<int>& ADMSTC, std::vector<double>& TDP);
+std::vector<int> queryPreparation(int m, ArrayRef<int> ROOT, ArrayRef<double> TDP, const CSRRef& CHILD);
+std::vector<int> queryPreparation(int m, ArrayRef<int> ROOT, const CountTDP& TDP, const CSRRef& CHILD);
+// Nearest admissible proper ancestor of every node (-1 if none)
+std::vector<int> findAdmissibleParents(int m, ArrayRef<int> ROOT, ArrayRef<double> TDP, const CSRRef& CHILD);
+std::vector<int> findAdmissibleParents(int m, ArrayRef<int> ROOT, const CountTDP& TDP, const CSRRef& CHILD);
+// Position of every node in ADMSTC (-1 for inadmissible nodes)
+std::vector<int> admissibleIndex(int m, ArrayRef<int> ADMSTC);
+int findLeft(double gamma, ArrayRef<int> ADMSTC, ArrayRef<double> TDP);
+int findLeft(double gamma, ArrayRef<int> ADMSTC, const CountTDP& TDP);
 
 std::vector< std::vector<int> > answerQuery(double gamma, std::vector<int>& ADMSTC, std::vector<int>& SIZE, std::vector<int>& MARK, std::vector<double>& TDP, std::vector< std::vector<int> >& CHILD);
+std::vector< std::vector<int> > answerQuery(double gamma, ArrayRef<int> ADMSTC, ArrayRef<int> SIZE, std::vector<int>& MARK, ArrayRef<double> TDP, const CSRRef& CHILD);
 
 std::vector< std::vector< std::vector<int> > > answerQueryBatch(std::vector<double>& gamma_batch, std::vector<int>& ADMSTC, std::vector<int>& SIZE, std::vector<int>& MARK, std::vector<double>& TDP, std::vector< std::vector<int> >& CHILD);
+std::vector< std::vector< std::vector<int> > > answerQueryBatch(ArrayRef<double> gamma_batch, ArrayRef<int> ADMSTC, ArrayRef<int> SIZE, std::vector<int>& MARK, ArrayRef<double> TDP, const CSRRef& CHILD);
 
 // std::vector< std::vector< std::vector<int> > > answerQueryBatch_opt(
 //     std::vector<double>& gamma_batch, std::vector<int>& ADMSTC, 
@@ -26,43 +146,138 @@ std::vector< std::vector< std::vector<int> > > answerQueryBatch(std::vector<doub
 //     std::vector<int>& MARK, std::vector<double>& TDP, std::vector<std::vector<int> >& CHILD, 
 //     size_t chunk_size);
 
+// Batch query returning only cluster representatives: REPS[OFFSETS[i]..OFFSETS[i+1]-1] for gamma_batch[i]
+void answerQueryBatchReps(ArrayRef<double> gamma_batch, ArrayRef<int> ADMSTC, ArrayRef<int> ADMPAR, ArrayRef<double> TDP, std::vector<int>& REPS, std::vector<int>& OFFSETS);
+void answerQueryBatchReps(ArrayRef<double> gamma_batch, ArrayRef<int> ADMSTC, ArrayRef<int> ADMPAR, const CountTDP& TDP, std::vector<int>& REPS, std::vector<int>& OFFSETS);
+// Same, pruned: clusters of fewer than min_size voxels are left out, and of the others only the
+// top_k largest are kept per gamma (all if top_k < 0; ties at the cut go to the earlier ones), in
+// the order of the unpruned answer
+void answerQueryBatchReps(ArrayRef<double> gamma_batch, ArrayRef<int> ADMSTC, ArrayRef<int> ADMPAR, ArrayRef<double> TDP,
+                          ArrayRef<int> SIZE, int min_size, int top_k, std::vector<int>& REPS, std::vector<int>& OFFSETS);
+void answerQueryBatchReps(ArrayRef<double> gamma_batch, ArrayRef<int> ADMSTC, ArrayRef<int> ADMPAR, const CountTDP& TDP,
+                          ArrayRef<int> SIZE, int min_size, int top_k, std::vector<int>& REPS, std::vector<int>& OFFSETS);
+// Admissible children of every node (the nodes a with ADMPAR[a] = v, in ADMSTC order)
+CSR admissibleChildren(int m, ArrayRef<int> ADMSTC, ArrayRef<int> ADMPAR);
+// Jump pointers over the admissible parents, for containingCluster (-1 for inadmissible nodes)
+std::vector<int> admissibleJumps(int m, ArrayRef<int> ADMSTC, ArrayRef<int> ADMPAR);
+// Representative of the cluster at gamma that contains node v (-1 if v lies in none), as found
+// among the clusters of answerQuery, in O(log depth) without answering the query
+int containingCluster(int v, double gamma, ArrayRef<int> ADMIDX, ArrayRef<int> ADMPAR,
+                      ArrayRef<int> ADMJUMP, ArrayRef<double> TDP);
+int containingCluster(int v, double gamma, ArrayRef<int> ADMIDX, ArrayRef<int> ADMPAR,
+                      ArrayRef<int> ADMJUMP, const CountTDP& TDP);
+// Representatives of the clusters that appear (ADDED) and disappear (REMOVED) when gamma moves from gamma0 to gamma1
+void answerQueryDelta(double gamma0, double gamma1, ArrayRef<int> ADMSTC, ArrayRef<int> ADMIDX, ArrayRef<int> ADMPAR,
+                      const CSRRef& ADMCHILD, ArrayRef<double> TDP, std::vector<int>& ADDED, std::vector<int>& REMOVED);
+void answerQueryDelta(double gamma0, double gamma1, ArrayRef<int> ADMSTC, ArrayRef<int> ADMIDX, ArrayRef<int> ADMPAR,
+                      const CSRRef& ADMCHILD, const CountTDP& TDP, std::vector<int>& ADDED, std::vector<int>& REMOVED);
+// LABEL[v] = k+1 for the voxels v of the cluster represented by REPS[k]
+void labelClusters(const int* REPS, int nreps, ArrayRef<int> SIZE, ArrayRef<int> ORDER, ArrayRef<int> POS, int* LABEL);
+// Same, with the labels written to LABEL[INDEXP[v]] in a volume of nvox voxels
+void labelClusters(const int* REPS, int nreps, ArrayRef<int> SIZE, ArrayRef<int> ORDER, ArrayRef<int> POS,
+                   const int* INDEXP, int* LABEL, int nvox);
+// Representatives of the supra-threshold clusters formed by the first k nodes of ORD (1-based), largest first
+void thresholdClusters(int k, const int* ORD, ArrayRef<int> SIZE, const CSRRef& CHILD, std::vector<int>& MARK, std::vector<int>& REPS);
+void thresholdClusters(int k, const int* ORD, ArrayRef<int> SIZE, const CSRRef& CHILD, std::vector<bool>& MARK, std::vector<int>& REPS);
+
+// Summary table of a list of clusters, one entry per cluster (coordinates as in index2xyz)
+struct ClusterTable
+{
+    std::vector<int> SIZE;          // Number of voxels
+    std::vector<double> TDP;        // TDP bound
+    std::vector<double> PEAK;       // Largest statistic
+    std::vector<int> PEAKID;        // Node id of the peak voxel (the smaller id on ties)
+    std::vector<int> PEAKXYZ;       // xyz of the peak voxel, 3 per cluster
+    std::vector<int> LABEL;         // Atlas label at the peak voxel (0 without atlas)
+};
+// Summarise the clusters represented by REPS; STAT and ATLAS (may be NULL) are volumes addressed through INDEXP
+void clusterSummary(const int* REPS, int nreps, ArrayRef<int> SIZE, ArrayRef<int> ORDER, ArrayRef<int> POS,
+                    ArrayRef<double> TDP, const int* INDEXP, const int* DIMS, const double* STAT, const int* ATLAS,
+                    ClusterTable& TBL, int nthreads);
+void clusterSummary(const int* REPS, int nreps, ArrayRef<int> SIZE, ArrayRef<int> ORDER, ArrayRef<int> POS,
+                    const CountTDP& TDP, const int* INDEXP, const int* DIMS, const double* STAT, const int* ATLAS,
+                    ClusterTable& TBL, int nthreads);
+
+// Largest gamma at which each voxel lies in a cluster, written to GRADMAP[INDEXP[v]] (nvox = size of GRADMAP)
+void gradientMap(ArrayRef<double> gamma_batch, ArrayRef<int> ROOT, ArrayRef<double> TDP, const CSRRef& CHILD, const int* INDEXP, float* GRADMAP, int nvox);
+void gradientMap(ArrayRef<double> gamma_batch, ArrayRef<int> ROOT, const CountTDP& TDP, const CSRRef& CHILD, const int* INDEXP, float* GRADMAP, int nvox);
+// Same, counting only clusters of at least min_size voxels
+void gradientMap(ArrayRef<double> gamma_batch, ArrayRef<int> ROOT, ArrayRef<double> TDP, const CSRRef& CHILD,
+                 ArrayRef<int> SIZE, int min_size, const int* INDEXP, float* GRADMAP, int nvox);
+void gradientMap(ArrayRef<double> gamma_batch, ArrayRef<int> ROOT, const CountTDP& TDP, const CSRRef& CHILD,
+                 ArrayRef<int> SIZE, int min_size, const int* INDEXP, float* GRADMAP, int nvox);
+// Same, for the clusters of answered (e.g. top_k-pruned) queries: REPS and OFFSETS as returned by answerQueryBatchReps
+void gradientMap(ArrayRef<double> gamma_batch, ArrayRef<int> REPS, ArrayRef<int> OFFSETS,
+                 ArrayRef<int> SIZE, ArrayRef<int> ORDER, ArrayRef<int> POS,
+                 const int* INDEXP, float* GRADMAP, int nvox);
+
 std::vector<int> counting_sort(int n, int maxid, std::vector<int>& CLSTRSIZE);
 
 std::vector<int> index2xyz(int index, std::vector<int>& DIMS);
+std::vector<int> index2xyz(int index, const int* DIMS);
 std::vector<std::vector<int> > ids2xyz(std::vector<int>& IDS, std::vector<int>& DIMS);
+void ids2xyz(const int* IDS, int n, const int* DIMS, int* XYZ);  // XYZ holds n rows of 3
 bool xyz_check(int x, int y, int z, int index, std::vector<int>& DIMS, std::vector<int>& MASK);
+bool xyz_check(int x, int y, int z, int index, const int* DIMS, const int* MASK);
 std::vector<int> findNeighbours(std::vector<int>& MASK, std::vector<int>& DIMS, int index, int conn);
+std::vector<int> findNeighbours(const int* MASK, const int* DIMS, int index, int conn);
 std::vector<std::vector<int> > findAdjList(std::vector<int>& MASK, std::vector<int>& INDEXP, std::vector<int>& DIMS, int m, int conn);
+// Pointer-based variants, used by the zero-copy NumPy entry points
+std::vector<std::vector<int> > findAdjList(const int* MASK, const int* INDEXP, const int* DIMS, int m, int conn);
+// CSR variants of findAdjList
+CSR findAdjListCSR(std::vector<int>& MASK, std::vector<int>& INDEXP, std::vector<int>& DIMS, int m, int conn);
+CSR findAdjListCSR(const int* MASK, const int* INDEXP, const int* DIMS, int m, int conn);
+CSR findAdjListCSR(const int* MASK, const int* INDEXP, const int* DIMS, int m, int conn, int nthreads);
 
-std::vector<int> findDiscoveries_one_based(const std::vector<int>& idx, const std::vector<double>& allp, double simesfactor, int h, double alpha, int k, int m);
-int findConcentration_one_based(const std::vector<double>& p, double simesfactor, int h, double alpha, int m);
+std::vector<int> findDiscoveries_one_based(ArrayRef<int> idx, ArrayRef<double> allp, double simesfactor, int h, double alpha, int k, int m);
+int findConcentration_one_based(ArrayRef<double> p, double simesfactor, int h, double alpha, int m);
 
 
-// int findIndex(int irep, const std::vector<int>& ADMSTC, const std::vector<double>& TDP);
+// int findIndex(int irep, ArrayRef<int> ADMSTC, ArrayRef<double> TDP);
 // std::vector<std::vector<int> > changeQuery(
-//     int ix, double tdpchg, const std::vector<int>& ADMSTC, std::vector<int>& SIZE,
-//     std::vector<int>& MARK, const std::vector<double>& TDP, 
+//     int ix, double tdpchg, ArrayRef<int> ADMSTC, std::vector<int>& SIZE,
+//     std::vector<int>& MARK, ArrayRef<double> TDP, 
 //     std::vector<std::vector<int> >& CHILD, const std::vector<std::vector<int> >& ANS);
 
 // Find the index of the cluster that contains voxel v in the cluster list ANS
-int findRep(int v, const std::vector<int>& SIZE, const std::vector<std::vector<int> >& ANS);
+int findRep(int v, ArrayRef<int> SIZE, const std::vector<std::vector<int> >& ANS);
 
 // Find the index of a cluster in a cluster list (with no duplicate elements)
 // Returns -1 if no such index exists
-int findIndex(int irep, const std::vector<int>& ADMSTC, const std::vector<double>& TDP);
+int findIndex(int irep, ArrayRef<int> ADMSTC, ArrayRef<double> TDP);
 
 // Change the query, i.e., enlarge or shrink the chosen cluster
 std::vector<std::vector<int> > changeQuery(
     int v,                             // 0-based node index
     double tdpchg,                     // Expected change in TDP
-    const std::vector<int>& ADMSTC,    // Admissible vertices
+    ArrayRef<int> ADMSTC,    // Admissible vertices
     std::vector<int>& SIZE,            // Subtree sizes
-    std::vector<int>& MARK,            // Mark nodes
-    const std::vector<double>& TDP,    // TDP bounds
+    std::vector<int>& MARK,            // Mark nodes (unused)
+    ArrayRef<double> TDP,    // TDP bounds
     std::vector<std::vector<int> >& CHILD, // Children list
     const std::vector<std::vector<int> >& ANS // Clusters
 );
+std::vector<std::vector<int> > changeQuery(int v, double tdpchg, ArrayRef<int> ADMSTC, ArrayRef<int> SIZE,
+                                           ArrayRef<double> TDP, const CSRRef& CHILD,
+                                           const std::vector<std::vector<int> >& ANS);
+std::vector<std::vector<int> > changeQuery(int v, double tdpchg, ArrayRef<int> ADMSTC, ArrayRef<int> SIZE,
+                                           ArrayRef<double> TDP,
+                                           ArrayRef<int> ORDER, ArrayRef<int> POS,
+                                           const std::vector<std::vector<int> >& ANS);
+// Same, for a prepared forest: ADMIDX comes from admissibleIndex and ADMPAR from findAdmissibleParents.
+// The clusters of ANS must be whole subtrees with their representative last (as returned by answerQuery).
+// Runs in O(|ANS| + SIZE of the chosen cluster + depth) plus the size of the output, without marking any node.
+std::vector<std::vector<int> > changeQuery(int v, double tdpchg, ArrayRef<int> ADMSTC, ArrayRef<int> ADMIDX,
+                                           ArrayRef<int> ADMPAR, ArrayRef<int> SIZE, ArrayRef<double> TDP,
+                                           ArrayRef<int> ORDER, ArrayRef<int> POS,
+                                           const std::vector<std::vector<int> >& ANS);
+std::vector<std::vector<int> > changeQuery(int v, double tdpchg, ArrayRef<int> ADMSTC, ArrayRef<int> ADMIDX,
+                                           ArrayRef<int> ADMPAR, ArrayRef<int> SIZE, const CountTDP& TDP,
+                                           ArrayRef<int> ORDER, ArrayRef<int> POS,
+                                           const std::vector<std::vector<int> >& ANS);
 
 std::vector<int> findLMS(const std::vector<std::vector<int> >& CHILD);
+std::vector<int> findLMS(const CSRRef& CHILD);
+void findLMS(const CSRRef& CHILD, const int* ORD, int topk, std::vector<int>& LMS);  // ascending p (ORD 1-based, may be NULL), at most topk
 
 #endif // ARICLUSTER_H
\ No newline at end of file
@@ -0,0 +1,1109 @@
+
+/**
+ * @file ARISession.cpp
+ * @brief Implements ARISession, a persistent handle on the STC forest. The member
+ *        functions forward to the free functions in ARICluster.cpp, passing the
+ *        stored forest so that callers only supply the query parameters.
+ *
+ * The session can also be written to and read back from an index file, so that a map that was
+ * analysed before does not have to go through the whole pipeline again. The file holds a header,
+ * a table of sections and the arrays themselves in their in-memory layout (native byte order),
+ * each starting at a multiple of 64 bytes:
+ *
+ *   header   magic "ARIINDEX", uint32 version, uint32 number of sections, char key[64], int64 m
+ *   table    per section: uint32 id, uint32 element size, int64 element count, int64 file offset
+ *   data     the sections, in the order of the table
+ *
+ * Loading therefore maps the file read-only and points the session's arrays at their sections,
+ * without reading or parsing any of them (see loadIndex); the derived admissible structures are
+ * stored as well, so that nothing has to be rebuilt either. Bump INDEX_VERSION whenever the
+ * sections or their meaning change.
+ */
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <utility>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+#include <cmath>
+#include <thread>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "ARISession.h"
+#include "hommel.h"
+#include "ThreadPool.h"
+#include "Profile.h"
+#include "Progress.h"
+
+static const char INDEX_MAGIC[8] = {'A', 'R', 'I', 'I', 'N', 'D', 'E', 'X'};
+static const uint32_t INDEX_VERSION = 2;
+static const int64_t INDEX_ALIGN = 64;
+
+// Sections of the index file, in file order
+enum IndexSection
+{
+    SEC_ORD, SEC_RANK, SEC_SIZE, SEC_ROOT, SEC_CHILD_OFS, SEC_CHILD_IDX, SEC_ORDER, SEC_POS,
+    SEC_TDP, SEC_ADMSTC, SEC_ADMPAR, SEC_ADMIDX, SEC_ADMCHILD_OFS, SEC_ADMCHILD_IDX, SEC_ADMJUMP,
+    SEC_INDEXP, SEC_JUMPALPHA, SEC_SIMESFACTOR, NUM_SECTIONS
+};
+
+struct IndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nsections;
+    char key[64];
+    int64_t m;
+};
+
+struct IndexEntry
+{
+    uint32_t id;
+    uint32_t elemsize;
+    int64_t count;
+    int64_t offset;
+};
+
+// An index file mapped read-only into memory, unmapped when the last session viewing it goes
+class IndexFile
+{
+public:
+    IndexFile() : DATA(NULL), SIZE(0)
+    {
+#ifdef _WIN32
+        FILEHANDLE = INVALID_HANDLE_VALUE;
+        MAPHANDLE = NULL;
+#endif
+    }
+
+    ~IndexFile()
+    {
+#ifdef _WIN32
+        if (DATA) UnmapViewOfFile(DATA);
+        if (MAPHANDLE) CloseHandle(MAPHANDLE);
+        if (FILEHANDLE != INVALID_HANDLE_VALUE) CloseHandle(FILEHANDLE);
+#else
+        if (DATA) munmap(const_cast<char*>(DATA), SIZE);
+#endif
+    }
+
+    // Maps the file at path; returns false if it cannot be opened or is empty
+    bool open(const std::string& path)
+    {
+#ifdef _WIN32
+        FILEHANDLE = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (FILEHANDLE == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(FILEHANDLE, &size) || size.QuadPart == 0) return false;
+        MAPHANDLE = CreateFileMappingA(FILEHANDLE, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!MAPHANDLE) throw std::runtime_error("cannot map index file '" + path + "'");
+        DATA = static_cast<const char*>(MapViewOfFile(MAPHANDLE, FILE_MAP_READ, 0, 0, 0));
+        if (!DATA) throw std::runtime_error("cannot map index file '" + path + "'");
+        SIZE = size.QuadPart;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);  // The mapping keeps the file open
+        if (data == MAP_FAILED) throw std::runtime_error("cannot map index file '" + path + "'");
+        DATA = static_cast<const char*>(data);
+        SIZE = st.st_size;
+#endif
+        return true;
+    }
+
+    const char* data() const { return DATA; }
+    int64_t size() const { return SIZE; }
+
+private:
+    IndexFile(const IndexFile&);
+    IndexFile& operator=(const IndexFile&);
+
+    const char* DATA;
+    int64_t SIZE;
+#ifdef _WIN32
+    HANDLE FILEHANDLE;
+    HANDLE MAPHANDLE;
+#endif
+};
+
+ARISession::ARISession() : m(0), ACTIVE(0), QGAMMA(std::numeric_limits<double>::infinity()), COMPACT(false)
+{
+}
+
+void ARISession::findClusters(int m, std::vector< std::vector<int> >& ADJ, std::vector<int>& ORD, std::vector<int>& RANK)
+{
+    if (static_cast<int>(ORD.size()) != m || static_cast<int>(RANK.size()) != m) throw std::invalid_argument("'ORD' and 'RANK' must have m elements");
+
+    findClusters(m, ADJ, ORD.data(), RANK.data());
+}
+
+void ARISession::findClusters(int m, std::vector< std::vector<int> >& ADJ, const int* ORD, const int* RANK)
+{
+    if (static_cast<int>(ADJ.size()) != m) throw std::invalid_argument("'ADJ' must have m rows");
+
+    findClusters(m, CSR(ADJ), ORD, RANK);
+}
+
+void ARISession::findClusters(int m, const CSR& ADJ, const int* ORD, const int* RANK)
+{
+    findClusters(m, ADJ, ORD, RANK, 1);
+}
+
+void ARISession::findClusters(int m, const CSR& ADJ, const int* ORD, const int* RANK, int nthreads)
+{
+    if (ADJ.rows() != m) throw std::invalid_argument("'ADJ' must have m rows");
+
+    CSR C;
+    ::findClusters(m, ADJ, ORD, RANK, SIZE.vec(), ROOT.vec(), C, nthreads);
+    CHILD = std::move(C);
+    resetForest(m);
+}
+
+void ARISession::findClusters(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const int* ORD, const int* RANK)
+{
+    findClusters(m, MASK, INDEXP, DIMS, conn, ORD, RANK, 1);
+}
+
+void ARISession::findClusters(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const int* ORD, const int* RANK, int nthreads)
+{
+    CSR C;
+    ::findClusters(m, MASK, INDEXP, DIMS, conn, ORD, RANK, SIZE.vec(), ROOT.vec(), C, nthreads);
+    CHILD = std::move(C);
+    resetForest(m);
+}
+
+void ARISession::resetForest(int m)
+{
+    ::postOrder(SIZE, CHILD, ORDER.vec(), POS.vec());
+    this->m = m;
+
+    // Anything derived from a previous forest is no longer valid
+    TDP.clear();
+    TDPNUM.clear();
+    ADMSTC.clear();
+    ADMPAR.clear();
+    ADMIDX.clear();
+    ADMCHILD = CSR();
+    ADMJUMP.clear();
+    resetDelta();
+    ALPHAS.clear();
+    ACTIVE = 0;
+    MARK.assign(m, false);
+}
+
+void ARISession::resetDelta()
+{
+    QGAMMA = std::numeric_limits<double>::infinity();
+    QREPS.clear();
+}
+
+void ARISession::setForest(std::vector<int>& SIZE, std::vector<int>& ROOT, std::vector< std::vector<int> >& CHILD)
+{
+    if (SIZE.size() != CHILD.size()) throw std::invalid_argument("'SIZE' and 'CHILD' must have the same length");
+
+    this->m = SIZE.size();
+    this->SIZE = SIZE;
+    this->ROOT = ROOT;
+    this->CHILD = CSR(CHILD);
+    ::postOrder(this->SIZE, this->CHILD, ORDER.vec(), POS.vec());
+
+    TDP.clear();
+    TDPNUM.clear();
+    ADMSTC.clear();
+    ADMPAR.clear();
+    ADMIDX.clear();
+    ADMCHILD = CSR();
+    ADMJUMP.clear();
+    resetDelta();
+    ALPHAS.clear();
+    ACTIVE = 0;
+    MARK.assign(m, false);
+}
+
+void ARISession::forestTDP(int h, double alpha, double simesh, std::vector<double>& P)
+{
+    if (static_cast<int>(P.size()) != m) throw std::invalid_argument("'P' must have one p-value per node");
+
+    forestTDP(h, alpha, simesh, P.data());
+}
+
+void ARISession::forestTDP(int h, double alpha, double simesh, const double* P)
+{
+    forestTDP(h, alpha, simesh, P, 1);
+}
+
+void ARISession::forestTDP(int h, double alpha, double simesh, const double* P, int nthreads)
+{
+    std::vector<double> BOUNDS = ::forestTDP(m, h, alpha, simesh, P, SIZE, ROOT, CHILD, nthreads);
+    storeTDP(BOUNDS, TDP.vec(), TDPNUM.vec());
+    ADMSTC.clear();
+    ADMPAR.clear();
+    ADMIDX.clear();
+    ADMCHILD = CSR();
+    ADMJUMP.clear();
+    resetDelta();
+    ALPHAS.clear();
+    ACTIVE = 0;
+}
+
+void ARISession::forestTDP(const std::vector<double>& ALPHA, const double* JUMPALPHA, const double* SIMESFACTOR, const double* P, int nthreads)
+{
+    if (ALPHA.empty()) throw std::invalid_argument("'ALPHA' must hold at least one alpha");
+
+    std::vector<int> H(ALPHA.size());
+    std::vector<double> SIMESH(ALPHA.size());
+    for (size_t k = 0; k < ALPHA.size(); k++)
+    {
+        H[k] = findHalpha(JUMPALPHA, ALPHA[k], m);
+        SIMESH[k] = SIMESFACTOR[H[k]];
+    }
+    std::vector<double> TDPS = ::forestTDP(m, H, ALPHA, SIMESH, P, SIZE, ROOT, CHILD, nthreads);
+
+    ALPHAS.assign(ALPHA.size(), AlphaResults());
+    for (size_t k = 0; k < ALPHA.size(); k++)
+    {
+        std::vector<double> BOUNDS(TDPS.begin() + k * m, TDPS.begin() + (k + 1) * m);
+        ALPHAS[k].alpha = ALPHA[k];
+        storeTDP(BOUNDS, ALPHAS[k].TDP, ALPHAS[k].TDPNUM);
+    }
+    std::vector<double>().swap(TDPS);
+    ACTIVE = 0;
+    TDP.swap(ALPHAS[0].TDP);
+    TDPNUM.swap(ALPHAS[0].TDPNUM);
+    ADMSTC.clear();
+    ADMPAR.clear();
+    ADMIDX.clear();
+    ADMCHILD = CSR();
+    ADMJUMP.clear();
+    resetDelta();
+}
+
+void ARISession::selectAlpha(int k)
+{
+    if (k < 0 || k >= static_cast<int>(ALPHAS.size())) throw std::out_of_range("alpha index out of range");
+    if (k == ACTIVE) return;
+
+    // Park the results of the active alpha and bring in those of alpha k
+    TDP.swap(ALPHAS[ACTIVE].TDP);
+    TDPNUM.swap(ALPHAS[ACTIVE].TDPNUM);
+    ADMSTC.swap(ALPHAS[ACTIVE].ADMSTC);
+    ADMPAR.swap(ALPHAS[ACTIVE].ADMPAR);
+    ADMIDX.swap(ALPHAS[ACTIVE].ADMIDX);
+    ADMCHILD.swap(ALPHAS[ACTIVE].ADMCHILD);
+    ADMJUMP.swap(ALPHAS[ACTIVE].ADMJUMP);
+    TDP.swap(ALPHAS[k].TDP);
+    TDPNUM.swap(ALPHAS[k].TDPNUM);
+    ADMSTC.swap(ALPHAS[k].ADMSTC);
+    ADMPAR.swap(ALPHAS[k].ADMPAR);
+    ADMIDX.swap(ALPHAS[k].ADMIDX);
+    ADMCHILD.swap(ALPHAS[k].ADMCHILD);
+    ADMJUMP.swap(ALPHAS[k].ADMJUMP);
+    ACTIVE = k;
+    resetDelta();
+}
+
+void ARISession::queryPreparation()
+{
+    if (!hasTDP()) throw std::logic_error("forestTDP must be run before queryPreparation");
+
+    if (COMPACT)
+    {
+        ADMSTC = ::queryPreparation(m, ROOT, countTDP(), CHILD);
+        ADMPAR = ::findAdmissibleParents(m, ROOT, countTDP(), CHILD);
+    }
+    else
+    {
+        ADMSTC = ::queryPreparation(m, ROOT, TDP, CHILD);
+        ADMPAR = ::findAdmissibleParents(m, ROOT, TDP, CHILD);
+    }
+    ADMIDX = ::admissibleIndex(m, ADMSTC);
+    ADMCHILD = ::admissibleChildren(m, ADMSTC, ADMPAR);
+    ADMJUMP = ::admissibleJumps(m, ADMSTC, ADMPAR);
+    resetDelta();
+
+    // The parked alphas of a multi-alpha forestTDP
+    for (size_t k = 0; k < ALPHAS.size(); k++)
+    {
+        if (static_cast<int>(k) == ACTIVE) continue;
+        if (COMPACT)
+        {
+            CountTDP TDPK(ALPHAS[k].TDPNUM.data(), SIZE.data());
+            ALPHAS[k].ADMSTC = ::queryPreparation(m, ROOT, TDPK, CHILD);
+            ALPHAS[k].ADMPAR = ::findAdmissibleParents(m, ROOT, TDPK, CHILD);
+        }
+        else
+        {
+            ALPHAS[k].ADMSTC = ::queryPreparation(m, ROOT, ALPHAS[k].TDP, CHILD);
+            ALPHAS[k].ADMPAR = ::findAdmissibleParents(m, ROOT, ALPHAS[k].TDP, CHILD);
+        }
+        ALPHAS[k].ADMIDX = ::admissibleIndex(m, ALPHAS[k].ADMSTC);
+        ALPHAS[k].ADMCHILD = ::admissibleChildren(m, ALPHAS[k].ADMSTC, ALPHAS[k].ADMPAR);
+        ALPHAS[k].ADMJUMP = ::admissibleJumps(m, ALPHAS[k].ADMSTC, ALPHAS[k].ADMPAR);
+    }
+}
+
+// Convert the bounds of one alpha to (compact) or from discoveries
+static void convertTDP(bool compact, ArrayRef<int> SIZE, std::vector<double>& TDP, std::vector<int>& TDPNUM)
+{
+    if (compact)
+    {
+        if (!TDP.empty()) ::countTDP(TDP, SIZE, TDPNUM);
+        std::vector<double>().swap(TDP);
+    }
+    else
+    {
+        if (!TDPNUM.empty()) ::expandTDP(TDPNUM, SIZE, TDP);
+        std::vector<int>().swap(TDPNUM);
+    }
+}
+
+void ARISession::setCompact(bool on)
+{
+    if (on == COMPACT) return;
+
+    convertTDP(on, SIZE, TDP.vec(), TDPNUM.vec());
+    for (size_t k = 0; k < ALPHAS.size(); k++)
+    {
+        convertTDP(on, SIZE, ALPHAS[k].TDP, ALPHAS[k].TDPNUM);
+    }
+    COMPACT = on;
+}
+
+bool ARISession::hasTDP() const
+{
+    return static_cast<int>(COMPACT ? TDPNUM.size() : TDP.size()) == m;
+}
+
+void ARISession::storeTDP(std::vector<double>& BOUNDS, std::vector<double>& TDP, std::vector<int>& TDPNUM) const
+{
+    if (COMPACT)
+    {
+        ::countTDP(BOUNDS, SIZE, TDPNUM);
+        std::vector<double>().swap(BOUNDS);
+        TDP.clear();
+    }
+    else
+    {
+        TDP.swap(BOUNDS);
+        TDPNUM.clear();
+    }
+}
+
+std::vector<double> ARISession::tdpBounds() const
+{
+    if (!COMPACT) return TDP.toVector();
+
+    std::vector<double> BOUNDS;
+    ::expandTDP(TDPNUM, SIZE, BOUNDS);
+    return BOUNDS;
+}
+
+template <class T>
+static long long bytes(const std::vector<T>& V)
+{
+    return static_cast<long long>(V.capacity() * sizeof(T));
+}
+
+static long long bytes(const std::vector<bool>& V)
+{
+    return static_cast<long long>((V.capacity() + 7) / 8);
+}
+
+static long long bytes(const CSR& V)
+{
+    return bytes(V.OFS) + bytes(V.IDX);
+}
+
+// Mapped arrays hold no memory of their own (see loadIndex)
+template <class T>
+static long long bytes(const SessionArray<T>& V)
+{
+    return V.ownedBytes();
+}
+
+static long long bytes(const SessionCSR& V)
+{
+    return bytes(V.OFS) + bytes(V.IDX);
+}
+
+template <class T>
+static long long mappedBytes(const SessionArray<T>& V)
+{
+    return V.mappedBytes();
+}
+
+static long long mappedBytes(const SessionCSR& V)
+{
+    return mappedBytes(V.OFS) + mappedBytes(V.IDX);
+}
+
+std::map<std::string, long long> ARISession::footprint() const
+{
+    std::map<std::string, long long> F;
+    F["SIZE"] = bytes(SIZE);
+    F["ROOT"] = bytes(ROOT);
+    F["CHILD"] = bytes(CHILD);
+    F["ORDER"] = bytes(ORDER);
+    F["POS"] = bytes(POS);
+    F["TDP"] = bytes(TDP) + bytes(TDPNUM);
+    F["ADMSTC"] = bytes(ADMSTC);
+    F["ADMPAR"] = bytes(ADMPAR);
+    F["ADMIDX"] = bytes(ADMIDX);
+    F["ADMCHILD"] = bytes(ADMCHILD);
+    F["ADMJUMP"] = bytes(ADMJUMP);
+    F["MARK"] = bytes(MARK);
+    F["INDEXP"] = bytes(INDEXP);
+    F["QREPS"] = bytes(QREPS);
+    long long alphas = 0;
+    for (size_t k = 0; k < ALPHAS.size(); k++)
+    {
+        alphas += bytes(ALPHAS[k].TDP) + bytes(ALPHAS[k].TDPNUM) + bytes(ALPHAS[k].ADMSTC) + bytes(ALPHAS[k].ADMPAR) +
+                  bytes(ALPHAS[k].ADMIDX) + bytes(ALPHAS[k].ADMCHILD) + bytes(ALPHAS[k].ADMJUMP);
+    }
+    F["ALPHAS"] = alphas;
+
+    long long total = 0;
+    for (std::map<std::string, long long>::const_iterator it = F.begin(); it != F.end(); ++it) total += it->second;
+    F["total"] = total;
+    F["mapped"] = mappedBytes(SIZE) + mappedBytes(ROOT) + mappedBytes(CHILD) + mappedBytes(ORDER) + mappedBytes(POS) +
+                  mappedBytes(TDP) + mappedBytes(TDPNUM) + mappedBytes(ADMSTC) + mappedBytes(ADMPAR) + mappedBytes(ADMIDX) +
+                  mappedBytes(ADMCHILD) + mappedBytes(ADMJUMP) + mappedBytes(INDEXP);
+    return F;
+}
+
+bool ARISession::mapped() const
+{
+    return SIZE.mapped() || ROOT.mapped() || CHILD.OFS.mapped() || CHILD.IDX.mapped() || ORDER.mapped() || POS.mapped() ||
+           TDP.mapped() || TDPNUM.mapped() || ADMSTC.mapped() || ADMPAR.mapped() || ADMIDX.mapped() ||
+           ADMCHILD.OFS.mapped() || ADMCHILD.IDX.mapped() || ADMJUMP.mapped() || INDEXP.mapped();
+}
+
+void ARISession::setIndexp(std::vector<int>& INDEXP)
+{
+    if (static_cast<int>(INDEXP.size()) != m) throw std::invalid_argument("'INDEXP' must have one voxel index per node");
+
+    this->INDEXP = INDEXP;
+}
+
+void ARISession::setIndexp(const int* INDEXP)
+{
+    this->INDEXP.vec().assign(INDEXP, INDEXP + m);
+}
+
+std::vector< std::vector<int> > ARISession::answerQuery(double gamma)
+{
+    return answerQuery(gamma, 0, -1);
+}
+
+std::vector< std::vector<int> > ARISession::answerQuery(double gamma, int min_size, int top_k)
+{
+    std::vector<double> gamma_batch(1, gamma);
+    std::vector< std::vector< std::vector<int> > > batch_results = answerQueryBatch(gamma_batch, min_size, top_k);
+    return batch_results[0];
+}
+
+// Same clusters, in the same order, as ::answerQueryBatch: the representatives come from
+// answerQueryBatchReps and the voxels are copied out of ORDER, so no subtree is walked.
+std::vector< std::vector< std::vector<int> > > ARISession::answerQueryBatch(std::vector<double>& gamma_batch)
+{
+    return answerQueryBatch(gamma_batch, 0, -1);
+}
+
+// The pruning happens on the representatives, so the voxels of the clusters left out are never copied
+std::vector< std::vector< std::vector<int> > > ARISession::answerQueryBatch(std::vector<double>& gamma_batch, int min_size, int top_k)
+{
+    ProfileScope prof("answerQueryBatch", true);
+    prof.count("queries", gamma_batch.size());
+    std::vector<int> REPS, OFFSETS;
+    answerQueryBatchReps(gamma_batch, min_size, top_k, REPS, OFFSETS);
+
+    ProgressReporter* R = progressCurrent();
+    if (R) R->begin("answerQueryBatch", gamma_batch.size());
+    std::vector< std::vector< std::vector<int> > > batch_results(gamma_batch.size());
+    for (size_t i = 0; i < gamma_batch.size(); i++)
+    {
+        batch_results[i].reserve(OFFSETS[i + 1] - OFFSETS[i]);
+        for (int k = OFFSETS[i]; k < OFFSETS[i + 1]; k++)
+        {
+            batch_results[i].push_back(::subtree(REPS[k], SIZE, ORDER, POS));
+            prof.count("descendants", SIZE[REPS[k]]);
+        }
+        if (R) R->advance(1);
+    }
+    prof.count("clusters", REPS.size());
+    return batch_results;
+}
+
+void ARISession::answerQueryBatchReps(std::vector<double>& gamma_batch, std::vector<int>& REPS, std::vector<int>& OFFSETS)
+{
+    if (ADMSTC.empty() && m > 0) throw std::logic_error("queryPreparation must be run before answering queries");
+
+    if (COMPACT) ::answerQueryBatchReps(gamma_batch, ADMSTC, ADMPAR, countTDP(), REPS, OFFSETS);
+    else ::answerQueryBatchReps(gamma_batch, ADMSTC, ADMPAR, TDP, REPS, OFFSETS);
+}
+
+void ARISession::answerQueryBatchReps(std::vector<double>& gamma_batch, int min_size, int top_k, std::vector<int>& REPS, std::vector<int>& OFFSETS)
+{
+    if (min_size <= 1 && top_k < 0)
+    {
+        answerQueryBatchReps(gamma_batch, REPS, OFFSETS);
+        return;
+    }
+    if (ADMSTC.empty() && m > 0) throw std::logic_error("queryPreparation must be run before answering queries");
+
+    if (COMPACT) ::answerQueryBatchReps(gamma_batch, ADMSTC, ADMPAR, countTDP(), SIZE, min_size, top_k, REPS, OFFSETS);
+    else ::answerQueryBatchReps(gamma_batch, ADMSTC, ADMPAR, TDP, SIZE, min_size, top_k, REPS, OFFSETS);
+}
+
+std::vector<int> ARISession::clusterMembers(int v)
+{
+    if (v < 0 || v >= m) throw std::out_of_range("node id out of range");
+
+    return ::subtree(v, SIZE, ORDER, POS);
+}
+
+void ARISession::labelClusters(const int* REPS, int nreps, int* LABEL)
+{
+    for (int k = 0; k < nreps; k++)
+    {
+        if (REPS[k] < 0 || REPS[k] >= m) throw std::out_of_range("node id out of range");
+    }
+
+    ::labelClusters(REPS, nreps, SIZE, ORDER, POS, LABEL);
+}
+
+void ARISession::labelClusters(const int* REPS, int nreps, int* LABEL, int nvox)
+{
+    if (static_cast<int>(INDEXP.size()) != m) throw std::logic_error("setIndexp must be run before labelClusters");
+    for (int k = 0; k < nreps; k++)
+    {
+        if (REPS[k] < 0 || REPS[k] >= m) throw std::out_of_range("node id out of range");
+    }
+
+    ::labelClusters(REPS, nreps, SIZE, ORDER, POS, INDEXP.data(), LABEL, nvox);
+}
+
+void ARISession::answerQueryLabels(int* LABEL, int nvox, std::vector<int>& REPS, std::vector<int>& SIZES)
+{
+    if (static_cast<int>(INDEXP.size()) != m) throw std::logic_error("setIndexp must be run before answerQueryLabels");
+    if (QGAMMA == std::numeric_limits<double>::infinity()) throw std::logic_error("answerQueryDelta must be run before answerQueryLabels");
+
+    // Rank the clusters of the last answer by size, as the tables do with counting_sort
+    int n = QREPS.size();
+    std::vector<int> QSIZE(n);
+    int maxsize = 0;
+    for (int k = 0; k < n; k++)
+    {
+        QSIZE[k] = SIZE[QREPS[k]];
+        maxsize = std::max(maxsize, QSIZE[k]);
+    }
+    std::vector<int> RANKED = ::counting_sort(n, maxsize, QSIZE);
+    REPS.resize(n);
+    SIZES.resize(n);
+    for (int k = 0; k < n; k++)
+    {
+        REPS[k] = QREPS[RANKED[k]];
+        SIZES[k] = QSIZE[RANKED[k]];
+    }
+
+    std::fill(LABEL, LABEL + nvox, 0);
+    ::labelClusters(REPS.data(), n, SIZE, ORDER, POS, INDEXP.data(), LABEL, nvox);
+}
+
+void ARISession::thresholdClusters(int k, const int* ORD, std::vector<int>& REPS)
+{
+    if (k < 0 || k > m) throw std::out_of_range("'k' must be within [0, m]");
+
+    ::thresholdClusters(k, ORD, SIZE, CHILD, MARK, REPS);
+}
+
+void ARISession::clusterSummary(const int* REPS, int nreps, const int* DIMS, const double* STAT, const int* ATLAS, ClusterTable& TBL, int nthreads)
+{
+    if (!hasTDP()) throw std::logic_error("forestTDP must be run before clusterSummary");
+    if (static_cast<int>(INDEXP.size()) != m) throw std::logic_error("setIndexp must be run before clusterSummary");
+
+    long nvox = static_cast<long>(DIMS[0]) * DIMS[1] * DIMS[2];
+    for (int k = 0; k < nreps; k++)
+    {
+        if (REPS[k] < 0 || REPS[k] >= m) throw std::out_of_range("node id out of range");
+    }
+    for (int v = 0; v < m; v++)
+    {
+        if (INDEXP[v] < 0 || INDEXP[v] >= nvox) throw std::out_of_range("voxel index outside the volume");
+    }
+
+    if (COMPACT) ::clusterSummary(REPS, nreps, SIZE, ORDER, POS, countTDP(), INDEXP.data(), DIMS, STAT, ATLAS, TBL, nthreads);
+    else ::clusterSummary(REPS, nreps, SIZE, ORDER, POS, TDP, INDEXP.data(), DIMS, STAT, ATLAS, TBL, nthreads);
+}
+
+void ARISession::answerQueryDelta(double gamma, std::vector<int>& ADDED, std::vector<int>& REMOVED)
+{
+    if (ADMSTC.empty() && m > 0) throw std::logic_error("queryPreparation must be run before answering queries");
+
+    if (gamma < 0) gamma = 0;  // Constrain TDP threshold gamma to be non-negative
+    if (COMPACT) ::answerQueryDelta(QGAMMA, gamma, ADMSTC, ADMIDX, ADMPAR, ADMCHILD, countTDP(), ADDED, REMOVED);
+    else ::answerQueryDelta(QGAMMA, gamma, ADMSTC, ADMIDX, ADMPAR, ADMCHILD, TDP, ADDED, REMOVED);
+
+    // Drop the removed clusters from QREPS and merge in the added ones, keeping ADMSTC order
+    for (size_t i = 0; i < REMOVED.size(); i++) MARK[REMOVED[i]] = true;
+    std::vector<int> REPS;
+    REPS.reserve(QREPS.size() - REMOVED.size() + ADDED.size());
+    size_t j = 0;
+    for (size_t i = 0; i < QREPS.size(); i++)
+    {
+        if (MARK[QREPS[i]]) continue;
+        while (j < ADDED.size() && ADMIDX[ADDED[j]] < ADMIDX[QREPS[i]]) REPS.push_back(ADDED[j++]);
+        REPS.push_back(QREPS[i]);
+    }
+    while (j < ADDED.size()) REPS.push_back(ADDED[j++]);
+    for (size_t i = 0; i < REMOVED.size(); i++) MARK[REMOVED[i]] = false;
+
+    QREPS.swap(REPS);
+    QGAMMA = gamma;
+}
+
+int ARISession::containingCluster(int v, double gamma, int& size, double& tdp)
+{
+    if (ADMSTC.empty() && m > 0) throw std::logic_error("queryPreparation must be run before answering queries");
+    if (v < 0 || v >= m) throw std::out_of_range("'v' is not a node of the forest");
+
+    int rep = COMPACT ? ::containingCluster(v, gamma, ADMIDX, ADMPAR, ADMJUMP, countTDP())
+                      : ::containingCluster(v, gamma, ADMIDX, ADMPAR, ADMJUMP, TDP);
+    size = (rep < 0) ? 0 : SIZE[rep];
+    tdp = (rep < 0) ? -1 : (COMPACT ? countTDP()[rep] : TDP[rep]);
+    return rep;
+}
+
+std::vector< std::vector<int> > ARISession::changeQuery(int v, double tdpchg, const std::vector< std::vector<int> >& ANS)
+{
+    if (ADMSTC.empty() && m > 0) throw std::logic_error("queryPreparation must be run before answering queries");
+    if (v >= m) throw std::invalid_argument("'v' is not a node of the forest");
+
+    if (COMPACT) return ::changeQuery(v, tdpchg, ADMSTC, ADMIDX, ADMPAR, SIZE, countTDP(), ORDER, POS, ANS);
+    return ::changeQuery(v, tdpchg, ADMSTC, ADMIDX, ADMPAR, SIZE, TDP, ORDER, POS, ANS);
+}
+
+std::vector<int> ARISession::findLMS()
+{
+    return ::findLMS(CHILD);
+}
+
+void ARISession::findLMS(const int* ORD, int topk, const int* DIMS, std::vector<int>& LMS, std::vector<int>& XYZ)
+{
+    if (static_cast<int>(INDEXP.size()) != m) throw std::logic_error("setIndexp must be run before findLMS");
+
+    ::findLMS(CHILD, ORD, topk, LMS);
+
+    XYZ.resize(3 * LMS.size());
+    for (size_t i = 0; i < LMS.size(); i++)
+    {
+        int index = INDEXP[LMS[i]];
+        ::ids2xyz(&index, 1, DIMS, &XYZ[3 * i]);
+    }
+}
+
+void ARISession::gradientMap(std::vector<double>& gamma_batch, float* GRADMAP, int nvox)
+{
+    if (!hasTDP()) throw std::logic_error("forestTDP must be run before gradientMap");
+    if (static_cast<int>(INDEXP.size()) != m) throw std::logic_error("setIndexp must be run before gradientMap");
+
+    if (COMPACT) ::gradientMap(gamma_batch, ROOT, countTDP(), CHILD, INDEXP.data(), GRADMAP, nvox);
+    else ::gradientMap(gamma_batch, ROOT, TDP, CHILD, INDEXP.data(), GRADMAP, nvox);
+}
+
+void ARISession::gradientMap(std::vector<double>& gamma_batch, float* GRADMAP, int nvox, int min_size, int top_k)
+{
+    if (min_size <= 1 && top_k < 0)
+    {
+        gradientMap(gamma_batch, GRADMAP, nvox);
+        return;
+    }
+    if (!hasTDP()) throw std::logic_error("forestTDP must be run before gradientMap");
+    if (static_cast<int>(INDEXP.size()) != m) throw std::logic_error("setIndexp must be run before gradientMap");
+
+    if (top_k < 0)
+    {
+        if (COMPACT) ::gradientMap(gamma_batch, ROOT, countTDP(), CHILD, SIZE, min_size, INDEXP.data(), GRADMAP, nvox);
+        else ::gradientMap(gamma_batch, ROOT, TDP, CHILD, SIZE, min_size, INDEXP.data(), GRADMAP, nvox);
+        return;
+    }
+
+    // Which clusters are among the top_k largest differs from one gamma to the next, so these
+    // queries are answered one by one (on the representatives) and their voxels painted
+    std::vector<int> REPS, OFFSETS;
+    answerQueryBatchReps(gamma_batch, min_size, top_k, REPS, OFFSETS);
+    ::gradientMap(gamma_batch, REPS, OFFSETS, SIZE, ORDER, POS, INDEXP.data(), GRADMAP, nvox);
+}
+
+// Key field of the header: the key, zero-padded to 64 characters
+static void packKey(const std::string& key, char* KEY)
+{
+    if (key.size() > 64) throw std::invalid_argument("'key' must be at most 64 characters");
+
+    std::memset(KEY, 0, 64);
+    std::memcpy(KEY, key.data(), key.size());
+}
+
+void ARISession::saveIndex(const std::string& path, const std::string& key, const int* ORD, const int* RANK,
+                           const std::vector<double>& JUMPALPHA, const std::vector<double>& SIMESFACTOR) const
+{
+    ProfileScope prof("saveIndex");
+    prof.count("voxels", m);
+    if (ADMSTC.empty() && m > 0) throw std::logic_error("queryPreparation must be run before saveIndex");
+    if (static_cast<int>(INDEXP.size()) != m) throw std::logic_error("setIndexp must be run before saveIndex");
+
+    // The file always holds the bounds themselves, whichever mode the session is in
+    std::vector<double> BOUNDS;
+    if (COMPACT) BOUNDS = tdpBounds();
+    const void* DATA[NUM_SECTIONS] = {
+        ORD, RANK, SIZE.data(), ROOT.data(), CHILD.OFS.data(), CHILD.IDX.data(), ORDER.data(), POS.data(),
+        COMPACT ? BOUNDS.data() : TDP.data(), ADMSTC.data(), ADMPAR.data(), ADMIDX.data(), ADMCHILD.OFS.data(),
+        ADMCHILD.IDX.data(), ADMJUMP.data(), INDEXP.data(), JUMPALPHA.data(), SIMESFACTOR.data()
+    };
+    const int64_t COUNT[NUM_SECTIONS] = {
+        m, m, m, static_cast<int64_t>(ROOT.size()), m + 1, static_cast<int64_t>(CHILD.IDX.size()), m, m,
+        m, static_cast<int64_t>(ADMSTC.size()), m, m, m + 1, static_cast<int64_t>(ADMCHILD.IDX.size()),
+        m, m, static_cast<int64_t>(JUMPALPHA.size()), static_cast<int64_t>(SIMESFACTOR.size())
+    };
+
+    IndexHeader header;
+    std::memcpy(header.magic, INDEX_MAGIC, 8);
+    header.version = INDEX_VERSION;
+    header.nsections = NUM_SECTIONS;
+    packKey(key, header.key);
+    header.m = m;
+
+    IndexEntry TABLE[NUM_SECTIONS];
+    int64_t offset = sizeof(IndexHeader) + sizeof(TABLE);
+    for (int s = 0; s < NUM_SECTIONS; s++)
+    {
+        offset = (offset + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+        TABLE[s].id = s;
+        TABLE[s].elemsize = (s == SEC_TDP || s == SEC_JUMPALPHA || s == SEC_SIMESFACTOR) ? sizeof(double) : sizeof(int);
+        TABLE[s].count = COUNT[s];
+        TABLE[s].offset = offset;
+        offset += TABLE[s].count * TABLE[s].elemsize;
+    }
+
+    // Write to a temporary file first, so that an interrupted write never leaves a broken index
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+        if (!out) throw std::runtime_error("cannot write index file '" + tmp + "'");
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(TABLE), sizeof(TABLE));
+        for (int s = 0; s < NUM_SECTIONS; s++)
+        {
+            static const char PAD[INDEX_ALIGN] = {0};
+            out.write(PAD, TABLE[s].offset - out.tellp());
+            out.write(static_cast<const char*>(DATA[s]), TABLE[s].count * TABLE[s].elemsize);
+        }
+        if (!out) throw std::runtime_error("cannot write index file '" + tmp + "'");
+    }
+    std::remove(path.c_str());
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) throw std::runtime_error("cannot write index file '" + path + "'");
+}
+
+// Checks that a section lies within the file with the expected element size, and returns its data
+template <class T>
+static const T* sectionData(const IndexFile& file, const IndexEntry& entry)
+{
+    if (entry.elemsize != sizeof(T) || entry.count < 0 || entry.offset < 0 || entry.offset % INDEX_ALIGN != 0 ||
+        entry.count > (file.size() - entry.offset) / static_cast<int64_t>(sizeof(T)))
+    {
+        throw std::runtime_error("corrupt index file");
+    }
+    return reinterpret_cast<const T*>(file.data() + entry.offset);
+}
+
+// Point V at one section of the mapped file
+template <class T>
+static void mapSection(const IndexFile& file, const IndexEntry& entry, SessionArray<T>& V)
+{
+    V.map(sectionData<T>(file, entry), entry.count);
+}
+
+// Copy one section of the mapped file into V
+template <class T>
+static void copySection(const IndexFile& file, const IndexEntry& entry, std::vector<T>& V)
+{
+    const T* DATA = sectionData<T>(file, entry);
+    V.assign(DATA, DATA + entry.count);
+}
+
+bool ARISession::loadIndex(const std::string& path, const std::string& key, std::vector<int>& ORD, std::vector<int>& RANK,
+                           std::vector<double>& JUMPALPHA, std::vector<double>& SIMESFACTOR)
+{
+    ProfileScope prof("loadIndex", true);
+    std::shared_ptr<IndexFile> file = std::make_shared<IndexFile>();
+    if (!file->open(path)) return false;
+    prof.count("bytes", file->size());
+
+    IndexHeader header;
+    char KEY[64];
+    packKey(key, KEY);
+    if (file->size() < static_cast<int64_t>(sizeof(header))) return false;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, INDEX_MAGIC, 8) != 0 || header.version != INDEX_VERSION) return false;
+    if (std::memcmp(header.key, KEY, 64) != 0) return false;
+    if (header.nsections != NUM_SECTIONS || header.m < 0 || header.m > std::numeric_limits<int>::max() ||
+        file->size() < static_cast<int64_t>(sizeof(header) + sizeof(IndexEntry) * NUM_SECTIONS))
+    {
+        throw std::runtime_error("corrupt index file");
+    }
+
+    IndexEntry TABLE[NUM_SECTIONS];
+    std::memcpy(TABLE, file->data() + sizeof(header), sizeof(TABLE));
+
+    // Map into a fresh session, so that a corrupt file leaves this one untouched
+    ARISession S;
+    std::vector<int> ord, rank;
+    std::vector<double> jumpalpha, simesfactor;
+    S.m = header.m;
+    copySection(*file, TABLE[SEC_ORD], ord);
+    copySection(*file, TABLE[SEC_RANK], rank);
+    mapSection(*file, TABLE[SEC_SIZE], S.SIZE);
+    mapSection(*file, TABLE[SEC_ROOT], S.ROOT);
+    mapSection(*file, TABLE[SEC_CHILD_OFS], S.CHILD.OFS);
+    mapSection(*file, TABLE[SEC_CHILD_IDX], S.CHILD.IDX);
+    mapSection(*file, TABLE[SEC_ORDER], S.ORDER);
+    mapSection(*file, TABLE[SEC_POS], S.POS);
+    mapSection(*file, TABLE[SEC_TDP], S.TDP);
+    mapSection(*file, TABLE[SEC_ADMSTC], S.ADMSTC);
+    mapSection(*file, TABLE[SEC_ADMPAR], S.ADMPAR);
+    mapSection(*file, TABLE[SEC_ADMIDX], S.ADMIDX);
+    mapSection(*file, TABLE[SEC_ADMCHILD_OFS], S.ADMCHILD.OFS);
+    mapSection(*file, TABLE[SEC_ADMCHILD_IDX], S.ADMCHILD.IDX);
+    mapSection(*file, TABLE[SEC_ADMJUMP], S.ADMJUMP);
+    mapSection(*file, TABLE[SEC_INDEXP], S.INDEXP);
+    copySection(*file, TABLE[SEC_JUMPALPHA], jumpalpha);
+    copySection(*file, TABLE[SEC_SIMESFACTOR], simesfactor);
+
+    size_t n = S.m;
+    if (ord.size() != n || rank.size() != n || S.SIZE.size() != n || S.CHILD.OFS.size() != n + 1 || S.ORDER.size() != n ||
+        S.POS.size() != n || S.TDP.size() != n || S.ADMPAR.size() != n || S.ADMIDX.size() != n ||
+        S.ADMCHILD.OFS.size() != n + 1 || S.ADMJUMP.size() != n || S.INDEXP.size() != n ||
+        S.CHILD.OFS.back() != static_cast<int>(S.CHILD.IDX.size()) ||
+        S.ADMCHILD.OFS.back() != static_cast<int>(S.ADMCHILD.IDX.size()))
+    {
+        throw std::runtime_error("corrupt index file");
+    }
+
+    // The mapped bounds take no memory, so the session is left in full mode
+    S.INDEXFILE = file;
+    S.MARK.assign(n, false);
+    *this = std::move(S);
+    ORD.swap(ord);
+    RANK.swap(rank);
+    JUMPALPHA.swap(jumpalpha);
+    SIMESFACTOR.swap(simesfactor);
+    return true;
+}
+
+std::vector< std::vector<int> > ARISession::ids2xyz(std::vector<int>& IDS, std::vector<int>& DIMS)
+{
+    if (static_cast<int>(INDEXP.size()) != m) throw std::logic_error("setIndexp must be run before ids2xyz");
+
+    std::vector<int> VOX(IDS.size());
+    for (size_t i = 0; i < IDS.size(); i++)
+    {
+        if (IDS[i] < 0 || IDS[i] >= m) throw std::out_of_range("node id out of range");
+        VOX[i] = INDEXP[IDS[i]];
+    }
+    return ::ids2xyz(VOX, DIMS);
+}
+
+void ARISession::ids2xyz(const int* IDS, int n, const int* DIMS, int* XYZ)
+{
+    if (static_cast<int>(INDEXP.size()) != m) throw std::logic_error("setIndexp must be run before ids2xyz");
+
+    for (int i = 0; i < n; i++)
+    {
+        if (IDS[i] < 0 || IDS[i] >= m) throw std::out_of_range("node id out of range");
+        int index = INDEXP[IDS[i]];
+        ::ids2xyz(&index, 1, DIMS, XYZ + 3 * i);
+    }
+}
+
+void ARISession::clusterXYZ(int v, const int* DIMS, std::vector<int>& XYZ)
+{
+    if (static_cast<int>(INDEXP.size()) != m) throw std::logic_error("setIndexp must be run before clusterXYZ");
+    if (v < 0 || v >= m) throw std::out_of_range("node id out of range");
+
+    const int* DESC = ORDER.data() + POS[v] - SIZE[v] + 1;
+    XYZ.resize(3 * SIZE[v]);
+    for (int i = 0; i < SIZE[v]; i++)
+    {
+        int index = INDEXP[DESC[i]];
+        ::ids2xyz(&index, 1, DIMS, &XYZ[3 * i]);
+    }
+}
+
+// Ranks p in ascending order (stable, as np.argsort(kind='stable')) into the 1-based ORD and
+// RANK, with the sorted p-values in SP (see orderPValues)
+static void rankPValues(int m, const double* P, std::vector<int>& ORD, std::vector<int>& RANK, std::vector<double>& SP, int nthreads)
+{
+    ORD.resize(m);
+    RANK.resize(m);
+    SP.resize(m);
+    orderPValues(P, m, ORD.data(), RANK.data(), SP.data(), nthreads);
+}
+
+// The Hommel results of MAP from the sorted p-values SP
+static void hommelResults(int m, const std::vector<double>& SP, double alpha, bool simes, const std::vector<double>& SIMESFACTOR, MapAnalysis& MAP)
+{
+    MAP.JUMPALPHA = findalpha(SP.data(), m, SIMESFACTOR.data(), simes);
+    MAP.h = findHalpha(MAP.JUMPALPHA.data(), alpha, m);
+    double simesh = SIMESFACTOR[MAP.h];
+    MAP.wbtdp = static_cast<double>(findDiscoveriesOfP(SP.data(), SP.data(), simesh, MAP.h, alpha, m, m)[m]) / m;
+    MAP.concentration = findConcentration(SP.data(), simesh, MAP.h, alpha, m);
+}
+
+// Sorts p and runs the Hommel steps and the session stages that analyseMaps needs
+static void analyseMap(int m, const CSR& ADJ, const int* INDEXP, const double* P, double alpha, bool simes,
+                       const std::vector<double>& SIMESFACTOR, int nthreads, ProgressReporter* R, MapAnalysis& MAP)
+{
+    std::vector<double> SP;
+    rankPValues(m, P, MAP.ORD, MAP.RANK, SP, nthreads);
+    hommelResults(m, SP, alpha, simes, SIMESFACTOR, MAP);
+    std::vector<double>().swap(SP);
+
+    if (R) R->check();
+    MAP.session.findClusters(m, ADJ, MAP.ORD.data(), MAP.RANK.data(), nthreads);
+    if (R) R->check();
+    MAP.session.forestTDP(MAP.h, alpha, SIMESFACTOR[MAP.h], P, nthreads);
+    if (R) R->check();
+    MAP.session.queryPreparation();
+    MAP.session.setIndexp(INDEXP);
+}
+
+void analyseMaps(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const std::vector<const double*>& P,
+                 double alpha, bool simes, int nthreads, int maxmaps, std::vector<double>& SIMESFACTOR, std::vector<MapAnalysis>& MAPS)
+{
+    if (m < 1) throw std::invalid_argument("'m' must be positive");
+
+    ProfileScope prof("analyseMaps", true);
+    prof.count("maps", P.size());
+    prof.count("voxels", m * static_cast<long long>(P.size()));
+
+    if (nthreads <= 0) nthreads = std::thread::hardware_concurrency();
+    if (nthreads <= 0) nthreads = 1;
+    int nmaps = static_cast<int>(P.size());
+    int concurrent = std::min(nmaps, maxmaps > 0 ? std::min(maxmaps, nthreads) : nthreads);
+    int inner = concurrent > 0 ? std::max(1, nthreads / concurrent) : nthreads;  // Threads per map
+
+    // Shared by all maps
+    CSR ADJ = findAdjListCSR(MASK, INDEXP, DIMS, m, conn, nthreads);
+    SIMESFACTOR = findsimesfactor(simes, m);
+
+    MAPS.clear();
+    MAPS.resize(nmaps);
+    if (nmaps == 0) return;
+
+    // The maps are independent tasks; the per-map stages only check for cancellation in between,
+    // so that concurrent maps do not take turns at the stage shown by the reporter
+    ProgressReporter* R = progressCurrent();
+    if (R) R->begin("analyseMaps", nmaps);
+    if (concurrent == 1)
+    {
+        ProgressGuard quiet(NULL);  // The stages of the map run on this thread
+        for (int k = 0; k < nmaps; k++)
+        {
+            analyseMap(m, ADJ, INDEXP, P[k], alpha, simes, SIMESFACTOR, inner, R, MAPS[k]);
+            if (R) R->advance(1);
+        }
+        return;
+    }
+
+    ThreadPool pool(concurrent);
+    for (int k = 0; k < nmaps; k++)
+    {
+        pool.submit([&, k]() {
+            analyseMap(m, ADJ, INDEXP, P[k], alpha, simes, SIMESFACTOR, inner, R, MAPS[k]);
+            if (R) R->advance(1);
+        });
+    }
+    pool.wait();
+}
+
+void runPipeline(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const double* P, double alpha, bool simes, bool compact,
+                 const std::vector<double>& gamma_batch, float* GRADMAP, int nvox, const int* LMSDIMS, int nthreads, PipelineResult& RES)
+{
+    if (m < 1) throw std::invalid_argument("'m' must be positive");
+
+    ProfileScope prof("runPipeline", true);
+    prof.count("voxels", m);
+
+    if (nthreads <= 0) nthreads = std::thread::hardware_concurrency();
+    if (nthreads <= 0) nthreads = 1;
+    int inner = std::max(1, nthreads - 1);  // Threads of the stages that run alongside a side task
+    int sorting = std::max(1, nthreads / 2);  // The sort and the adjacency list share the threads
+
+    ProgressReporter* R = progressCurrent();
+    MapAnalysis& MAP = RES.MAP;
+    MAP.session = ARISession();
+    RES.ADJUSTED.clear();
+    RES.LMS.clear();
+    RES.LMSXYZ.clear();
+    std::vector<double> SP;
+    CSR ADJ;
+
+    // The stages off the critical path run on the side thread, one after another, while this
+    // thread runs the ones on it. The pool goes before the data its tasks use.
+    ThreadPool side(1);
+
+    // Sorting and Hommel only need P, the adjacency list only the mask
+    side.submit([&]() {
+        rankPValues(m, P, MAP.ORD, MAP.RANK, SP, sorting);
+        RES.SIMESFACTOR = findsimesfactor(simes, m);
+        hommelResults(m, SP, alpha, simes, RES.SIMESFACTOR, MAP);
+    });
+    ADJ = findAdjListCSR(MASK, INDEXP, DIMS, m, conn, std::max(1, nthreads - sorting));
+    side.wait();
+    if (MAP.wbtdp == 0) return;  // No significant voxels: nothing to cluster
+
+    // The adjusted p-values (back in the order of P) alongside the forest
+    side.submit([&]() {
+        std::vector<double> ADJUSTED = adjustedElementary(SP.data(), MAP.JUMPALPHA.data(), m, RES.SIMESFACTOR.data());
+        std::vector<double>().swap(SP);
+        RES.ADJUSTED.resize(m);
+        for (int i = 0; i < m; i++) RES.ADJUSTED[MAP.ORD[i] - 1] = ADJUSTED[i];
+    });
+    MAP.session.findClusters(m, ADJ, MAP.ORD.data(), MAP.RANK.data(), inner);
+    ADJ = CSR();
+    MAP.session.setIndexp(INDEXP);
+    MAP.session.setCompact(compact);
+    side.wait();
+    if (R) R->check();
+
+    // The local minima only need the forest, so they are found alongside the TDP bounds
+    side.submit([&]() { MAP.session.findLMS(NULL, -1, LMSDIMS, RES.LMS, RES.LMSXYZ); });
+    MAP.session.forestTDP(MAP.h, alpha, RES.SIMESFACTOR[MAP.h], P, nthreads);
+    side.wait();
+
+    // The gradient map only needs the TDP bounds, so it is built alongside the admissible STCs
+    side.submit([&]() { MAP.session.queryPreparation(); });
+    std::vector<double> GAMMAS(gamma_batch);
+    MAP.session.gradientMap(GAMMAS, GRADMAP, nvox);
+    side.wait();
+}
@@ -0,0 +1,310 @@
+#ifndef ARISESSION_H
+#define ARISESSION_H
+
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include "ARICluster.h"
+
+// Storage of one array of a session: a std::vector of its own, or a read-only view into the index
+// file mapped by ARISession::loadIndex. It is read the same way either way (and converts to an
+// ArrayRef for the query functions); vec() gives the std::vector to write to, copying a mapped
+// array out first, so that every call that changes the session still works on a mapped one.
+template <class T>
+class SessionArray
+{
+public:
+    SessionArray() : VIEW(NULL), N(0), MAPPED(false) {}
+    SessionArray(const std::vector<T>& V) : OWN(V), VIEW(NULL), N(0), MAPPED(false) {}
+
+    SessionArray& operator=(const std::vector<T>& V) { vec() = V; return *this; }
+    SessionArray& operator=(std::vector<T>&& V) { vec().swap(V); return *this; }
+
+    const T& operator[](size_t i) const { return data()[i]; }
+    size_t size() const { return MAPPED ? N : OWN.size(); }
+    bool empty() const { return size() == 0; }
+    const T* data() const { return MAPPED ? VIEW : OWN.data(); }
+    const T* begin() const { return data(); }
+    const T* end() const { return data() + size(); }
+    const T& back() const { return data()[size() - 1]; }
+    operator ArrayRef<T>() const { return ArrayRef<T>(data(), size()); }
+    std::vector<T> toVector() const { return std::vector<T>(begin(), end()); }
+
+    std::vector<T>& vec()
+    {
+        if (MAPPED)
+        {
+            OWN.assign(VIEW, VIEW + N);
+            VIEW = NULL;
+            N = 0;
+            MAPPED = false;
+        }
+        return OWN;
+    }
+    void clear() { vec().clear(); }
+    void swap(std::vector<T>& V) { vec().swap(V); }
+
+    // Read the N values at VIEW from now on (memory kept alive by the session, see loadIndex)
+    void map(const T* VIEW, size_t N)
+    {
+        std::vector<T>().swap(OWN);
+        this->VIEW = VIEW;
+        this->N = N;
+        MAPPED = true;
+    }
+    bool mapped() const { return MAPPED; }
+    long long ownedBytes() const { return static_cast<long long>(OWN.capacity() * sizeof(T)); }
+    long long mappedBytes() const { return MAPPED ? static_cast<long long>(N * sizeof(T)) : 0; }
+
+private:
+    std::vector<T> OWN;
+    const T* VIEW;
+    size_t N;
+    bool MAPPED;
+};
+
+// A CSR stored as two session arrays (see SessionArray)
+struct SessionCSR
+{
+    SessionArray<int> OFS;
+    SessionArray<int> IDX;
+
+    SessionCSR() { OFS.vec().assign(1, 0); }
+    SessionCSR& operator=(CSR C)
+    {
+        OFS.swap(C.OFS);
+        IDX.swap(C.IDX);
+        return *this;
+    }
+    void swap(CSR& C)
+    {
+        OFS.swap(C.OFS);
+        IDX.swap(C.IDX);
+    }
+
+    operator CSRRef() const { return CSRRef(OFS, IDX); }
+    int rows() const { return static_cast<int>(OFS.size()) - 1; }
+    std::vector< std::vector<int> > toRows() const { return CSRRef(*this).toRows(); }
+};
+
+class IndexFile;
+
+// An ARISession owns the STC forest (CHILD, SIZE, ROOT) and everything derived from it
+// (TDP, ADMSTC, MARK) on the C++ side. The forest is built once by findClusters (or handed
+// over once by setForest) and all later queries run against the stored data, so nothing
+// has to be copied back and forth between Python and C++ on every call.
+// The forest is also numbered in post-order once, so that every cluster is a contiguous range
+// of ORDER and queries copy ranges instead of walking subtrees.
+// In compact mode (setCompact) the TDP bounds are kept as numbers of discoveries, 4 instead of 8
+// bytes per node and alpha, from which every query recomputes the very same bounds (see CountTDP).
+class ARISession
+{
+public:
+    ARISession();
+
+    // Build the forest from the adjacency list and the sorting orders/ranks (1-based)
+    void findClusters(int m, std::vector< std::vector<int> >& ADJ, std::vector<int>& ORD, std::vector<int>& RANK);
+    void findClusters(int m, std::vector< std::vector<int> >& ADJ, const int* ORD, const int* RANK);
+    void findClusters(int m, const CSR& ADJ, const int* ORD, const int* RANK);
+    void findClusters(int m, const CSR& ADJ, const int* ORD, const int* RANK, int nthreads);  // nthreads <= 0: all hardware threads
+    // Same, with the neighbours read from the mask volume instead of an adjacency list
+    void findClusters(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const int* ORD, const int* RANK);
+    void findClusters(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const int* ORD, const int* RANK, int nthreads);
+
+    // Adopt a forest that was computed elsewhere
+    void setForest(std::vector<int>& SIZE, std::vector<int>& ROOT, std::vector< std::vector<int> >& CHILD);
+
+    // Compute the TDP bounds of all STCs (P holds the unsorted p-values)
+    void forestTDP(int h, double alpha, double simesh, std::vector<double>& P);
+    void forestTDP(int h, double alpha, double simesh, const double* P);  // P must hold m values
+    void forestTDP(int h, double alpha, double simesh, const double* P, int nthreads);  // nthreads <= 0: all hardware threads
+
+    // Compute the TDP bounds for several alphas in one pass (see ::forestTDP). JUMPALPHA holds the
+    // m jumps of h(alpha) and SIMESFACTOR its m+1 values, as returned by findalpha/findsimesfactor.
+    // ALPHA[0] becomes the active alpha; queryPreparation prepares all of them, after which
+    // selectAlpha(k) makes ALPHA[k] the active one without recomputing anything.
+    void forestTDP(const std::vector<double>& ALPHA, const double* JUMPALPHA, const double* SIMESFACTOR, const double* P, int nthreads);
+    void selectAlpha(int k);
+
+    // Set up ADMSTC (and ADMPAR, ADMIDX, ADMCHILD, ADMJUMP) from the stored TDP bounds
+    void queryPreparation();
+
+    // Keep the TDP bounds as numbers of discoveries (TDPNUM) instead of doubles (TDP), or back.
+    // Query results are the same in both modes; switching converts the stored bounds.
+    void setCompact(bool on);
+    bool compact() const { return COMPACT; }
+    // TDP bounds of all nodes in either mode (empty before forestTDP)
+    std::vector<double> tdpBounds() const;
+    // Bytes held by each stored array (by member name, plus "total"), and the bytes of the index
+    // file the mapped ones view ("mapped", not part of the total, see loadIndex)
+    std::map<std::string, long long> footprint() const;
+    // Whether any array views a mapped index file
+    bool mapped() const;
+
+    // Voxel indices of the in-mask voxels, used to map node ids to xyz coordinates
+    void setIndexp(std::vector<int>& INDEXP);
+    void setIndexp(const int* INDEXP);  // INDEXP must hold m values
+
+    std::vector< std::vector<int> > answerQuery(double gamma);
+    std::vector< std::vector< std::vector<int> > > answerQueryBatch(std::vector<double>& gamma_batch);
+    // Pruned queries: only clusters of at least min_size voxels and, of those, the top_k largest per
+    // gamma (all if top_k < 0), in the order of the unpruned answer (see ::answerQueryBatchReps)
+    std::vector< std::vector<int> > answerQuery(double gamma, int min_size, int top_k);
+    std::vector< std::vector< std::vector<int> > > answerQueryBatch(std::vector<double>& gamma_batch, int min_size, int top_k);
+
+    // Compact batch query: cluster representatives per gamma (see ::answerQueryBatchReps)
+    void answerQueryBatchReps(std::vector<double>& gamma_batch, std::vector<int>& REPS, std::vector<int>& OFFSETS);
+    void answerQueryBatchReps(std::vector<double>& gamma_batch, int min_size, int top_k, std::vector<int>& REPS, std::vector<int>& OFFSETS);
+    // Voxels of the cluster represented by v, and per-voxel labels for a list of representatives
+    std::vector<int> clusterMembers(int v);
+    void labelClusters(const int* REPS, int nreps, int* LABEL);
+    void labelClusters(const int* REPS, int nreps, int* LABEL, int nvox);  // LABEL is a volume of nvox voxels, addressed through INDEXP
+    // Write the clusters of the last answerQueryDelta (QREPS) into a label volume of nvox voxels,
+    // addressed through INDEXP: LABEL is cleared and the voxels of the k-th largest cluster get
+    // label k (ties in the order of answerQuery, ranked as by counting_sort). REPS[k-1] and
+    // SIZES[k-1] are the representative and size of label k.
+    void answerQueryLabels(int* LABEL, int nvox, std::vector<int>& REPS, std::vector<int>& SIZES);
+    // Supra-threshold clusters of the k nodes with the smallest p-values (ORD as given to findClusters)
+    void thresholdClusters(int k, const int* ORD, std::vector<int>& REPS);
+    // Summary table of the clusters represented by REPS (see ::clusterSummary); STAT and ATLAS
+    // (may be NULL) are volumes of DIMS[0]*DIMS[1]*DIMS[2] voxels, addressed through INDEXP
+    void clusterSummary(const int* REPS, int nreps, const int* DIMS, const double* STAT, const int* ATLAS, ClusterTable& TBL, int nthreads);
+    // Stateful query for a moving TDP threshold: the representatives of the clusters that appeared
+    // (ADDED) and disappeared (REMOVED) since the previous call (see ::answerQueryDelta). The first
+    // call after queryPreparation or selectAlpha returns all clusters at gamma in ADDED. QREPS then
+    // holds the representatives of all clusters at gamma, in the order of answerQuery.
+    void answerQueryDelta(double gamma, std::vector<int>& ADDED, std::vector<int>& REMOVED);
+    // Representative of the cluster at gamma that contains node v, or -1 (see ::containingCluster),
+    // with the size and TDP bound of that cluster (0 and -1 if none). Needs no answered query, so a
+    // hover readout can call it for any gamma.
+    int containingCluster(int v, double gamma, int& size, double& tdp);
+    std::vector< std::vector<int> > changeQuery(int v, double tdpchg, const std::vector< std::vector<int> >& ANS);
+    std::vector<int> findLMS();
+    // Local minima in ascending order of p (ORD as given to findClusters, or NULL for node id order),
+    // at most topk of them (all if topk < 0), with their xyz coordinates in XYZ (n x 3, see ids2xyz)
+    void findLMS(const int* ORD, int topk, const int* DIMS, std::vector<int>& LMS, std::vector<int>& XYZ);
+
+    // Gradient map over a volume of nvox voxels, addressed through INDEXP (see ::gradientMap)
+    void gradientMap(std::vector<double>& gamma_batch, float* GRADMAP, int nvox);
+    // Same, counting only the clusters of a pruned query (see answerQueryBatch). With top_k < 0 this
+    // is still one walk of the forest; with top_k >= 0 every gamma is answered and painted.
+    void gradientMap(std::vector<double>& gamma_batch, float* GRADMAP, int nvox, int min_size, int top_k);
+
+    // Convert node ids (0-based, in-mask) to xyz coordinates through INDEXP
+    std::vector< std::vector<int> > ids2xyz(std::vector<int>& IDS, std::vector<int>& DIMS);
+    void ids2xyz(const int* IDS, int n, const int* DIMS, int* XYZ);  // XYZ holds n rows of 3
+    // xyz coordinates (n x 3) of the voxels of the cluster represented by v, in the order of clusterMembers
+    void clusterXYZ(int v, const int* DIMS, std::vector<int>& XYZ);
+
+    // On-disk index (see ARISession.cpp for the format). saveIndex writes the forest, TDP bounds,
+    // admissible STCs and INDEXP of a prepared session, together with the sorting orders/ranks
+    // (m values each) and the Hommel results, under a key (at most 64 characters) identifying the
+    // inputs. loadIndex maps the file read-only and the session's arrays view its sections, so
+    // nothing is read until a query touches it and every process that opens the same index shares
+    // the pages; only ORD, RANK and the Hommel results are copied out, and the session is left in
+    // full (not compact) mode, as the mapped bounds take no memory of their own. It returns false,
+    // leaving the session untouched, if the file does not exist or was written for another key
+    // or format version.
+    void saveIndex(const std::string& path, const std::string& key, const int* ORD, const int* RANK,
+                   const std::vector<double>& JUMPALPHA, const std::vector<double>& SIMESFACTOR) const;
+    bool loadIndex(const std::string& path, const std::string& key, std::vector<int>& ORD, std::vector<int>& RANK,
+                   std::vector<double>& JUMPALPHA, std::vector<double>& SIMESFACTOR);
+
+    int m;                                  // Number of in-mask voxels
+    SessionArray<int> SIZE;                 // Subtree sizes
+    SessionArray<int> ROOT;                 // Forest roots
+    SessionCSR CHILD;                       // Children list in CSR form (heavy child first)
+    SessionArray<int> ORDER;                // Nodes in post-order (see postOrder)
+    SessionArray<int> POS;                  // Position of each node in ORDER
+    SessionArray<double> TDP;               // TDP bounds of all nodes (-1 for invalid STCs); empty in compact mode
+    SessionArray<int> TDPNUM;               // Discoveries of all nodes in compact mode (-1 for invalid STCs), empty otherwise
+    SessionArray<int> ADMSTC;               // Admissible STCs in ascending order of TDP
+    SessionArray<int> ADMPAR;               // Nearest admissible proper ancestor (-1 if none)
+    SessionArray<int> ADMIDX;               // Position of each node in ADMSTC (-1 if inadmissible)
+    SessionCSR ADMCHILD;                    // Admissible children (see admissibleChildren)
+    SessionArray<int> ADMJUMP;              // Jump pointers over ADMPAR (see admissibleJumps)
+    std::vector<bool> MARK;                 // Scratch marks, always cleared back to false
+    SessionArray<int> INDEXP;               // Voxel indices of in-mask voxels
+
+    // Results of one alpha of a multi-alpha forestTDP
+    struct AlphaResults
+    {
+        double alpha;
+        std::vector<double> TDP;
+        std::vector<int> TDPNUM;
+        std::vector<int> ADMSTC;
+        std::vector<int> ADMPAR;
+        std::vector<int> ADMIDX;
+        CSR ADMCHILD;
+        std::vector<int> ADMJUMP;
+    };
+    std::vector<AlphaResults> ALPHAS;       // All alphas of a multi-alpha forestTDP (empty otherwise); the
+                                            // results of the active one are kept in TDP, ADMSTC, ADMPAR, ADMIDX, ADMCHILD and ADMJUMP
+    int ACTIVE;                             // Index of the active alpha in ALPHAS
+    double QGAMMA;                          // Gamma of the last answerQueryDelta (infinity if none)
+    std::vector<int> QREPS;                 // Representatives of the clusters at QGAMMA
+    bool COMPACT;                           // TDP bounds kept in TDPNUM (see setCompact)
+    std::shared_ptr<const IndexFile> INDEXFILE;  // The mapped index file the arrays may view (see loadIndex)
+
+private:
+    // Whether forestTDP has run, and the stored bounds in the form the query functions take
+    bool hasTDP() const;
+    CountTDP countTDP() const { return CountTDP(TDPNUM.data(), SIZE.data()); }
+    // Store freshly computed bounds (in the current mode) in TDP or TDPNUM
+    void storeTDP(std::vector<double>& BOUNDS, std::vector<double>& TDP, std::vector<int>& TDPNUM) const;
+    // Number a newly built forest and drop everything derived from the previous one
+    void resetForest(int m);
+    // Forget the state of answerQueryDelta
+    void resetDelta();
+};
+
+// One map of analyseMaps: the session, prepared for queries (forest, TDP bounds, admissible STCs
+// and INDEXP), with the sorting orders/ranks (1-based) and the Hommel results it was built from
+struct MapAnalysis
+{
+    ARISession session;
+    std::vector<int> ORD;
+    std::vector<int> RANK;
+    std::vector<double> JUMPALPHA;          // Jumps of h(alpha) (see findalpha)
+    int h;                                  // h(alpha)
+    double wbtdp;                           // Whole-brain TDP: discoveries among all m voxels / m
+    int concentration;                      // Concentration index into the sorted p-values (see findConcentration)
+};
+
+// Analyse several maps with the same mask at one alpha. Everything that only depends on the mask,
+// m and conn is computed once and shared: the adjacency list (MASK, INDEXP, DIMS and conn as for
+// findClusters) and the simes factors (returned in SIMESFACTOR, m+1 values). Every map P[k]
+// (m unsorted p-values) then goes through Hommel, findClusters, forestTDP and queryPreparation
+// into MAPS[k]. At most maxmaps maps (<= 0: one per thread) are in progress at a time, each on
+// its share of the nthreads threads (<= 0: all hardware threads).
+void analyseMaps(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const std::vector<const double*>& P,
+                 double alpha, bool simes, int nthreads, int maxmaps, std::vector<double>& SIMESFACTOR, std::vector<MapAnalysis>& MAPS);
+
+// Everything runPipeline computes for one map: the prepared session and the Hommel results (as in
+// analyseMaps), the simes factors (m+1 values), the adjusted p-values of the elementary
+// hypotheses (in the order of P) and the local minima (see ARISession::findLMS, in node id order)
+// with their xyz coordinates
+struct PipelineResult
+{
+    MapAnalysis MAP;
+    std::vector<double> SIMESFACTOR;
+    std::vector<double> ADJUSTED;
+    std::vector<int> LMS;
+    std::vector<int> LMSXYZ;
+};
+
+// The whole analysis of one map, run as a graph of stages rather than one stage after another:
+// sorting and Hommel (which only need P) run alongside the adjacency list (which only needs the
+// mask), the adjusted p-values alongside findClusters, the local minima alongside forestTDP and
+// queryPreparation alongside the gradient map, so that the run takes as long as its critical path.
+// P holds the m unsorted p-values and MASK, INDEXP, DIMS and conn are as for findClusters; the
+// session is built in compact mode if compact is set (see ARISession::setCompact). The gradient
+// map for gamma_batch is written to the nvox voxels of GRADMAP (see ::gradientMap) and the xyz
+// coordinates of the local minima follow LMSDIMS (see ids2xyz). If the whole-brain TDP is 0, the
+// run stops after Hommel, with an empty session and GRADMAP untouched. nthreads <= 0: all
+// hardware threads.
+void runPipeline(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const double* P, double alpha, bool simes, bool compact,
+                 const std::vector<double>& gamma_batch, float* GRADMAP, int nvox, const int* LMSDIMS, int nthreads, PipelineResult& RES);
+
+#endif // ARISESSION_H
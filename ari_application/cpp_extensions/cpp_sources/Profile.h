@@ -0,0 +1,219 @@
+// Profile.h
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Per-stage profiling of the native functions. A function opens a ProfileScope named after
+// itself and adds its counters (voxels processed, heavy paths walked, ...) to it; when the scope
+// closes, its wall time and counters are added to the totals of that stage. Profiling is off by
+// default, and a scope then only reads one flag. profileEnable(true) switches it on, and
+// profileStats() returns the totals of all stages since the last profileReset().
+// Every thread collects its totals in its own buffer, which is merged into the shared totals when
+// the thread exits (the ThreadPool workers exit before the functions that use them return) and
+// when profileStats() is called, so parallel stages do not contend for a lock.
+// Compiling with ARI_NO_PROFILE removes the instrumentation altogether.
+
+// Totals of one stage
+struct ProfileStage
+{
+    long long calls;
+    double seconds;                             // Wall time
+    long long peakrss;                          // Peak resident set size of the process in kB at the end of a call (0 if not recorded)
+    std::map<std::string, long long> COUNTS;    // Counters, summed over all calls
+
+    ProfileStage() : calls(0), seconds(0), peakrss(0) {}
+};
+
+// Peak resident set size of the process in kB (0 where getrusage is not available)
+inline long long peakResidentKB()
+{
+#ifndef _WIN32
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;  // bytes
+#else
+    return usage.ru_maxrss;  // kilobytes
+#endif
+#else
+    return 0;
+#endif
+}
+
+class Profiler
+{
+public:
+    static Profiler& instance()
+    {
+        static Profiler P;
+        return P;
+    }
+
+    std::atomic<bool> enabled;
+
+    // Add the totals of one thread
+    void merge(std::map<std::string, ProfileStage>& STAGES)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (std::map<std::string, ProfileStage>::iterator it = STAGES.begin(); it != STAGES.end(); ++it)
+        {
+            ProfileStage& S = TOTALS[it->first];
+            S.calls += it->second.calls;
+            S.seconds += it->second.seconds;
+            if (it->second.peakrss > S.peakrss) S.peakrss = it->second.peakrss;
+            for (std::map<std::string, long long>::iterator c = it->second.COUNTS.begin(); c != it->second.COUNTS.end(); ++c)
+            {
+                S.COUNTS[c->first] += c->second;
+            }
+        }
+        STAGES.clear();
+    }
+
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        TOTALS.clear();
+    }
+
+    std::map<std::string, ProfileStage> totals()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return TOTALS;
+    }
+
+private:
+    Profiler() : enabled(false) {}
+
+    std::mutex mtx;
+    std::map<std::string, ProfileStage> TOTALS;
+};
+
+// Totals of the calling thread, merged into the Profiler when the thread exits
+struct ProfileBuffer
+{
+    std::map<std::string, ProfileStage> STAGES;
+    ~ProfileBuffer() { Profiler::instance().merge(STAGES); }
+};
+
+inline ProfileBuffer& profileBuffer()
+{
+    thread_local ProfileBuffer B;
+    return B;
+}
+
+#ifndef ARI_NO_PROFILE
+
+inline bool profileEnabled() { return Profiler::instance().enabled.load(std::memory_order_relaxed); }
+
+// Switch profiling on or off (off by default)
+inline void profileEnable(bool on) { Profiler::instance().enabled.store(on); }
+
+// Forget all totals, including those of the calling thread
+inline void profileReset()
+{
+    profileBuffer().STAGES.clear();
+    Profiler::instance().reset();
+}
+
+// Totals of all stages since the last profileReset
+inline std::map<std::string, ProfileStage> profileStats()
+{
+    Profiler::instance().merge(profileBuffer().STAGES);
+    return Profiler::instance().totals();
+}
+
+// Times one call of a stage and collects its counters (at most MAXCOUNTS different ones).
+// With rss set, the peak resident set size is recorded at the end of the call as well; that is
+// a system call, so it is meant for the entry points rather than for functions called per path.
+class ProfileScope
+{
+public:
+    explicit ProfileScope(const char* stage, bool rss = false) : stage(stage), rss(rss), active(profileEnabled()), ncounts(0)
+    {
+        if (active) t0 = std::chrono::steady_clock::now();
+    }
+
+    ~ProfileScope()
+    {
+        if (!active) return;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        ProfileStage& S = profileBuffer().STAGES[stage];
+        S.calls++;
+        S.seconds += seconds;
+        if (rss)
+        {
+            long long kb = peakResidentKB();
+            if (kb > S.peakrss) S.peakrss = kb;
+        }
+        for (int i = 0; i < ncounts; i++)
+        {
+            S.COUNTS[NAMES[i]] += COUNTS[i];
+        }
+    }
+
+    // Whether this call is profiled, for counters that take work to compute
+    bool enabled() const { return active; }
+
+    void count(const char* name, long long n)
+    {
+        if (!active) return;
+        for (int i = 0; i < ncounts; i++)
+        {
+            if (NAMES[i] == name || std::strcmp(NAMES[i], name) == 0)
+            {
+                COUNTS[i] += n;
+                return;
+            }
+        }
+        if (ncounts < MAXCOUNTS)
+        {
+            NAMES[ncounts] = name;
+            COUNTS[ncounts] = n;
+            ncounts++;
+        }
+    }
+
+private:
+    static const int MAXCOUNTS = 8;
+
+    const char* stage;
+    bool rss;
+    bool active;
+    int ncounts;
+    const char* NAMES[MAXCOUNTS];
+    long long COUNTS[MAXCOUNTS];
+    std::chrono::steady_clock::time_point t0;
+
+    ProfileScope(const ProfileScope&);
+    ProfileScope& operator=(const ProfileScope&);
+};
+
+#else
+
+inline bool profileEnabled() { return false; }
+inline void profileEnable(bool) {}
+inline void profileReset() {}
+inline std::map<std::string, ProfileStage> profileStats() { return std::map<std::string, ProfileStage>(); }
+
+class ProfileScope
+{
+public:
+    explicit ProfileScope(const char*, bool = false) {}
+    bool enabled() const { return false; }
+    void count(const char*, long long) {}
+};
+
+#endif // ARI_NO_PROFILE
+
+#endif // PROFILE_H
@@ -0,0 +1,170 @@
+// Progress.h
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+
+// Progress reports and cancellation for the long native loops (findAdjList, findClusters,
+// forestTDP, answerQueryBatch, gradientMap). The caller installs a ProgressReporter on its thread
+// with progressInstall; a function that supports it picks the reporter up at entry (and hands it
+// to its ThreadPool tasks), announces each stage with begin() and reports its work with advance()
+// every PROGRESS_GRAIN units or so. advance() throws ARICancelled once cancel() has been called,
+// from any thread, so a cancelled call unwinds within one grain of work per thread and frees its
+// cores. Without a reporter the loops only test a null pointer.
+// The optional callback is called from whichever thread reports, at most once per interval and
+// never concurrently; returning false cancels the call.
+
+// Units of work (voxels, nodes, queries) a loop does between two reports
+static const long long PROGRESS_GRAIN = 4096;
+
+// Thrown by a call that was cancelled through its ProgressReporter
+class ARICancelled : public std::runtime_error
+{
+public:
+    ARICancelled() : std::runtime_error("cancelled") {}
+};
+
+typedef bool (*ProgressCallback)(void* ctx, const char* stage, double fraction);
+
+class ProgressReporter
+{
+public:
+    explicit ProgressReporter(ProgressCallback callback = NULL, void* ctx = NULL, double interval = 0.1)
+        : callback(callback), ctx(ctx), interval(interval), stage(""), done(0), total(0), stopped(false), deadline(0)
+    {
+    }
+
+    // Start a stage of total units of work (called by the thread that runs the function)
+    void begin(const char* name, long long n)
+    {
+        stage.store(name);
+        total.store(n);
+        done.store(0);
+        check();
+        report(true);
+    }
+
+    // Add n units of work to the current stage (from any thread); throws ARICancelled if cancelled
+    void advance(long long n)
+    {
+        done.fetch_add(n, std::memory_order_relaxed);
+        check();
+        if (callback) report(false);
+    }
+
+    // Same without the cancellation check, for destructors
+    void add(long long n) { done.fetch_add(n, std::memory_order_relaxed); }
+
+    // Throw ARICancelled if cancel() has been called
+    void check() const
+    {
+        if (stopped.load(std::memory_order_relaxed)) throw ARICancelled();
+    }
+
+    void cancel() { stopped.store(true); }
+    bool cancelled() const { return stopped.load(); }
+
+    const char* currentStage() const { return stage.load(); }
+
+    // Fraction of the current stage done so far, in [0, 1]
+    double fraction() const
+    {
+        long long n = total.load(std::memory_order_relaxed);
+        if (n <= 0) return 0;
+        double f = static_cast<double>(done.load(std::memory_order_relaxed)) / static_cast<double>(n);
+        return f < 1 ? f : 1;
+    }
+
+private:
+    // Call the callback if the interval has passed since the previous call (or always, with force)
+    void report(bool force)
+    {
+        if (!callback) return;
+        long long now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        if (!force && now < deadline.load(std::memory_order_relaxed)) return;
+
+        std::unique_lock<std::mutex> lock(mtx, std::try_to_lock);
+        if (!lock.owns_lock()) return;  // Another thread is reporting
+        deadline.store(now + static_cast<long long>(interval * 1e9), std::memory_order_relaxed);
+        if (!callback(ctx, stage.load(), fraction())) stopped.store(true);
+        lock.unlock();
+        check();
+    }
+
+    ProgressCallback callback;
+    void* ctx;
+    double interval;                    // Seconds between two callback calls
+    std::atomic<const char*> stage;
+    std::atomic<long long> done;
+    std::atomic<long long> total;
+    std::atomic<bool> stopped;
+    std::atomic<long long> deadline;    // steady_clock time (ns) of the next callback call
+    std::mutex mtx;                     // Held while the callback runs
+
+    ProgressReporter(const ProgressReporter&);
+    ProgressReporter& operator=(const ProgressReporter&);
+};
+
+// Reporter installed on the calling thread, or NULL
+inline ProgressReporter*& progressSlot()
+{
+    thread_local ProgressReporter* R = NULL;
+    return R;
+}
+
+inline ProgressReporter* progressCurrent() { return progressSlot(); }
+
+// Install R (may be NULL) on the calling thread and return the previously installed reporter
+inline ProgressReporter* progressInstall(ProgressReporter* R)
+{
+    ProgressReporter* prev = progressSlot();
+    progressSlot() = R;
+    return prev;
+}
+
+// Installs a reporter (may be NULL) on the calling thread for the lifetime of the guard
+class ProgressGuard
+{
+public:
+    explicit ProgressGuard(ProgressReporter* R) : prev(progressInstall(R)) {}
+    ~ProgressGuard() { progressInstall(prev); }
+
+private:
+    ProgressReporter* prev;
+
+    ProgressGuard(const ProgressGuard&);
+    ProgressGuard& operator=(const ProgressGuard&);
+};
+
+// Collects the progress of one loop and passes it on to the reporter every PROGRESS_GRAIN units,
+// so that the shared counters are only touched once per grain
+class ProgressTicker
+{
+public:
+    explicit ProgressTicker(ProgressReporter* R) : R(R), pending(0) {}
+    ~ProgressTicker() { if (R && pending) R->add(pending); }
+
+    void operator()(long long n = 1)
+    {
+        if (!R) return;
+        pending += n;
+        if (pending >= PROGRESS_GRAIN)
+        {
+            long long k = pending;
+            pending = 0;
+            R->advance(k);
+        }
+    }
+
+private:
+    ProgressReporter* R;
+    long long pending;
+
+    ProgressTicker(const ProgressTicker&);
+    ProgressTicker& operator=(const ProgressTicker&);
+};
+
+#endif // PROGRESS_H
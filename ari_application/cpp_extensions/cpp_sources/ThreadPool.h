@@ -0,0 +1,147 @@
+// ThreadPool.h
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+
+// A small work-stealing thread pool. Every worker owns a task queue; submit() deals the tasks
+// out round-robin, a worker takes tasks from the front of its own queue and, once that is empty,
+// steals from the back of the other queues. Submitting tasks in descending order of cost thus
+// starts the most expensive tasks first, while the cheap ones at the back fill up idle workers.
+// wait() blocks until all submitted tasks have finished and rethrows the first exception thrown
+// by a task, if any.
+class ThreadPool
+{
+public:
+    // nthreads <= 0 uses one worker per hardware thread
+    explicit ThreadPool(int nthreads = 0) : queued(0), pending(0), next(0), stop(false)
+    {
+        if (nthreads <= 0) nthreads = std::thread::hardware_concurrency();
+        if (nthreads <= 0) nthreads = 1;
+
+        for (int i = 0; i < nthreads; i++) queues.push_back(new Queue());
+        for (int i = 0; i < nthreads; i++) workers.push_back(std::thread(&ThreadPool::work, this, i));
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stop = true;
+        }
+        cv_work.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+        for (size_t i = 0; i < queues.size(); i++) delete queues[i];
+    }
+
+    int size() const { return static_cast<int>(workers.size()); }
+
+    void submit(const std::function<void()>& task)
+    {
+        Queue* q = queues[next];
+        next = (next + 1) % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(q->mtx);
+            q->tasks.push_back(task);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            queued++;
+            pending++;
+        }
+        cv_work.notify_one();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv_done.wait(lock, [this] { return pending == 0; });
+        if (error)
+        {
+            std::exception_ptr e = error;
+            error = std::exception_ptr();
+            std::rethrow_exception(e);
+        }
+    }
+
+private:
+    struct Queue
+    {
+        std::deque< std::function<void()> > tasks;
+        std::mutex mtx;
+    };
+
+    // Take a task from the front of the own queue, or steal one from the back of another queue
+    bool take(int i, std::function<void()>& task)
+    {
+        int n = queues.size();
+        for (int k = 0; k < n; k++)
+        {
+            Queue* q = queues[(i + k) % n];
+            std::lock_guard<std::mutex> lock(q->mtx);
+            if (q->tasks.empty()) continue;
+            if (k == 0)
+            {
+                task = q->tasks.front();
+                q->tasks.pop_front();
+            }
+            else
+            {
+                task = q->tasks.back();
+                q->tasks.pop_back();
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void work(int i)
+    {
+        std::function<void()> task;
+        while (true)
+        {
+            if (take(i, task))
+            {
+                try
+                {
+                    task();
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    if (!error) error = std::current_exception();
+                }
+                task = std::function<void()>();
+
+                std::lock_guard<std::mutex> lock(mtx);
+                if (--pending == 0) cv_done.notify_all();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mtx);
+            cv_work.wait(lock, [this] { return stop || queued > 0; });
+            if (stop && queued == 0) return;
+        }
+    }
+
+    std::vector<Queue*> queues;
+    std::vector<std::thread> workers;
+    std::mutex mtx;                    // Guards pending, stop & error
+    std::condition_variable cv_work;   // Signalled when tasks are queued or the pool stops
+    std::condition_variable cv_done;   // Signalled when all pending tasks have finished
+    std::atomic<int> queued;           // Tasks still sitting in a queue
+    int pending;                       // Tasks submitted but not finished
+    size_t next;                       // Queue that receives the next submitted task
+    bool stop;
+    std::exception_ptr error;
+};
+
+#endif // THREADPOOL_H
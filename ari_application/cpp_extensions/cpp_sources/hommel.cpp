@@ -2,11 +2,26 @@
 #include <vector>
 #include <cmath>
 #include <algorithm>
+#include <utility>
+#include <stdexcept>
+#include <memory>
+#include <cstring>
+#include <thread>
+#include <stdint.h>
 #include <stdbool.h> 
 #include "hommel.h"
+#include "hommel_simd.h"
+#include "Profile.h"
+#include "ThreadPool.h"
 
 // Implementation of Fortune 1989
 std::vector<int> findhull(int m, const std::vector<double>& p) {
+    return findhull(m, p.data());
+}
+
+std::vector<int> findhull(int m, const double* p) {
+    ProfileScope prof("findhull");
+    prof.count("pvalues", m);
     int r;
     std::vector<int> hull(1);
     hull.push_back(1);
@@ -31,6 +46,7 @@ std::vector<int> findhull(int m, const std::vector<double>& p) {
             hull.push_back(i);
         }
     }
+    prof.count("hull", hull.size() - 1);
     return hull;
 }
 
@@ -42,6 +58,14 @@ std::vector<int> findhull(int m, const std::vector<double>& p) {
 // - const std::vector<double>& simesfactor: A constant reference to a vector representing the denominator of the local test.
 // - bool simes: A boolean indicating whether the Simes method is assumed or not.
 std::vector<double> findalpha(const std::vector<double>& p, int m, const std::vector<double>& simesfactor, bool simes) {
+    return findalpha(p.data(), m, simesfactor.data(), simes);
+}
+
+// Pointer-based variant of findalpha, so that callers holding contiguous arrays (e.g. NumPy
+// buffers) do not have to copy them into a std::vector first
+std::vector<double> findalpha(const double* p, int m, const double* simesfactor, bool simes) {
+    ProfileScope prof("findalpha", true);
+    prof.count("pvalues", m);
     
     // Create a vector 'alpha' of size m+1, initialized with zeros.
     // This will store the alpha values that correspond to the jumps of h(alpha).
@@ -82,6 +106,7 @@ std::vector<double> findalpha(const std::vector<double>& p, int m, const std::ve
 
 // Calculates the denominator of the local test
 std::vector<double> findsimesfactor(bool simes, int m) {
+    ProfileScope prof("findsimesfactor");
     std::vector<double> simesfactor(m+1);
     double multiplier = 0;
     simesfactor[0] = 0;
@@ -99,17 +124,16 @@ std::vector<double> findsimesfactor(bool simes, int m) {
 
 // Calculate adjusted p-values for all elementary hypotheses
 std::vector<double> adjustedElementary(const std::vector<double>& p, const std::vector<double>& alpha, int m, const std::vector<double>& simesfactor) {
+    return adjustedElementary(p.data(), alpha.data(), m, simesfactor.data());
+}
+
+std::vector<double> adjustedElementary(const double* p, const double* alpha, int m, const double* simesfactor) {
+    ProfileScope prof("adjustedElementary", true);
+    prof.count("pvalues", m);
     std::vector<double> adjusted(m);
-    int i = 1;
-    int j = m + 1;
-    while (i <= m) {
-        if (simesfactor[j-1] * p[i-1] <= alpha[j-1]) {
-            adjusted[i-1] = std::min(simesfactor[j] * p[i-1], alpha[j-1]);
-            i++;
-        } else {
-            j--;
-        }
-    }
+    // i = 1, j = m + 1; while i <= m: if simesfactor[j-1] * p[i-1] <= alpha[j-1], set
+    // adjusted[i-1] = min(simesfactor[j] * p[i-1], alpha[j-1]) and i++, else j-- (vectorised, see hommel_simd.cpp)
+    simdAdjustedElementary(p, alpha, m, simesfactor, adjusted.data());
     return adjusted;
 }
 
@@ -134,6 +158,11 @@ double adjustedIntersection(double pI, const std::vector<double>& alpha, int m,
 
 // Calculate the value of h(alpha) for a given alpha
 int findHalpha(const std::vector<double>& jumpalpha, double alpha, int m) {
+    return findHalpha(jumpalpha.data(), alpha, m);
+}
+
+int findHalpha(const double* jumpalpha, double alpha, int m) {
+    ProfileScope prof("findHalpha");
     int lower = 0;
     int upper = m + 1;
     int mid = 0;
@@ -150,12 +179,15 @@ int findHalpha(const std::vector<double>& jumpalpha, double alpha, int m) {
 
 // Calculates the size of the concentration set at a fixed alpha
 int findConcentration(const std::vector<double>& p, double simesfactor, int h, double alpha, int m) {
+    return findConcentration(p.data(), simesfactor, h, alpha, m);
+}
+
+int findConcentration(const double* p, double simesfactor, int h, double alpha, int m) {
+    ProfileScope prof("findConcentration");
     int z = m - h;
     if (z > 0) {
-        // while ((z < m) & (simesfactor * p[z-1] > (z - m + h + 1) * alpha)) {
-        while ((z < m) && (simesfactor * p[z-1] > (z - m + h + 1) * alpha)) {
-            z++;
-        }
+        // while ((z < m) && (simesfactor * p[z-1] > (z - m + h + 1) * alpha)) z++, vectorised
+        z = simdConcentration(p, z, simesfactor, h, alpha, m);
     }
     return z;
 }
@@ -190,15 +222,17 @@ void Union(int x, int y, std::vector<int>& parent, std::vector<int>& lowest, std
 }
 
 
-// Calculate the category for each p-value
+// Calculate the category for each p-value. Categories above m all act as m + 1 in
+// findDiscoveries (which never uses more than m), so they are capped there; that also keeps
+// the conversion to int in range.
 int getCategory(double p, double simesfactor, double alpha, int m) {
     if (p == 0 || simesfactor == 0)
         return 1;
     else if (alpha == 0)
         return m + 1;
     else {
-        double cat = (simesfactor / alpha) * p;
-        return static_cast<int>(std::ceil(cat));
+        double cat = std::ceil((simesfactor / alpha) * p);
+        return (cat <= m) ? static_cast<int>(cat) : m + 1;
     }
 }
 
@@ -210,14 +244,15 @@ int getCategory(double p, double simesfactor, double alpha, int m) {
 
 // Implementation of findDiscoveries
 std::vector<int> findDiscoveries(const std::vector<int>& idx, const std::vector<double>& allp, double simesfactor, int h, double alpha, int k, int m) {
-    // Calculate categories for the p-values
-    std::vector<int> cats;
-    for (int i = 0; i < k; i++) {
-        cats.push_back(getCategory(allp[idx[i] - 1], simesfactor, alpha, m));
-    }
+    return findDiscoveries(idx.data(), allp.data(), simesfactor, h, alpha, k, m);
+}
+
+// The algorithm proper, given the categories of the selected p-values and the concentration
+const int* findDiscoveriesOfCategories(const int* cats, int z, int h, int k, int m, DiscoveryScratch& S) {
+    ProfileScope prof("findDiscoveries");
+    prof.count("pvalues", k);
 
     // Find the maximum category needed
-    int z = findConcentration(allp, simesfactor, h, alpha, m);
     int maxcat = std::min(z - m + h + 1, k);
     int maxcatI = 0;
     for (int i = k - 1; i >= 0; i--) {
@@ -228,17 +263,22 @@ std::vector<int> findDiscoveries(const std::vector<int>& idx, const std::vector<
     }
     maxcat = std::min(maxcat, maxcatI);
 
-    // Prepare disjoint set data structure
-    std::vector<int> parent(maxcat + 1);
-    std::vector<int> lowest(maxcat + 1);
-    std::vector<int> rank(maxcat + 1, 0);
+    // Prepare disjoint set data structure (the vectors keep their capacity between calls)
+    std::vector<int>& parent = S.parent;
+    std::vector<int>& lowest = S.lowest;
+    std::vector<int>& rank = S.rank;
+    parent.resize(maxcat + 1);
+    lowest.resize(maxcat + 1);
+    rank.assign(maxcat + 1, 0);
     for (int i = 0; i <= maxcat; i++) {
         parent[i] = i;
         lowest[i] = i;
     }
 
     // The algorithm proper
-    std::vector<int> discoveries(k + 1, 0);
+    std::vector<int>& discoveries = S.discoveries;
+    discoveries.resize(k + 1);
+    discoveries[0] = 0;
     int lowestInPi;
     for (int i = 0; i < k; i++) {
         if (cats[i] <= maxcat) {
@@ -254,5 +294,200 @@ std::vector<int> findDiscoveries(const std::vector<int>& idx, const std::vector<
         }
     }
 
-    return discoveries;
-}
\ No newline at end of file
+    return discoveries.data();
+}
+
+std::vector<int> findDiscoveries(const int* idx, const double* allp, double simesfactor, int h, double alpha, int k, int m) {
+    // Calculate categories for the p-values (getCategory, vectorised)
+    DiscoveryScratch S;
+    S.cats.resize(k);
+    simdGatherCategories(idx, allp, k, simesfactor, alpha, m, S.cats.data());
+
+    findDiscoveriesOfCategories(S.cats.data(), findConcentration(allp, simesfactor, h, alpha, m), h, k, m, S);
+    return std::move(S.discoveries);
+}
+
+std::vector<int> findDiscoveriesOfP(const double* pk, const double* allp, double simesfactor, int h, double alpha, int k, int m) {
+    // Calculate categories for the p-values (getCategory, vectorised)
+    DiscoveryScratch S;
+    S.cats.resize(k);
+    simdCategories(pk, k, simesfactor, alpha, m, S.cats.data());
+
+    findDiscoveriesOfCategories(S.cats.data(), findConcentration(allp, simesfactor, h, alpha, m), h, k, m, S);
+    return std::move(S.discoveries);
+}
+// The number of discoveries in each of many selections (see hommel.h)
+std::vector<int> findDiscoveriesBatch(const int* PTR, const int* IDX, int nsets, const double* allp, double simesfactor, int h, double alpha, int m, int nthreads) {
+    if (nsets < 0 || PTR[0] != 0) throw std::invalid_argument("'PTR' must start at 0");
+    for (int s = 0; s < nsets; s++) {
+        if (PTR[s + 1] < PTR[s]) throw std::invalid_argument("'PTR' must be non-decreasing");
+    }
+    for (int j = 0; j < PTR[nsets]; j++) {
+        if (IDX[j] < 1 || IDX[j] > m) throw std::out_of_range("'IDX' must hold ranks from 1 to m");
+    }
+
+    ProfileScope prof("findDiscoveriesBatch", true);
+    prof.count("sets", nsets);
+    prof.count("pvalues", PTR[nsets]);
+
+    // The concentration, and the categories of all m p-values when the selections hold more
+    // p-values than that (otherwise each selection computes the categories of its own)
+    int z = findConcentration(allp, simesfactor, h, alpha, m);
+    std::vector<int> CAT;
+    if (PTR[nsets] > m) {
+        CAT.resize(m);
+        simdCategories(allp, m, simesfactor, alpha, m, CAT.data());
+    }
+
+    std::vector<int> NUM(nsets, 0);
+    auto run = [&](int first, int last) {
+        DiscoveryScratch S;
+        for (int s = first; s < last; s++) {
+            int k = PTR[s + 1] - PTR[s];
+            if (k == 0) continue;
+            const int* I = IDX + PTR[s];
+            S.cats.resize(k);
+            if (CAT.empty()) {
+                simdGatherCategories(I, allp, k, simesfactor, alpha, m, S.cats.data());
+            } else {
+                for (int i = 0; i < k; i++) {
+                    S.cats[i] = CAT[I[i] - 1];
+                }
+            }
+            NUM[s] = findDiscoveriesOfCategories(S.cats.data(), z, h, k, m, S)[k];
+        }
+    };
+
+    // Consecutive selections are grouped into tasks of at least SET_GRAIN p-values
+    const int SET_GRAIN = 4096;
+    if (nthreads == 1 || PTR[nsets] <= SET_GRAIN) {
+        run(0, nsets);
+        return NUM;
+    }
+
+    ThreadPool pool(nthreads);
+    int first = 0;
+    while (first < nsets) {
+        int last = first + 1;
+        while (last < nsets && PTR[last] - PTR[first] < SET_GRAIN) last++;
+        pool.submit([=, &run]() { run(first, last); });
+        first = last;
+    }
+    pool.wait();
+
+    return NUM;
+}
+
+// Sort key of p: its IEEE bit pattern with the sign bit set for positive values and all bits
+// flipped for negative ones, so that the keys compare as unsigned integers as the values do.
+// -0 becomes +0, which keeps the two in their original order as with operator<.
+static inline uint64_t sortKey(double p) {
+    if (p == 0) p = 0;
+    uint64_t u;
+    std::memcpy(&u, &p, sizeof(u));
+    return (u >> 63) ? ~u : (u | 0x8000000000000000ULL);
+}
+
+void orderPValues(const std::vector<double>& P, std::vector<int>& ORD, std::vector<int>& RANK, std::vector<double>& SP, int nthreads) {
+    int m = P.size();
+    ORD.resize(m);
+    RANK.resize(m);
+    SP.resize(m);
+    orderPValues(P.data(), m, ORD.data(), RANK.data(), SP.data(), nthreads);
+}
+
+// LSD radix sort of (key, index) pairs, RADIX_BITS bits per pass. Every thread owns a contiguous chunk of
+// the array: it counts the digits of its chunk and then scatters the chunk to the offsets that
+// all chunks before it and all smaller digits leave free, which keeps each pass stable. Passes
+// whose digit is the same for all keys (such as the exponent bits of p-values close together)
+// are skipped.
+void orderPValues(const double* P, int m, int* ORD, int* RANK, double* SP, int nthreads) {
+    for (int i = 0; i < m; i++) {
+        if (std::isnan(P[i])) throw std::invalid_argument("'P' must not contain missing values");
+    }
+
+    ProfileScope prof("orderPValues", true);
+    prof.count("pvalues", m);
+
+    const int SORT_GRAIN = 65536;  // Fewest p-values per thread
+    const int RADIX_BITS = 11;     // 6 passes over the 64 bits
+    const int BUCKETS = 1 << RADIX_BITS;
+    if (nthreads <= 0) nthreads = std::thread::hardware_concurrency();
+    int T = std::max(1, std::min(nthreads, m / SORT_GRAIN));
+    std::unique_ptr<ThreadPool> pool;
+    if (T > 1) pool.reset(new ThreadPool(T));
+
+    // Run f(t) for every chunk t, on the pool if there is one
+    auto chunks = [&](const std::function<void(int)>& f) {
+        if (!pool) {
+            f(0);
+            return;
+        }
+        for (int t = 0; t < T; t++) pool->submit([&f, t]() { f(t); });
+        pool->wait();
+    };
+    std::vector<int> LO(T + 1);  // Chunk t is LO[t], ..., LO[t+1] - 1
+    for (int t = 0; t <= T; t++) LO[t] = static_cast<int>(static_cast<long long>(m) * t / T);
+
+    std::vector<uint64_t> KEY(m), KEY2(m);
+    std::vector<int> IDX(m), IDX2(m);
+    chunks([&](int t) {
+        for (int i = LO[t], end = LO[t + 1]; i < end; i++) {
+            KEY[i] = sortKey(P[i]);
+            IDX[i] = i;
+        }
+    });
+
+    std::vector<int> COUNT(BUCKETS * T);
+    int passes = 0;
+    for (int shift = 0; shift < 64; shift += RADIX_BITS) {
+        chunks([&](int t) {
+            int* C = &COUNT[BUCKETS * t];
+            const uint64_t* K = KEY.data();
+            std::fill(C, C + BUCKETS, 0);
+            for (int i = LO[t], end = LO[t + 1]; i < end; i++) C[(K[i] >> shift) & (BUCKETS - 1)]++;
+        });
+
+        // Offsets: digit by digit, chunk by chunk
+        int pos = 0;
+        bool trivial = false;
+        for (int b = 0; b < BUCKETS && !trivial; b++) {
+            int total = 0;
+            for (int t = 0; t < T; t++) {
+                int c = COUNT[BUCKETS * t + b];
+                COUNT[BUCKETS * t + b] = pos;
+                pos += c;
+                total += c;
+            }
+            trivial = (total == m);
+        }
+        if (trivial) continue;
+
+        chunks([&](int t) {
+            int* C = &COUNT[BUCKETS * t];
+            const uint64_t* K = KEY.data();
+            const int* I = IDX.data();
+            uint64_t* K2 = KEY2.data();
+            int* I2 = IDX2.data();
+            for (int i = LO[t], end = LO[t + 1]; i < end; i++) {
+                int j = C[(K[i] >> shift) & (BUCKETS - 1)]++;
+                K2[j] = K[i];
+                I2[j] = I[i];
+            }
+        });
+        KEY.swap(KEY2);
+        IDX.swap(IDX2);
+        passes++;
+    }
+    prof.count("passes", passes);
+
+    std::vector<uint64_t>().swap(KEY);
+    std::vector<uint64_t>().swap(KEY2);
+    chunks([&](int t) {
+        for (int i = LO[t], end = LO[t + 1]; i < end; i++) {
+            ORD[i] = IDX[i] + 1;
+            RANK[IDX[i]] = i + 1;
+            SP[i] = P[IDX[i]];
+        }
+    });
+}
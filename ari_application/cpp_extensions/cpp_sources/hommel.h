@@ -12,6 +12,8 @@
 // These declarations inform the compiler about the functions' existence,
 // their return types, and the types of their parameters, but do not provide
 // the actual implementation. This allows other files to use these functions.
+// Most functions come in two flavours: one taking std::vector references and one taking
+// raw pointers to contiguous arrays (used by the zero-copy NumPy entry points).
 
 // /**
 //  * findhull - Finds the convex hull of a given set of points.
@@ -21,6 +23,7 @@
 //  */
 
 std::vector<int> findhull(int m, const std::vector<double>& p);
+std::vector<int> findhull(int m, const double* p);
 
 // /**
 //  * findalpha - Computes the jumps of h(alpha) for given p-values.
@@ -31,16 +34,57 @@ std::vector<int> findhull(int m, const std::vector<double>& p);
 //  * @return: A vector of alpha values representing the jumps.
 //  */
 std::vector<double> findalpha(const std::vector<double>& p, int m, const std::vector<double>& simesfactor, bool simes);
+std::vector<double> findalpha(const double* p, int m, const double* simesfactor, bool simes);
 
 
 std::vector<double> findsimesfactor(bool simes, int m);
 std::vector<double> adjustedElementary(const std::vector<double>& p, const std::vector<double>& alpha, int m, const std::vector<double>& simesfactor);
+std::vector<double> adjustedElementary(const double* p, const double* alpha, int m, const double* simesfactor);
 double adjustedIntersection(double pI, const std::vector<double>& alpha, int m, const std::vector<double>& simesfactor);
 int findHalpha(const std::vector<double>& jumpalpha, double alpha, int m);
+int findHalpha(const double* jumpalpha, double alpha, int m);
 int findConcentration(const std::vector<double>& p, double simesfactor, int h, double alpha, int m);
+int findConcentration(const double* p, double simesfactor, int h, double alpha, int m);
 int Find(int x, std::vector<int>& parent);
 void Union(int x, int y, std::vector<int>& parent, std::vector<int>& lowest, std::vector<int>& rank);
 int getCategory(double p, double simesfactor, double alpha, int m);
 std::vector<int> findDiscoveries(const std::vector<int>& idx, const std::vector<double>& allp, double simesfactor, int h, double alpha, int k, int m);
+std::vector<int> findDiscoveries(const int* idx, const double* allp, double simesfactor, int h, double alpha, int k, int m);
+// Same, with the selected p-values passed directly (pk[i] = allp[idx[i] - 1]), so that callers
+// evaluating several alphas on one selection only gather them once
+std::vector<int> findDiscoveriesOfP(const double* pk, const double* allp, double simesfactor, int h, double alpha, int k, int m);
+
+// Scratch space of findDiscoveriesOfCategories. Callers that make many calls keep one per thread,
+// so that its vectors only grow when a call needs more room than the ones before it.
+struct DiscoveryScratch
+{
+    std::vector<int> cats;          // For the caller: the categories of the selection
+    std::vector<int> parent, lowest, rank;
+    std::vector<int> discoveries;
+};
+
+// The algorithm of findDiscoveries, given cats[i] (the category of the i-th selected p-value,
+// getCategory) and z = findConcentration(allp, simesfactor, h, alpha, m). Neither depends on the
+// selection other than through its p-values, so callers running many selections of one set of
+// p-values compute them once. Returns the k + 1 counts, which live in S.discoveries.
+const int* findDiscoveriesOfCategories(const int* cats, int z, int h, int k, int m, DiscoveryScratch& S);
+
+// The number of discoveries in each of nsets selections of one set of sorted p-values, such as
+// all clusters of a map or all regions of an atlas: selection s is IDX[PTR[s]], ...,
+// IDX[PTR[s+1] - 1] (1-based ranks, as idx of findDiscoveries), and its count equals
+// findDiscoveries(...)[k] for its k p-values. The concentration is computed once for all
+// selections, as are the categories when the selections overlap (hold more than m p-values in
+// all). The selections run on nthreads threads (nthreads <= 0: all hardware threads).
+// Throws std::invalid_argument for a PTR that does not start at 0 or decreases and
+// std::out_of_range for ranks outside 1, ..., m.
+std::vector<int> findDiscoveriesBatch(const int* PTR, const int* IDX, int nsets, const double* allp, double simesfactor, int h, double alpha, int m, int nthreads);
+
+// Sorting order of the m unsorted p-values P, for both the Hommel and the cluster functions: ORD
+// (1-based) lists the p-values in ascending order, RANK[i] (1-based) is the position of P[i] in
+// it and SP holds the sorted p-values. Ties keep their original order (as
+// np.argsort(kind='stable')). A parallel radix sort on the bit patterns of P, on nthreads threads
+// (nthreads <= 0: all hardware threads). Throws std::invalid_argument if P holds a NaN.
+void orderPValues(const std::vector<double>& P, std::vector<int>& ORD, std::vector<int>& RANK, std::vector<double>& SP, int nthreads);
+void orderPValues(const double* P, int m, int* ORD, int* RANK, double* SP, int nthreads);  // ORD, RANK & SP hold m values
 
 #endif // HOMMEL_H
\ No newline at end of file
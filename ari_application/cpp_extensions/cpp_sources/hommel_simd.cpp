@@ -0,0 +1,458 @@
+/**
+ * @file hommel_simd.cpp
+ * @brief Vectorised versions of the scalar loops of hommel.cpp, with the instruction set chosen
+ *        at run time (see hommel_simd.h).
+ *
+ * The x86 kernels are compiled with per-function target attributes (GCC/Clang) or as plain
+ * intrinsics (MSVC), so the module itself needs no -mavx2 and still runs on any x86-64 CPU. The
+ * NEON kernels are used on 64-bit ARM, where NEON is always present.
+ *
+ * Exact agreement with the scalar loops: every lane does what one scalar iteration does (the
+ * same multiplications and comparisons, and rounding up with ceil), minima are taken with the
+ * operands in the order of std::min, and no multiply-add is fused. Lanes past the point where
+ * the scalar loop would have stopped are computed but discarded.
+ */
+
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "hommel_simd.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define ARI_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define ARI_TARGET(isa)
+#else
+#define ARI_TARGET(isa) __attribute__((target(isa)))
+#endif
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC 12 warns about the deliberately undefined registers inside its own intrinsics (GCC bug 105593)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define ARI_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+// ---------------------------------------------------------------------------------------------
+// Scalar kernels (the reference, and the tails of the vector loops)
+// ---------------------------------------------------------------------------------------------
+
+// getCategory for simesfactor != 0 and alpha != 0, with ratio = simesfactor / alpha
+static inline int categoryOf(double p, double ratio, int m)
+{
+    if (p == 0) return 1;
+    double cat = std::ceil(ratio * p);
+    return (cat <= m) ? static_cast<int>(cat) : m + 1;
+}
+
+static void categoriesScalar(const double* PK, const int* IDX, const double* ALLP, int i, int k, double ratio, int m, int* CATS)
+{
+    for (; i < k; i++)
+    {
+        CATS[i] = categoryOf(IDX ? ALLP[IDX[i] - 1] : PK[i], ratio, m);
+    }
+}
+
+static int concentrationScalar(const double* p, int z, double simesfactor, int h, double alpha, int m)
+{
+    while ((z < m) && (simesfactor * p[z-1] > (z - m + h + 1) * alpha)) {
+        z++;
+    }
+    return z;
+}
+
+static void adjustedScalar(const double* p, const double* alpha, int m, const double* simesfactor, int i, int j, double* ADJUSTED)
+{
+    while (i <= m) {
+        if (simesfactor[j-1] * p[i-1] <= alpha[j-1]) {
+            ADJUSTED[i-1] = std::min(simesfactor[j] * p[i-1], alpha[j-1]);
+            i++;
+        } else {
+            j--;
+        }
+    }
+}
+
+// Number of lanes before the first clear bit of mask
+static inline int leadingLanes(unsigned int mask)
+{
+    int n = 0;
+    while (mask & (1u << n)) n++;
+    return n;
+}
+
+// ---------------------------------------------------------------------------------------------
+// AVX2 (4 lanes) and AVX-512 (8 lanes)
+// ---------------------------------------------------------------------------------------------
+
+#ifdef ARI_SIMD_X86
+
+ARI_TARGET("avx2")
+static void categoriesAVX2(const double* PK, const int* IDX, const double* ALLP, int k, double ratio, int m, int* CATS)
+{
+    const __m256d R = _mm256_set1_pd(ratio);
+    const __m256d MAXCAT = _mm256_set1_pd(m + 1.0);
+    const __m256d ZERO = _mm256_setzero_pd();
+    const __m256d ONE = _mm256_set1_pd(1.0);
+    const __m128i BASE = _mm_set1_epi32(1);
+
+    int i = 0;
+    for (; i + 4 <= k; i += 4)
+    {
+        __m256d P = IDX ? _mm256_i32gather_pd(ALLP, _mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(IDX + i)), BASE), 8)
+                        : _mm256_loadu_pd(PK + i);
+        __m256d C = _mm256_round_pd(_mm256_mul_pd(R, P), _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC);
+        C = _mm256_min_pd(C, MAXCAT);  // Also maps NaN to m + 1
+        C = _mm256_blendv_pd(C, ONE, _mm256_cmp_pd(P, ZERO, _CMP_EQ_OQ));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(CATS + i), _mm256_cvttpd_epi32(C));
+    }
+    categoriesScalar(PK, IDX, ALLP, i, k, ratio, m, CATS);
+}
+
+ARI_TARGET("avx2")
+static int concentrationAVX2(const double* p, int z, double simesfactor, int h, double alpha, int m)
+{
+    const __m256d S = _mm256_set1_pd(simesfactor);
+    const __m256d A = _mm256_set1_pd(alpha);
+    const __m256d FOUR = _mm256_set1_pd(4.0);
+    double b = z - m + h + 1;
+    __m256d B = _mm256_setr_pd(b, b + 1, b + 2, b + 3);
+
+    for (; z + 4 <= m; z += 4)
+    {
+        __m256d GT = _mm256_cmp_pd(_mm256_mul_pd(S, _mm256_loadu_pd(p + z - 1)), _mm256_mul_pd(B, A), _CMP_GT_OQ);
+        unsigned int mask = _mm256_movemask_pd(GT);
+        if (mask != 0xF) return z + leadingLanes(mask);
+        B = _mm256_add_pd(B, FOUR);
+    }
+    return concentrationScalar(p, z, simesfactor, h, alpha, m);
+}
+
+ARI_TARGET("avx2")
+static void adjustedAVX2(const double* p, const double* alpha, int m, const double* simesfactor, double* ADJUSTED)
+{
+    int i = 1;
+    int j = m + 1;
+    while (i + 3 <= m)
+    {
+        __m256d P = _mm256_loadu_pd(p + i - 1);
+        __m256d A = _mm256_set1_pd(alpha[j-1]);
+        __m256d LE = _mm256_cmp_pd(_mm256_mul_pd(_mm256_set1_pd(simesfactor[j-1]), P), A, _CMP_LE_OQ);
+        unsigned int mask = _mm256_movemask_pd(LE);
+        if (mask == 0) { j--; continue; }
+
+        // min(A, X) picks X unless A < X, as std::min(X, A) does. Lanes past the first failing
+        // one are overwritten later.
+        _mm256_storeu_pd(ADJUSTED + i - 1, _mm256_min_pd(A, _mm256_mul_pd(_mm256_set1_pd(simesfactor[j]), P)));
+        int n = leadingLanes(mask);
+        i += n;
+        if (n < 4) j--;
+    }
+    adjustedScalar(p, alpha, m, simesfactor, i, j, ADJUSTED);
+}
+
+ARI_TARGET("avx512f")
+static void categoriesAVX512(const double* PK, const int* IDX, const double* ALLP, int k, double ratio, int m, int* CATS)
+{
+    const __m512d R = _mm512_set1_pd(ratio);
+    const __m512d MAXCAT = _mm512_set1_pd(m + 1.0);
+    const __m512d ZERO = _mm512_setzero_pd();
+    const __m512d ONE = _mm512_set1_pd(1.0);
+    const __m256i BASE = _mm256_set1_epi32(1);
+
+    int i = 0;
+    for (; i + 8 <= k; i += 8)
+    {
+        __m512d P = IDX ? _mm512_i32gather_pd(_mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(IDX + i)), BASE), ALLP, 8)
+                        : _mm512_loadu_pd(PK + i);
+        __m512d C = _mm512_roundscale_pd(_mm512_mul_pd(R, P), _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC);
+        C = _mm512_min_pd(C, MAXCAT);  // Also maps NaN to m + 1
+        C = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(P, ZERO, _CMP_EQ_OQ), C, ONE);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(CATS + i), _mm512_cvttpd_epi32(C));
+    }
+    categoriesScalar(PK, IDX, ALLP, i, k, ratio, m, CATS);
+}
+
+ARI_TARGET("avx512f")
+static int concentrationAVX512(const double* p, int z, double simesfactor, int h, double alpha, int m)
+{
+    const __m512d S = _mm512_set1_pd(simesfactor);
+    const __m512d A = _mm512_set1_pd(alpha);
+    const __m512d EIGHT = _mm512_set1_pd(8.0);
+    double b = z - m + h + 1;
+    __m512d B = _mm512_add_pd(_mm512_set1_pd(b), _mm512_setr_pd(0, 1, 2, 3, 4, 5, 6, 7));
+
+    for (; z + 8 <= m; z += 8)
+    {
+        unsigned int mask = _mm512_cmp_pd_mask(_mm512_mul_pd(S, _mm512_loadu_pd(p + z - 1)), _mm512_mul_pd(B, A), _CMP_GT_OQ);
+        if (mask != 0xFF) return z + leadingLanes(mask);
+        B = _mm512_add_pd(B, EIGHT);
+    }
+    return concentrationScalar(p, z, simesfactor, h, alpha, m);
+}
+
+ARI_TARGET("avx512f")
+static void adjustedAVX512(const double* p, const double* alpha, int m, const double* simesfactor, double* ADJUSTED)
+{
+    int i = 1;
+    int j = m + 1;
+    while (i + 7 <= m)
+    {
+        __m512d P = _mm512_loadu_pd(p + i - 1);
+        __m512d A = _mm512_set1_pd(alpha[j-1]);
+        unsigned int mask = _mm512_cmp_pd_mask(_mm512_mul_pd(_mm512_set1_pd(simesfactor[j-1]), P), A, _CMP_LE_OQ);
+        if (mask == 0) { j--; continue; }
+
+        _mm512_storeu_pd(ADJUSTED + i - 1, _mm512_min_pd(A, _mm512_mul_pd(_mm512_set1_pd(simesfactor[j]), P)));
+        int n = leadingLanes(mask);
+        i += n;
+        if (n < 8) j--;
+    }
+    adjustedScalar(p, alpha, m, simesfactor, i, j, ADJUSTED);
+}
+
+#endif // ARI_SIMD_X86
+
+// ---------------------------------------------------------------------------------------------
+// NEON (2 lanes)
+// ---------------------------------------------------------------------------------------------
+
+#ifdef ARI_SIMD_NEON
+
+static void categoriesNEON(const double* PK, const int* IDX, const double* ALLP, int k, double ratio, int m, int* CATS)
+{
+    const float64x2_t R = vdupq_n_f64(ratio);
+    const float64x2_t MAXCAT = vdupq_n_f64(m + 1.0);
+    const float64x2_t ZERO = vdupq_n_f64(0.0);
+    const float64x2_t ONE = vdupq_n_f64(1.0);
+
+    int i = 0;
+    for (; i + 2 <= k; i += 2)
+    {
+        float64x2_t P;
+        if (IDX)
+        {
+            double G[2] = { ALLP[IDX[i] - 1], ALLP[IDX[i + 1] - 1] };
+            P = vld1q_f64(G);
+        }
+        else
+        {
+            P = vld1q_f64(PK + i);
+        }
+        float64x2_t C = vrndpq_f64(vmulq_f64(R, P));
+        C = vminnmq_f64(C, MAXCAT);  // Also maps NaN to m + 1
+        C = vbslq_f64(vceqq_f64(P, ZERO), ONE, C);
+        vst1_s32(CATS + i, vmovn_s64(vcvtq_s64_f64(C)));
+    }
+    categoriesScalar(PK, IDX, ALLP, i, k, ratio, m, CATS);
+}
+
+static int concentrationNEON(const double* p, int z, double simesfactor, int h, double alpha, int m)
+{
+    const float64x2_t S = vdupq_n_f64(simesfactor);
+    const float64x2_t A = vdupq_n_f64(alpha);
+    const float64x2_t TWO = vdupq_n_f64(2.0);
+    double b = z - m + h + 1;
+    double B0[2] = { b, b + 1 };
+    float64x2_t B = vld1q_f64(B0);
+
+    for (; z + 2 <= m; z += 2)
+    {
+        uint64x2_t GT = vcgtq_f64(vmulq_f64(S, vld1q_f64(p + z - 1)), vmulq_f64(B, A));
+        unsigned int mask = (vgetq_lane_u64(GT, 0) ? 1u : 0u) | (vgetq_lane_u64(GT, 1) ? 2u : 0u);
+        if (mask != 0x3) return z + leadingLanes(mask);
+        B = vaddq_f64(B, TWO);
+    }
+    return concentrationScalar(p, z, simesfactor, h, alpha, m);
+}
+
+static void adjustedNEON(const double* p, const double* alpha, int m, const double* simesfactor, double* ADJUSTED)
+{
+    int i = 1;
+    int j = m + 1;
+    while (i + 1 <= m)
+    {
+        float64x2_t P = vld1q_f64(p + i - 1);
+        float64x2_t A = vdupq_n_f64(alpha[j-1]);
+        uint64x2_t LE = vcleq_f64(vmulq_f64(vdupq_n_f64(simesfactor[j-1]), P), A);
+        unsigned int mask = (vgetq_lane_u64(LE, 0) ? 1u : 0u) | (vgetq_lane_u64(LE, 1) ? 2u : 0u);
+        if (mask == 0) { j--; continue; }
+
+        // std::min(X, A): A where A < X, X otherwise
+        float64x2_t X = vmulq_f64(vdupq_n_f64(simesfactor[j]), P);
+        vst1q_f64(ADJUSTED + i - 1, vbslq_f64(vcltq_f64(A, X), A, X));
+        int n = leadingLanes(mask);
+        i += n;
+        if (n < 2) j--;
+    }
+    adjustedScalar(p, alpha, m, simesfactor, i, j, ADJUSTED);
+}
+
+#endif // ARI_SIMD_NEON
+
+// ---------------------------------------------------------------------------------------------
+// Dispatch
+// ---------------------------------------------------------------------------------------------
+
+// Best instruction set of this CPU
+static int detectSimd()
+{
+#if defined(ARI_SIMD_NEON)
+    return SIMD_NEON;
+#elif defined(ARI_SIMD_X86) && defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return SIMD_SCALAR;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave) return SIMD_SCALAR;
+    unsigned long long xcr0 = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    if ((info[1] & (1 << 16)) && (xcr0 & 0xE6) == 0xE6) return SIMD_AVX512;
+    if ((info[1] & (1 << 5)) && (xcr0 & 0x6) == 0x6) return SIMD_AVX2;
+    return SIMD_SCALAR;
+#elif defined(ARI_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    return SIMD_SCALAR;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+// Highest supported instruction set not above level
+static int supportedLevel(int level)
+{
+    static const int best = detectSimd();
+    for (; level > SIMD_SCALAR; level--)
+    {
+        bool sameFamily = (level == SIMD_NEON) == (best == SIMD_NEON);
+        if (sameFamily && level <= best) return level;
+    }
+    return SIMD_SCALAR;
+}
+
+// Level given by ARI_SIMD, or the best one if it is not set
+static int initialLevel()
+{
+    const char* env = std::getenv("ARI_SIMD");
+    int level = SIMD_AVX512;
+    if (env != NULL)
+    {
+        for (int l = SIMD_SCALAR; l <= SIMD_AVX512; l++)
+        {
+            if (std::strcmp(env, simdLevelName(l)) == 0) level = l;
+        }
+    }
+    return supportedLevel(level);
+}
+
+static std::atomic<int>& levelInUse()
+{
+    static std::atomic<int> LEVEL(initialLevel());
+    return LEVEL;
+}
+
+int simdLevel()
+{
+    return levelInUse().load(std::memory_order_relaxed);
+}
+
+const char* simdLevelName(int level)
+{
+    switch (level)
+    {
+        case SIMD_NEON: return "neon";
+        case SIMD_AVX2: return "avx2";
+        case SIMD_AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+int setSimdLevel(int level)
+{
+    level = supportedLevel(level);
+    levelInUse().store(level);
+    return level;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Kernels
+// ---------------------------------------------------------------------------------------------
+
+static void categories(const double* PK, const int* IDX, const double* ALLP, int k, double simesfactor, double alpha, int m, int* CATS)
+{
+    // The special cases of getCategory
+    if (simesfactor == 0)
+    {
+        std::fill(CATS, CATS + k, 1);
+        return;
+    }
+    if (alpha == 0)
+    {
+        for (int i = 0; i < k; i++)
+        {
+            CATS[i] = ((IDX ? ALLP[IDX[i] - 1] : PK[i]) == 0) ? 1 : m + 1;
+        }
+        return;
+    }
+    double ratio = simesfactor / alpha;
+
+    switch (simdLevel())
+    {
+#ifdef ARI_SIMD_X86
+        case SIMD_AVX512: categoriesAVX512(PK, IDX, ALLP, k, ratio, m, CATS); return;
+        case SIMD_AVX2: categoriesAVX2(PK, IDX, ALLP, k, ratio, m, CATS); return;
+#endif
+#ifdef ARI_SIMD_NEON
+        case SIMD_NEON: categoriesNEON(PK, IDX, ALLP, k, ratio, m, CATS); return;
+#endif
+        default: categoriesScalar(PK, IDX, ALLP, 0, k, ratio, m, CATS);
+    }
+}
+
+void simdCategories(const double* PK, int k, double simesfactor, double alpha, int m, int* CATS)
+{
+    categories(PK, NULL, NULL, k, simesfactor, alpha, m, CATS);
+}
+
+void simdGatherCategories(const int* IDX, const double* ALLP, int k, double simesfactor, double alpha, int m, int* CATS)
+{
+    categories(NULL, IDX, ALLP, k, simesfactor, alpha, m, CATS);
+}
+
+int simdConcentration(const double* p, int z0, double simesfactor, int h, double alpha, int m)
+{
+    switch (simdLevel())
+    {
+#ifdef ARI_SIMD_X86
+        case SIMD_AVX512: return concentrationAVX512(p, z0, simesfactor, h, alpha, m);
+        case SIMD_AVX2: return concentrationAVX2(p, z0, simesfactor, h, alpha, m);
+#endif
+#ifdef ARI_SIMD_NEON
+        case SIMD_NEON: return concentrationNEON(p, z0, simesfactor, h, alpha, m);
+#endif
+        default: return concentrationScalar(p, z0, simesfactor, h, alpha, m);
+    }
+}
+
+void simdAdjustedElementary(const double* p, const double* alpha, int m, const double* simesfactor, double* ADJUSTED)
+{
+    switch (simdLevel())
+    {
+#ifdef ARI_SIMD_X86
+        case SIMD_AVX512: adjustedAVX512(p, alpha, m, simesfactor, ADJUSTED); return;
+        case SIMD_AVX2: adjustedAVX2(p, alpha, m, simesfactor, ADJUSTED); return;
+#endif
+#ifdef ARI_SIMD_NEON
+        case SIMD_NEON: adjustedNEON(p, alpha, m, simesfactor, ADJUSTED); return;
+#endif
+        default: adjustedScalar(p, alpha, m, simesfactor, 1, m + 1, ADJUSTED);
+    }
+}
@@ -0,0 +1,38 @@
+// hommel_simd.h
+#ifndef HOMMEL_SIMD_H
+#define HOMMEL_SIMD_H
+
+// Vectorised kernels behind the scalar loops of hommel.cpp. Each kernel has a scalar version and
+// AVX2, AVX-512 and NEON versions; the fastest one the CPU supports is chosen the first time a
+// kernel runs (the environment variable ARI_SIMD=scalar|neon|avx2|avx512 caps the choice). All
+// versions perform the same floating-point operations in the same order, so their results agree
+// exactly with the scalar ones.
+
+enum SimdLevel
+{
+    SIMD_SCALAR = 0,
+    SIMD_NEON = 1,
+    SIMD_AVX2 = 2,
+    SIMD_AVX512 = 3
+};
+
+// Instruction set in use, and its name ("scalar", "neon", "avx2" or "avx512")
+int simdLevel();
+const char* simdLevelName(int level);
+
+// Use the given instruction set, or the best supported one below it; returns the one in use
+int setSimdLevel(int level);
+
+// CATS[i] = getCategory(PK[i], simesfactor, alpha, m) for i < k
+void simdCategories(const double* PK, int k, double simesfactor, double alpha, int m, int* CATS);
+
+// Same for PK[i] = ALLP[IDX[i] - 1] (IDX 1-based)
+void simdGatherCategories(const int* IDX, const double* ALLP, int k, double simesfactor, double alpha, int m, int* CATS);
+
+// The loop of findConcentration: the smallest z >= z0 with z == m or simesfactor * p[z-1] <= (z - m + h + 1) * alpha
+int simdConcentration(const double* p, int z0, double simesfactor, int h, double alpha, int m);
+
+// The loop of adjustedElementary, writing the m adjusted p-values to ADJUSTED
+void simdAdjustedElementary(const double* p, const double* alpha, int m, const double* simesfactor, double* ADJUSTED);
+
+#endif // HOMMEL_SIMD_H
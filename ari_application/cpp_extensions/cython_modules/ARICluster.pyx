@@ -3,10 +3,36 @@
 # cython: language_level=3
 
 from libcpp.vector cimport vector
+from libcpp.string cimport string
 from libcpp cimport bool
+from libcpp.utility cimport move
 from cython.operator cimport dereference as deref
 
-cdef extern from "../cpp_sources/ARICluster.h":
+include "native_array.pxi"
+include "profile.pxi"
+include "simd.pxi"
+include "progress.pxi"
+
+import os
+
+cdef extern from "../cpp_sources/ARICluster.h" nogil:
+    cdef cppclass CSR:
+        CSR() except +
+        CSR(const vector[vector[int]]& ROWS) except +
+        vector[int] OFS
+        vector[int] IDX
+        int rows()
+        int degree(int i)
+        vector[vector[int]] toRows() except +
+
+    cdef cppclass ClusterTable:
+        vector[int] SIZE
+        vector[double] TDP
+        vector[double] PEAK
+        vector[int] PEAKID
+        vector[int] PEAKXYZ
+        vector[int] LABEL
+
     vector[int] descendants(int v, vector[int]& SIZE, vector[vector[int]]& CHILD)
     void heavyPathTDP(int v, int par, int m, int h, double alpha, double simesh, vector[double]& P, vector[int]& SIZE, vector[vector[int]]& CHILD, vector[double]& TDP)
     vector[double] forestTDP(int m, int h, double alpha, double simesh, vector[double]& P, vector[int]& SIZE, vector[int]& ROOT, vector[vector[int]]& CHILD)
@@ -40,6 +66,11 @@ cdef extern from "../cpp_sources/ARICluster.h":
                                      const vector[vector[int]]& ANS)
     vector[int] findLMS(const vector[vector[int]]& CHILD)
 
+    # Pointer flavours, used by the np_ entry points below
+    vector[vector[int]] findAdjList(const int* MASK, const int* INDEXP, const int* DIMS, int m, int conn)
+    CSR findAdjListCSR(const int* MASK, const int* INDEXP, const int* DIMS, int m, int conn) except +
+    CSR findAdjListCSR(const int* MASK, const int* INDEXP, const int* DIMS, int m, int conn, int nthreads) except +
+
 def py_descendants(int v, list SIZE, list CHILD):
     cdef vector[int] SIZE_vector = SIZE
     cdef vector[vector[int]] CHILD_vector = [vector[int]() for _ in CHILD]
@@ -279,4 +310,827 @@ def py_findLMS(list CHILD):
         CHILD_vector.push_back(child_vector)
 
     cdef vector[int] result = findLMS(CHILD_vector)
-    return list(result)
\ No newline at end of file
+    return list(result)
+
+cdef extern from "../cpp_sources/ARISession.h" nogil:
+    cdef cppclass SessionArray[T]:
+        size_t size()
+        bool empty()
+        const T* data()
+        T operator[](size_t i)
+        vector[T] toVector() except +
+
+    cdef cppclass SessionCSR:
+        int rows()
+        vector[vector[int]] toRows() except +
+
+    cdef cppclass AlphaResults "ARISession::AlphaResults":
+        double alpha
+        vector[double] TDP
+
+    cdef cppclass CppARISession "ARISession":
+        CppARISession() except +
+        void findClusters(int m, vector[vector[int]]& ADJ, vector[int]& ORD, vector[int]& RANK) except +
+        void findClusters(int m, vector[vector[int]]& ADJ, const int* ORD, const int* RANK) except +
+        void findClusters(int m, const CSR& ADJ, const int* ORD, const int* RANK) except +
+        void findClusters(int m, const CSR& ADJ, const int* ORD, const int* RANK, int nthreads) except +
+        void findClusters(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const int* ORD, const int* RANK) except +
+        void findClusters(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const int* ORD, const int* RANK, int nthreads) except +
+        void setForest(vector[int]& SIZE, vector[int]& ROOT, vector[vector[int]]& CHILD) except +
+        void forestTDP(int h, double alpha, double simesh, vector[double]& P) except +
+        void forestTDP(int h, double alpha, double simesh, const double* P) except +
+        void forestTDP(int h, double alpha, double simesh, const double* P, int nthreads) except +
+        void forestTDP(const vector[double]& ALPHA, const double* JUMPALPHA, const double* SIMESFACTOR, const double* P, int nthreads) except +
+        void selectAlpha(int k) except +
+        void queryPreparation() except +
+        void setCompact(bool on) except +
+        bool compact()
+        vector[double] tdpBounds() except +
+        map[string, long long] footprint() except +
+        bool mapped()
+        void setIndexp(vector[int]& INDEXP) except +
+        void setIndexp(const int* INDEXP) except +
+        vector[vector[int]] answerQuery(double gamma) except +
+        vector[vector[vector[int]]] answerQueryBatch(vector[double]& gamma_batch) except +
+        vector[vector[int]] answerQuery(double gamma, int min_size, int top_k) except +
+        vector[vector[vector[int]]] answerQueryBatch(vector[double]& gamma_batch, int min_size, int top_k) except +
+        void answerQueryBatchReps(vector[double]& gamma_batch, vector[int]& REPS, vector[int]& OFFSETS) except +
+        void answerQueryBatchReps(vector[double]& gamma_batch, int min_size, int top_k, vector[int]& REPS, vector[int]& OFFSETS) except +
+        vector[int] clusterMembers(int v) except +
+        void labelClusters(const int* REPS, int nreps, int* LABEL) except +
+        void labelClusters(const int* REPS, int nreps, int* LABEL, int nvox) except +
+        void answerQueryLabels(int* LABEL, int nvox, vector[int]& REPS, vector[int]& SIZES) except +
+        void thresholdClusters(int k, const int* ORD, vector[int]& REPS) except +
+        void clusterSummary(const int* REPS, int nreps, const int* DIMS, const double* STAT, const int* ATLAS, ClusterTable& TBL, int nthreads) except +
+        void answerQueryDelta(double gamma, vector[int]& ADDED, vector[int]& REMOVED) except +
+        int containingCluster(int v, double gamma, int& size, double& tdp) except +
+        vector[vector[int]] changeQuery(int v, double tdpchg, const vector[vector[int]]& ANS) except +
+        vector[int] findLMS() except +
+        void findLMS(const int* ORD, int topk, const int* DIMS, vector[int]& LMS, vector[int]& XYZ) except +
+        void gradientMap(vector[double]& gamma_batch, float* GRADMAP, int nvox) except +
+        void gradientMap(vector[double]& gamma_batch, float* GRADMAP, int nvox, int min_size, int top_k) except +
+        vector[vector[int]] ids2xyz(vector[int]& IDS, vector[int]& DIMS) except +
+        void ids2xyz(const int* IDS, int n, const int* DIMS, int* XYZ) except +
+        void clusterXYZ(int v, const int* DIMS, vector[int]& XYZ) except +
+        void saveIndex(const string& path, const string& key, const int* ORD, const int* RANK,
+                       const vector[double]& JUMPALPHA, const vector[double]& SIMESFACTOR) except +
+        bool loadIndex(const string& path, const string& key, vector[int]& ORD, vector[int]& RANK,
+                       vector[double]& JUMPALPHA, vector[double]& SIMESFACTOR) except +
+        int m
+        SessionArray[int] SIZE
+        SessionArray[int] ROOT
+        SessionCSR CHILD
+        SessionArray[int] ORDER
+        SessionArray[int] POS
+        SessionArray[double] TDP
+        SessionArray[int] ADMSTC
+        vector[int] QREPS
+        SessionArray[int] INDEXP
+        vector[AlphaResults] ALPHAS
+        int ACTIVE
+
+    cdef cppclass MapAnalysis:
+        CppARISession session
+        vector[int] ORD
+        vector[int] RANK
+        vector[double] JUMPALPHA
+        int h
+        double wbtdp
+        int concentration
+
+    void analyseMaps(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const vector[const double*]& P,
+                     double alpha, bool simes, int nthreads, int maxmaps, vector[double]& SIMESFACTOR, vector[MapAnalysis]& MAPS) except +
+
+    cdef cppclass PipelineResult:
+        MapAnalysis MAP
+        vector[double] SIMESFACTOR
+        vector[double] ADJUSTED
+        vector[int] LMS
+        vector[int] LMSXYZ
+
+    void runPipeline(int m, const int* MASK, const int* INDEXP, const int* DIMS, int conn, const double* P, double alpha, bool simes, bool compact,
+                     const vector[double]& gamma_batch, float* GRADMAP, int nvox, const int* LMSDIMS, int nthreads, PipelineResult& RES) except +
+
+
+cdef class ARISession:
+    """
+    Persistent handle on the STC forest. After findClusters (or setForest), forestTDP and
+    queryPreparation, the forest, TDP bounds, admissible STCs and marks stay on the C++ side
+    and all later queries run against them without re-marshalling anything from Python.
+    """
+    cdef CppARISession* thisptr
+
+    def __cinit__(self):
+        self.thisptr = new CppARISession()
+
+    def __dealloc__(self):
+        del self.thisptr
+
+    def findClusters(self, int m, list ADJ, list ORD, list RANK):
+        cdef vector[vector[int]] ADJ_vector = [vector[int]() for _ in ADJ]
+        for i in range(len(ADJ)):
+            ADJ_vector[i] = ADJ[i]
+        cdef vector[int] ORD_vector = ORD
+        cdef vector[int] RANK_vector = RANK
+        with nogil:
+            self.thisptr.findClusters(m, ADJ_vector, ORD_vector, RANK_vector)
+
+    def setForest(self, list SIZE, list ROOT, list CHILD):
+        cdef vector[int] SIZE_vector = SIZE
+        cdef vector[int] ROOT_vector = ROOT
+        cdef vector[vector[int]] CHILD_vector = [vector[int]() for _ in CHILD]
+        for i, child in enumerate(CHILD):
+            CHILD_vector[i] = child
+        with nogil:
+            self.thisptr.setForest(SIZE_vector, ROOT_vector, CHILD_vector)
+
+    def forestTDP(self, int h, double alpha, double simesh, list P):
+        cdef vector[double] P_vector = P
+        with nogil:
+            self.thisptr.forestTDP(h, alpha, simesh, P_vector)
+
+    def queryPreparation(self):
+        with nogil:
+            self.thisptr.queryPreparation()
+
+    def setIndexp(self, list INDEXP):
+        cdef vector[int] INDEXP_vector = INDEXP
+        with nogil:
+            self.thisptr.setIndexp(INDEXP_vector)
+
+    def answerQuery(self, double gamma, int min_size=0, int top_k=-1):
+        cdef vector[vector[int]] result
+        with nogil:
+            result = self.thisptr.answerQuery(gamma, min_size, top_k)
+        return [list(x) for x in result]
+
+    def answerQueryBatch(self, list gamma_batch, NativeProgress progress=None, int min_size=0, int top_k=-1):
+        cdef vector[double] gamma_batch_vector = gamma_batch
+        cdef vector[vector[vector[int]]] batch_results
+        cdef ProgressReporter* prev = progress_install(progress)
+        try:
+            with nogil:
+                batch_results = self.thisptr.answerQueryBatch(gamma_batch_vector, min_size, top_k)
+        except RuntimeError:
+            progress_raise(progress)
+            raise
+        finally:
+            progressInstall(prev)
+        result = []
+        for batch_result in batch_results:
+            result.append([list(x) for x in batch_result])
+        return result
+
+    def changeQuery(self, int v, double tdpchg, list ANS):
+        cdef vector[vector[int]] ANS_vector
+        cdef vector[int] ans_vector
+        for x in ANS:
+            ans_vector = x
+            ANS_vector.push_back(ans_vector)
+        cdef vector[vector[int]] result
+        with nogil:
+            result = self.thisptr.changeQuery(v, tdpchg, ANS_vector)
+        return [list(x) for x in result]
+
+    def findLMS(self):
+        cdef vector[int] result
+        with nogil:
+            result = self.thisptr.findLMS()
+        return list(result)
+
+    def ids2xyz(self, list IDS, list DIMS):
+        """
+        Convert node ids (0-based, in-mask) to xyz coordinates, mapping them through the
+        voxel indices given to setIndexp.
+        """
+        cdef vector[int] IDS_vector = IDS
+        cdef vector[int] DIMS_vector = DIMS
+        cdef vector[vector[int]] result
+        with nogil:
+            result = self.thisptr.ids2xyz(IDS_vector, DIMS_vector)
+        return [list(x) for x in result]
+
+    # Read-only copies of the stored data, for Python code that still works on lists
+    property m:
+        def __get__(self):
+            return self.thisptr.m
+
+    property SIZE:
+        def __get__(self):
+            return list(self.thisptr.SIZE.toVector())
+
+    property ROOT:
+        def __get__(self):
+            return list(self.thisptr.ROOT.toVector())
+
+    property CHILD:
+        def __get__(self):
+            return [list(x) for x in self.thisptr.CHILD.toRows()]
+
+    property TDP:
+        def __get__(self):
+            return list(self.thisptr.tdpBounds())
+
+    property ADMSTC:
+        def __get__(self):
+            return list(self.thisptr.ADMSTC.toVector())
+
+    property compact:
+        """
+        Keep the TDP bounds as numbers of discoveries (half the memory) instead of doubles. The
+        queries give the same results either way; setting it converts the stored bounds.
+        """
+        def __get__(self):
+            return self.thisptr.compact()
+
+        def __set__(self, bool on):
+            self.thisptr.setCompact(on)
+
+    property mapped:
+        """
+        Whether the session's arrays are views into an index file mapped by np_loadIndex.
+        """
+        def __get__(self):
+            return self.thisptr.mapped()
+
+
+# Zero-copy entry points: these take contiguous NumPy arrays (int32 indices, float64 p-values)
+# instead of lists, so runARI does not need a list copy of every million-element array.
+# The adjacency list and the forest stay on the C++ side (AdjacencyList, ARISession) and
+# array results are returned as NumPy arrays that own the C++ output buffers.
+# The native work runs without the GIL; the long calls take an optional NativeProgress
+# (progress.pxi) to report their progress to and to be cancelled through.
+
+cdef class AdjacencyList:
+    """
+    Opaque handle on an adjacency list (in CSR form) built by np_findAdjList, to be passed
+    on to np_findClusters without converting it to Python lists.
+    """
+    cdef CSR ADJ
+
+    def __len__(self):
+        return self.ADJ.rows()
+
+    def tolist(self):
+        return [list(x) for x in self.ADJ.toRows()]
+
+
+def np_findAdjList(const int[::1] MASK, const int[::1] INDEXP, const int[::1] DIMS, int m, int conn, int nthreads=1, NativeProgress progress=None):
+    """
+    Build the adjacency list of the in-mask voxels in CSR form, on nthreads threads
+    (nthreads <= 0 uses all hardware threads; the result does not depend on it).
+    """
+    if DIMS.shape[0] != 3:
+        raise ValueError("'DIMS' must hold 3 dimensions")
+    if MASK.shape[0] != DIMS[0] * DIMS[1] * DIMS[2]:
+        raise ValueError("'MASK' must hold one value per voxel")
+    if m < 1 or INDEXP.shape[0] < m:
+        raise ValueError("'INDEXP' must hold m voxel indices")
+    cdef AdjacencyList adj = AdjacencyList()
+    cdef ProgressReporter* prev = progress_install(progress)
+    try:
+        with nogil:
+            adj.ADJ = findAdjListCSR(&MASK[0], &INDEXP[0], &DIMS[0], m, conn, nthreads)
+    except RuntimeError:
+        progress_raise(progress)
+        raise
+    finally:
+        progressInstall(prev)
+    return adj
+
+def np_findClusters(int m, AdjacencyList ADJ, const int[::1] ORD, const int[::1] RANK, int nthreads=1, NativeProgress progress=None):
+    """
+    Build the STC forest on nthreads threads and return it as an ARISession
+    (nthreads <= 0 uses all hardware threads; the forest does not depend on it).
+    """
+    if m < 1 or ORD.shape[0] < m or RANK.shape[0] < m:
+        raise ValueError("'ORD' and 'RANK' must hold m values")
+    cdef ARISession session = ARISession()
+    cdef ProgressReporter* prev = progress_install(progress)
+    try:
+        with nogil:
+            session.thisptr.findClusters(m, ADJ.ADJ, &ORD[0], &RANK[0], nthreads)
+    except RuntimeError:
+        progress_raise(progress)
+        raise
+    finally:
+        progressInstall(prev)
+    return session
+
+def np_findClustersGrid(int m, const int[::1] MASK, const int[::1] INDEXP, const int[::1] DIMS, int conn, const int[::1] ORD, const int[::1] RANK, int nthreads=1, NativeProgress progress=None):
+    """
+    Build the STC forest straight from the mask volume (as passed to np_findAdjList) and return
+    it as an ARISession. Gives the same forest as np_findClusters(m, np_findAdjList(...), ...)
+    without storing the adjacency list. nthreads is as in np_findClusters.
+    """
+    if m < 1 or ORD.shape[0] < m or RANK.shape[0] < m or INDEXP.shape[0] < m:
+        raise ValueError("'INDEXP', 'ORD' and 'RANK' must hold m values")
+    if DIMS.shape[0] != 3 or MASK.shape[0] != DIMS[0] * DIMS[1] * DIMS[2]:
+        raise ValueError("'MASK' must hold DIMS[0]*DIMS[1]*DIMS[2] values")
+    cdef ARISession session = ARISession()
+    cdef ProgressReporter* prev = progress_install(progress)
+    try:
+        with nogil:
+            session.thisptr.findClusters(m, &MASK[0], &INDEXP[0], &DIMS[0], conn, &ORD[0], &RANK[0], nthreads)
+    except RuntimeError:
+        progress_raise(progress)
+        raise
+    finally:
+        progressInstall(prev)
+    return session
+
+def np_forestTDP(ARISession session, int h, double alpha, double simesh, const double[::1] P, int nthreads=1, NativeProgress progress=None):
+    """
+    Compute the TDP bounds of the session's forest, spreading the heavy paths over nthreads
+    threads (nthreads <= 0 uses all hardware threads; the result does not depend on it).
+    The session keeps its own copy for later queries; the returned float64 array holds the
+    same values.
+    """
+    if P.shape[0] != session.thisptr.m or P.shape[0] == 0:
+        raise ValueError("'P' must have one p-value per node")
+    cdef ProgressReporter* prev = progress_install(progress)
+    try:
+        with nogil:
+            session.thisptr.forestTDP(h, alpha, simesh, &P[0], nthreads)
+    except RuntimeError:
+        progress_raise(progress)
+        raise
+    finally:
+        progressInstall(prev)
+    cdef vector[double] TDP = session.thisptr.TDP.toVector()
+    return double_array(TDP)
+
+def np_forestTDPMulti(ARISession session, alphas, const double[::1] JUMPALPHA, const double[::1] SIMESFACTOR, const double[::1] P, int nthreads=1, NativeProgress progress=None):
+    """
+    Compute the TDP bounds of the session's forest for all alphas in one pass over the heavy
+    paths (JUMPALPHA and SIMESFACTOR as returned by np_findalpha/np_findsimesfactor). Returns
+    an m x len(alphas) float64 matrix with one column per alpha. The first alpha becomes the
+    active one; after np_queryPreparation, np_selectAlpha switches between them.
+    """
+    cdef int m = session.thisptr.m
+    if P.shape[0] != m or m == 0:
+        raise ValueError("'P' must have one p-value per node")
+    if JUMPALPHA.shape[0] < m or SIMESFACTOR.shape[0] < m + 1:
+        raise ValueError("'JUMPALPHA' and 'SIMESFACTOR' must hold m and m+1 values")
+    cdef vector[double] ALPHA = alphas
+    cdef ProgressReporter* prev = progress_install(progress)
+    try:
+        with nogil:
+            session.thisptr.forestTDP(ALPHA, &JUMPALPHA[0], &SIMESFACTOR[0], &P[0], nthreads)
+    except RuntimeError:
+        progress_raise(progress)
+        raise
+    finally:
+        progressInstall(prev)
+
+    TDPS = np.empty((ALPHA.size(), m), dtype=np.float64)
+    cdef double[:, ::1] TDPS_view = TDPS
+    cdef size_t k
+    cdef int v
+    cdef const double* column
+    for k in range(ALPHA.size()):
+        column = session.thisptr.TDP.data() if <int> k == session.thisptr.ACTIVE else <const double*> session.thisptr.ALPHAS[k].TDP.data()
+        for v in range(m):
+            TDPS_view[k, v] = column[v]
+    return TDPS.T
+
+def np_selectAlpha(ARISession session, int k):
+    """
+    Make the k-th alpha of np_forestTDPMulti the active one for all later queries.
+    """
+    with nogil:
+        session.thisptr.selectAlpha(k)
+
+def np_queryPreparation(ARISession session):
+    """
+    Set up the admissible STCs of the session and return them as an int32 array. After
+    np_forestTDPMulti this prepares every alpha and returns those of the active one.
+    """
+    with nogil:
+        session.thisptr.queryPreparation()
+    cdef vector[int] ADMSTC = session.thisptr.ADMSTC.toVector()
+    return int_array(ADMSTC)
+
+def np_setIndexp(ARISession session, const int[::1] INDEXP):
+    if INDEXP.shape[0] != session.thisptr.m or INDEXP.shape[0] == 0:
+        raise ValueError("'INDEXP' must have one voxel index per node")
+    session.thisptr.setIndexp(&INDEXP[0])
+
+def np_gradientMap(ARISession session, gamma_batch, float[:, :, ::1] GRADMAP, NativeProgress progress=None, int min_size=0, int top_k=-1):
+    """
+    Write the largest gamma in gamma_batch at which each in-mask voxel lies inside a
+    cluster (0 if there is none) into the C-contiguous float32 volume GRADMAP, addressed
+    through the voxel indices given to np_setIndexp. Voxels outside the mask are untouched.
+    Only clusters of at least min_size voxels count and, with top_k >= 0, only the top_k
+    largest of those at each gamma (which answers every gamma instead of one forest walk).
+    """
+    cdef vector[double] gamma_vector = gamma_batch
+    cdef ProgressReporter* prev = progress_install(progress)
+    try:
+        with nogil:
+            session.thisptr.gradientMap(gamma_vector, &GRADMAP[0, 0, 0], GRADMAP.shape[0] * GRADMAP.shape[1] * GRADMAP.shape[2], min_size, top_k)
+    except RuntimeError:
+        progress_raise(progress)
+        raise
+    finally:
+        progressInstall(prev)
+
+def np_answerQueryBatchReps(ARISession session, gamma_batch, NativeProgress progress=None, int min_size=0, int top_k=-1):
+    """
+    Compact batch query. Returns (REPS, OFFSETS) as int32 arrays: the clusters for
+    gamma_batch[i] are represented by REPS[OFFSETS[i]:OFFSETS[i+1]], in the order of
+    answerQuery. Use np_clusterMembers or np_labelClusters to get the voxels. Clusters of
+    fewer than min_size voxels are left out, and with top_k >= 0 only the top_k largest
+    of each query are kept (ties at the cut go to the earlier ones).
+    """
+    cdef vector[double] gamma_vector = gamma_batch
+    cdef vector[int] REPS
+    cdef vector[int] OFFSETS
+    cdef ProgressReporter* prev = progress_install(progress)
+    try:
+        with nogil:
+            session.thisptr.answerQueryBatchReps(gamma_vector, min_size, top_k, REPS, OFFSETS)
+    except RuntimeError:
+        progress_raise(progress)
+        raise
+    finally:
+        progressInstall(prev)
+    return int_array(REPS), int_array(OFFSETS)
+
+def np_clusterMembers(ARISession session, int v):
+    """
+    Node ids (0-based) of the cluster represented by v, as an int32 array.
+    """
+    cdef vector[int] DESC
+    with nogil:
+        DESC = session.thisptr.clusterMembers(v)
+    return int_array(DESC)
+
+def np_labelClusters(ARISession session, const int[::1] REPS):
+    """
+    Per-node labels for the clusters represented by REPS: label k+1 for the nodes of
+    cluster REPS[k] and 0 elsewhere, as an int32 array of length m.
+    """
+    LABEL = np.zeros(session.thisptr.m, dtype=np.intc)
+    cdef int[::1] LABEL_view = LABEL
+    if REPS.shape[0] > 0 and session.thisptr.m > 0:
+        with nogil:
+            session.thisptr.labelClusters(&REPS[0], REPS.shape[0], &LABEL_view[0])
+    return LABEL
+
+def np_labelVolume(ARISession session, const int[::1] REPS, int[:, :, ::1] LABEL):
+    """
+    Write label k+1 for the voxels of cluster REPS[k] into the C-contiguous int32 volume LABEL,
+    addressed through the voxel indices given to np_setIndexp. Other voxels are untouched.
+    """
+    if REPS.shape[0] > 0:
+        with nogil:
+            session.thisptr.labelClusters(&REPS[0], REPS.shape[0], &LABEL[0, 0, 0], LABEL.shape[0] * LABEL.shape[1] * LABEL.shape[2])
+
+def np_answerQueryLabels(ARISession session, int[:, :, ::1] LABEL):
+    """
+    Write the answer of the last np_answerQueryDelta (the clusters of np_queryReps) into the
+    C-contiguous int32 volume LABEL, addressed through the voxel indices given to np_setIndexp:
+    LABEL is cleared and the voxels of the k-th largest cluster get label k (ranked as
+    prepare_tblARI does with counting_sort). Returns (REPS, SIZES) as int32 arrays, the
+    representative and size of label k at position k-1.
+    """
+    cdef vector[int] REPS
+    cdef vector[int] SIZES
+    with nogil:
+        session.thisptr.answerQueryLabels(&LABEL[0, 0, 0], LABEL.shape[0] * LABEL.shape[1] * LABEL.shape[2], REPS, SIZES)
+    return int_array(REPS), int_array(SIZES)
+
+def np_thresholdClusters(ARISession session, int k, const int[::1] ORD):
+    """
+    Supra-threshold clusters of the k nodes with the smallest p-values, i.e. the connected
+    components (with the conn of findClusters) of the voxels below a p-value threshold.
+    ORD is the 1-based sorting order the forest was built with. Returns the representatives
+    as an int32 array, largest cluster first; TDP[rep] is the TDP bound of each cluster.
+    """
+    if ORD.shape[0] != session.thisptr.m:
+        raise ValueError("'ORD' must have one entry per node")
+    cdef vector[int] REPS
+    if k != 0:
+        with nogil:
+            session.thisptr.thresholdClusters(k, &ORD[0], REPS)
+    return int_array(REPS)
+
+def np_clusterSummary(ARISession session, const int[::1] REPS, const double[:, :, ::1] STAT, const int[:, :, ::1] ATLAS=None, int nthreads=0):
+    """
+    Summary table of the clusters represented by REPS, computed in one parallel pass over their
+    voxels on nthreads threads (nthreads <= 0: all hardware threads). STAT (and ATLAS, if given)
+    are C-contiguous volumes addressed through the voxel indices given to np_setIndexp.
+    Returns a dict of arrays with one row per cluster: 'size', 'tdp', the largest statistic
+    'peak' with its node id 'peak_id' and array indices 'peak_xyz' (n x 3), and the atlas label
+    at the peak 'label' (0 without ATLAS).
+    """
+    cdef int DIMS[3]
+    # The C++ side counts the first axis fastest, i.e. the last axis of a C-contiguous array
+    DIMS[0] = STAT.shape[2]
+    DIMS[1] = STAT.shape[1]
+    DIMS[2] = STAT.shape[0]
+    cdef const int* ATLAS_ptr = NULL
+    if ATLAS is not None:
+        if ATLAS.shape[0] != STAT.shape[0] or ATLAS.shape[1] != STAT.shape[1] or ATLAS.shape[2] != STAT.shape[2]:
+            raise ValueError("'ATLAS' must have the shape of 'STAT'")
+        ATLAS_ptr = &ATLAS[0, 0, 0]
+    cdef ClusterTable TBL
+    if REPS.shape[0] > 0:
+        with nogil:
+            session.thisptr.clusterSummary(&REPS[0], REPS.shape[0], DIMS, &STAT[0, 0, 0], ATLAS_ptr, TBL, nthreads)
+    return {
+        'size': int_array(TBL.SIZE),
+        'tdp': double_array(TBL.TDP),
+        'peak': double_array(TBL.PEAK),
+        'peak_id': int_array(TBL.PEAKID),
+        'peak_xyz': int_array(TBL.PEAKXYZ).reshape(-1, 3)[:, ::-1],
+        'label': int_array(TBL.LABEL),
+    }
+
+def np_findLMSXYZ(ARISession session, const int[::1] DIMS, const int[::1] ORD=None, int topk=-1):
+    """
+    Local minima (leaves of the forest) with their xyz coordinates (as in ids2xyz), in one call.
+    With ORD (the 1-based sorting order the forest was built with) the minima come in ascending
+    order of p, otherwise in order of node id; topk >= 0 keeps only the first topk of them.
+    Returns (LMS, XYZ) as an int32 array and a C-contiguous int32 array of shape (n, 3).
+    """
+    if DIMS.shape[0] != 3:
+        raise ValueError("'DIMS' must hold 3 dimensions")
+    cdef const int* ORD_ptr = NULL
+    if ORD is not None:
+        if ORD.shape[0] != session.thisptr.m:
+            raise ValueError("'ORD' must have one entry per node")
+        if ORD.shape[0] > 0:
+            ORD_ptr = &ORD[0]
+    cdef vector[int] LMS
+    cdef vector[int] XYZ
+    with nogil:
+        session.thisptr.findLMS(ORD_ptr, topk, &DIMS[0], LMS, XYZ)
+    return int_array(LMS), int_array(XYZ).reshape(-1, 3)
+
+def np_ids2xyz(ARISession session, const int[::1] IDS, const int[::1] DIMS):
+    """
+    xyz coordinates (as in ids2xyz) of the node ids IDS, as a C-contiguous int32 array of shape (n, 3).
+    """
+    if DIMS.shape[0] != 3:
+        raise ValueError("'DIMS' must hold 3 dimensions")
+    XYZ = np.empty((IDS.shape[0], 3), dtype=np.intc)
+    cdef int[:, ::1] XYZ_view = XYZ
+    if IDS.shape[0] > 0:
+        with nogil:
+            session.thisptr.ids2xyz(&IDS[0], IDS.shape[0], &DIMS[0], &XYZ_view[0, 0])
+    return XYZ
+
+def np_clusterXYZ(ARISession session, int v, const int[::1] DIMS):
+    """
+    xyz coordinates (as in ids2xyz) of the voxels of the cluster represented by v, in the order
+    of np_clusterMembers, as a C-contiguous int32 array of shape (n, 3).
+    """
+    if DIMS.shape[0] != 3:
+        raise ValueError("'DIMS' must hold 3 dimensions")
+    cdef vector[int] XYZ
+    with nogil:
+        session.thisptr.clusterXYZ(v, &DIMS[0], XYZ)
+    return int_array(XYZ).reshape(-1, 3)
+
+def np_answerQueryDelta(ARISession session, double gamma):
+    """
+    Stateful query for a moving TDP threshold. Returns (ADDED, REMOVED) as int32 arrays: the
+    representatives of the clusters that appeared and disappeared since the previous call for
+    this session (all clusters at gamma on the first call), in the order of answerQuery. A merge
+    shows up as one added and several removed clusters. Use np_clusterMembers for the voxels.
+    """
+    cdef vector[int] ADDED
+    cdef vector[int] REMOVED
+    with nogil:
+        session.thisptr.answerQueryDelta(gamma, ADDED, REMOVED)
+    return int_array(ADDED), int_array(REMOVED)
+
+def np_containingCluster(ARISession session, int v, double gamma):
+    """
+    The cluster at TDP threshold gamma that contains node v (0-based), as (rep, size, tdp): its
+    representative, number of voxels and TDP bound, or None if v lies in no cluster at gamma.
+    Answers in O(log depth) from the jump pointers set up by np_queryPreparation, for any gamma
+    and without answering the query first (e.g. for a readout under the mouse pointer).
+    """
+    cdef int rep
+    cdef int size
+    cdef double tdp
+    with nogil:
+        rep = session.thisptr.containingCluster(v, gamma, size, tdp)
+    if rep < 0:
+        return None
+    return rep, size, tdp
+
+def np_queryReps(ARISession session):
+    """
+    Representatives of all clusters at the gamma of the last np_answerQueryDelta call, in the
+    order of answerQuery, as an int32 array.
+    """
+    cdef vector[int] QREPS = session.thisptr.QREPS
+    return int_array(QREPS)
+
+def np_postOrder(ARISession session):
+    """
+    Post-order numbering of the session's forest as int32 arrays (ORDER, POS): the cluster
+    represented by v consists of ORDER[POS[v] - SIZE[v] + 1 : POS[v] + 1].
+    """
+    cdef vector[int] ORDER = session.thisptr.ORDER.toVector()
+    cdef vector[int] POS = session.thisptr.POS.toVector()
+    return int_array(ORDER), int_array(POS)
+
+def np_clusterSpans(ARISession session, const int[::1] REPS):
+    """
+    Ranges of the clusters represented by REPS in the ORDER array of np_postOrder, as
+    int32 arrays (BEGIN, LENGTH).
+    """
+    cdef Py_ssize_t n = REPS.shape[0]
+    BEGIN = np.empty(n, dtype=np.intc)
+    LENGTH = np.empty(n, dtype=np.intc)
+    cdef int[::1] BEGIN_view = BEGIN
+    cdef int[::1] LENGTH_view = LENGTH
+    cdef Py_ssize_t k
+    cdef int v
+    for k in range(n):
+        v = REPS[k]
+        if v < 0 or v >= session.thisptr.m:
+            raise IndexError("node id out of range")
+        LENGTH_view[k] = session.thisptr.SIZE[v]
+        BEGIN_view[k] = session.thisptr.POS[v] - LENGTH_view[k] + 1
+    return BEGIN, LENGTH
+
+def np_forestArrays(ARISession session):
+    """
+    Copies of the session's subtree sizes, roots and admissible STCs (int32) and TDP bounds (float64)
+    as a dict of NumPy arrays 'SIZE', 'ROOT', 'ADMSTC' and 'TDP', for Python code that indexes them.
+    """
+    cdef vector[int] SIZE = session.thisptr.SIZE.toVector()
+    cdef vector[int] ROOT = session.thisptr.ROOT.toVector()
+    cdef vector[int] ADMSTC = session.thisptr.ADMSTC.toVector()
+    cdef vector[double] TDP = session.thisptr.tdpBounds()
+    return {
+        'SIZE': int_array(SIZE),
+        'ROOT': int_array(ROOT),
+        'ADMSTC': int_array(ADMSTC),
+        'TDP': double_array(TDP)
+    }
+
+def np_memoryFootprint(ARISession session):
+    """
+    Bytes held by the session, as a dict mapping each stored array (SIZE, CHILD, TDP, ADMSTC, ...,
+    with ALPHAS the parked alphas of np_forestTDPMulti) to its size, plus the 'total'. Arrays that
+    view an index file mapped by np_loadIndex hold none; 'mapped' gives the bytes they view.
+    """
+    cdef map[string, long long] F = session.thisptr.footprint()
+    cdef map[string, long long].iterator it = F.begin()
+    result = {}
+    while it != F.end():
+        result[deref(it).first.decode()] = deref(it).second
+        inc(it)
+    return result
+
+def np_saveIndex(ARISession session, path, str key, const int[::1] ORD, const int[::1] RANK, JUMPALPHA, SIMESFACTOR):
+    """
+    Write the prepared session to an index file at path, together with the sorting orders/ranks
+    and the Hommel results (jump_alpha, simes_factor), under key (see np_loadIndex).
+    """
+    if ORD.shape[0] != session.thisptr.m or RANK.shape[0] != session.thisptr.m or ORD.shape[0] == 0:
+        raise ValueError("'ORD' and 'RANK' must have one value per node")
+    cdef vector[double] JUMPALPHA_vector = JUMPALPHA
+    cdef vector[double] SIMESFACTOR_vector = SIMESFACTOR
+    cdef string path_str = os.fsencode(path)
+    cdef string key_str = key.encode()
+    with nogil:
+        session.thisptr.saveIndex(path_str, key_str, &ORD[0], &RANK[0], JUMPALPHA_vector, SIMESFACTOR_vector)
+
+def np_loadIndex(path, str key):
+    """
+    Open an index file written by np_saveIndex. Returns None if there is no index at path or it
+    was written for a different key (i.e. different inputs) or format version; otherwise a dict
+    with the restored 'session' (ready for queries) and int32/float64 arrays 'ORD', 'RANK',
+    'jump_alpha' and 'simes_factor'. The session's arrays are views into the file, which is
+    mapped read-only (see ARISession.mapped), so it starts answering queries without reading
+    them in. Raises RuntimeError if the file is corrupt.
+    """
+    cdef ARISession session = ARISession()
+    cdef vector[int] ORD, RANK
+    cdef vector[double] JUMPALPHA, SIMESFACTOR
+    cdef string path_str = os.fsencode(path)
+    cdef string key_str = key.encode()
+    cdef bool found
+    with nogil:
+        found = session.thisptr.loadIndex(path_str, key_str, ORD, RANK, JUMPALPHA, SIMESFACTOR)
+    if not found:
+        return None
+    return {
+        'session': session,
+        'ORD': int_array(ORD),
+        'RANK': int_array(RANK),
+        'jump_alpha': double_array(JUMPALPHA),
+        'simes_factor': double_array(SIMESFACTOR)
+    }
+
+def np_analyseMaps(const double[:, ::1] P, const int[::1] MASK, const int[::1] INDEXP, const int[::1] DIMS, int conn, double alpha,
+                   bool simes=True, int nthreads=0, int max_maps=0, NativeProgress progress=None):
+    """
+    Analyse several maps that share one mask at one alpha: row k of P holds the m unsorted in-mask
+    p-values of map k, and MASK, INDEXP, DIMS and conn are as in np_findClustersGrid. The adjacency
+    list and the simes factors are computed once for all maps; each map then goes through Hommel,
+    findClusters, forestTDP and queryPreparation, with at most max_maps maps (<= 0: one per thread)
+    in progress at a time on nthreads threads (<= 0: all hardware threads).
+    Returns (simes_factor, maps): the shared float64 simes factors and, per map, a dict with the
+    prepared 'session' (INDEXP already set), the int32 arrays 'ORD' and 'RANK' (1-based), the
+    float64 'jump_alpha', 'h' (h(alpha)), the whole-brain TDP 'wbtdp' and 'concentration', the
+    index of the concentration threshold in the sorted p-values.
+    """
+    cdef int m = P.shape[1]
+    if m < 1 or INDEXP.shape[0] != m:
+        raise ValueError("'P' must have one column per in-mask voxel of 'INDEXP'")
+    if DIMS.shape[0] != 3 or MASK.shape[0] != DIMS[0] * DIMS[1] * DIMS[2]:
+        raise ValueError("'MASK' must hold DIMS[0]*DIMS[1]*DIMS[2] values")
+    cdef vector[const double*] ROWS
+    cdef Py_ssize_t k
+    for k in range(P.shape[0]):
+        ROWS.push_back(&P[k, 0])
+
+    cdef vector[double] SIMESFACTOR
+    cdef vector[MapAnalysis] MAPS
+    cdef ProgressReporter* prev = progress_install(progress)
+    try:
+        with nogil:
+            analyseMaps(m, &MASK[0], &INDEXP[0], &DIMS[0], conn, ROWS, alpha, simes, nthreads, max_maps, SIMESFACTOR, MAPS)
+    except RuntimeError:
+        progress_raise(progress)
+        raise
+    finally:
+        progressInstall(prev)
+
+    cdef ARISession session
+    maps = []
+    for k in range(MAPS.size()):
+        session = ARISession()
+        session.thisptr[0] = move(MAPS[k].session)
+        maps.append({
+            'session': session,
+            'ORD': int_array(MAPS[k].ORD),
+            'RANK': int_array(MAPS[k].RANK),
+            'jump_alpha': double_array(MAPS[k].JUMPALPHA),
+            'h': MAPS[k].h,
+            'wbtdp': MAPS[k].wbtdp,
+            'concentration': MAPS[k].concentration
+        })
+    return double_array(SIMESFACTOR), maps
+
+def np_runPipeline(const double[::1] P, const int[::1] MASK, const int[::1] INDEXP, const int[::1] DIMS, int conn, double alpha,
+                   gamma_batch, float[:, :, ::1] GRADMAP, const int[::1] LMSDIMS, bool simes=True, bool compact=False, int nthreads=0,
+                   NativeProgress progress=None):
+    """
+    The whole analysis of one map in one call, with independent stages running concurrently (see
+    runPipeline in ARISession.h): P holds the m unsorted in-mask p-values and MASK, INDEXP, DIMS
+    and conn are as in np_findClustersGrid. The gradient map for gamma_batch is written to GRADMAP
+    as by np_gradientMap, and the xyz coordinates of the local minima follow LMSDIMS as in
+    np_findLMSXYZ. Returns a dict with the entries of np_analyseMaps plus the float64
+    'simes_factor' and 'adjusted' (adjusted p-values, in the order of P) and 'LMS' and 'LMS_xyz'
+    as returned by np_findLMSXYZ. If 'wbtdp' is 0 the run stops after Hommel: 'session' is then
+    None and GRADMAP is untouched.
+    """
+    cdef int m = P.shape[0]
+    if m < 1 or INDEXP.shape[0] != m:
+        raise ValueError("'P' must have one value per in-mask voxel of 'INDEXP'")
+    if DIMS.shape[0] != 3 or MASK.shape[0] != DIMS[0] * DIMS[1] * DIMS[2]:
+        raise ValueError("'MASK' must hold DIMS[0]*DIMS[1]*DIMS[2] values")
+    if LMSDIMS.shape[0] != 3:
+        raise ValueError("'LMSDIMS' must hold 3 dimensions")
+    cdef vector[double] gamma_vector = gamma_batch
+    cdef int nvox = GRADMAP.shape[0] * GRADMAP.shape[1] * GRADMAP.shape[2]
+
+    cdef PipelineResult RES
+    cdef ProgressReporter* prev = progress_install(progress)
+    try:
+        with nogil:
+            runPipeline(m, &MASK[0], &INDEXP[0], &DIMS[0], conn, &P[0], alpha, simes, compact,
+                        gamma_vector, &GRADMAP[0, 0, 0], nvox, &LMSDIMS[0], nthreads, RES)
+    except RuntimeError:
+        progress_raise(progress)
+        raise
+    finally:
+        progressInstall(prev)
+
+    cdef ARISession session = None
+    if RES.MAP.wbtdp != 0:
+        session = ARISession()
+        session.thisptr[0] = move(RES.MAP.session)
+    return {
+        'session': session,
+        'ORD': int_array(RES.MAP.ORD),
+        'RANK': int_array(RES.MAP.RANK),
+        'jump_alpha': double_array(RES.MAP.JUMPALPHA),
+        'h': RES.MAP.h,
+        'wbtdp': RES.MAP.wbtdp,
+        'concentration': RES.MAP.concentration,
+        'simes_factor': double_array(RES.SIMESFACTOR),
+        'adjusted': double_array(RES.ADJUSTED),
+        'LMS': int_array(RES.LMS),
+        'LMS_xyz': int_array(RES.LMSXYZ).reshape(-1, 3)
+    }
@@ -5,7 +5,11 @@
 from libcpp.vector cimport vector
 from libcpp cimport bool
 
-cdef extern from "../cpp_sources/hommel.h":
+include "native_array.pxi"
+include "profile.pxi"
+include "simd.pxi"
+
+cdef extern from "../cpp_sources/hommel.h" nogil:
     vector[int] findhull(int m, const vector[double]& p)
     vector[double] findalpha(const vector[double]& p, int m, const vector[double]& simesfactor, bool simes)
     vector[double] findsimesfactor(bool simes, int m)
@@ -15,6 +19,15 @@ cdef extern from "../cpp_sources/hommel.h":
     int findConcentration(const vector[double]& p, double simesfactor, int h, double alpha, int m)
     vector[int] findDiscoveries(const vector[int]& idx, const vector[double]& allp, double simesfactor, int h, double alpha, int k, int m)
 
+    # Pointer flavours, used by the np_ entry points below
+    vector[double] findalpha(const double* p, int m, const double* simesfactor, bool simes) except +
+    vector[double] adjustedElementary(const double* p, const double* alpha, int m, const double* simesfactor) except +
+    int findHalpha(const double* jumpalpha, double alpha, int m) except +
+    int findConcentration(const double* p, double simesfactor, int h, double alpha, int m) except +
+    vector[int] findDiscoveries(const int* idx, const double* allp, double simesfactor, int h, double alpha, int k, int m) except +
+    vector[int] findDiscoveriesBatch(const int* PTR, const int* IDX, int nsets, const double* allp, double simesfactor, int h, double alpha, int m, int nthreads) except +
+    void orderPValues(const vector[double]& P, vector[int]& ORD, vector[int]& RANK, vector[double]& SP, int nthreads) except +
+
 def py_findhull(int m, list p):
     cdef vector[double] p_vector = p
     cdef vector[int] result = findhull(m, p_vector)
@@ -58,3 +71,85 @@ def py_findDiscoveries(list idx, list allp, double simesfactor, int h, double al
     cdef vector[int] result = findDiscoveries(idx_vector, allp_vector, simesfactor, h, alpha, k, m)
     return list(result)
 
+
+# Zero-copy entry points: these take contiguous NumPy arrays (float64 p-values, int32 indices)
+# instead of lists and return NumPy arrays that own the C++ output buffers. The native work runs
+# without the GIL.
+
+def np_findsimesfactor(bool simes, int m):
+    cdef vector[double] result
+    with nogil:
+        result = findsimesfactor(simes, m)
+    return double_array(result)
+
+def np_findalpha(const double[::1] p, int m, const double[::1] simesfactor, bool simes):
+    if m < 1 or p.shape[0] < m or simesfactor.shape[0] < m + 1:
+        raise ValueError("'p' must hold m and 'simesfactor' m + 1 values")
+    cdef vector[double] result
+    with nogil:
+        result = findalpha(&p[0], m, &simesfactor[0], simes)
+    return double_array(result)
+
+def np_adjustedElementary(const double[::1] p, const double[::1] alpha, int m, const double[::1] simesfactor):
+    if m < 1 or p.shape[0] < m or alpha.shape[0] < m or simesfactor.shape[0] < m + 1:
+        raise ValueError("'p' and 'alpha' must hold m and 'simesfactor' m + 1 values")
+    cdef vector[double] result
+    with nogil:
+        result = adjustedElementary(&p[0], &alpha[0], m, &simesfactor[0])
+    return double_array(result)
+
+def np_findHalpha(const double[::1] jumpalpha, double alpha, int m):
+    if m < 1 or jumpalpha.shape[0] < m:
+        raise ValueError("'jumpalpha' must hold m values")
+    cdef int h
+    with nogil:
+        h = findHalpha(&jumpalpha[0], alpha, m)
+    return h
+
+def np_findConcentration(const double[::1] p, double simesfactor, int h, double alpha, int m):
+    if m < 1 or p.shape[0] < m:
+        raise ValueError("'p' must hold m values")
+    cdef int z
+    with nogil:
+        z = findConcentration(&p[0], simesfactor, h, alpha, m)
+    return z
+
+def np_findDiscoveries(const int[::1] idx, const double[::1] allp, double simesfactor, int h, double alpha, int k, int m):
+    if k < 1 or idx.shape[0] < k or allp.shape[0] < m:
+        raise ValueError("'idx' must hold k and 'allp' m values")
+    cdef vector[int] result
+    with nogil:
+        result = findDiscoveries(&idx[0], &allp[0], simesfactor, h, alpha, k, m)
+    return int_array(result)
+
+def np_findDiscoveriesBatch(const int[::1] ptr, const int[::1] idx, const double[::1] allp, double simesfactor, int h, double alpha, int m, int nthreads=0):
+    """
+    Number of discoveries in each selection idx[ptr[s]:ptr[s+1]] of 1-based ranks into the sorted
+    p-values allp (len(ptr) - 1 selections), as np_findDiscoveries(...)[k] for each of them. The
+    selections run on nthreads threads (0: all cores).
+    """
+    if m < 1 or allp.shape[0] < m:
+        raise ValueError("'allp' must hold m values")
+    if ptr.shape[0] < 1 or ptr[0] != 0 or ptr[ptr.shape[0] - 1] > idx.shape[0]:
+        raise ValueError("'ptr' must run from 0 to at most len(idx)")
+    cdef int nsets = ptr.shape[0] - 1
+    cdef const int* IDX = &idx[0] if idx.shape[0] > 0 else NULL
+    cdef vector[int] result
+    with nogil:
+        result = findDiscoveriesBatch(&ptr[0], IDX, nsets, &allp[0], simesfactor, h, alpha, m, nthreads)
+    return int_array(result)
+
+def np_orderPValues(const double[::1] p, int nthreads=0):
+    """
+    Sorting order of the p-values p, as (ord, rank, sorted_p): ord (1-based, int32) lists them in
+    ascending order with ties in their original order (as np.argsort(p, kind='stable') + 1),
+    rank[i] (1-based) is the position of p[i] in ord and sorted_p = p[ord - 1]. Sorts on nthreads
+    threads (0: all cores).
+    """
+    cdef vector[double] P = vector[double](&p[0], &p[0] + p.shape[0]) if p.shape[0] > 0 else vector[double]()
+    cdef vector[int] ORD
+    cdef vector[int] RANK
+    cdef vector[double] SP
+    with nogil:
+        orderPValues(P, ORD, RANK, SP, nthreads)
+    return int_array(ORD), int_array(RANK), double_array(SP)
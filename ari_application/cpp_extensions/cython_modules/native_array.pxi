@@ -0,0 +1,74 @@
+# native_array.pxi
+# Buffer-protocol holders that hand std::vector results over to NumPy without copying.
+# The vector is swapped into the holder and the returned ndarray keeps the holder alive,
+# so the ndarray owns the C++ buffer. Included by hommel.pyx and ARICluster.pyx.
+
+from cpython.buffer cimport PyBUF_WRITABLE
+from libcpp.vector cimport vector
+import numpy as np
+
+
+cdef class IntVectorBuffer:
+    cdef vector[int] vec
+    cdef Py_ssize_t shape[1]
+    cdef Py_ssize_t strides[1]
+
+    def __getbuffer__(self, Py_buffer* buffer, int flags):
+        self.shape[0] = self.vec.size()
+        self.strides[0] = sizeof(int)
+        buffer.buf = <char*> self.vec.data()
+        buffer.format = b'i'
+        buffer.internal = NULL
+        buffer.itemsize = sizeof(int)
+        buffer.len = self.vec.size() * sizeof(int)
+        buffer.ndim = 1
+        buffer.obj = self
+        buffer.readonly = 0
+        buffer.shape = self.shape
+        buffer.strides = self.strides
+        buffer.suboffsets = NULL
+
+    def __releasebuffer__(self, Py_buffer* buffer):
+        pass
+
+
+cdef class DoubleVectorBuffer:
+    cdef vector[double] vec
+    cdef Py_ssize_t shape[1]
+    cdef Py_ssize_t strides[1]
+
+    def __getbuffer__(self, Py_buffer* buffer, int flags):
+        self.shape[0] = self.vec.size()
+        self.strides[0] = sizeof(double)
+        buffer.buf = <char*> self.vec.data()
+        buffer.format = b'd'
+        buffer.internal = NULL
+        buffer.itemsize = sizeof(double)
+        buffer.len = self.vec.size() * sizeof(double)
+        buffer.ndim = 1
+        buffer.obj = self
+        buffer.readonly = 0
+        buffer.shape = self.shape
+        buffer.strides = self.strides
+        buffer.suboffsets = NULL
+
+    def __releasebuffer__(self, Py_buffer* buffer):
+        pass
+
+
+cdef object int_array(vector[int]& vec):
+    """Move vec into an int32 ndarray (vec is left empty)."""
+    if vec.empty():
+        return np.empty(0, dtype=np.intc)
+    cdef IntVectorBuffer holder = IntVectorBuffer()
+    holder.vec.swap(vec)
+    return np.asarray(holder)
+
+
+cdef object double_array(vector[double]& vec):
+    """Move vec into a float64 ndarray (vec is left empty)."""
+    if vec.empty():
+        return np.empty(0, dtype=np.float64)
+    cdef DoubleVectorBuffer holder = DoubleVectorBuffer()
+    holder.vec.swap(vec)
+    return np.asarray(holder)
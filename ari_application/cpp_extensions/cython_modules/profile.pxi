@@ -0,0 +1,54 @@
+# profile.pxi
+# Per-stage profiling counters of the native code (see cpp_sources/Profile.h). Each extension
+# module links its own copy of the C++ sources and so keeps its own totals: the Hommel stages
+# called from Python are counted in hommel, everything that runs inside an ARISession (including
+# the findDiscoveries calls of forestTDP) in ARICluster. Included by hommel.pyx and ARICluster.pyx.
+
+from libcpp cimport bool
+from libcpp.map cimport map
+from libcpp.string cimport string
+from cython.operator cimport dereference as deref, preincrement as inc
+
+cdef extern from "../cpp_sources/Profile.h":
+    cdef cppclass ProfileStage:
+        long long calls
+        double seconds
+        long long peakrss
+        map[string, long long] COUNTS
+
+    void profileEnable(bool on)
+    void profileReset()
+    map[string, ProfileStage] profileStats() except +
+
+
+def np_profileEnable(bool on=True):
+    """Switch the profiling counters of this module on or off (off by default)."""
+    profileEnable(on)
+
+def np_profileReset():
+    """Clear the profiling counters of this module."""
+    profileReset()
+
+def np_profileStats():
+    """
+    Totals per stage since the last np_profileReset, as a dict mapping the stage name to a dict
+    with 'calls', 'seconds' (wall time), 'peak_rss_kb' (peak resident set size of the process at
+    the end of a call, 0 where it is not recorded) and the counters of that stage.
+    """
+    cdef map[string, ProfileStage] stats = profileStats()
+    cdef map[string, ProfileStage].iterator it = stats.begin()
+    cdef map[string, long long].iterator c
+    result = {}
+    while it != stats.end():
+        stage = {
+            'calls': deref(it).second.calls,
+            'seconds': deref(it).second.seconds,
+            'peak_rss_kb': deref(it).second.peakrss
+        }
+        c = deref(it).second.COUNTS.begin()
+        while c != deref(it).second.COUNTS.end():
+            stage[deref(c).first.decode()] = deref(c).second
+            inc(c)
+        result[deref(it).first.decode()] = stage
+        inc(it)
+    return result
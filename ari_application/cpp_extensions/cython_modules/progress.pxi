@@ -0,0 +1,76 @@
+# progress.pxi
+# Progress reports and cancellation of the long native calls (see cpp_sources/Progress.h). The
+# calls release the GIL while they run, so a NativeProgress can be polled and cancelled from
+# another Python thread. Included by ARICluster.pyx.
+
+cdef extern from "../cpp_sources/Progress.h" nogil:
+    ctypedef bint (*ProgressCallback)(void* ctx, const char* stage, double fraction) noexcept
+
+    cdef cppclass ProgressReporter:
+        ProgressReporter(ProgressCallback callback, void* ctx, double interval) except +
+        void cancel()
+        bint cancelled()
+        const char* currentStage()
+        double fraction()
+
+    ProgressReporter* progressInstall(ProgressReporter* R)
+
+
+class Cancelled(RuntimeError):
+    """Raised by a native call that was cancelled through its NativeProgress."""
+
+
+cdef bint progress_callback(void* ctx, const char* stage, double fraction) noexcept with gil:
+    cdef NativeProgress hook = <NativeProgress> ctx
+    try:
+        return hook.callback(stage.decode(), fraction) is not False
+    except BaseException:
+        return False  # An exception in the callback cancels the call
+
+
+cdef class NativeProgress:
+    """
+    Progress of, and cancellation for, the native calls that take a progress argument. While such
+    a call runs (without the GIL), any thread can read stage and fraction (of the current stage)
+    and call cancel(); the call then raises Cancelled within a few thousand voxels of work on each
+    of its threads. If callback is given, the native loops call callback(stage, fraction) at most
+    every interval seconds, from the thread that reports and holding the GIL for the call;
+    returning False (or raising) cancels. Once cancelled, a NativeProgress stays cancelled.
+    """
+    cdef ProgressReporter* thisptr
+    cdef object callback
+
+    def __cinit__(self, callback=None, double interval=0.1):
+        cdef ProgressCallback cb = NULL
+        if callback is not None:
+            cb = progress_callback
+        self.callback = callback
+        self.thisptr = new ProgressReporter(cb, <void*> self, interval)
+
+    def __dealloc__(self):
+        del self.thisptr
+
+    def cancel(self):
+        self.thisptr.cancel()
+
+    property cancelled:
+        def __get__(self):
+            return self.thisptr.cancelled()
+
+    property stage:
+        def __get__(self):
+            return self.thisptr.currentStage().decode()
+
+    property fraction:
+        def __get__(self):
+            return self.thisptr.fraction()
+
+
+cdef ProgressReporter* progress_install(NativeProgress progress):
+    """Install progress (None for none) on the calling thread; returns the previous reporter."""
+    return progressInstall(progress.thisptr if progress is not None else NULL)
+
+cdef progress_raise(NativeProgress progress):
+    """Raise Cancelled in place of the RuntimeError of a cancelled call."""
+    if progress is not None and progress.thisptr.cancelled():
+        raise Cancelled("cancelled") from None
@@ -0,0 +1,23 @@
+# simd.pxi
+# Instruction set used by the vectorised Hommel kernels (see cpp_sources/hommel_simd.h). Like the
+# profiling counters, the choice is per extension module. Included by hommel.pyx and ARICluster.pyx.
+
+cdef extern from "../cpp_sources/hommel_simd.h":
+    int simdLevel()
+    const char* simdLevelName(int level)
+    int setSimdLevel(int level)
+
+SIMD_LEVELS = ('scalar', 'neon', 'avx2', 'avx512')
+
+def np_simdLevel():
+    """Name of the instruction set in use: 'scalar', 'neon', 'avx2' or 'avx512'."""
+    return simdLevelName(simdLevel()).decode()
+
+def np_setSimdLevel(str name):
+    """
+    Use the named instruction set (one of SIMD_LEVELS), or the best supported one below it, and
+    return the name of the one in use. All of them give identical results; 'scalar' is the reference.
+    """
+    if name not in SIMD_LEVELS:
+        raise ValueError(f"'name' must be one of {SIMD_LEVELS}")
+    return simdLevelName(setSimdLevel(SIMD_LEVELS.index(name))).decode()
@@ -37,4 +37,46 @@ print("\nfindConcentration:")
 print(hommel.py_findConcentration(p, 1.0, 5, 0.5, m))
 
 print("\nfindDiscoveries:")
-print(hommel.py_findDiscoveries([1, 2, 3, 4, 5], p, 1.0, 5, 0.5, 5, m))
\ No newline at end of file
+print(hommel.py_findDiscoveries([1, 2, 3, 4, 5], p, 1.0, 5, 0.5, 5, m))
+# The vectorised kernels must agree exactly with the scalar ones, on every instruction set
+# this CPU supports
+import numpy as np
+
+rng = np.random.default_rng(1)
+m = 10007
+p_sorted = np.sort(rng.random(m) ** 4)
+simes_factor = hommel.np_findsimesfactor(True, m)
+idx = np.ascontiguousarray(rng.integers(1, m + 1, m), dtype=np.intc)
+
+def kernels():
+    jump_alpha = hommel.np_findalpha(p_sorted, m, simes_factor, True)
+    results = [hommel.np_adjustedElementary(p_sorted, jump_alpha, m, simes_factor)]
+    for alpha in (1e-9, 0.05, 0.5):
+        h = hommel.np_findHalpha(jump_alpha, alpha, m)
+        results.append(np.array([hommel.np_findConcentration(p_sorted, simes_factor[h], h, alpha, m)]))
+        results.append(hommel.np_findDiscoveries(idx, p_sorted, simes_factor[h], h, alpha, m, m))
+    return results
+
+print("\nSIMD kernels:")
+best = hommel.np_simdLevel()
+hommel.np_setSimdLevel('scalar')
+reference = kernels()
+for level in hommel.SIMD_LEVELS[1:]:
+    if hommel.np_setSimdLevel(level) != level:
+        continue
+    same = all(np.array_equal(a, b) for a, b in zip(kernels(), reference))
+    print(f"{level}: {'identical to scalar' if same else 'DIFFERENT from scalar'}")
+hommel.np_setSimdLevel(best)
+
+# The batched discoveries must agree with one np_findDiscoveries call per selection
+print("\nfindDiscoveriesBatch:")
+sizes = rng.integers(0, 200, 300)
+ptr = np.zeros(len(sizes) + 1, dtype=np.intc)
+np.cumsum(sizes, out=ptr[1:])
+sets_idx = np.ascontiguousarray(rng.integers(1, m + 1, ptr[-1]), dtype=np.intc)
+jump_alpha = hommel.np_findalpha(p_sorted, m, simes_factor, True)
+h = hommel.np_findHalpha(jump_alpha, 0.05, m)
+batch = hommel.np_findDiscoveriesBatch(ptr, sets_idx, p_sorted, simes_factor[h], h, 0.05, m)
+single = [hommel.np_findDiscoveries(sets_idx[a:b], p_sorted, simes_factor[h], h, 0.05, b - a, m)[b - a] if b > a else 0
+          for a, b in zip(ptr[:-1], ptr[1:])]
+print("identical to single calls" if np.array_equal(batch, single) else "DIFFERENT from single calls")
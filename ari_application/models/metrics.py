@@ -225,30 +225,35 @@ class Metrics:
             else:
                 mask = (data > threshold_value) & mask
 
-            # Apply clustering on thresholded regions
-            cluster_map = Metrics.cluster_threshold(mask)
+            # Statistic used for the peak of each cluster
+            if self.brain_nav.fileInfo[file_nr]['type'] == "p":
+                Statmap = -norm.ppf(pval)  # Equivalent to `-qnorm(pval)`
+            else:
+                Statmap = data
 
-            # Identify unique clusters - ignore 0 (background)
-            clus_labels = sorted(np.unique(cluster_map[cluster_map > 0]), reverse=True)
+            # Read the clusters and their TDP straight off the STC forest when the thresholded voxels
+            # are the smallest p-values of the analysis; otherwise fall back to hierarchical clustering
+            forest_clusters = self.forest_threshold_clusters(file_nr, mask, Statmap)
 
-            # Run ARI analysis
-            if self.brain_nav.fileInfo[file_nr]['type'] == "p":
-                tblARI_raw, clusterlist = self.compute_ARI_analysis(
-                    Pmap=pval,
-                    clusters=cluster_map,
-                    mask=self.brain_nav.fileInfo[file_nr]['mask'].T, # this could be changed to data as defined above.
-                    Statmap=-norm.ppf(pval),  # Equivalent to `-qnorm(pval)`
-                    silent=True
-                )
+            if forest_clusters is not None:
+                cluster_map, tblARI_raw, clusterlist = forest_clusters
             else:
+                # Apply clustering on thresholded regions
+                cluster_map = Metrics.cluster_threshold(mask)
+
+                # Run ARI analysis
                 tblARI_raw, clusterlist = self.compute_ARI_analysis(
                     Pmap=pval,
                     clusters=cluster_map,
-                    mask=self.brain_nav.fileInfo[file_nr]['mask'].T,
-                    Statmap=data,
+                    mask=self.brain_nav.fileInfo[file_nr]['mask'].T, # this could be changed to data as defined above.
+                    alpha=self.brain_nav.input['alpha'],
+                    Statmap=Statmap,
                     silent=True
                 )
 
+            # Identify unique clusters - ignore 0 (background)
+            clus_labels = sorted(np.unique(cluster_map[cluster_map > 0]), reverse=True)
+
             # Remove last row (same as R: `tblARI <- tblARI[-dim(tblARI)[1],]`)
             # tblARI = tblARI[:-1]
 
@@ -295,29 +300,17 @@ class Metrics:
                 
         elif thresholding_method == "tdp":
             # Find all maximal supra-threshold clusters with the given TDP threshold
-            # The C++ function starts by finding the left boundary (left) based on the TDP threshold (gamma).
-            # •	It then iterates over the admissible STCs starting from this left boundary.
-            # •	For each admissible STC that hasn’t been marked (MARK[ADMSTC[i]] == 0), it:
-            # •	Finds all descendants of the cluster using the descendants function.
-            # •	Appends this list of descendants (DESC) to the output list (ANS).
-            # •	Marks the corresponding voxels in the MARK array.
-            # •	Finally, it clears the marks in MARK and converts the list ANS into a vector of vectors (result) to return.
-            # clusterlist = ARI_C.py_answerQuery(
-            #     threshold_value,                                      # TDP threshold value (gamma) to filter supra-threshold clusters (STCs)
-            #     self.brain_nav.fileInfo[file_nr]['stcs'],                    # Indices of admissible supra-threshold clusters (STCs) that meet initial conditions
-            #     self.brain_nav.fileInfo[file_nr]['reslist']['SIZE'],         # Sizes of the clusters; used to manage and sort clusters
-            #     self.brain_nav.fileInfo[file_nr]['marks'],                   # Marker array to track processed clusters/voxels and prevent duplicate processing
-            #     self.brain_nav.fileInfo[file_nr]['tdps'],                    # TDP values associated with each cluster, used to filter and process clusters
-            #     self.brain_nav.fileInfo[file_nr]['reslist']['CHILD']         # Child relationships between clusters, representing hierarchical cluster structure
-            # )
-            clusterlist, _ = get_clusters.answer_query(
-                threshold_value,                                               # TDP threshold value (gamma) to filter supra-threshold clusters (STCs)
-                self.brain_nav.fileInfo[file_nr]['stcs'],                    # Indices of admissible supra-threshold clusters (STCs) that meet initial conditions
-                self.brain_nav.fileInfo[file_nr]['reslist']['SIZE'],         # Sizes of the clusters; used to manage and sort clusters
-                self.brain_nav.fileInfo[file_nr]['marks'],                   # Marker array to track processed clusters/voxels and prevent duplicate processing
-                self.brain_nav.fileInfo[file_nr]['tdps'],                    # TDP values associated with each cluster, used to filter and process clusters
-                self.brain_nav.fileInfo[file_nr]['reslist']['CHILD']         # Child relationships between clusters, representing hierarchical cluster structure
-            )
+            # Incremental query on the ARI session: only the clusters that appeared or disappeared since the
+            # previous threshold are returned (by their representatives); the voxel lists of all other
+            # clusters are kept from the previous call in 'tdp_clusters'
+            session = self.brain_nav.fileInfo[file_nr]['ari_session']
+            tdp_clusters = self.brain_nav.fileInfo[file_nr].setdefault('tdp_clusters', {})
+            added, removed = ARI_C.np_answerQueryDelta(session, threshold_value)
+            for rep in removed:
+                tdp_clusters.pop(int(rep), None)
+            for rep in added:
+                tdp_clusters[int(rep)] = ARI_C.np_clusterMembers(session, int(rep)).tolist()
+            clusterlist = [tdp_clusters[int(rep)] for rep in ARI_C.np_queryReps(session)]
 
             
             # •	Each element of clusterlist is a list of integers.
@@ -326,10 +319,17 @@ class Metrics:
             #       Structure:      clusterlist is a list of lists  where each sublist represents 
             #                       the indices of voxels that make up one cluster.
 
+            # Size-ranked labels of the same answer, written into a volume on the C++ side. The session
+            # ranks the clusters with the counting sort of prepare_tblARI, so the table is built in the
+            # order of the returned representatives and needs no sort of its own
+            label_volume = np.zeros(self.brain_nav.fileInfo[file_nr]['tr_volDim'], dtype=np.intc)
+            label_reps, _ = ARI_C.np_answerQueryLabels(session, label_volume)
+            ranked_clusterlist = [tdp_clusters[int(rep)] for rep in label_reps]
+
             # Update image and table
-            ord_clusterlist, tblARI, tblARI_df, Vox_xyzs = self.prepare_tblARI(clusterlist) # clus2node
-            
-            img_clus, img_tdps, tblARI_df = self.update_clust_img(ord_clusterlist, tblARI_df)
+            ord_clusterlist, tblARI, tblARI_df, Vox_xyzs = self.prepare_tblARI(ranked_clusterlist, ranked=True) # clus2node
+
+            img_clus, img_tdps, tblARI_df = self.update_clust_img(ord_clusterlist, tblARI_df, label_volume)
 
             self.brain_nav.fileInfo[file_nr]['tdp_whole_brain_clusterlist'] = clusterlist
         
@@ -483,6 +483,68 @@ class Metrics:
 
             return cluster_map
     
+    def forest_threshold_clusters(self, file_nr, supra, Statmap):
+        """
+        Supra-threshold clusters read off the STC forest of the ARI session instead of clustering
+        the voxel coordinates (see cluster_threshold). The clusters at a p-value threshold are the
+        subtrees of the forest whose root is below the threshold and whose parent is not, so they
+        are found in time linear in the number of supra-threshold voxels, with the connectivity of
+        the TDP analysis. The TDP of each cluster is the forest TDP bound of its root (at the alpha
+        of the analysis), so no Hommel summary is computed per cluster.
+
+        Parameters:
+        - file_nr: File whose ARI session is used.
+        - supra (numpy.ndarray): Binary map of the supra-threshold voxels (transposed, in the mask).
+        - Statmap (numpy.ndarray): Statistics used for the peak of each cluster.
+
+        Returns:
+        - (cluster_map, tblARI_raw, clusterlist) in the layout of cluster_threshold and
+          compute_ARI_analysis, or None if there is no session or the supra-threshold voxels
+          are not the smallest p-values of the analysis.
+        """
+        file_info = self.brain_nav.fileInfo[file_nr]
+        session = file_info.get('ari_session')
+        if session is None:
+            return None
+
+        indexp_linear = file_info['indexp_linear']
+        ordp = np.ascontiguousarray(file_info['ordp'], dtype=np.intc)
+
+        # The supra-threshold voxels must be the first k nodes in the sorting order of the forest
+        supra = np.nan_to_num(supra, nan=False).astype(bool)
+        sel = supra.ravel()[indexp_linear]
+        k = int(np.count_nonzero(sel))
+        if k != np.count_nonzero(supra) or not sel[ordp[:k] - 1].all():
+            return None
+
+        reps = ARI_C.np_thresholdClusters(session, k, ordp)
+        n = len(reps)
+
+        # Label volume: the largest cluster gets the highest label, as in cluster_threshold
+        labels = np.zeros(supra.shape, dtype=np.intc)
+        ARI_C.np_labelVolume(session, np.ascontiguousarray(reps[::-1]), labels)
+        cluster_map = labels.astype(int)
+
+        # One row per cluster, largest first, as in compute_ARI_analysis
+        tdps = file_info['tdps']
+        stat = np.asarray(Statmap).ravel()
+        out = []
+        clusterlist = []
+        for i, rep in enumerate(reps):
+            members = ARI_C.np_clusterMembers(session, int(rep))
+            size = len(members)
+            tdp = tdps[rep]
+            false_null = int(round(tdp * size))
+            out.append([n - i, size, false_null, size - false_null, tdp, size, stat[indexp_linear[members]].max()])
+            clusterlist.append(members.tolist())
+
+        tblARI = pd.DataFrame(out, columns=[
+            "Cluster", "Size", "False Null", "True Null", "Active Proportion",
+            "Voxel Count", "Max Stat"
+        ])
+
+        return cluster_map, tblARI, clusterlist
+
     # @staticmethod
     def compute_ARI_analysis(self, Pmap, clusters, mask=None, alpha=0.05, Statmap=None, summary_stat="max", silent=False):
         """
@@ -566,9 +628,6 @@ class Metrics:
             # Append to clusterlist (this is mask-relative for compatibility with Hommel)
             clusterlist.append(mask_relative_idxs.tolist())
 
-            # Now compute Hommel summary using **mask-relative** indices
-            cluster_summary = Metrics.summary_hommel_roi(hom, ix=mask_relative_idxs, alpha=alpha)
-
             # Get the statistics for each voxel
             voxel_stats = StatFun(cluster_voxels_xyzs)
 
@@ -581,14 +640,17 @@ class Metrics:
             cluster_stats = Metrics.summary_cluster(cluster_voxels_with_stats)
             # cluster_stats = cluster_stats['Max_Coords']
             
-            # Combine all statistics into a single row
+            # Combine all statistics into a single row (the Hommel summary is added below)
             # row = [cluster_id] + list(cluster_summary.values()) + list(cluster_stats.values())
-            row = [cluster_id] + list(cluster_summary.values()) + list(cluster_stats)
-            out.append(row)
+            out.append(list(cluster_stats))
 
             # Update progress
             progress.setValue(i + 1)
 
+        # Hommel summaries of all clusters in one native call, using the **mask-relative** indices
+        summaries = Metrics.summary_hommel_rois(hom, clusterlist, alpha=alpha)
+        out = [[cluster_id] + list(summary.values()) + row for cluster_id, summary, row in zip(cluster_ids, summaries, out)]
+
         # Convert output to DataFrame
         tblARI = pd.DataFrame(out, columns=[
             "Cluster", "Size", "False Null", "True Null", "Active Proportion", 
@@ -636,6 +698,52 @@ class Metrics:
             "ActiveProp": Active_Proportion
         }
     
+    @staticmethod
+    def summary_hommel_rois(hommel, sets, alpha=0.05):
+        """
+        summary_hommel_roi for many clusters or regions at once, with a single native call.
+
+        Parameters:
+        - hommel (pyHommel): A Hommel correction object with adjusted p-values.
+        - sets (list of array-like): Indices of the p-values of each cluster.
+        - alpha (float): Significance level for discoveries.
+
+        Returns:
+        - list of dict: One summary_hommel_roi dictionary per cluster.
+        """
+        False_Null, Active_Proportion = hommel.discoveries_sets(sets, alpha=alpha)
+        return [{
+            "Size": len(ix),
+            "FalseNull": int(d),
+            "TrueNull": len(ix) - int(d),
+            "ActiveProp": float(tdp)
+        } for ix, d, tdp in zip(sets, False_Null, Active_Proportion)]
+
+    @staticmethod
+    def summary_hommel_regions(hommel, labels, codebook=None, alpha=0.05):
+        """
+        TDP table of all regions of an atlas (or any label map) in one native call.
+
+        Parameters:
+        - hommel (pyHommel): A Hommel correction object with adjusted p-values.
+        - labels (array-like): Region label of each p-value (0: no region).
+        - codebook (dict, optional): Region names by label, as in atlasInfo['codebook'].
+        - alpha (float): Significance level for discoveries.
+
+        Returns:
+        - pandas.DataFrame: One row per region with its size, discoveries and TDP.
+        """
+        regions, sizes, False_Null, Active_Proportion = hommel.discoveries_regions(labels, alpha=alpha)
+        names = [codebook.get(r, 'Undefined') for r in regions] if codebook is not None else [str(r) for r in regions]
+        return pd.DataFrame({
+            "Region": regions,
+            "Name": names,
+            "Size": sizes,
+            "False Null": False_Null,
+            "True Null": sizes - False_Null,
+            "Active Proportion": Active_Proportion
+        })
+
     @staticmethod
     def get_array(map, map_dims=None):
         """
@@ -715,7 +823,82 @@ class Metrics:
 
         return out
 
-    def prepare_tblARI(self, clusterlist): #  clus2node
+    def kernel_atlas(self, file_nr, file_nr_template, atlasInfo):
+        """
+        Atlas labels resampled to the voxels of the transposed data (see native_cluster_summary):
+        every data voxel gets the label of the template voxel it maps to through
+        inverse_mapped_matrix_F, and 0 if it maps to none. The volume is kept with the alignment
+        of the file to the template, until another atlas is loaded for it.
+
+        Parameters:
+        - file_nr: File whose data space is used.
+        - file_nr_template: Template the file is aligned to.
+        - atlasInfo (dict or None): The atlas of that template, as in brain_nav.atlasInfo.
+
+        Returns:
+        - numpy.ndarray: C-contiguous int32 volume of shape tr_volDim, or None without atlas.
+        """
+        if atlasInfo is None:
+            return None
+
+        aligned = self.brain_nav.aligned_statMapInfo[(file_nr, file_nr_template)]
+        cached = aligned.get('kernel_atlas')
+        if cached is not None and cached[0] is atlasInfo['data']:
+            return cached[1]
+
+        # The peaks are unravelled with the x axis fastest (see prepare_tblARI), whereas the
+        # native code reads the volume in C order, hence the ravel/reshape
+        inverse_mapped_matrix_F = aligned['inverse_mapped_matrix_F']
+        atlas_data = atlasInfo['data']
+        mapped = np.all(inverse_mapped_matrix_F >= 0, axis=-1) & np.all(inverse_mapped_matrix_F < atlas_data.shape[:3], axis=-1)
+        labels = np.zeros(mapped.shape, dtype=np.intc)
+        ui = inverse_mapped_matrix_F[mapped]
+        labels[mapped] = atlas_data[ui[:, 0], ui[:, 1], ui[:, 2]]
+        labels = np.ascontiguousarray(labels.ravel(order='F').reshape(self.brain_nav.fileInfo[file_nr]['tr_volDim']))
+
+        aligned['kernel_atlas'] = (atlas_data, labels)
+        return labels
+
+    def native_cluster_summary(self, file_nr, clusterlist, file_data, atlas=None):
+        """
+        Size, TDP, maximum statistic and atlas label at the peak of all clusters, computed by the
+        ARI session in one pass over the cluster voxels (see np_clusterSummary) instead of
+        indexing the data per cluster. Every cluster must be a subtree of the STC forest, listed
+        with its root last (as returned by the TDP queries); for p-maps the maximum statistic is
+        returned as minus the smallest p.
+
+        Parameters:
+        - file_nr: File whose ARI session is used.
+        - clusterlist (list of lists): Node ids of the clusters.
+        - file_data (numpy.ndarray): The transposed data, addressed through indexp_linear.
+        - atlas (numpy.ndarray, optional): The labels of kernel_atlas; without it 'label' is 0.
+
+        Returns:
+        - dict of arrays ('size', 'tdp', 'peak', 'label', ...) with one row per cluster, or None if
+          there is no session or a cluster is not a subtree of the forest.
+        """
+        file_info = self.brain_nav.fileInfo[file_nr]
+        session = file_info.get('ari_session')
+        if session is None or file_data.ndim != 3:
+            return None
+
+        reps = np.ascontiguousarray([cluster[-1] for cluster in clusterlist], dtype=np.intc)
+        stat = np.ascontiguousarray(file_data, dtype=np.float64)
+        if file_info['type'] == "p":
+            stat = -stat  # -norm.ppf is decreasing, so the peak is the smallest p-value
+
+        try:
+            summary = ARI_C.np_clusterSummary(session, reps, stat, atlas, nthreads=0)
+        except (IndexError, ValueError, RuntimeError):
+            return None
+
+        # A cluster that is not a subtree of the forest has a different size than its last node
+        if not np.array_equal(summary['size'], [len(cluster) for cluster in clusterlist]):
+            return None
+
+        return summary
+
+    def prepare_tblARI(self, clusterlist, ranked=False): #  clus2node
         import time
         """
         Prepares the cluster statistics table (tblARI) by sorting clusters by size
@@ -723,6 +906,8 @@ class Metrics:
 
         Args:
             clusterlist (list of lists): The list of clusters to be processed.
+            ranked (bool): True if clusterlist is already sorted by size (e.g. by np_answerQueryLabels),
+                        in which case it is not sorted again.
 
         Returns:
             pd.DataFrame: The tblARI DataFrame with cluster statistics, including cluster size,
@@ -731,7 +916,6 @@ class Metrics:
 
         file_nr = self.brain_nav.file_nr
         file_nr_template = self.brain_nav.file_nr_template
-        lm_ids_df = self.brain_nav.fileInfo[file_nr]['stable_LM_ids_df']
 
         # Handle the case where no clusters are found
         if clusterlist is None or len(clusterlist) == 0:
@@ -745,7 +929,7 @@ class Metrics:
         n = len(clusterlist)
         
         # If more than one cluster is found, proceed to sort the clusters by size
-        if n > 1:
+        if n > 1 and not ranked:
             # Calculate the size of each cluster
             cluster_sizes = [len(cluster) for cluster in clusterlist]
 
@@ -778,57 +962,64 @@ class Metrics:
 
         indexp = self.brain_nav.fileInfo[file_nr]['indexp']
 
-        # Iterate over each cluster to calculate statistics
+        # Pick atlas key based on whether we're using the statmap as template or data as template
+        if file_nr_template == self.brain_nav.data_bg_index:
+            atlas_key = ('data_as_template', file_nr)
+        else:
+            atlas_key = file_nr_template
+        atlasInfo = self.brain_nav.atlasInfo.get(atlas_key)
+        inverse_mapped_matrix_F = self.brain_nav.aligned_statMapInfo[(file_nr, file_nr_template)]['inverse_mapped_matrix_F']
+
+        # Size, TDP, maximum statistic and atlas label of all clusters in one native pass (None if not available)
         start_time1 = time.time()
+        summary = self.native_cluster_summary(file_nr, clusterlist, file_data, self.kernel_atlas(file_nr, file_nr_template, atlasInfo))
+
+        # Voxel (data space) coordinates of the peak of every cluster, i.e. the voxel with the smallest
+        # p-value (the lowest local minimum for p-maps), as voxel_to_LM gives them: the node ids are
+        # mapped to voxel indices through indexp_linear and unravelled with the x axis fastest.
+        # With the native summary the peaks come with it; otherwise they are the voxels with the
+        # largest statistic below
+        indexp_linear = self.brain_nav.fileInfo[file_nr]['indexp_linear']
+        tr_volDim = self.brain_nav.fileInfo[file_nr]['tr_volDim']
+        if summary is not None:
+            peak_xyz = np.column_stack(np.unravel_index(indexp_linear[summary['peak_id']], tr_volDim, order='F'))
+
+        # Iterate over each cluster to calculate statistics
         xyz_max_ui = []
         atlas_names = []  # Store the atlas region names for each cluster - at the voxel with the maximum statistic
         for i in range(n):
 
             # Determine cluster statistics based on the map type
-            if self.brain_nav.fileInfo[file_nr]['type'] == "p":
-                # Convert p-values to z-scores using the percent point function (ppf)
-                clus_stat = -norm.ppf(file_data[indexp][clusterlist[i]])
+            if summary is not None:
+                clus_stat = None
+                xyz_coords = peak_xyz[i].tolist()
 
-            elif self.brain_nav.fileInfo[file_nr]['type'] == "z":
-                # Use z-scores directly
-                clus_stat = file_data[indexp][clusterlist[i]]
-            
             else:
-                # Assume raw values if no specific map type is specified
-                clus_stat = file_data[indexp][clusterlist[i]]
+                if self.brain_nav.fileInfo[file_nr]['type'] == "p":
+                    # Convert p-values to z-scores using the percent point function (ppf)
+                    clus_stat = -norm.ppf(file_data[indexp][clusterlist[i]])
 
-            # Process the cluster minima
-            cluster_indices     = clusterlist[i]
-            cluster_indices_set = set(cluster_indices)  # Convert to a set for faster lookup
-            cluster_minima_df   = lm_ids_df[lm_ids_df['lm_id'].isin(cluster_indices_set)]
+                elif self.brain_nav.fileInfo[file_nr]['type'] == "z":
+                    # Use z-scores directly
+                    clus_stat = file_data[indexp][clusterlist[i]]
 
-            if not cluster_minima_df.empty:
-                # Extract the IDs of the local minima
-                cluster_minima_ids = cluster_minima_df['lm_id'].tolist()
-
-                # Find the lowest minimum and its p-value
-                lowest_minimum_id, lowest_minimum_p = Metrics.find_lowest_minimum(self, cluster_minima_ids)
-
-                # Retrieve the voxel-to-local-minimum mapping and XYZ coordinates
-                voxel_to_LM = self.brain_nav.fileInfo[file_nr]['voxel_to_LM']
-                xyz_coords = list(voxel_to_LM[lowest_minimum_id])
-
-                # map coords to ui space for mni conversion
-                # x_ui, y_ui, z_ui  = self.brain_nav.fileInfo[file_nr]['inverse_mapped_matrix_F'][xyz_coords[0],xyz_coords[1], xyz_coords[2]]
-                x_ui, y_ui, z_ui  = self.brain_nav.aligned_statMapInfo[(file_nr, file_nr_template)]['inverse_mapped_matrix_F'][xyz_coords[0],xyz_coords[1], xyz_coords[2]]
-
-                xyz_max_ui.append([x_ui, y_ui, z_ui])
+                else:
+                    # Assume raw values if no specific map type is specified
+                    clus_stat = file_data[indexp][clusterlist[i]]
 
-                # --- Get region name from atlas ---
+                peak_node = clusterlist[i][int(np.argmax(clus_stat))]
+                xyz_coords = [int(c) for c in np.unravel_index(indexp_linear[peak_node], tr_volDim, order='F')]
 
-                # Pick atlas key based on whether we're using the statmap as template or data as template
-                if file_nr_template == self.brain_nav.data_bg_index:
-                    atlas_key = ('data_as_template', file_nr)
-                else:
-                    atlas_key = file_nr_template
+            # map coords to ui space for mni conversion
+            # x_ui, y_ui, z_ui  = self.brain_nav.fileInfo[file_nr]['inverse_mapped_matrix_F'][xyz_coords[0],xyz_coords[1], xyz_coords[2]]
+            x_ui, y_ui, z_ui  = inverse_mapped_matrix_F[xyz_coords[0], xyz_coords[1], xyz_coords[2]]
 
-                atlasInfo = self.brain_nav.atlasInfo.get(atlas_key)
+            xyz_max_ui.append([x_ui, y_ui, z_ui])
 
+            # --- Get region name from atlas ---
+            if summary is not None:
+                atlas_region_name = 'None' if atlasInfo is None else atlasInfo['codebook'].get(int(summary['label'][i]), 'Undefined')
+            else:
                 try:
                     atlas_region_code = atlasInfo['data'][x_ui, y_ui, z_ui]
                     atlas_region_name = atlasInfo['codebook'].get(atlas_region_code, 'Undefined')
@@ -836,18 +1027,31 @@ class Metrics:
                     print(f"Error retrieving atlas region: {e}")
                     atlas_region_name = 'None'
 
-                atlas_names.append(atlas_region_name)
+            atlas_names.append(atlas_region_name)
+
+            # Use the previously retrieved coordinates as the maximum coordinates
+            xyz_max = xyz_coords # These are in data space
+
+            if summary is not None:
+                clus_size = int(summary['size'][i])
+                clus_tdp = float(summary['tdp'][i])
+                clus_max = summary['peak'][i]
+
+                if self.brain_nav.fileInfo[file_nr]['type'] == "p":
+                    clus_max = -norm.ppf(-clus_max)  # The summary holds the smallest p-value as -p
+
+                tblARI.append([
+                    clus_size, None, round(clus_size * clus_tdp), round(clus_size * (1 - clus_tdp)), clus_tdp,
+                    xyz_max[0], xyz_max[1], xyz_max[2], clus_max
+                ])
+                continue
 
-        
             # Identify the voxel with the maximum statistic within the cluster
             id_clus = np.argmax(clus_stat)
 
             # Get the index of the voxel with the maximum statistic
             # id_max = clusterlist[i][id_clus]
 
-            # Use the previously retrieved coordinates as the maximum coordinates
-            xyz_max = xyz_coords # These are in data space
-
             # Calculate the size of the current cluster
             clus_size = len(clusterlist[i])
 
@@ -1202,10 +1406,8 @@ class Metrics:
                                 
         # Retrieve hierarchical data
         stcs = file_info['stcs']                 # Supra-threshold clusters
-        marks = file_info['marks']               # Marking array
         tdp = file_info['tdps']                  # TDP values for clusters
-        size = file_info['reslist']['SIZE']      # Cluster sizes
-        child = file_info['reslist']['CHILD']    # Cluster hierarchy
+        size = file_info['reslist']['SIZE']      # Cluster sizes (the hierarchy stays in the ARI session)
         # clus2node = file_info['clus2node']
 
         # current voxel xyz (UI space) 
@@ -1229,34 +1431,35 @@ class Metrics:
         # v = (z_raw - 1) * dims[0] * dims[1] + (y_raw - 1) * dims[0] + (x_raw - 1)
         v = Metrics.xyz2index(xyz, dims)
 
-        # map to masked volume vector
-        v = sum(file_info['indexp_linear']<=v)-1
+        # map to masked volume vector (indexp_linear is sorted)
+        v = int(np.searchsorted(file_info['indexp_linear'], v, side='right')) - 1
 
         # check if v is part of any cluster. 
         # clustID = Metrics.findRep(v, size, file_info['clusterlist'])
 
-        # --- New: Check the TDP change validity using the check_tdp_change function ---
-        error_info = get_clusters.check_tdp_change(v, tdp_change, stcs, size, tdp, file_info['clusterlist'], marks)
-        if error_info["error_code"] != 0:
-            # If there is an error, do not call the changeQuery function.
+        try:
+            # Call the C++ changeQuery function generally faster!
+            # updated_clusters = ARI_C.py_changeQuery(v, tdp_change, stcs, size, marks, tdp, child, file_info['clusterlist'])
+
+            # Call the Pythonized  changeQuery routine
+            # updated_clusters = get_clusters.change_query(v, tdp_change, stcs, size, marks, tdp, child, file_info['clusterlist'])
+
+            # Call the changeQuery of the ARI session, which works on the stored forest: the clusters are
+            # found through their representatives and subtree ranges, so no voxel has to be scanned.
+            # An invalid request (no cluster at v, no further change attainable, ...) is raised as ValueError
+            updated_clusters = file_info['ari_session'].changeQuery(v, tdp_change, file_info['clusterlist'])
+        except (ValueError, RuntimeError) as error:
+            # If there is an error, keep the current cluster list
             updated_clusters = file_info['clusterlist'] # old cluster list (misnomer)
-            # print(f"Change Query Error {error_info['error_code']}: {error_info['error_message']}")
-            print("\033[91m" + f"ERROR! Change Query Error {error_info['error_code']}: {error_info['error_message']}" + "\033[0m")
+            print("\033[91m" + f"ERROR! Change Query Error: {error}" + "\033[0m")
             # Construct the styled error message
             message = (
                 f"<span style='color: red; font-weight: bold;'>"
-                f"ERROR! Change Query Error {error_info['error_code']}: {error_info['error_message']}"
+                f"ERROR! Change Query Error: {error}"
                 f"</span>"
             )
             # Send the formatted message to the message log
             self.brain_nav.message_box.log_message(message)
-            # return updated_clusters
-
-        # Call the C++ changeQuery function generally faster!
-        # updated_clusters = ARI_C.py_changeQuery(v, tdp_change, stcs, size, marks, tdp, child, file_info['clusterlist'])
-
-        # Call the Pythonized  changeQuery routine
-        updated_clusters = get_clusters.change_query(v, tdp_change, stcs, size, marks, tdp, child, file_info['clusterlist'])
 
         # update the clusterlist field
         file_info['clusterlist'] = updated_clusters 
@@ -1565,7 +1768,34 @@ class Metrics:
 
         return -1
 
-    def update_clust_img(self, clusterlist, tblARI_df):
+    def cluster_at(self, file_nr, xyz, gamma):
+        """
+        Find the cluster at TDP threshold gamma that contains the voxel at xyz, without answering
+        the query for gamma first (a shortcut around findRep and img_clus for a live readout).
+
+        Parameters:
+            file_nr (int): The file whose ARI session is queried.
+            xyz (array-like): Voxel coordinates in the transposed volume (as in change_cluster_size).
+            gamma (float): TDP threshold.
+
+        Returns:
+            tuple or None: (representative, size, tdp) of the cluster, or None if the voxel lies
+            outside the mask or in no cluster at gamma.
+        """
+        file_info = self.brain_nav.fileInfo[file_nr]
+        if 'ari_session' not in file_info:
+            return None
+
+        # Map the voxel index to its node id through the (ascending) in-mask voxel indices
+        v = Metrics.xyz2index(xyz, file_info['tr_volDim'])
+        indexp_linear = file_info['indexp_linear']
+        node = int(np.searchsorted(indexp_linear, v))
+        if node >= len(indexp_linear) or indexp_linear[node] != v:
+            return None
+
+        return ARI_C.np_containingCluster(file_info['ari_session'], node, gamma)
+
+    def update_clust_img(self, clusterlist, tblARI_df, label_volume=None):
         """
         Update the cluster image and ARI table by assigning cluster IDs based on the lowest local minima.
 
@@ -1577,6 +1807,9 @@ class Metrics:
         Parameters:
             clusterlist (list of lists): A list where each element is a list of voxel indices representing a cluster.
             tblARI_df (pandas.DataFrame): A DataFrame containing cluster statistics, which will be updated with cluster IDs.
+            label_volume (numpy.ndarray, optional): int32 volume (tr_volDim) in which cluster i carries label i+1,
+                as written by ARI_C.np_answerQueryLabels. The image is then painted from it in one pass
+                instead of cluster by cluster.
 
         Returns:
             tuple:
@@ -1595,20 +1828,28 @@ class Metrics:
 
         n = len(clusterlist)
 
+        if label_volume is not None:
+            # Local minima per cluster, read from the labels at their voxels
+            lm_ids = lm_ids_df['lm_id'].to_numpy(dtype=np.intp)
+            lm_labels = label_volume.ravel()[self.brain_nav.fileInfo[file_nr]['indexp_linear'][lm_ids]]
+            minima = {}
+            for lm_id, label in zip(lm_ids.tolist(), lm_labels.tolist()):
+                minima.setdefault(label, []).append(lm_id)
+            # Cluster ID of every label (0 for the background)
+            label_ids = np.zeros(n + 1)
+
         for i in range(n):  # Iterate over all clusters
             cluster_indices = clusterlist[i]  # Indices for the current cluster
 
-            # Map indices to voxel coordinates
-            x_coords = self.brain_nav.fileInfo[file_nr]['indexp'][0][cluster_indices]
-            y_coords = self.brain_nav.fileInfo[file_nr]['indexp'][1][cluster_indices]
-            z_coords = self.brain_nav.fileInfo[file_nr]['indexp'][2][cluster_indices]
-
-            # Filter DataFrame
-            cluster_indices_set = set(cluster_indices)  # Convert to a set for faster lookup
-            cluster_minima_df = lm_ids_df[lm_ids_df['lm_id'].isin(cluster_indices_set)]
+            if label_volume is not None:
+                cluster_minima_ids = minima.get(i + 1, [])
+            else:
+                # Filter DataFrame
+                cluster_indices_set = set(cluster_indices)  # Convert to a set for faster lookup
+                cluster_minima_df = lm_ids_df[lm_ids_df['lm_id'].isin(cluster_indices_set)]
 
-            # Extract the filtered IDs
-            cluster_minima_ids = cluster_minima_df['lm_id'].tolist()
+                # Extract the filtered IDs
+                cluster_minima_ids = cluster_minima_df['lm_id'].tolist()
 
             if cluster_minima_ids:
                 # Determine the lowest minimum using the tree structure
@@ -1618,7 +1859,14 @@ class Metrics:
                 cluster_ID = self.brain_nav.fileInfo[file_nr]['stable_LM_ids_count'].get(lowest_minimum_id, None)
 
                 # Assign the cluster ID based on the lowest minimum
-                img_clus[x_coords, y_coords, z_coords] = cluster_ID
+                if label_volume is not None:
+                    label_ids[i + 1] = cluster_ID
+                else:
+                    # Map indices to voxel coordinates
+                    x_coords = self.brain_nav.fileInfo[file_nr]['indexp'][0][cluster_indices]
+                    y_coords = self.brain_nav.fileInfo[file_nr]['indexp'][1][cluster_indices]
+                    z_coords = self.brain_nav.fileInfo[file_nr]['indexp'][2][cluster_indices]
+                    img_clus[x_coords, y_coords, z_coords] = cluster_ID
 
                 # Update tblARI with the actual cluster_ID (second column)
                 tblARI_df.loc[i, 'Unique ID'] = cluster_ID
@@ -1630,6 +1878,9 @@ class Metrics:
                 # Append None or a placeholder value to maintain consistency
                 tblARI_df.loc[i, 'Unique ID'] = None
 
+        if label_volume is not None:
+            img_clus = label_ids[label_volume]
+
         # Update the table in self to align other routines
         self.brain_nav.fileInfo[file_nr]['tblARI_df'] = tblARI_df
 
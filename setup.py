@@ -149,35 +149,51 @@ from setuptools import setup, Extension, find_packages
 from Cython.Build import cythonize
 import numpy as np
 import os
+import sys
 
 current_dir = os.path.dirname(os.path.abspath(__file__))
 
-debug_args = ["-g", "-O0", "-Wall"]
-common_sources = [os.path.join(current_dir, "ari_application/cpp_extensions/cpp_sources/hommel.cpp")]
+# Build profile: optimised by default, which is what the wheels ship; ARI_BUILD=debug builds with
+# -g -O0 instead. No -march flags: the Hommel kernels pick AVX2/AVX-512/NEON at run time (see
+# hommel_simd.cpp), and multiply-adds are not fused so that all of them agree with the scalar code.
+BUILD = os.environ.get("ARI_BUILD", "release")
+if sys.platform == "win32":
+    build_args = ["/Od", "/Zi"] if BUILD == "debug" else ["/O2", "/DNDEBUG", "/fp:precise"]
+    link_args = ["/DEBUG"] if BUILD == "debug" else []
+    thread_args = []
+else:
+    build_args = ["-g", "-O0", "-Wall"] if BUILD == "debug" else ["-O3", "-DNDEBUG", "-Wall", "-ffp-contract=off"]
+    link_args = ["-g"] if BUILD == "debug" else []
+    thread_args = ["-pthread"]  # Both modules run parts of the analysis on a thread pool
+common_sources = [
+    os.path.join(current_dir, "ari_application/cpp_extensions/cpp_sources/hommel.cpp"),
+    os.path.join(current_dir, "ari_application/cpp_extensions/cpp_sources/hommel_simd.cpp")
+]
 
 extensions = [
     Extension(
         name="ari_application.cpp_extensions.cython_modules.hommel",
         sources=[
             os.path.join(current_dir, "ari_application/cpp_extensions/cython_modules/hommel.pyx"),
-            os.path.join(current_dir, "ari_application/cpp_extensions/cpp_sources/hommel.cpp")
+            *common_sources
         ],
         language="c++",
         include_dirs=[np.get_include()],
-        extra_compile_args=debug_args,
-        extra_link_args=debug_args,
+        extra_compile_args=build_args + thread_args,
+        extra_link_args=link_args + thread_args,
     ),
     Extension(
         name="ari_application.cpp_extensions.cython_modules.ARICluster",
         sources=[
             os.path.join(current_dir, "ari_application/cpp_extensions/cython_modules/ARICluster.pyx"),
             os.path.join(current_dir, "ari_application/cpp_extensions/cpp_sources/ARICluster.cpp"),
+            os.path.join(current_dir, "ari_application/cpp_extensions/cpp_sources/ARISession.cpp"),
             *common_sources
         ],
         language="c++",
         include_dirs=[np.get_include()],
-        extra_compile_args=debug_args,
-        extra_link_args=debug_args,
+        extra_compile_args=build_args + thread_args,
+        extra_link_args=link_args + thread_args,
     ),
 ]
 